@@ -147,6 +147,39 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
             params.prompt_cache_all = true;
         } else if (arg == "--prompt-cache-ro") {
             params.prompt_cache_ro = true;
+        } else if (arg == "--prompt-cache-dir") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.prompt_cache_dir = argv[i];
+        } else if (arg == "--prompt-cache-block") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.prompt_cache_block = std::stoi(argv[i]);
+        } else if (arg == "--prompt-cache-size") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.prompt_cache_size = std::stoi(argv[i]);
+        } else if (arg == "--prompt-cache-type") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            invalid_param = true;
+            for (int t = 0; t < GGML_TYPE_COUNT; ++t) {
+                if (ggml_type_name((ggml_type) t) && std::string(argv[i]) == ggml_type_name((ggml_type) t)) {
+                    params.prompt_cache_type = (ggml_type) t;
+                    invalid_param = false;
+                }
+            }
+            if (invalid_param) {
+                break;
+            }
         } else if (arg == "-f" || arg == "--file") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -299,6 +332,12 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
                 break;
             }
             params.n_batch = std::stoi(argv[i]);
+        } else if (arg == "--kv-chunk") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_kv_chunk = std::stoi(argv[i]);
         } else if (arg == "--keep") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -311,6 +350,30 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
                 break;
             }
             params.n_draft = std::stoi(argv[i]);
+        } else if (arg == "--draft-exit") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_draft_exit = std::stoi(argv[i]);
+        } else if (arg == "--draft-skip") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_draft_skip = std::stoi(argv[i]);
+        } else if (arg == "--draft-lookup") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_draft_lookup = std::stoi(argv[i]);
+        } else if (arg == "--draft-branch") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_draft_branch = std::stoi(argv[i]);
         } else if (arg == "--chunks") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -348,10 +411,36 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
                 break;
             }
             params.lora_base = argv[i];
+        } else if (arg == "--lora-runtime") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.lora_runtime = argv[i];
         } else if (arg == "-i" || arg == "--interactive") {
             params.interactive = true;
         } else if (arg == "--embedding") {
             params.embedding = true;
+        } else if (arg == "--pooling") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            std::string value(argv[i]);
+            if (value == "mean") {
+                params.pooling = LLAMA_POOLING_MEAN;
+            } else if (value == "last") {
+                params.pooling = LLAMA_POOLING_LAST;
+            } else if (value == "first") {
+                params.pooling = LLAMA_POOLING_FIRST;
+            } else {
+                invalid_param = true;
+                break;
+            }
+        } else if (arg == "--embd-normalize") {
+            params.embd_normalize = true;
+        } else if (arg == "--embd-split") {
+            params.embd_split = true;
         } else if (arg == "--interactive-first") {
             params.interactive_first = true;
         } else if (arg == "-ins" || arg == "--instruct") {
@@ -423,6 +512,14 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
 #endif // GGML_USE_CUBLAS
         } else if (arg == "--no-mmap") {
             params.use_mmap = false;
+        } else if (arg == "--fuse-weights") {
+            params.fuse_weights = true;
+        } else if (arg == "--stream-layers") {
+            params.stream_layers = true;
+        } else if (arg == "--repack") {
+            params.repack_weights = true;
+        } else if (arg == "--layer-timings") {
+            params.layer_timings = true;
         } else if (arg == "--mtest") {
             params.mem_test = true;
         } else if (arg == "--numa") {
@@ -536,6 +633,8 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
                 std::istreambuf_iterator<char>(),
                 std::back_inserter(params.grammar)
             );
+        } else if (arg == "--grammar-restrict") {
+            params.grammar_restrict = true;
 #ifndef LOG_DISABLE_LOGS
         // Parse args for logging parameters
         } else if ( log_param_single_parse( argv[i] ) ) {
@@ -605,6 +704,14 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("  --prompt-cache-all    if specified, saves user input and generations to cache as well.\n");
     printf("                        not supported with --interactive or other interactive options\n");
     printf("  --prompt-cache-ro     if specified, uses the prompt cache but does not update it.\n");
+    printf("  --prompt-cache-type T type of the KV cache saved in the prompt cache (default: f16)\n");
+    printf("                        f16 saves the full session format of version 1, other types (e.g. q8_0) save a compact file\n");
+    printf("                        of version 2. The blocks of --prompt-cache-dir are always compact files\n");
+    printf("  --prompt-cache-dir DIR\n");
+    printf("                        directory of a prompt prefix cache shared by the processes using the same model (default: none)\n");
+    printf("  --prompt-cache-block N\n");
+    printf("                        number of tokens of the blocks of the prompt prefix cache (default: %d)\n", params.prompt_cache_block);
+    printf("  --prompt-cache-size N size budget of the prompt prefix cache in MiB, 0 = unlimited (default: %d)\n", params.prompt_cache_size);
     printf("  --random-prompt       start with a randomized prompt.\n");
     printf("  --in-prefix-bos       prefix BOS to user inputs, preceding the `--in-prefix` string\n");
     printf("  --in-prefix STRING    string to prefix user inputs with (default: empty)\n");
@@ -614,6 +721,7 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("  -n N, --n-predict N   number of tokens to predict (default: %d, -1 = infinity, -2 = until context filled)\n", params.n_predict);
     printf("  -c N, --ctx-size N    size of the prompt context (default: %d)\n", params.n_ctx);
     printf("  -b N, --batch-size N  batch size for prompt processing (default: %d)\n", params.n_batch);
+    printf("  --kv-chunk N          grow the KV cache on demand in chunks of N tokens (default: %d, 0 = allocate for the full context)\n", params.n_kv_chunk);
     printf("  --top-k N             top-k sampling (default: %d, 0 = disabled)\n", params.top_k);
     printf("  --top-p N             top-p sampling (default: %.1f, 1.0 = disabled)\n", (double)params.top_p);
     printf("  --tfs N               tail free sampling, parameter z (default: %.1f, 1.0 = disabled)\n", (double)params.tfs_z);
@@ -633,6 +741,7 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("                        or `--logit-bias 15043-1` to decrease likelihood of token ' Hello'\n");
     printf("  --grammar GRAMMAR     BNF-like grammar to constrain generations (see samples in grammars/ dir)\n");
     printf("  --grammar-file FNAME  file to read grammar from\n");
+    printf("  --grammar-restrict    compute only the logits of the tokens the grammar accepts next\n");
     printf("  --cfg-negative-prompt PROMPT\n");
     printf("                        negative prompt to use for guidance. (default: empty)\n");
     printf("  --cfg-negative-prompt-file FNAME\n");
@@ -647,10 +756,20 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("                        not recommended: doubles context memory required and no measurable increase in quality\n");
     printf("  --temp N              temperature (default: %.1f)\n", (double)params.temp);
     printf("  --perplexity          compute perplexity over each ctx window of the prompt\n");
+    printf("  --pooling {mean,last,first}\n");
+    printf("                        how sentence embeddings are pooled over the tokens of an input (default: last)\n");
+    printf("  --embd-normalize      scale sentence embeddings to unit L2 norm\n");
+    printf("  --embd-split          embed each line of the prompt separately (default: the whole prompt)\n");
     printf("  --hellaswag           compute HellaSwag score over random tasks from datafile supplied with -f\n");
     printf("  --hellaswag-tasks N   number of tasks to use when computing the HellaSwag score (default: %zu)\n", params.hellaswag_tasks);
     printf("  --keep N              number of tokens to keep from the initial prompt (default: %d, -1 = all)\n", params.n_keep);
     printf("  --draft N             number of tokens to draft for speculative decoding (default: %d)\n", params.n_draft);
+    printf("  --draft-exit N        without a draft model, draft with the first N layers of the model (default: %d, 0 = disabled)\n", params.n_draft_exit);
+    printf("  --draft-skip N        without a draft model, draft skipping every N-th layer of the model (default: %d, 0 = disabled)\n", params.n_draft_skip);
+    printf("  --draft-lookup N      without a draft model, draft by looking up the last N tokens in the prompt and the generated text\n");
+    printf("                        and copying what followed them (default: %d, 0 = disabled)\n", params.n_draft_lookup);
+    printf("  --draft-branch N      with a draft model, draft token trees with N children per node and verify them in one batch\n");
+    printf("                        (default: %d, 0 = draft a single sequence)\n", params.n_draft_branch);
     printf("  --chunks N            max number of chunks to process (default: %d, -1 = all)\n", params.n_chunks);
     if (llama_mlock_supported()) {
         printf("  --mlock               force system to keep model in RAM rather than swapping or compressing\n");
@@ -658,6 +777,13 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     if (llama_mmap_supported()) {
         printf("  --no-mmap             do not memory-map model (slower load but may reduce pageouts if not using mlock)\n");
     }
+    printf("  --fuse-weights        multiply the Q/K/V and gate/up weights of each layer in one matmul each\n");
+    printf("                        with mmap, only weights stored next to each other in the model file are fused\n");
+    printf("  --stream-layers       with mmap, read each layer from the model file while the previous one is evaluated\n");
+    printf("                        and release it after, for models larger than the memory\n");
+    printf("                        the model can only have one context, e.g. not with --cfg-scale\n");
+    printf("  --repack              with --no-mmap, interleave the rows of the q4_0 weights for faster CPU matmuls (AVX2 only)\n");
+    printf("  --layer-timings       compute the layers one at a time and print the compute time of each layer\n");
     printf("  --numa                attempt optimizations that help on some NUMA systems\n");
     printf("                        if run without this previously, it is recommended to drop the system page cache before using this\n");
     printf("                        see https://github.com/ggerganov/llama.cpp/issues/1437\n");
@@ -680,6 +806,7 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     fprintf(stderr, "  --simple-io           use basic IO for better compatibility in subprocesses and limited consoles\n");
     printf("  --lora FNAME          apply LoRA adapter (implies --no-mmap)\n");
     printf("  --lora-base FNAME     optional model to use as a base for the layers modified by the LoRA adapter\n");
+    printf("  --lora-runtime FNAME  apply LoRA adapter at runtime, without modifying the model weights\n");
     printf("  -m FNAME, --model FNAME\n");
     printf("                        model path (default: %s)\n", params.model.c_str());
     printf("  -md FNAME, --model-draft FNAME\n");
@@ -717,6 +844,7 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
 
     lparams.n_ctx           = params.n_ctx;
     lparams.n_batch         = params.n_batch;
+    lparams.n_kv_chunk      = params.n_kv_chunk;
     if (params.n_gpu_layers != -1) {
         lparams.n_gpu_layers = params.n_gpu_layers;
     }
@@ -728,6 +856,10 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     lparams.f16_kv          = params.memory_f16;
     lparams.use_mmap        = params.use_mmap;
     lparams.use_mlock       = params.use_mlock;
+    lparams.fuse_weights    = params.fuse_weights;
+    lparams.stream_layers   = params.stream_layers;
+    lparams.repack_weights  = params.repack_weights;
+    lparams.layer_timings   = params.layer_timings;
     lparams.logits_all      = params.perplexity;
     lparams.embedding       = params.embedding;
     lparams.rope_freq_base  = params.rope_freq_base;
@@ -765,6 +897,17 @@ std::tuple<struct llama_model *, struct llama_context *> llama_init_from_gpt_par
         }
     }
 
+    if (!params.lora_runtime.empty()) {
+        // the adapter is freed with the model
+        llama_lora_adapter * adapter = llama_lora_adapter_init(model, params.lora_runtime.c_str());
+        if (adapter == NULL || llama_set_lora_adapter(lctx, adapter, 1.0f) != 0) {
+            fprintf(stderr, "%s: error: failed to apply runtime lora adapter\n", __func__);
+            llama_free(lctx);
+            llama_free_model(model);
+            return std::make_tuple(nullptr, nullptr);
+        }
+    }
+
     if (params.ignore_eos) {
         params.logit_bias[llama_token_eos(lctx)] = -INFINITY;
     }
@@ -969,6 +1112,31 @@ llama_token llama_sample_token(
     return id;
 }
 
+void llama_grammar_restrict_output(
+                  struct llama_context * ctx,
+            const struct llama_grammar * grammar,
+         std::vector<llama_token_data> & candidates) {
+    const int n_vocab = llama_n_vocab(ctx);
+
+    candidates.clear();
+    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+        candidates.emplace_back(llama_token_data{token_id, 0.0f, 0.0f});
+    }
+
+    llama_token_data_array cur_p = { candidates.data(), candidates.size(), false };
+
+    llama_sample_grammar(ctx, &cur_p, grammar);
+
+    std::vector<llama_token> accepted;
+    for (const auto & candidate : candidates) {
+        if (candidate.logit != -INFINITY) {
+            accepted.push_back(candidate.id);
+        }
+    }
+
+    llama_set_output_tokens(ctx, accepted.data(), accepted.size());
+}
+
 //
 // YAML utils
 //
@@ -1175,8 +1343,13 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "export: %s # default: false\n", params.export_cgraph ? "true" : "false");
     fprintf(stream, "file: # never logged, see prompt instead. Can still be specified for input.\n");
     fprintf(stream, "frequency_penalty: %f # default: 0.0 \n", params.frequency_penalty);
+    fprintf(stream, "fuse_weights: %s # default: false\n", params.fuse_weights ? "true" : "false");
+    fprintf(stream, "stream_layers: %s # default: false\n", params.stream_layers ? "true" : "false");
+    fprintf(stream, "repack_weights: %s # default: false\n", params.repack_weights ? "true" : "false");
+    fprintf(stream, "layer_timings: %s # default: false\n", params.layer_timings ? "true" : "false");
     dump_string_yaml_multiline(stream, "grammar", params.grammar.c_str());
     fprintf(stream, "grammar-file: # never logged, see grammar instead. Can still be specified for input.\n");
+    fprintf(stream, "grammar_restrict: %s # default: false\n", params.grammar_restrict ? "true" : "false");
     fprintf(stream, "hellaswag: %s # default: false\n", params.hellaswag ? "true" : "false");
     fprintf(stream, "hellaswag_tasks: %zu # default: 400\n", params.hellaswag_tasks);
 
@@ -1191,6 +1364,7 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "interactive: %s # default: false\n", params.interactive ? "true" : "false");
     fprintf(stream, "interactive_first: %s # default: false\n", params.interactive_first ? "true" : "false");
     fprintf(stream, "keep: %d # default: 0\n", params.n_keep);
+    fprintf(stream, "kv_chunk: %d # default: 0\n", params.n_kv_chunk);
     fprintf(stream, "logdir: %s # default: unset (no logging)\n", params.logdir.c_str());
 
     fprintf(stream, "logit_bias:\n");
@@ -1203,6 +1377,7 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
 
     fprintf(stream, "lora: %s\n", params.lora_adapter.c_str());
     fprintf(stream, "lora_base: %s\n", params.lora_base.c_str());
+    fprintf(stream, "lora_runtime: %s\n", params.lora_runtime.c_str());
     fprintf(stream, "low_vram: %s # default: false\n", params.low_vram ? "true" : "false");
     fprintf(stream, "main_gpu: %d # default: 0\n", params.main_gpu);
     fprintf(stream, "memory_f32: %s # default: false\n", !params.memory_f16 ? "true" : "false");
@@ -1228,6 +1403,10 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "prompt_cache: %s\n", params.path_prompt_cache.c_str());
     fprintf(stream, "prompt_cache_all: %s # default: false\n", params.prompt_cache_all ? "true" : "false");
     fprintf(stream, "prompt_cache_ro: %s # default: false\n", params.prompt_cache_ro ? "true" : "false");
+    fprintf(stream, "prompt_cache_type: %s # default: f16\n", ggml_type_name(params.prompt_cache_type));
+    fprintf(stream, "prompt_cache_dir: %s\n", params.prompt_cache_dir.c_str());
+    fprintf(stream, "prompt_cache_block: %d # default: 256\n", params.prompt_cache_block);
+    fprintf(stream, "prompt_cache_size: %d # default: 0\n", params.prompt_cache_size);
     dump_vector_int_yaml(stream, "prompt_tokens", prompt_tokens);
     fprintf(stream, "random_prompt: %s # default: false\n", params.random_prompt ? "true" : "false");
     fprintf(stream, "repeat_penalty: %f # default: 1.1\n", params.repeat_penalty);
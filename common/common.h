@@ -34,14 +34,20 @@ struct gpt_params {
     int32_t n_predict                       = -1;   // new tokens to predict
     int32_t n_ctx                           = 512;  // context size
     int32_t n_batch                         = 512;  // batch size for prompt processing (must be >=32 to use BLAS)
+    int32_t n_kv_chunk                      = 0;    // if > 0, grow the KV cache on demand in chunks of this many tokens
     int32_t n_keep                          = 0;    // number of tokens to keep from initial prompt
     int32_t n_draft                         = 16;   // number of tokens to draft during speculative decoding
+    int32_t n_draft_exit                    = 0;    // draft with the first n layers of the model itself (0 = disabled)
+    int32_t n_draft_skip                    = 0;    // draft with the model itself, skipping every n-th layer (0 = disabled)
+    int32_t n_draft_lookup                  = 0;    // draft by looking up the last n tokens in the prompt and the generated text (0 = disabled)
+    int32_t n_draft_branch                  = 0;    // draft token trees branching into n tokens per node with llama_speculative (0 = disabled)
     int32_t n_chunks                        = -1;   // max number of chunks to process (-1 = unlimited)
     int32_t n_gpu_layers                    = -1;   // number of layers to store in VRAM (-1 - use default)
     int32_t main_gpu                        = 0;    // the GPU that is used for scratch and small tensors
     float   tensor_split[LLAMA_MAX_DEVICES] = {0};  // how split tensors should be distributed across GPUs
     int32_t n_probs                         = 0;    // if greater than 0, output the probabilities of top n_probs tokens.
     int32_t n_beams                         = 0;    // if non-zero then use beam search of given width.
+    enum llama_pooling_type pooling         = LLAMA_POOLING_LAST; // how the sentence embedding of each input is pooled
     float   rope_freq_base                  = 10000.0f; // RoPE base frequency
     float   rope_freq_scale                 = 1.0f;     // RoPE frequency scaling factor
 
@@ -71,6 +77,10 @@ struct gpt_params {
     std::string model_alias       = "unknown"; // model alias
     std::string prompt            = "";
     std::string path_prompt_cache = "";  // path to file for saving/loading prompt eval state
+    ggml_type   prompt_cache_type = GGML_TYPE_F16; // type of the saved KV cache, f16 saves a full (v1) session file, other types a compact (v2) one
+    std::string prompt_cache_dir  = "";  // directory of the prompt prefix cache shared by the processes (see prompt-cache.h)
+    int32_t     prompt_cache_block = 256; // number of tokens of the blocks of the prompt prefix cache
+    int32_t     prompt_cache_size  = 0;   // size budget of the prompt prefix cache in MiB (0 = unlimited)
     std::string input_prefix      = "";  // string to prefix user inputs with
     std::string input_suffix      = "";  // string to suffix user inputs with
     std::string grammar           = "";  // optional BNF-like grammar to constrain sampling
@@ -79,6 +89,7 @@ struct gpt_params {
 
     std::string lora_adapter = "";  // lora adapter path
     std::string lora_base    = "";  // base model path for the lora adapter
+    std::string lora_runtime = "";  // lora adapter path, applied at runtime
 
     int  ppl_stride        = 0;     // stride for perplexity calculations. If left at 0, the pre-existing approach will be used.
     int  ppl_output_type   = 0;     // = 0 -> ppl output is as usual, = 1 -> ppl output is num_tokens, ppl, one per line
@@ -97,6 +108,8 @@ struct gpt_params {
     bool prompt_cache_ro   = false; // open the prompt cache read-only and do not update it
 
     bool embedding         = false; // get only sentence embedding
+    bool embd_normalize    = false; // scale sentence embeddings to unit L2 norm
+    bool embd_split        = false; // embed each line of the prompt separately
     bool escape            = false; // escape "\n", "\r", "\t", "\'", "\"", and "\\"
     bool interactive_first = false; // wait for user input immediately
     bool multiline_input   = false; // reverse the usage of `\`
@@ -104,11 +117,16 @@ struct gpt_params {
 
     bool input_prefix_bos  = false; // prefix BOS to user inputs, preceding input_prefix
     bool ignore_eos        = false; // ignore generated EOS tokens
+    bool grammar_restrict  = false; // compute only the logits of the tokens the grammar accepts
     bool instruct          = false; // instruction mode (used for Alpaca models)
     bool penalize_nl       = true;  // consider newlines as a repeatable token
     bool perplexity        = false; // compute perplexity over the prompt
     bool use_mmap          = true;  // use mmap for faster loads
     bool use_mlock         = false; // use mlock to keep model in memory
+    bool fuse_weights      = false; // fuse the Q/K/V and gate/up weights of each layer at load time
+    bool stream_layers     = false; // read the layers from the model file as they are evaluated
+    bool repack_weights    = false; // interleave the rows of the q4_0 weights at load time
+    bool layer_timings     = false; // measure the compute time of each layer
     bool mem_test          = false; // compute maximum memory usage
     bool numa              = false; // attempt optimizations that help on some NUMA systems
     bool export_cgraph     = false; // export the computation graph
@@ -191,6 +209,14 @@ llama_token llama_sample_token(
          std::vector<llama_token_data> & candidates,
                                    int   idx = 0);
 
+// Restricts the logits of the next evals of ctx to the tokens the grammar accepts in its current state
+// (see llama_set_output_tokens), candidates is used as scratch space
+// The logits of the other tokens are -INFINITY, so the grammar does not need to filter them again when sampling
+void llama_grammar_restrict_output(
+                  struct llama_context * ctx,
+            const struct llama_grammar * grammar,
+         std::vector<llama_token_data> & candidates);
+
 //
 // YAML utils
 //
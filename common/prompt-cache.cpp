@@ -0,0 +1,261 @@
+#include "prompt-cache.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#   define NOMINMAX
+#endif
+#include <windows.h>
+#include <process.h>
+#include <sys/utime.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+namespace prompt_cache {
+
+struct file_info {
+    std::string path;
+    size_t      size;
+    time_t      mtime;
+    int         index; // index of the last block of the file in the prompt
+};
+
+static uint64_t hash_bytes(uint64_t h, const void * data, size_t size) {
+    // FNV-1a
+    const uint8_t * p = (const uint8_t *) data;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// a file is identified by its name, size and modification time
+static uint64_t hash_file(uint64_t h, const std::string & path) {
+    const size_t pos = path.find_last_of("/\\");
+    const std::string name = pos == std::string::npos ? path : path.substr(pos + 1);
+    h = hash_bytes(h, name.data(), name.size() + 1);
+
+    struct stat st;
+    if (!path.empty() && stat(path.c_str(), &st) == 0) {
+        const int64_t size  = st.st_size;
+        const int64_t mtime = st.st_mtime;
+        h = hash_bytes(h, &size,  sizeof(size));
+        h = hash_bytes(h, &mtime, sizeof(mtime));
+    }
+
+    return h;
+}
+
+// the weights are those of the model file and of the lora adapters applied to it, the KV cache
+// also depends on the context size, the RoPE frequencies and the types it is computed and saved in
+static uint64_t hash_model(const gpt_params & params) {
+    uint64_t h = 14695981039346656037ull;
+
+    h = hash_file(h, params.model);
+    h = hash_file(h, params.lora_adapter);
+    h = hash_file(h, params.lora_base);
+    h = hash_file(h, params.lora_runtime);
+
+    const int32_t n_ctx      = params.n_ctx;
+    const float   freq_base  = params.rope_freq_base;
+    const float   freq_scale = params.rope_freq_scale;
+    const int32_t type_kv    = params.memory_f16 ? GGML_TYPE_F16 : GGML_TYPE_F32;
+    const int32_t type_saved = params.prompt_cache_type;
+
+    h = hash_bytes(h, &n_ctx,      sizeof(n_ctx));
+    h = hash_bytes(h, &freq_base,  sizeof(freq_base));
+    h = hash_bytes(h, &freq_scale, sizeof(freq_scale));
+    h = hash_bytes(h, &type_kv,    sizeof(type_kv));
+    h = hash_bytes(h, &type_saved, sizeof(type_saved));
+
+    return h;
+}
+
+static std::string block_path(const std::string & dir, uint64_t h, size_t ib) {
+    char name[48];
+    snprintf(name, sizeof(name), "%016" PRIx64 "-%zu.bin", h, ib);
+    return dir + "/" + name;
+}
+
+// paths of the files of the first n_blocks blocks of tokens
+static std::vector<std::string> block_paths(const gpt_params & params, const std::vector<llama_token> & tokens, size_t n_blocks) {
+    std::vector<std::string> paths;
+
+    uint64_t h = hash_model(params);
+    for (size_t ib = 0; ib < n_blocks; ++ib) {
+        h = hash_bytes(h, tokens.data() + ib*params.prompt_cache_block, params.prompt_cache_block*sizeof(llama_token));
+        paths.push_back(block_path(params.prompt_cache_dir, h, ib));
+    }
+
+    return paths;
+}
+
+static bool file_exists(const std::string & path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+// marks the files of a chain of blocks as recently used
+// the parents are marked last, so that they are never older than their children
+static void touch(const std::vector<std::string> & paths, size_t n_blocks) {
+    for (size_t ib = n_blocks; ib-- > 0;) {
+#if defined(_WIN32)
+        _utime(paths[ib].c_str(), NULL);
+#else
+        utime(paths[ib].c_str(), NULL);
+#endif
+    }
+}
+
+static std::vector<file_info> list_files(const std::string & dir) {
+    std::vector<file_info> files;
+
+    auto add = [&](const std::string & name) {
+        if (name.size() < 4 || name.compare(name.size() - 4, 4, ".bin") != 0) {
+            return;
+        }
+        const size_t pos = name.find_last_of('-');
+        const int index = pos == std::string::npos ? 0 : atoi(name.c_str() + pos + 1);
+        const std::string path = dir + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0) {
+            files.push_back({ path, (size_t) st.st_size, st.st_mtime, index });
+        }
+    };
+
+#if defined(_WIN32)
+    WIN32_FIND_DATAA data;
+    HANDLE handle = FindFirstFileA((dir + "/*.bin").c_str(), &data);
+    if (handle != INVALID_HANDLE_VALUE) {
+        do {
+            add(data.cFileName);
+        } while (FindNextFileA(handle, &data));
+        FindClose(handle);
+    }
+#else
+    DIR * d = opendir(dir.c_str());
+    if (d) {
+        while (struct dirent * entry = readdir(d)) {
+            add(entry->d_name);
+        }
+        closedir(d);
+    }
+#endif
+
+    return files;
+}
+
+static void evict(const gpt_params & params) {
+    const size_t max_size = (size_t) params.prompt_cache_size*1024*1024;
+    if (max_size == 0) {
+        return;
+    }
+
+    std::vector<file_info> files = list_files(params.prompt_cache_dir);
+
+    size_t total = 0;
+    for (const auto & file : files) {
+        total += file.size;
+    }
+
+    // the files of the longer prefixes are removed first among the files used at the same time, so that a
+    // parent is not removed before its children
+    std::sort(files.begin(), files.end(), [](const file_info & a, const file_info & b) {
+        return a.mtime != b.mtime ? a.mtime < b.mtime : a.index > b.index;
+    });
+
+    for (size_t i = 0; i < files.size() && total > max_size; ++i) {
+        if (remove(files[i].path.c_str()) == 0) {
+            total -= files[i].size;
+        }
+    }
+}
+
+size_t load(struct llama_context * ctx, const gpt_params & params, const std::vector<llama_token> & tokens) {
+    if (params.prompt_cache_dir.empty() || params.prompt_cache_block <= 0 || tokens.empty()) {
+        return 0;
+    }
+
+    // the blocks are stored in order, so the longest prefix ends at the first missing block
+    std::vector<std::string> paths = block_paths(params, tokens, (tokens.size() - 1)/params.prompt_cache_block);
+    size_t n_found = 0;
+    while (n_found < paths.size() && file_exists(paths[n_found])) {
+        n_found++;
+    }
+
+    std::vector<llama_token> session_tokens(tokens.size());
+
+    for (size_t n_blocks = n_found; n_blocks > 0; --n_blocks) {
+        const size_t n_tokens = n_blocks*params.prompt_cache_block;
+
+        size_t n_token_count = 0;
+        if (!llama_load_session_file(ctx, paths[n_blocks - 1].c_str(), session_tokens.data(), session_tokens.size(), &n_token_count)) {
+            fprintf(stderr, "%s: failed to load '%s', trying a shorter prefix\n", __func__, paths[n_blocks - 1].c_str());
+            continue;
+        }
+
+        if (n_token_count != n_tokens || !std::equal(tokens.begin(), tokens.begin() + n_tokens, session_tokens.begin())) {
+            fprintf(stderr, "%s: '%s' does not match the prompt, trying a shorter prefix\n", __func__, paths[n_blocks - 1].c_str());
+            continue;
+        }
+
+        touch(paths, n_blocks);
+
+        return n_tokens;
+    }
+
+    return 0;
+}
+
+void save(struct llama_context * ctx, const gpt_params & params, const std::vector<llama_token> & tokens) {
+    if (params.prompt_cache_dir.empty() || params.prompt_cache_block <= 0) {
+        return;
+    }
+
+    const size_t n_tokens = std::min(tokens.size(), (size_t) llama_get_kv_cache_token_count(ctx));
+    const std::vector<std::string> paths = block_paths(params, tokens, n_tokens/params.prompt_cache_block);
+
+    size_t n_saved = 0;
+    for (size_t ib = 0; ib < paths.size(); ++ib, ++n_saved) {
+        if (file_exists(paths[ib])) {
+            continue;
+        }
+
+        // the file is written under a temporary name, so that other processes never read a partial file
+#if defined(_WIN32)
+        const int pid = _getpid();
+#else
+        const int pid = getpid();
+#endif
+        const std::string path_tmp = paths[ib] + "." + std::to_string(pid) + ".tmp";
+        // the chain is restarted with a block without parent at the maximum depth of the session files
+        const char * path_parent = ib % LLAMA_SESSION_MAX_DEPTH != 0 ? paths[ib - 1].c_str() : NULL;
+
+        if (!llama_save_session_file_compact(ctx, path_tmp.c_str(), tokens.data(), (ib + 1)*params.prompt_cache_block, params.prompt_cache_type, path_parent)) {
+            fprintf(stderr, "%s: failed to save '%s'\n", __func__, paths[ib].c_str());
+            remove(path_tmp.c_str());
+            break;
+        }
+
+        if (rename(path_tmp.c_str(), paths[ib].c_str()) != 0) {
+            // another process stored the same block first
+            remove(path_tmp.c_str());
+        }
+    }
+
+    touch(paths, n_saved);
+
+    evict(params);
+}
+
+}
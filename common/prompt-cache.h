@@ -0,0 +1,23 @@
+// Prompt prefix cache shared by the processes using the same model
+//
+// The prompt is split in blocks of n_block tokens. The cache of the first i blocks is stored in the cache
+// directory as a compact session file named after the hash of the model, the lora adapters, the KV cache
+// parameters (context size, RoPE frequencies, types) and the tokens of these blocks, with the file of the first i - 1 blocks as parent - except every LLAMA_SESSION_MAX_DEPTH
+// blocks, where the file is stored without parent. The least recently used files are removed when the
+// directory grows over the size budget.
+
+#pragma once
+
+#include "common.h"
+
+#include <string>
+#include <vector>
+
+namespace prompt_cache {
+    // restores the cache of the longest prefix of tokens found in the cache directory
+    // at least the last token is left to evaluate. Returns the number of tokens restored
+    size_t load(struct llama_context * ctx, const gpt_params & params, const std::vector<llama_token> & tokens);
+
+    // stores the blocks of the evaluated tokens missing from the cache directory, then evicts the least recently used files
+    void save(struct llama_context * ctx, const gpt_params & params, const std::vector<llama_token> & tokens);
+}
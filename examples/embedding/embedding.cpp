@@ -3,6 +3,7 @@
 #include "build-info.h"
 
 #include <ctime>
+#include <sstream>
 
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
@@ -55,44 +56,62 @@ int main(int argc, char ** argv) {
                 params.n_threads, std::thread::hardware_concurrency(), llama_print_system_info());
     }
 
-    int n_past = 0;
-
-    // tokenize the prompt
-    auto embd_inp = ::llama_tokenize(ctx, params.prompt, true);
-
-    if (params.verbose_prompt) {
-        fprintf(stderr, "\n");
-        fprintf(stderr, "%s: prompt: '%s'\n", __func__, params.prompt.c_str());
-        fprintf(stderr, "%s: number of tokens in prompt = %zu\n", __func__, embd_inp.size());
-        for (int i = 0; i < (int) embd_inp.size(); i++) {
-            fprintf(stderr, "%6d -> '%s'\n", embd_inp[i], llama_token_to_piece(ctx, embd_inp[i]).c_str());
+    // the whole prompt is one input, or with --embd-split each of its lines
+    std::vector<std::string> prompts;
+    if (params.embd_split) {
+        std::stringstream ss(params.prompt);
+        std::string line;
+        while (std::getline(ss, line)) {
+            if (!line.empty()) {
+                prompts.push_back(line);
+            }
         }
-        fprintf(stderr, "\n");
     }
-
-    if (embd_inp.size() > (size_t)params.n_ctx) {
-        fprintf(stderr, "%s: error: prompt is longer than the context window (%zu tokens, n_ctx = %d)\n",
-                __func__, embd_inp.size(), params.n_ctx);
-        return 1;
+    if (prompts.empty()) {
+        prompts.push_back(params.prompt);
     }
 
-    while (!embd_inp.empty()) {
-        int n_tokens = std::min(params.n_batch, (int) embd_inp.size());
-        if (llama_eval(ctx, embd_inp.data(), n_tokens, n_past, params.n_threads)) {
-            fprintf(stderr, "%s : failed to eval\n", __func__);
+    // tokenize the prompts
+    std::vector<llama_token> embd_inp;
+    std::vector<int>         n_tokens;
+
+    for (const auto & prompt : prompts) {
+        auto inp = ::llama_tokenize(ctx, prompt, true);
+
+        if (params.verbose_prompt) {
+            fprintf(stderr, "\n");
+            fprintf(stderr, "%s: prompt: '%s'\n", __func__, prompt.c_str());
+            fprintf(stderr, "%s: number of tokens in prompt = %zu\n", __func__, inp.size());
+            for (int i = 0; i < (int) inp.size(); i++) {
+                fprintf(stderr, "%6d -> '%s'\n", inp[i], llama_token_to_piece(ctx, inp[i]).c_str());
+            }
+            fprintf(stderr, "\n");
+        }
+
+        if (inp.size() > (size_t)params.n_ctx) {
+            fprintf(stderr, "%s: error: prompt is longer than the context window (%zu tokens, n_ctx = %d)\n",
+                    __func__, inp.size(), params.n_ctx);
             return 1;
         }
-        n_past += n_tokens;
-        embd_inp.erase(embd_inp.begin(), embd_inp.begin() + n_tokens);
+
+        embd_inp.insert(embd_inp.end(), inp.begin(), inp.end());
+        n_tokens.push_back(inp.size());
     }
 
     const int n_embd = llama_n_embd(ctx);
-    const auto embeddings = llama_get_embeddings(ctx);
+    std::vector<float> embeddings(n_tokens.size()*n_embd);
+
+    if (llama_embed_batch(ctx, embd_inp.data(), n_tokens.data(), n_tokens.size(), params.pooling, params.embd_normalize, embeddings.data(), params.n_threads)) {
+        fprintf(stderr, "%s : failed to eval\n", __func__);
+        return 1;
+    }
 
-    for (int i = 0; i < n_embd; i++) {
-        printf("%f ", embeddings[i]);
+    for (size_t j = 0; j < n_tokens.size(); j++) {
+        for (int i = 0; i < n_embd; i++) {
+            printf("%f ", embeddings[j*n_embd + i]);
+        }
+        printf("\n");
     }
-    printf("\n");
 
     llama_print_timings(ctx);
     llama_free(ctx);
@@ -4,6 +4,7 @@
 #include "llama.h"
 #include "build-info.h"
 #include "grammar-parser.h"
+#include "prompt-cache.h"
 
 #include <cassert>
 #include <cinttypes>
@@ -175,6 +176,10 @@ int main(int argc, char ** argv) {
     if (params.cfg_scale > 1.f) {
         struct llama_context_params lparams = llama_context_params_from_gpt_params(params);
         ctx_guidance = llama_new_context_with_model(model, lparams);
+        if (ctx_guidance == NULL) {
+            LOG_TEE("%s: error: unable to create the guidance context (--stream-layers needs a single context)\n", __func__);
+            return 1;
+        }
     }
 
     if (model == NULL) {
@@ -227,6 +232,14 @@ int main(int argc, char ** argv) {
     std::string path_session = params.path_prompt_cache;
     std::vector<llama_token> session_tokens;
 
+    auto save_session = [&]() {
+        if (params.prompt_cache_type == GGML_TYPE_F16) {
+            llama_save_session_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
+        } else {
+            llama_save_session_file_compact(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size(), params.prompt_cache_type, NULL);
+        }
+    };
+
     if (!path_session.empty()) {
         LOG_TEE("%s: attempting to load saved session from '%s'\n", __func__, path_session.c_str());
 
@@ -299,6 +312,15 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
+    // restore the longest prefix of the prompt found in the shared prompt cache
+    if (!params.prompt_cache_dir.empty() && session_tokens.empty()) {
+        const size_t n_restored = prompt_cache::load(ctx, params, embd_inp);
+        session_tokens.assign(embd_inp.begin(), embd_inp.begin() + n_restored);
+        llama_set_rng_seed(ctx, params.seed);
+
+        LOG_TEE("%s: restored %zu / %zu tokens of prompt from the prompt cache '%s'\n", __func__, n_restored, embd_inp.size(), params.prompt_cache_dir.c_str());
+    }
+
     // debug message about similarity of saved session, if applicable
     size_t n_matching_session_tokens = 0;
     if (!session_tokens.empty()) {
@@ -473,6 +495,7 @@ int main(int argc, char ** argv) {
     bool is_antiprompt        = false;
     bool input_echo           = true;
     bool need_to_save_session = !path_session.empty() && n_matching_session_tokens < embd_inp.size();
+    bool need_to_save_prompt_cache = !params.prompt_cache_dir.empty() && n_matching_session_tokens < embd_inp.size();
 
     int n_past             = 0;
     int n_remain           = params.n_predict;
@@ -513,29 +536,43 @@ int main(int argc, char ** argv) {
                 fflush(stdout);
             }
 
-            // infinite text generation via context swapping
+            // infinite text generation via context shifting
             // if we run out of context:
-            // - take the n_keep first tokens from the original prompt (via n_past)
-            // - take half of the last (n_ctx - n_keep) tokens and recompute the logits in batches
+            // - keep the n_keep first tokens from the original prompt as attention sinks
+            // - discard half of the last (n_ctx - n_keep) tokens from the KV cache and shift the rest back
+            // if the KV cache cannot be shifted in place, the remaining half is re-evaluated in batches instead
             if (n_past + (int) embd.size() + std::max<int>(0, guidance_offset) > n_ctx) {
                 if (params.n_predict == -2) {
                     LOG_TEE("\n\n%s: context full and n_predict == -%d => stopping\n", __func__, params.n_predict);
                     break;
                 }
 
-                const int n_left = n_past - params.n_keep;
-                LOG("context full, swapping: n_past = %d, n_left = %d, n_ctx = %d, n_keep = %d\n", n_past, n_left, n_ctx, params.n_keep);
-
                 // always keep the first token - BOS
-                n_past          = std::max(1, params.n_keep);
-                n_past_guidance = std::max(1, params.n_keep + guidance_offset);
+                const int n_keep    = std::max(1, params.n_keep);
+                const int n_left    = n_past - n_keep;
+                const int n_discard = n_left - n_left/2;
+
+                LOG("context full, shifting: n_past = %d, n_left = %d, n_ctx = %d, n_keep = %d, n_discard = %d\n", n_past, n_left, n_ctx, n_keep, n_discard);
+
+                const int n_keep_guidance = std::max(1, n_keep + guidance_offset);
+
+                if (llama_kv_cache_shift(ctx, n_keep, n_discard, params.n_threads) == 0 &&
+                    (!ctx_guidance || llama_kv_cache_shift(ctx_guidance, n_keep_guidance, n_discard, params.n_threads) == 0)) {
+                    n_past          -= n_discard;
+                    n_past_guidance -= n_discard;
 
-                LOG("after swap: n_past = %d, n_past_guidance = %d\n", n_past, n_past_guidance);
+                    LOG("after shift: n_past = %d, n_past_guidance = %d\n", n_past, n_past_guidance);
+                } else {
+                    n_past          = n_keep;
+                    n_past_guidance = n_keep_guidance;
+
+                    LOG("after swap: n_past = %d, n_past_guidance = %d\n", n_past, n_past_guidance);
 
-                // insert n_left/2 tokens at the start of embd from last_tokens
-                embd.insert(embd.begin(), last_tokens.begin() + n_ctx - n_left/2 - embd.size(), last_tokens.end() - embd.size());
+                    // insert n_left/2 tokens at the start of embd from last_tokens
+                    embd.insert(embd.begin(), last_tokens.begin() + n_ctx - n_left/2 - embd.size(), last_tokens.end() - embd.size());
 
-                LOG("embd: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx, embd));
+                    LOG("embd: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx, embd));
+                }
 
                 LOG("clear session path\n");
                 path_session.clear();
@@ -566,10 +603,10 @@ int main(int argc, char ** argv) {
             // evaluate tokens in batches
             // embd is typically prepared beforehand to fit within a batch, but not always
 
-            if (ctx_guidance) {
-                int input_size = 0;
-                llama_token * input_buf = NULL;
+            int input_size = 0;
+            llama_token * input_buf = NULL;
 
+            if (ctx_guidance) {
                 if (n_past_guidance < (int) guidance_inp.size()) {
                     // Guidance context should have the same data with these modifications:
                     //
@@ -592,32 +629,30 @@ int main(int argc, char ** argv) {
                     input_buf  = embd.data();
                     input_size = embd.size();
                 }
+            }
 
-                for (int i = 0; i < input_size; i += params.n_batch) {
-                    int n_eval = std::min(input_size - i, params.n_batch);
-                    if (llama_eval(ctx_guidance, input_buf + i, n_eval, n_past_guidance, params.n_threads)) {
-                        LOG_TEE("%s : failed to eval\n", __func__);
-                        return 1;
-                    }
-
-                    n_past_guidance += n_eval;
-                }
+            if (grammar != NULL && params.grammar_restrict) {
+                // the logits are only needed for the tokens the grammar accepts next
+                llama_grammar_restrict_output(ctx, grammar, candidates);
             }
 
-            for (int i = 0; i < (int) embd.size(); i += params.n_batch) {
-                int n_eval = (int) embd.size() - i;
-                if (n_eval > params.n_batch) {
-                    n_eval = params.n_batch;
-                }
+            // the guidance context is evaluated in the same batch as the main context
+            for (int i = 0; i < std::max((int) embd.size(), input_size); i += params.n_batch) {
+                const int n_eval          = std::max(0, std::min((int) embd.size() - i, params.n_batch));
+                const int n_eval_guidance = std::max(0, std::min(input_size - i, params.n_batch));
 
                 LOG("eval: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx, embd));
 
-                if (llama_eval(ctx, &embd[i], n_eval, n_past, params.n_threads)) {
+                const llama_token * eval_buf          = n_eval          > 0 ? &embd[i]      : NULL;
+                const llama_token * eval_buf_guidance = n_eval_guidance > 0 ? input_buf + i : NULL;
+
+                if (llama_eval_guided(ctx, eval_buf, n_eval, n_past, ctx_guidance, eval_buf_guidance, n_eval_guidance, n_past_guidance, params.n_threads)) {
                     LOG_TEE("%s : failed to eval\n", __func__);
                     return 1;
                 }
 
-                n_past += n_eval;
+                n_past          += n_eval;
+                n_past_guidance += n_eval_guidance;
 
                 LOG("n_past = %d\n", n_past);
             }
@@ -635,12 +670,27 @@ int main(int argc, char ** argv) {
             // optionally save the session on first sample (for faster prompt loading next time)
             if (!path_session.empty() && need_to_save_session && !params.prompt_cache_ro) {
                 need_to_save_session = false;
-                llama_save_session_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
+                save_session();
 
                 LOG("saved session to %s\n", path_session.c_str());
             }
 
-            const llama_token id = llama_sample_token(ctx, ctx_guidance, grammar, params, last_tokens, candidates);
+            if (need_to_save_prompt_cache && !params.prompt_cache_ro) {
+                need_to_save_prompt_cache = false;
+                prompt_cache::save(ctx, params, embd_inp);
+
+                LOG("saved prompt to the prompt cache %s\n", params.prompt_cache_dir.c_str());
+            }
+
+            // with --grammar-restrict, the logits of the tokens the grammar rejects are already -INFINITY and
+            // the grammar only needs to accept the sampled token
+            struct llama_grammar * grammar_filter = params.grammar_restrict ? NULL : grammar;
+
+            const llama_token id = llama_sample_token(ctx, ctx_guidance, grammar_filter, params, last_tokens, candidates);
+
+            if (grammar != NULL && grammar_filter == NULL) {
+                llama_grammar_accept_token(ctx, grammar, id);
+            }
 
             last_tokens.erase(last_tokens.begin());
             last_tokens.push_back(id);
@@ -854,10 +904,18 @@ int main(int argc, char ** argv) {
 
     if (!path_session.empty() && params.prompt_cache_all && !params.prompt_cache_ro) {
         LOG_TEE("\n%s: saving final output to session file '%s'\n", __func__, path_session.c_str());
-        llama_save_session_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
+        save_session();
     }
 
     llama_print_timings(ctx);
+    {
+        const llama_memory_info mem = llama_get_memory_info(ctx);
+        const double MiB = 1024.0*1024.0;
+        LOG_TEE("%s: memory: model = %.2f MiB (%.2f MiB mapped, %.2f MiB resident, %.2f MiB host, %.2f MiB device)\n", __func__,
+                mem.model_size/MiB, mem.model_mapped/MiB, mem.model_resident/MiB, mem.model_host/MiB, mem.model_device/MiB);
+        LOG_TEE("%s: memory: KV cache = %.2f MiB (%.2f MiB max, %.2f MiB used), compute = %.2f MiB, alloc = %.2f MiB (%.2f MiB peak), work = %.2f MiB, output = %.2f MiB\n", __func__,
+                mem.kv_size/MiB, mem.kv_max/MiB, mem.kv_used/MiB, mem.compute_size/MiB, mem.alloc_size/MiB, mem.alloc_peak/MiB, mem.work_size/MiB, mem.output_size/MiB);
+    }
     write_logfile(ctx, params, model, input_tokens, output_ss.str(), output_tokens);
 
     if (ctx_guidance) { llama_free(ctx_guidance); }
@@ -309,14 +309,15 @@ results_perplexity perplexity(llama_context * ctx, const gpt_params & params) {
 
     std::vector<std::thread> workers(std::thread::hardware_concurrency() - 1);
 
+    // the logits of each batch are written directly to their place in the chunk
+    std::vector<float> logits((size_t) params.n_ctx * n_vocab);
+
     for (int i = 0; i < n_chunk; ++i) {
         const int start =     i * params.n_ctx;
         const int end   = start + params.n_ctx;
 
         const int num_batches = (params.n_ctx + n_batch - 1) / n_batch;
 
-        std::vector<float> logits;
-
         const auto t_start = std::chrono::high_resolution_clock::now();
 
         for (int j = 0; j < num_batches; ++j) {
@@ -331,18 +332,20 @@ results_perplexity perplexity(llama_context * ctx, const gpt_params & params) {
                 tokens[batch_start] = llama_token_bos(ctx);
             }
 
+            llama_set_logits_buffer(ctx, logits.data() + (size_t) j * n_batch * n_vocab, (size_t) batch_size * n_vocab);
+
             if (llama_eval(ctx, tokens.data() + batch_start, batch_size, j * n_batch, params.n_threads)) {
                 fprintf(stderr, "%s : failed to eval\n", __func__);
+                llama_set_logits_buffer(ctx, NULL, 0);
                 return {tokens, -1, logit_history, prob_history};
             }
 
             // restore the original token in case it was set to BOS
             tokens[batch_start] = token_org;
-
-            const auto batch_logits = llama_get_logits(ctx);
-            logits.insert(logits.end(), batch_logits, batch_logits + batch_size * n_vocab);
         }
 
+        llama_set_logits_buffer(ctx, NULL, 0);
+
         const auto t_end = std::chrono::high_resolution_clock::now();
 
         if (i == 0) {
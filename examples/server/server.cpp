@@ -388,6 +388,9 @@ struct llama_server_context
             n_past--;
         }
 
+        // release the KV cache storage of a previous, longer prompt
+        llama_kv_cache_trim(ctx, n_past);
+
         LOG_VERBOSE("prompt ingested", {
                                            {"n_past", n_past},
                                            {"cached", tokens_to_str(ctx, embd.cbegin(), embd.cbegin() + n_past)},
@@ -689,6 +692,54 @@ struct llama_server_context
         std::vector<float> embedding(data, data + n_embd);
         return embedding;
     }
+
+    std::vector<std::vector<float>> getEmbeddings(const std::vector<std::string> &contents, llama_pooling_type pooling, bool normalize)
+    {
+        const int n_embd = llama_n_embd(ctx);
+        if (!params.embedding)
+        {
+            LOG_WARNING("embedding disabled", {
+                                                  {"params.embedding", params.embedding},
+                                              });
+            return std::vector<std::vector<float>>(contents.size(), std::vector<float>(n_embd, 0.0f));
+        }
+
+        std::vector<llama_token> tokens;
+        std::vector<int> n_tokens;
+        for (const auto &content : contents)
+        {
+            auto content_tokens = tokenize(content, true);  // always add BOS
+            if (content_tokens.size() > (size_t)params.n_ctx)
+            {
+                content_tokens.resize(params.n_ctx);
+                truncated = true;
+            }
+            tokens.insert(tokens.end(), content_tokens.begin(), content_tokens.end());
+            n_tokens.push_back(content_tokens.size());
+        }
+        num_prompt_tokens = tokens.size();
+
+        // the KV cache is overwritten, nothing of a previous prompt can be reused
+        embd.clear();
+        n_past = 0;
+
+        std::vector<float> data(contents.size() * n_embd);
+        if (llama_embed_batch(ctx, tokens.data(), n_tokens.data(), n_tokens.size(), pooling, normalize, data.data(), params.n_threads))
+        {
+            LOG_ERROR("failed to eval", {
+                                            {"n_inputs", contents.size()},
+                                            {"n_tokens", tokens.size()},
+                                        });
+            return std::vector<std::vector<float>>(contents.size(), std::vector<float>(n_embd, 0.0f));
+        }
+
+        std::vector<std::vector<float>> embeddings;
+        for (size_t i = 0; i < contents.size(); i++)
+        {
+            embeddings.emplace_back(data.begin() + i * n_embd, data.begin() + (i + 1) * n_embd);
+        }
+        return embeddings;
+    }
 };
 
 static void server_print_usage(const char *argv0, const gpt_params &params,
@@ -704,6 +755,7 @@ static void server_print_usage(const char *argv0, const gpt_params &params,
     printf("  --rope-freq-base N    RoPE base frequency (default: %.1f)\n", params.rope_freq_base);
     printf("  --rope-freq-scale N   RoPE frequency scaling factor (default: %g)\n", params.rope_freq_scale);
     printf("  -b N, --batch-size N  batch size for prompt processing (default: %d)\n", params.n_batch);
+    printf("  --kv-chunk N          grow the KV cache on demand in chunks of N tokens (default: %d, 0 = allocate for the full context)\n", params.n_kv_chunk);
     printf("  --memory-f32          use f32 instead of f16 for memory key+value (default: disabled)\n");
     printf("                        not recommended: doubles context memory required and no measurable increase in quality\n");
     if (llama_mlock_supported())
@@ -861,6 +913,15 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
             params.n_batch = std::stoi(argv[i]);
             params.n_batch = std::min(512, params.n_batch);
         }
+        else if (arg == "--kv-chunk")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.n_kv_chunk = std::stoi(argv[i]);
+        }
         else if (arg == "--gpu-layers" || arg == "-ngl" || arg == "--n-gpu-layers")
         {
             if (++i >= argc)
@@ -1540,6 +1601,33 @@ int main(int argc, char **argv)
 
         llama.rewind();
         llama_reset_timings(llama.ctx);
+        if (body.count("content") != 0 && body["content"].is_array())
+        {
+            // several inputs are embedded in a single batch
+            for (const auto & content : body["content"])
+            {
+                if (!content.is_string())
+                {
+                    res.status = 400;
+                    return;
+                }
+            }
+            const std::vector<std::string> contents = body["content"];
+            const std::string pooling_str = body.value("pooling", "last");
+            llama_pooling_type pooling = LLAMA_POOLING_LAST;
+            if (pooling_str == "mean")
+            {
+                pooling = LLAMA_POOLING_MEAN;
+            }
+            else if (pooling_str == "first")
+            {
+                pooling = LLAMA_POOLING_FIRST;
+            }
+            const json data = json{
+                {"embeddings", llama.getEmbeddings(contents, pooling, body.value("normalize", false))},
+            };
+            return res.set_content(data.dump(), "application/json");
+        }
         if (body.count("content") != 0)
         {
             llama.prompt = body["content"];
@@ -4,11 +4,66 @@
 #include "llama.h"
 #include "grammar-parser.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstdio>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+// index of the n-grams of the prompt and the generated text, for drafting without a draft model
+struct ngram_index {
+    int n_max = 0;
+
+    // hash of n tokens -> position after their latest occurrence, one map per n in [1, n_max]
+    std::vector<std::unordered_map<uint64_t, int>> maps;
+
+    // number of positions in the history whose n-grams are indexed
+    int n_indexed = 0;
+};
+
+static uint64_t ngram_hash(const llama_token * tokens, int n) {
+    uint64_t h = 14695981039346656037ull; // FNV-1a
+    for (int i = 0; i < n; ++i) {
+        h = (h ^ (uint32_t) tokens[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+// drafts up to n_draft tokens by finding the longest suffix of the history that occurred before, and copying
+// what followed it - hash collisions only lead to drafts that the target model rejects
+static int ngram_index_draft(ngram_index & index, const std::vector<llama_token> & history, int n_draft, std::vector<llama_token> & drafted) {
+    const int n_hist = history.size();
+
+    // only index the n-grams that are followed by a token, so that the suffix does not find itself
+    for (int p = index.n_indexed; p + 1 < n_hist; ++p) {
+        for (int n = 1; n <= index.n_max && n <= p + 1; ++n) {
+            index.maps[n - 1][ngram_hash(&history[p + 1 - n], n)] = p + 1;
+        }
+    }
+    index.n_indexed = std::max(index.n_indexed, n_hist - 1);
+
+    for (int n = std::min(index.n_max, n_hist); n >= 1; --n) {
+        const auto & map = index.maps[n - 1];
+        const auto it = map.find(ngram_hash(&history[n_hist - n], n));
+        if (it == map.end()) {
+            continue;
+        }
+
+        int n_cur = 0;
+        for (int p = it->second; p < n_hist && n_cur < n_draft; ++p, ++n_cur) {
+            drafted.push_back(history[p]);
+        }
+
+        LOG("found a %d-gram in the history, drafted %d tokens\n", n, n_cur);
+
+        return n_cur;
+    }
+
+    return 0;
+}
+
 int main(int argc, char ** argv) {
     gpt_params params;
 
@@ -16,8 +71,14 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
-    if (params.model_draft.empty()) {
-        fprintf(stderr, "%s: error: --model-draft is required\n", __func__);
+    // without a draft model, the target model drafts either with a subset of its layers (self-speculative decoding)
+    // or by copying from the prompt and the generated text (prompt lookup)
+    const bool has_dft   = !params.model_draft.empty();
+    const bool lookup    = !has_dft && params.n_draft_lookup > 0;
+    const bool self_spec = !has_dft && !lookup;
+
+    if (self_spec && params.n_draft_exit <= 0 && params.n_draft_skip <= 0) {
+        fprintf(stderr, "%s: error: --model-draft, --draft-exit, --draft-skip or --draft-lookup is required\n", __func__);
         return 1;
     }
 
@@ -40,9 +101,68 @@ int main(int argc, char ** argv) {
     params.perplexity = true; // HACK: enable logits_all = true
     std::tie(model_tgt, ctx_tgt) = llama_init_from_gpt_params(params);
 
-    // load the draft model
-    params.model = params.model_draft;
-    std::tie(model_dft, ctx_dft) = llama_init_from_gpt_params(params);
+    // load the draft model, or draft with the target model itself
+    std::unique_ptr<bool[]> layer_skip;
+
+    if (self_spec) {
+        ctx_dft = ctx_tgt;
+
+        const int n_layer = llama_n_layer(ctx_tgt);
+
+        int n_layer_dft = 0;
+
+        layer_skip.reset(new bool[n_layer]);
+        for (int il = 0; il < n_layer; ++il) {
+            layer_skip[il] =
+                (params.n_draft_exit > 0 && il >= params.n_draft_exit) ||
+                (params.n_draft_skip > 0 && (il + 1) % params.n_draft_skip == 0);
+
+            n_layer_dft += !layer_skip[il];
+        }
+
+        LOG_TEE("%s: drafting with %d of %d layers\n", __func__, n_layer_dft, n_layer);
+    } else if (lookup) {
+        ctx_dft = ctx_tgt;
+
+        LOG_TEE("%s: drafting by looking up the last %d tokens\n", __func__, params.n_draft_lookup);
+    } else {
+        params.model = params.model_draft;
+        std::tie(model_dft, ctx_dft) = llama_init_from_gpt_params(params);
+    }
+
+    // with a draft model, llama_speculative can draft token trees instead of a single sequence
+    llama_speculative * spec = NULL;
+
+    if (has_dft && params.n_draft_branch > 0) {
+        if (!params.grammar.empty()) {
+            fprintf(stderr, "%s: error: --draft-branch does not support grammars\n", __func__);
+            return 1;
+        }
+
+        llama_speculative_params sparams = llama_speculative_default_params();
+        sparams.n_draft  = params.n_draft;
+        sparams.n_branch = params.n_draft_branch;
+        sparams.temp     = params.temp;
+
+        spec = llama_speculative_init(ctx_tgt, ctx_dft, sparams);
+        if (spec == NULL) {
+            return 1;
+        }
+
+        LOG_TEE("%s: drafting trees with %d children per node, sampling with temperature %.2f only\n", __func__, sparams.n_branch, sparams.temp);
+    }
+
+    // with self-speculation, the draft runs without the skipped layers - these store no K and V
+    // for the drafted tokens, which are evaluated again by the target model anyway
+    auto eval_dft = [&](const llama_token * tokens, int n_tokens, int n_past) {
+        if (self_spec) {
+            llama_set_layer_skip(ctx_dft, layer_skip.get());
+        }
+        llama_eval(ctx_dft, tokens, n_tokens, n_past, params.n_threads);
+        if (self_spec) {
+            llama_set_layer_skip(ctx_dft, NULL);
+        }
+    };
 
     // tokenize the prompt
     std::vector<llama_token> inp;
@@ -68,10 +188,16 @@ int main(int argc, char ** argv) {
 
     const auto t_enc_start = ggml_time_us();
 
-    // eval the prompt with both models
-    llama_eval(ctx_tgt,  inp.data(), int(inp.size() - 1), 0, params.n_threads);
-    llama_eval(ctx_tgt, &inp.back(),      1, inp.size() - 1, params.n_threads);
-    llama_eval(ctx_dft,  inp.data(),     int(inp.size()), 0, params.n_threads);
+    // eval the prompt with both models - without a draft model, there is only the target to evaluate
+    if (spec) {
+        llama_speculative_prompt(spec, inp.data(), inp.size(), params.n_threads);
+    } else {
+        llama_eval(ctx_tgt,  inp.data(), int(inp.size() - 1), 0, params.n_threads);
+        llama_eval(ctx_tgt, &inp.back(),      1, inp.size() - 1, params.n_threads);
+        if (has_dft) {
+            llama_eval(ctx_dft,  inp.data(),     int(inp.size()), 0, params.n_threads);
+        }
+    }
 
     const auto t_enc_end = ggml_time_us();
 
@@ -92,6 +218,13 @@ int main(int argc, char ** argv) {
 
     std::vector<llama_token> drafted;
 
+    // the prompt and the accepted tokens, for prompt lookup
+    std::vector<llama_token> history = inp;
+
+    ngram_index index;
+    index.n_max = params.n_draft_lookup;
+    index.maps.resize(std::max(0, index.n_max));
+
     std::vector<llama_token> last_tokens(n_ctx);
     std::fill(last_tokens.begin(), last_tokens.end(), 0);
 
@@ -126,7 +259,31 @@ int main(int argc, char ** argv) {
 
     const auto t_dec_start = ggml_time_us();
 
+    // the tokens accepted by llama_speculative in one step
+    std::vector<llama_token> accepted(n_draft + 1);
+
     while (true) {
+        if (spec) {
+            const int n_out = llama_speculative_step(spec, accepted.data(), accepted.size(), params.n_threads);
+            if (n_out < 0) {
+                break;
+            }
+
+            for (int i = 0; i < n_out && !has_eos; ++i) {
+                printf("%s", llama_token_to_piece(ctx_tgt, accepted[i]).c_str());
+
+                has_eos = accepted[i] == llama_token_eos(ctx_tgt);
+                ++n_predict;
+            }
+            fflush(stdout);
+
+            if (n_predict > params.n_predict || has_eos) {
+                break;
+            }
+
+            continue;
+        }
+
         LOG("drafted: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx_dft, drafted));
 
         int i_dft = 0;
@@ -138,6 +295,8 @@ int main(int argc, char ** argv) {
             last_tokens.erase(last_tokens.begin());
             last_tokens.push_back(id);
 
+            history.push_back(id);
+
             //LOG("last: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx_tgt, last_tokens));
 
             const std::string token_str = llama_token_to_piece(ctx_tgt, id);
@@ -170,7 +329,9 @@ int main(int argc, char ** argv) {
                 LOG("out of drafted tokens\n");
             }
 
-            llama_eval(ctx_dft, &id, 1, n_past_dft, params.n_threads);
+            if (!lookup) {
+                eval_dft(&id, 1, n_past_dft);
+            }
             ++n_past_dft;
 
             drafted.clear();
@@ -192,52 +353,57 @@ int main(int argc, char ** argv) {
             LOG("copied target grammar to draft grammar\n");
         }
 
-        // sample n_draft tokens from the draft model using greedy decoding
-        int n_past_cur = n_past_dft;
-        for (int i = 0; i < n_draft; ++i) {
-            float * logits = llama_get_logits(ctx_dft);
-
-            candidates.clear();
-            for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-                candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
-            }
-
-            llama_token_data_array cur_p = { candidates.data(), candidates.size(), false };
-
-            if (grammar_dft != NULL) {
-                llama_sample_grammar(ctx_dft, &cur_p, grammar_dft);
-            }
-
-            // computes softmax and sorts the candidates
-            llama_sample_softmax(ctx_dft, &cur_p);
-
-            for (int i = 0; i < 3; ++i) {
-                LOG(" - draft candidate %3d: %6d (%8.3f) '%s'\n", i, cur_p.data[i].id, cur_p.data[i].p, llama_token_to_piece(ctx_dft, cur_p.data[i].id).c_str());
-            }
-
-            // TODO: better logic?
-            if (cur_p.data[0].p < 2*cur_p.data[1].p) {
-                LOG("stopping drafting, probability too low: %.3f < 2*%.3f\n", cur_p.data[0].p, cur_p.data[1].p);
-                break;
-            }
-
-            // drafted token
-            const llama_token id = cur_p.data[0].id;
-
-            drafted.push_back(id);
-            ++n_drafted;
-
-            // no need to evaluate the last drafted token, since we won't use the result
-            if (i == n_draft - 1) {
-                break;
-            }
-
-            // evaluate the drafted token on the draft model
-            llama_eval(ctx_dft, &drafted.back(), 1, n_past_cur, params.n_threads);
-            ++n_past_cur;
-
-            if (grammar_dft != NULL) {
-                llama_grammar_accept_token(ctx_dft, grammar_dft, id);
+        if (lookup) {
+            // draft n_draft tokens from the prompt and the accepted tokens
+            n_drafted += ngram_index_draft(index, history, n_draft, drafted);
+        } else {
+            // sample n_draft tokens from the draft model using greedy decoding
+            int n_past_cur = n_past_dft;
+            for (int i = 0; i < n_draft; ++i) {
+                float * logits = llama_get_logits(ctx_dft);
+
+                candidates.clear();
+                for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+                    candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+                }
+
+                llama_token_data_array cur_p = { candidates.data(), candidates.size(), false };
+
+                if (grammar_dft != NULL) {
+                    llama_sample_grammar(ctx_dft, &cur_p, grammar_dft);
+                }
+
+                // computes softmax and sorts the candidates
+                llama_sample_softmax(ctx_dft, &cur_p);
+
+                for (int i = 0; i < 3; ++i) {
+                    LOG(" - draft candidate %3d: %6d (%8.3f) '%s'\n", i, cur_p.data[i].id, cur_p.data[i].p, llama_token_to_piece(ctx_dft, cur_p.data[i].id).c_str());
+                }
+
+                // TODO: better logic?
+                if (cur_p.data[0].p < 2*cur_p.data[1].p) {
+                    LOG("stopping drafting, probability too low: %.3f < 2*%.3f\n", cur_p.data[0].p, cur_p.data[1].p);
+                    break;
+                }
+
+                // drafted token
+                const llama_token id = cur_p.data[0].id;
+
+                drafted.push_back(id);
+                ++n_drafted;
+
+                // no need to evaluate the last drafted token, since we won't use the result
+                if (i == n_draft - 1) {
+                    break;
+                }
+
+                // evaluate the drafted token on the draft model
+                eval_dft(&drafted.back(), 1, n_past_cur);
+                ++n_past_cur;
+
+                if (grammar_dft != NULL) {
+                    llama_grammar_accept_token(ctx_dft, grammar_dft, id);
+                }
             }
         }
 
@@ -251,6 +417,11 @@ int main(int argc, char ** argv) {
 
     auto t_dec_end = ggml_time_us();
 
+    if (spec) {
+        llama_speculative_get_stats(spec, &n_drafted, &n_accept);
+        llama_speculative_free(spec);
+    }
+
     LOG_TEE("\n\n");
 
     LOG_TEE("encoded %4d tokens in %8.3f seconds, speed: %8.3f t/s\n", n_input,   (t_enc_end - t_enc_start) / 1e6f, inp.size() / ((t_enc_end - t_enc_start) / 1e6f));
@@ -264,18 +435,23 @@ int main(int argc, char ** argv) {
     LOG_TEE("n_accept  = %d\n", n_accept);
     LOG_TEE("accept    = %.3f%%\n", 100.0f * n_accept / n_drafted);
 
-    LOG_TEE("\ndraft:\n");
-    llama_print_timings(ctx_dft);
+    if (!has_dft) {
+        LOG_TEE("\ndraft and target:\n");
+        llama_print_timings(ctx_tgt);
+    } else {
+        LOG_TEE("\ndraft:\n");
+        llama_print_timings(ctx_dft);
 
-    LOG_TEE("\ntarget:\n");
-    llama_print_timings(ctx_tgt);
+        LOG_TEE("\ntarget:\n");
+        llama_print_timings(ctx_tgt);
+
+        llama_free(ctx_dft);
+        llama_free_model(model_dft);
+    }
 
     llama_free(ctx_tgt);
     llama_free_model(model_tgt);
 
-    llama_free(ctx_dft);
-    llama_free_model(model_dft);
-
     if (grammar_dft != NULL) {
         llama_grammar_free(grammar_dft);
         llama_grammar_free(grammar_tgt);
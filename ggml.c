@@ -1612,6 +1612,7 @@ static void ggml_vec_dot_q4_1_q8_1(const int n, float * restrict s, const void *
 static void ggml_vec_dot_q5_0_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 static void ggml_vec_dot_q5_1_q8_1(const int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 static void ggml_vec_dot_q8_0_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+static void ggml_vec_dot_q4_0x4_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 
 static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
     [GGML_TYPE_I8] = {
@@ -1639,6 +1640,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .is_quantized             = false,
         .vec_dot                  = (ggml_vec_dot_t) ggml_vec_dot_f32,
         .vec_dot_type             = GGML_TYPE_F32,
+        .vec_dot_nrows            = 1,
     },
     [GGML_TYPE_F16] = {
         .type_name                = "f16",
@@ -1650,6 +1652,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) ggml_fp32_to_fp16_row,
         .vec_dot                  = (ggml_vec_dot_t) ggml_vec_dot_f16,
         .vec_dot_type             = GGML_TYPE_F16,
+        .vec_dot_nrows            = 1,
     },
     [GGML_TYPE_Q4_0] = {
         .type_name                = "q4_0",
@@ -1661,6 +1664,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q4_0_reference,
         .vec_dot                  = ggml_vec_dot_q4_0_q8_0,
         .vec_dot_type             = GGML_TYPE_Q8_0,
+        .vec_dot_nrows            = 1,
     },
     [GGML_TYPE_Q4_1] = {
         .type_name                = "q4_1",
@@ -1672,6 +1676,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q4_1_reference,
         .vec_dot                  = ggml_vec_dot_q4_1_q8_1,
         .vec_dot_type             = GGML_TYPE_Q8_1,
+        .vec_dot_nrows            = 1,
     },
     [GGML_TYPE_Q5_0] = {
         .type_name                = "q5_0",
@@ -1683,6 +1688,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q5_0_reference,
         .vec_dot                  = ggml_vec_dot_q5_0_q8_0,
         .vec_dot_type             = GGML_TYPE_Q8_0,
+        .vec_dot_nrows            = 1,
     },
     [GGML_TYPE_Q5_1] = {
         .type_name                = "q5_1",
@@ -1694,6 +1700,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q5_1_reference,
         .vec_dot                  = ggml_vec_dot_q5_1_q8_1,
         .vec_dot_type             = GGML_TYPE_Q8_1,
+        .vec_dot_nrows            = 1,
     },
     [GGML_TYPE_Q8_0] = {
         .type_name                = "q8_0",
@@ -1705,6 +1712,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q8_0_reference,
         .vec_dot                  = ggml_vec_dot_q8_0_q8_0,
         .vec_dot_type             = GGML_TYPE_Q8_0,
+        .vec_dot_nrows            = 1,
     },
     [GGML_TYPE_Q8_1] = {
         .type_name                = "q8_1",
@@ -1714,6 +1722,16 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float               = quantize_row_q8_1,
         .from_float_reference     = (ggml_from_float_t) quantize_row_q8_1_reference,
         .vec_dot_type             = GGML_TYPE_Q8_1,
+        .vec_dot_nrows            = 1,
+    },
+    [GGML_TYPE_Q4_0_4X] = {
+        .type_name                = "q4_0_4x",
+        .blck_size                = QK4_0,
+        .type_size                = sizeof(block_q4_0),
+        .is_quantized             = true,
+        .vec_dot                  = ggml_vec_dot_q4_0x4_q8_0,
+        .vec_dot_type             = GGML_TYPE_Q8_0,
+        .vec_dot_nrows            = 4,
     },
 #ifdef GGML_USE_K_QUANTS
     [GGML_TYPE_Q2_K] = {
@@ -1726,6 +1744,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q2_K_reference,
         .vec_dot                  = ggml_vec_dot_q2_K_q8_K,
         .vec_dot_type             = GGML_TYPE_Q8_K,
+        .vec_dot_nrows            = 1,
     },
     [GGML_TYPE_Q3_K] = {
         .type_name                = "q3_K",
@@ -1737,6 +1756,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q3_K_reference,
         .vec_dot                  = ggml_vec_dot_q3_K_q8_K,
         .vec_dot_type             = GGML_TYPE_Q8_K,
+        .vec_dot_nrows            = 1,
     },
     [GGML_TYPE_Q4_K] = {
         .type_name                = "q4_K",
@@ -1748,6 +1768,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q4_K_reference,
         .vec_dot                  = ggml_vec_dot_q4_K_q8_K,
         .vec_dot_type             = GGML_TYPE_Q8_K,
+        .vec_dot_nrows            = 1,
     },
     [GGML_TYPE_Q5_K] = {
         .type_name                = "q5_K",
@@ -1759,6 +1780,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q5_K_reference,
         .vec_dot                  = ggml_vec_dot_q5_K_q8_K,
         .vec_dot_type             = GGML_TYPE_Q8_K,
+        .vec_dot_nrows            = 1,
     },
     [GGML_TYPE_Q6_K] = {
         .type_name                = "q6_K",
@@ -1770,6 +1792,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q6_K_reference,
         .vec_dot                  = ggml_vec_dot_q6_K_q8_K,
         .vec_dot_type             = GGML_TYPE_Q8_K,
+        .vec_dot_nrows            = 1,
     },
     [GGML_TYPE_Q8_K] = {
         .type_name                = "q8_K",
@@ -2403,6 +2426,70 @@ static void ggml_vec_dot_f16(const int n, float * restrict s, ggml_fp16_t * rest
     *s = sumf;
 }
 
+// dot products of 4 rows of q4_0_4x with y - the blocks of the 4 rows are interleaved, so that each block of y
+// is loaded once for the 4 rows and the rows are read sequentially
+static void ggml_vec_dot_q4_0x4_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q4_0 * restrict x = vx;
+    const block_q8_0 * restrict y = vy;
+
+#if defined(__AVX2__)
+    __m256 acc[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+
+    const __m256i off = _mm256_set1_epi8( 8 );
+
+    for (int i = 0; i < nb; ++i) {
+        const __m256i by = _mm256_loadu_si256((const __m256i *)y[i].qs);
+        const float   dy = GGML_FP16_TO_FP32(y[i].d);
+
+        for (int r = 0; r < 4; ++r) {
+            const block_q4_0 * restrict xr = &x[4*i + r];
+
+            const __m256 d = _mm256_set1_ps( GGML_FP16_TO_FP32(xr->d) * dy );
+
+            __m256i bx = bytes_from_nibbles_32(xr->qs);
+            bx = _mm256_sub_epi8( bx, off );
+
+            const __m256 q = mul_sum_i8_pairs_float(bx, by);
+
+            acc[r] = _mm256_fmadd_ps( d, q, acc[r] );
+        }
+    }
+
+    for (int r = 0; r < 4; ++r) {
+        s[r] = hsum_float_8(acc[r]);
+    }
+#else
+    // scalar
+    float sumf[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+    for (int i = 0; i < nb; i++) {
+        for (int r = 0; r < 4; ++r) {
+            const block_q4_0 * restrict xr = &x[4*i + r];
+
+            int sumi = 0;
+
+            for (int j = 0; j < qk/2; ++j) {
+                const int v0 = (xr->qs[j] & 0x0F) - 8;
+                const int v1 = (xr->qs[j] >>   4) - 8;
+
+                sumi += (v0 * y[i].qs[j]) + (v1 * y[i].qs[j + qk/2]);
+            }
+
+            sumf[r] += sumi*GGML_FP16_TO_FP32(xr->d)*GGML_FP16_TO_FP32(y[i].d);
+        }
+    }
+
+    for (int r = 0; r < 4; ++r) {
+        s[r] = sumf[r];
+    }
+#endif
+}
+
 static void ggml_vec_dot_q4_0_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
     const int qk = QK8_0;
     const int nb = n / qk;
@@ -4270,6 +4357,10 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+int ggml_numa_n_nodes(void) {
+    return (int) g_state.numa.n_nodes;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void ggml_print_object(const struct ggml_object * obj) {
@@ -6957,6 +7048,7 @@ struct ggml_tensor * ggml_soft_max_back_inplace(
 static struct ggml_tensor * ggml_rope_impl(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
         int                   n_past,
         int                   n_dims,
         int                   mode,
@@ -6967,6 +7059,13 @@ static struct ggml_tensor * ggml_rope_impl(
         bool                  xpos_down,
         bool                  inplace) {
     GGML_ASSERT(n_past >= 0);
+    if (b) {
+        GGML_ASSERT(ggml_is_vector(b));
+        GGML_ASSERT(b->type == GGML_TYPE_I32);
+        GGML_ASSERT(a->ne[2] == b->ne[0]);
+        GGML_ASSERT((mode & 1) == 0);
+    }
+
     bool is_node = false;
 
     if (a->grad) {
@@ -6985,6 +7084,7 @@ static struct ggml_tensor * ggml_rope_impl(
     result->op   = GGML_OP_ROPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
     result->src[0] = a;
+    result->src[1] = b;
 
     return result;
 }
@@ -6996,7 +7096,7 @@ struct ggml_tensor * ggml_rope(
         int                   n_dims,
         int                   mode,
         int                   n_ctx) {
-    return ggml_rope_impl(ctx, a, n_past, n_dims, mode, n_ctx, 10000.0f, 1.0f, 0.0f, false, false);
+    return ggml_rope_impl(ctx, a, NULL, n_past, n_dims, mode, n_ctx, 10000.0f, 1.0f, 0.0f, false, false);
 }
 
 struct ggml_tensor * ggml_rope_inplace(
@@ -7006,7 +7106,7 @@ struct ggml_tensor * ggml_rope_inplace(
         int                   n_dims,
         int                   mode,
         int                   n_ctx) {
-    return ggml_rope_impl(ctx, a, n_past, n_dims, mode, n_ctx, 10000.0f, 1.0f, 0.0f, false, true);
+    return ggml_rope_impl(ctx, a, NULL, n_past, n_dims, mode, n_ctx, 10000.0f, 1.0f, 0.0f, false, true);
 }
 
 struct ggml_tensor * ggml_rope_custom(
@@ -7018,7 +7118,7 @@ struct ggml_tensor * ggml_rope_custom(
         int                   n_ctx,
         float                 freq_base,
         float                 freq_scale) {
-    return ggml_rope_impl(ctx, a, n_past, n_dims, mode, n_ctx, freq_base, freq_scale, 0.0f, false, false);
+    return ggml_rope_impl(ctx, a, NULL, n_past, n_dims, mode, n_ctx, freq_base, freq_scale, 0.0f, false, false);
 }
 
 struct ggml_tensor * ggml_rope_custom_inplace(
@@ -7030,7 +7130,7 @@ struct ggml_tensor * ggml_rope_custom_inplace(
         int                   n_ctx,
         float                 freq_base,
         float                 freq_scale) {
-    return ggml_rope_impl(ctx, a, n_past, n_dims, mode, n_ctx, freq_base, freq_scale, 0.0f, false, true);
+    return ggml_rope_impl(ctx, a, NULL, n_past, n_dims, mode, n_ctx, freq_base, freq_scale, 0.0f, false, true);
 }
 
 struct ggml_tensor * ggml_rope_xpos_inplace(
@@ -7040,7 +7140,19 @@ struct ggml_tensor * ggml_rope_xpos_inplace(
         int                   n_dims,
         float                 base,
         bool                  down) {
-    return ggml_rope_impl(ctx, a, n_past, n_dims, 0, 0, 10000.0f, 1.0f, base, down, true);
+    return ggml_rope_impl(ctx, a, NULL, n_past, n_dims, 0, 0, 10000.0f, 1.0f, base, down, true);
+}
+
+struct ggml_tensor * ggml_rope_custom_pos_inplace(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        int                   n_dims,
+        int                   mode,
+        int                   n_ctx,
+        float                 freq_base,
+        float                 freq_scale) {
+    return ggml_rope_impl(ctx, a, b, 0, n_dims, mode, n_ctx, freq_base, freq_scale, 0.0f, false, true);
 }
 
 // ggml_rope_back
@@ -10194,6 +10306,7 @@ static void ggml_compute_forward_concat_f32(
     GGML_ASSERT(src0->nb[0] == sizeof(float));
 
     const int ith = params->ith;
+    const int nth = params->nth;
 
     GGML_TENSOR_BINARY_OP_LOCALS;
 
@@ -10203,7 +10316,7 @@ static void ggml_compute_forward_concat_f32(
     GGML_ASSERT(nb10 == sizeof(float));
 
     for (int i3 = 0; i3 < ne3; i3++) {
-        for (int i2 = ith; i2 < ne2; i2++) {
+        for (int i2 = ith; i2 < ne2; i2 += nth) {
             if (i2 < ne02) { // src0
                 for (int i1 = 0; i1 < ne1; i1++) {
                     for (int i0 = 0; i0 < ne0; i0++) {
@@ -11197,7 +11310,8 @@ static bool ggml_compute_forward_mul_mat_use_blas(
     const int64_t ne1 = dst->ne[1];
 
     // TODO: find the optimal values for these
-    if (ggml_is_contiguous(src0) &&
+    if (type_traits[src0->type].vec_dot_nrows == 1 &&
+        ggml_is_contiguous(src0) &&
         ggml_is_contiguous(src1) &&
         (ne0 >= 32 && ne1 >= 32 && ne10 >= 32)) {
 
@@ -11229,6 +11343,10 @@ static void ggml_compute_forward_mul_mat(
     ggml_vec_dot_t    const vec_dot               = type_traits[type].vec_dot;
     enum ggml_type    const vec_dot_type          = type_traits[type].vec_dot_type;
     ggml_from_float_t const from_float_to_vec_dot = type_traits[vec_dot_type].from_float;
+    int64_t           const vec_dot_nrows         = type_traits[type].vec_dot_nrows;
+
+    // vec_dot computes groups of src0 rows
+    GGML_ASSERT(ne01 % vec_dot_nrows == 0);
 
     GGML_ASSERT(ne0 == ne01);
     GGML_ASSERT(ne1 == ne11);
@@ -11357,7 +11475,8 @@ static void ggml_compute_forward_mul_mat(
     const int64_t ith0 = ith % nth0;
     const int64_t ith1 = ith / nth0;
 
-    const int64_t dr0 = (nr0 + nth0 - 1)/nth0;
+    // the src0 rows of a thread are whole groups of vec_dot_nrows rows
+    const int64_t dr0 = ((nr0 + nth0 - 1)/nth0 + vec_dot_nrows - 1)/vec_dot_nrows*vec_dot_nrows;
     const int64_t dr1 = (nr1 + nth1 - 1)/nth1;
 
     const int64_t ir010 = dr0*ith0;
@@ -11416,7 +11535,7 @@ static void ggml_compute_forward_mul_mat(
                 //    vec_dot(ne00, &dst_col[ir0], src0_row + ir0*nb01, src1_col);
                 //}
 
-                for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
+                for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ir0 += vec_dot_nrows) {
                     vec_dot(ne00, &tmp[ir0 - iir0], src0_row + ir0*nb01, src1_col);
                 }
                 memcpy(&dst_col[iir0], tmp, (MIN(iir0 + blck_0, ir011) - iir0)*sizeof(float));
@@ -12526,6 +12645,7 @@ static void ggml_compute_forward_alibi(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0_4X:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -12600,6 +12720,7 @@ static void ggml_compute_forward_clamp(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0_4X:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -12612,6 +12733,7 @@ static void ggml_compute_forward_clamp(
 static void ggml_compute_forward_rope_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
@@ -12666,9 +12788,12 @@ static void ggml_compute_forward_rope_f32(
     const bool is_neox = mode & 2;
     const bool is_glm  = mode & 4;
 
+    // optional per-row positions
+    const int32_t * pos = src1 ? (const int32_t *) src1->data : NULL;
+
     for (int64_t i3 = 0; i3 < ne3; i3++) {
         for (int64_t i2 = ((mode & 1) == 0 ? 0 : n_past); i2 < ne2; i2++) {
-            const int64_t p = ((mode & 1) == 0 ? n_past + i2 : i2);
+            const int64_t p = pos ? pos[i2] : ((mode & 1) == 0 ? n_past + i2 : i2);
             for (int64_t i1 = 0; i1 < ne1; i1++) {
                 if (ir++ < ir0) continue;
                 if (ir   > ir1) break;
@@ -12705,7 +12830,7 @@ static void ggml_compute_forward_rope_f32(
                         const float cos_theta = cosf(theta);
                         const float sin_theta = sinf(theta);
                         // zeta scaling for xPos only:
-                        float zeta = xpos_base != 0.0f ? powf((i0 + 0.4f * ne0) / (1.4f * ne0), (n_past + i2) / xpos_base) : 1.0f;
+                        float zeta = xpos_base != 0.0f ? powf((i0 + 0.4f * ne0) / (1.4f * ne0), p / xpos_base) : 1.0f;
                         if (xpos_down) zeta = 1.0f / zeta;
 
                         theta *= theta_scale;
@@ -12750,6 +12875,7 @@ static void ggml_compute_forward_rope_f32(
 static void ggml_compute_forward_rope_f16(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
@@ -12798,9 +12924,12 @@ static void ggml_compute_forward_rope_f16(
     const bool is_neox = mode & 2;
     const bool is_glm  = mode & 4;
 
+    // optional per-row positions
+    const int32_t * pos = src1 ? (const int32_t *) src1->data : NULL;
+
     for (int64_t i3 = 0; i3 < ne3; i3++) {
         for (int64_t i2 = ((mode & 1) == 0 ? 0 : n_past); i2 < ne2; i2++) {
-            const int64_t p = ((mode & 1) == 0 ? n_past + i2 : i2);
+            const int64_t p = pos ? pos[i2] : ((mode & 1) == 0 ? n_past + i2 : i2);
             for (int64_t i1 = 0; i1 < ne1; i1++) {
                 if (ir++ < ir0) continue;
                 if (ir   > ir1) break;
@@ -12879,15 +13008,16 @@ static void ggml_compute_forward_rope_f16(
 static void ggml_compute_forward_rope(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
     switch (src0->type) {
         case GGML_TYPE_F16:
             {
-                ggml_compute_forward_rope_f16(params, src0, dst);
+                ggml_compute_forward_rope_f16(params, src0, src1, dst);
             } break;
         case GGML_TYPE_F32:
             {
-                ggml_compute_forward_rope_f32(params, src0, dst);
+                ggml_compute_forward_rope_f32(params, src0, src1, dst);
             } break;
         default:
             {
@@ -15853,7 +15983,7 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             } break;
         case GGML_OP_ROPE:
             {
-                ggml_compute_forward_rope(params, tensor->src[0], tensor);
+                ggml_compute_forward_rope(params, tensor->src[0], tensor->src[1], tensor);
             } break;
         case GGML_OP_ROPE_BACK:
             {
@@ -16543,6 +16673,7 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                             src0->grad,
                             ggml_rope_impl(ctx,
                                 tensor->grad,
+                                NULL,
                                 n_past,
                                 n_dims,
                                 mode,
@@ -17115,14 +17246,12 @@ typedef pthread_t ggml_thread_t;
 
 // Android's libc implementation "bionic" does not support setting affinity
 #if defined(__linux__) && !defined(__BIONIC__)
-static void set_numa_thread_affinity(int thread_n, int n_threads) {
+static void set_numa_node_affinity(int node_num) {
     if (!ggml_is_numa()) {
         return;
     }
 
-    // run thread on node_num thread_n / (threads per node)
-    const int node_num = thread_n / ((n_threads + g_state.numa.n_nodes - 1) / g_state.numa.n_nodes);
-    struct ggml_numa_node * node = &g_state.numa.nodes[node_num];
+    struct ggml_numa_node * node = &g_state.numa.nodes[node_num % g_state.numa.n_nodes];
     size_t setsize = CPU_ALLOC_SIZE(g_state.numa.total_cpus);
 
     cpu_set_t * cpus = CPU_ALLOC(g_state.numa.total_cpus);
@@ -17140,6 +17269,15 @@ static void set_numa_thread_affinity(int thread_n, int n_threads) {
     CPU_FREE(cpus);
 }
 
+static void set_numa_thread_affinity(int thread_n, int n_threads) {
+    if (!ggml_is_numa()) {
+        return;
+    }
+
+    // run thread on node_num thread_n / (threads per node)
+    set_numa_node_affinity(thread_n / ((n_threads + g_state.numa.n_nodes - 1) / g_state.numa.n_nodes));
+}
+
 static void clear_numa_thread_affinity(void) {
     if (!ggml_is_numa()) {
         return;
@@ -17161,13 +17299,64 @@ static void clear_numa_thread_affinity(void) {
 
     CPU_FREE(cpus);
 }
+
+static void set_cpu_thread_affinity(int cpu) {
+    size_t setsize = CPU_ALLOC_SIZE(cpu + 1);
+
+    cpu_set_t * cpus = CPU_ALLOC(cpu + 1);
+    CPU_ZERO_S(setsize, cpus);
+    CPU_SET_S(cpu, setsize, cpus);
+
+    int rv = pthread_setaffinity_np(pthread_self(), setsize, cpus);
+    if (rv) {
+        fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n",
+            strerror(rv));
+    }
+
+    CPU_FREE(cpus);
+}
+
+struct ggml_thread_affinity {
+    cpu_set_t cpus;
+    bool valid;
+};
+
+static void get_thread_affinity(struct ggml_thread_affinity * affinity) {
+    affinity->valid = pthread_getaffinity_np(pthread_self(), sizeof(affinity->cpus), &affinity->cpus) == 0;
+}
+
+static void set_thread_affinity(const struct ggml_thread_affinity * affinity) {
+    if (!affinity->valid) {
+        return;
+    }
+
+    int rv = pthread_setaffinity_np(pthread_self(), sizeof(affinity->cpus), &affinity->cpus);
+    if (rv) {
+        fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n",
+            strerror(rv));
+    }
+}
 #else
 // TODO: Windows etc.
 // (the linux implementation may also work on BSD, someone should test)
+static void set_numa_node_affinity(int node_num) { UNUSED(node_num); }
 static void set_numa_thread_affinity(int thread_n, int n_threads) { UNUSED(thread_n); UNUSED(n_threads);  }
 static void clear_numa_thread_affinity(void) {}
+
+static void set_cpu_thread_affinity(int cpu) { UNUSED(cpu); }
+
+struct ggml_thread_affinity {
+    bool valid;
+};
+
+static void get_thread_affinity(struct ggml_thread_affinity * affinity) { affinity->valid = false; }
+static void set_thread_affinity(const struct ggml_thread_affinity * affinity) { UNUSED(affinity); }
 #endif
 
+void ggml_numa_set_thread_node(int node) {
+    set_numa_node_affinity(node);
+}
+
 struct ggml_compute_state_shared {
     const struct ggml_cgraph * cgraph;
     const struct ggml_cplan  * cplan;
@@ -17209,7 +17398,11 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     const int * n_tasks_arr = cplan->n_tasks;
     const int   n_threads   = state->shared->n_threads;
 
-    set_numa_thread_affinity(state->ith, n_threads);
+    if (cplan->n_cpus > 0) {
+        set_cpu_thread_affinity(cplan->cpus[state->ith % cplan->n_cpus]);
+    } else {
+        set_numa_thread_affinity(state->ith, n_threads);
+    }
 
     int node_n = -1;
 
@@ -17749,6 +17942,15 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     };
     struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
 
+    // the main thread is a worker too - remember its affinity if it is about to be pinned
+    struct ggml_thread_affinity affinity_prev;
+    affinity_prev.valid = false;
+    if (cplan->n_cpus > 0) {
+        get_thread_affinity(&affinity_prev);
+    }
+
+    const int64_t t_threads_start_us = ggml_time_us();
+
     // create thread pool
     if (n_threads > 1) {
         for (int j = 1; j < n_threads; ++j) {
@@ -17767,6 +17969,8 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     workers[0].ith = 0;
     workers[0].shared = &state_shared;
 
+    cplan->t_threads_us = ggml_time_us() - t_threads_start_us;
+
     const int64_t perf_start_cycles  = ggml_perf_cycles();
     const int64_t perf_start_time_us = ggml_perf_time_us();
 
@@ -17774,15 +17978,21 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     int compute_status = (size_t) ggml_graph_compute_thread(&workers[0]);
 
     // don't leave affinity set on the main thread
-    clear_numa_thread_affinity();
+    if (cplan->n_cpus > 0) {
+        set_thread_affinity(&affinity_prev);
+    } else {
+        clear_numa_thread_affinity();
+    }
 
     // join or kill thread pool
+    const int64_t t_join_start_us = ggml_time_us();
     if (n_threads > 1) {
         for (int j = 1; j < n_threads; j++) {
             const int rc = ggml_thread_join(workers[j].thrd, NULL);
             GGML_ASSERT(rc == 0);
         }
     }
+    cplan->t_threads_us += ggml_time_us() - t_join_start_us;
 
     // performance stats (graph)
     {
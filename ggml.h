@@ -206,7 +206,7 @@
 #define GGML_QNT_VERSION_FACTOR 1000 // do not change this
 
 #define GGML_MAX_DIMS          4
-#define GGML_MAX_NODES         4096
+#define GGML_MAX_NODES         8192
 #define GGML_MAX_PARAMS        256
 #define GGML_MAX_CONTEXTS      64
 #define GGML_MAX_SRC           6
@@ -307,6 +307,7 @@ extern "C" {
         GGML_TYPE_I8,
         GGML_TYPE_I16,
         GGML_TYPE_I32,
+        GGML_TYPE_Q4_0_4X, // q4_0 with the blocks of each group of 4 rows interleaved, for mul_mat only
         GGML_TYPE_COUNT,
     };
 
@@ -507,12 +508,20 @@ extern "C" {
         // abort ggml_graph_compute when true
         bool (*abort_callback)(void * data);
         void * abort_callback_data;
+
+        // if n_cpus > 0, thread i of the computation is pinned to cpus[i % n_cpus]
+        // this takes precedence over the NUMA affinity and the affinity of the calling thread is restored afterwards
+        const int * cpus;
+        int n_cpus;
+
+        // set by `ggml_graph_compute()`: time spent creating and joining the worker threads
+        int64_t t_threads_us;
     };
 
     // next prime after GGML_MAX_NODES
-    // #define GGML_GRAPH_HASHTABLE_SIZE 4099
+    // #define GGML_GRAPH_HASHTABLE_SIZE 8209
     // next prime after GGML_MAX_NODES * 2 (nodes + leafs)
-    #define GGML_GRAPH_HASHTABLE_SIZE 8273
+    #define GGML_GRAPH_HASHTABLE_SIZE 16411
 
     // computation graph
     struct ggml_cgraph {
@@ -579,6 +588,8 @@ extern "C" {
 
     GGML_API void    ggml_numa_init(void); // call once for better performance on NUMA systems
     GGML_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
+    GGML_API int     ggml_numa_n_nodes(void); // number of NUMA nodes detected by init
+    GGML_API void    ggml_numa_set_thread_node(int node); // run the calling thread on the CPUs of a NUMA node
 
     GGML_API void    ggml_print_object (const struct ggml_object * obj);
     GGML_API void    ggml_print_objects(const struct ggml_context * ctx);
@@ -1253,6 +1264,18 @@ extern "C" {
             float                 freq_base,
             float                 freq_scale);
 
+    // custom RoPE with explicit positions, in-place, returns view(a)
+    // b is an I32 vector with the position of each row along a->ne[2]
+    GGML_API struct ggml_tensor * ggml_rope_custom_pos_inplace(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            int                   n_dims,
+            int                   mode,
+            int                   n_ctx,
+            float                 freq_base,
+            float                 freq_scale);
+
     // xPos RoPE, in-place, returns view(a)
     GGML_API struct ggml_tensor * ggml_rope_xpos_inplace(
             struct ggml_context * ctx,
@@ -1996,6 +2019,7 @@ extern "C" {
         ggml_from_float_t from_float_reference;
         ggml_vec_dot_t    vec_dot;
         enum ggml_type    vec_dot_type;
+        int               vec_dot_nrows; // number of rows of x computed by one vec_dot call
     } ggml_type_traits_t;
 
     ggml_type_traits_t ggml_internal_get_type_traits(enum ggml_type type);
@@ -45,12 +45,15 @@
     #endif
     #include <windows.h>
     #include <io.h>
+    #include <direct.h> // for _getcwd
     #include <stdio.h> // for _fseeki64
 #endif
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cinttypes>
 #include <climits>
 #include <cstdarg>
@@ -58,6 +61,8 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <condition_variable>
+#include <deque>
 #include <ctime>
 #include <fstream>
 #include <initializer_list>
@@ -68,9 +73,11 @@
 #include <queue>
 #include <random>
 #include <regex>
+#include <set>
 #include <sstream>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
@@ -427,7 +434,16 @@ struct LLM_TN {
 // ggml helpers
 //
 
-static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads) {
+// time spent in the phases of ggml_graph_compute_helper
+struct llama_compute_timings {
+    int64_t t_plan_us    = 0;
+    int64_t t_threads_us = 0;
+    int64_t t_compute_us = 0;
+};
+
+static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads, const std::vector<int> & cpus = {}, llama_compute_timings * timings = nullptr) {
+    const int64_t t_start_us = ggml_time_us();
+
     struct ggml_cplan plan = ggml_graph_plan(graph, n_threads);
 
     if (plan.work_size > 0) {
@@ -435,7 +451,18 @@ static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph *
         plan.work_data = buf.data();
     }
 
+    plan.cpus   = cpus.data();
+    plan.n_cpus = cpus.size();
+
+    const int64_t t_compute_start_us = ggml_time_us();
+
     ggml_graph_compute(graph, &plan);
+
+    if (timings) {
+        timings->t_plan_us    += t_compute_start_us - t_start_us;
+        timings->t_threads_us += plan.t_threads_us;
+        timings->t_compute_us += ggml_time_us() - t_compute_start_us - plan.t_threads_us;
+    }
 }
 
 //
@@ -588,6 +615,19 @@ struct llama_mmap {
 
     llama_mmap(const llama_mmap &) = delete;
 
+    // makes a range of the mapping resident by reading one byte of each page
+    static void touch(void * ptr, size_t len) {
+        const size_t page = page_size();
+
+        advise_willneed(ptr, len);
+
+        uint8_t sum = 0;
+        for (size_t i = 0; i < len; i += page) {
+            sum += ((const volatile uint8_t *) ptr)[i];
+        }
+        (void) sum;
+    }
+
 #ifdef _POSIX_MAPPED_FILES
     static constexpr bool SUPPORTED = true;
 
@@ -625,6 +665,53 @@ struct llama_mmap {
     ~llama_mmap() {
         munmap(addr, size);
     }
+
+    static size_t page_size() {
+        return (size_t) sysconf(_SC_PAGESIZE);
+    }
+
+    // start reading a range of the mapping in the background
+    static void advise_willneed(void * ptr, size_t len) {
+        posix_madvise(ptr, len, POSIX_MADV_WILLNEED);
+    }
+
+    // release the pages of a range of the mapping - they are read again from the file when accessed
+    static void advise_dontneed(void * ptr, size_t len) {
+#ifdef __linux__
+        // posix_madvise(POSIX_MADV_DONTNEED) is a no-op in glibc
+        madvise(ptr, len, MADV_DONTNEED);
+#else
+        posix_madvise(ptr, len, POSIX_MADV_DONTNEED);
+#endif
+    }
+
+    // number of bytes of a range of the mapping resident in memory
+    static size_t resident(void * ptr, size_t len) {
+        const size_t page  = page_size();
+        uint8_t *    first = (uint8_t *) ((uintptr_t) ptr/page*page);
+        const size_t n     = ((uint8_t *) ptr + len - first + page - 1)/page;
+
+        // queried in chunks to bound the size of the page vector
+        const size_t n_chunk = 64*1024;
+#ifdef __APPLE__
+        std::vector<char> vec(std::min(n, n_chunk));
+#else
+        std::vector<unsigned char> vec(std::min(n, n_chunk));
+#endif
+
+        size_t n_resident = 0;
+        for (size_t i = 0; i < n; i += n_chunk) {
+            const size_t n_cur = std::min(n - i, n_chunk);
+            if (mincore(first + i*page, n_cur*page, vec.data()) != 0) {
+                return len;
+            }
+            for (size_t j = 0; j < n_cur; ++j) {
+                n_resident += vec[j] & 1;
+            }
+        }
+
+        return std::min(n_resident*page, len);
+    }
 #elif defined(_WIN32)
     static constexpr bool SUPPORTED = true;
 
@@ -677,6 +764,27 @@ struct llama_mmap {
                     llama_format_win_err(GetLastError()).c_str());
         }
     }
+
+    static size_t page_size() {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        return (size_t) si.dwPageSize;
+    }
+
+    static void advise_willneed(void * ptr, size_t len) {
+        (void) ptr;
+        (void) len;
+    }
+
+    static void advise_dontneed(void * ptr, size_t len) {
+        (void) ptr;
+        (void) len;
+    }
+
+    static size_t resident(void * ptr, size_t len) {
+        (void) ptr;
+        return len;
+    }
 #else
     static constexpr bool SUPPORTED = false;
 
@@ -687,6 +795,25 @@ struct llama_mmap {
 
         throw std::runtime_error(std::string("mmap not supported"));
     }
+
+    static size_t page_size() {
+        return 4096;
+    }
+
+    static void advise_willneed(void * ptr, size_t len) {
+        (void) ptr;
+        (void) len;
+    }
+
+    static void advise_dontneed(void * ptr, size_t len) {
+        (void) ptr;
+        (void) len;
+    }
+
+    static size_t resident(void * ptr, size_t len) {
+        (void) ptr;
+        return len;
+    }
 #endif
 };
 
@@ -952,6 +1079,9 @@ struct llama_layer {
     struct ggml_tensor * w1; // ffn_gate
     struct ggml_tensor * w2; // ffn_down
     struct ggml_tensor * w3; // ffn_up
+
+    // ffn_gate and ffn_up concatenated by rows (see llama_context_params.fuse_weights)
+    struct ggml_tensor * w13;
 };
 
 struct llama_kv_cache {
@@ -962,7 +1092,8 @@ struct llama_kv_cache {
 
     llama_buffer buf;
 
-    int n; // number of tokens currently in the cache
+    int n;    // number of tokens currently in the cache
+    int size; // number of tokens the cache has storage for
 
     ~llama_kv_cache() {
         if (ctx) {
@@ -1018,6 +1149,31 @@ struct llama_vocab {
     }
 };
 
+struct llama_lora_weight {
+    struct ggml_tensor * a; // [n_in, r] - transposed when loaded, to multiply the input directly
+    struct ggml_tensor * b; // [r, n_out]
+};
+
+struct llama_lora_adapter {
+    const struct llama_model * model;
+
+    float scaling = 1.0f; // alpha/r
+
+    // the low-rank factors of each adapted model tensor
+    std::unordered_map<const struct ggml_tensor *, llama_lora_weight> weights;
+
+    struct ggml_context * ctx = NULL;
+
+    // number of contexts the adapter is set for, guarded by the lora_mutex of the model
+    mutable int n_used = 0;
+
+    ~llama_lora_adapter() {
+        if (ctx) {
+            ggml_free(ctx);
+        }
+    }
+};
+
 struct llama_model {
     e_model     type  = MODEL_UNKNOWN;
     llm_arch    arch  = LLM_ARCH_UNKNOWN;
@@ -1054,10 +1210,25 @@ struct llama_model {
     // for quantize-stats only
     std::vector<std::pair<std::string, struct ggml_tensor *>> tensors_by_name;
 
+    // runtime LoRA adapters loaded for the model that were not freed yet
+    // the contexts of the model can set and free them from several threads
+    mutable std::set<llama_lora_adapter *> lora_adapters;
+    mutable std::mutex lora_mutex;
+
+    // number of contexts of the model and of those streaming its layers - the streamed pages of the mapping are
+    // released for all the contexts, so a streaming context must be the only one
+    mutable std::mutex contexts_mutex;
+    mutable int n_contexts  = 0;
+    mutable int n_streaming = 0;
+
     int64_t t_load_us = 0;
     int64_t t_start_us = 0;
 
     ~llama_model() {
+        for (llama_lora_adapter * adapter : lora_adapters) {
+            delete adapter;
+        }
+
         if (ctx) {
             ggml_free(ctx);
         }
@@ -1075,9 +1246,158 @@ struct llama_model {
     }
 };
 
+// reads the weights of the model mapping layer by layer ahead of the evals, and releases them after
+// (see llama_context_params.stream_layers)
+struct llama_layer_streamer {
+    // page-aligned ranges of the mapping with the weights of each group: the layers, then the output
+    std::vector<std::vector<std::pair<uint8_t *, size_t>>> ranges;
+
+    // group of each streamed weight
+    std::unordered_map<const struct ggml_tensor *, int> group_of;
+
+    // the nodes of a segment of the graph
+    std::unique_ptr<struct ggml_cgraph> segment;
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    std::deque<int> queue;
+    std::vector<int64_t> tickets; // ticket of the last read request of each group, 0 - not requested
+    int64_t n_requested = 0;
+    int64_t n_read      = 0;
+    bool    stop        = false;
+
+    llama_layer_streamer(const llama_model & model) : segment(new ggml_cgraph) {
+        uint8_t * addr = (uint8_t *) model.mapping->addr;
+        const size_t    page = llama_mmap::page_size();
+
+        auto add_group = [&](std::initializer_list<const struct ggml_tensor *> tensors) {
+            const int g = (int) ranges.size();
+
+            std::vector<std::pair<uint8_t *, size_t>> group;
+            for (const struct ggml_tensor * t : tensors) {
+                if (!t || t->backend != GGML_BACKEND_CPU) {
+                    continue;
+                }
+                const uint8_t * data = (const uint8_t *) t->data;
+                if (data < addr || data + ggml_nbytes(t) > addr + model.mapping->size) {
+                    continue;
+                }
+                group_of[t] = g;
+
+                const size_t first = (data - addr)/page*page;
+                const size_t last  = (data - addr + ggml_nbytes(t) + page - 1)/page*page;
+                group.push_back({ addr + first, std::min(last, model.mapping->size) - first });
+            }
+
+            // merge the overlapping ranges, e.g. of fused weights and their parts
+            std::sort(group.begin(), group.end());
+            std::vector<std::pair<uint8_t *, size_t>> merged;
+            for (const auto & r : group) {
+                if (!merged.empty() && r.first <= merged.back().first + merged.back().second) {
+                    merged.back().second = std::max(merged.back().second, (size_t) (r.first + r.second - merged.back().first));
+                } else {
+                    merged.push_back(r);
+                }
+            }
+            ranges.push_back(merged);
+        };
+
+        for (const auto & layer : model.layers) {
+            add_group({ layer.attn_norm, layer.attn_norm_b, layer.attn_norm_2, layer.attn_norm_2_b,
+                        layer.wq, layer.wk, layer.wv, layer.wo, layer.wqkv,
+                        layer.ffn_norm, layer.w1, layer.w2, layer.w3, layer.w13 });
+        }
+        add_group({ model.output_norm, model.output_norm_b, model.output });
+
+        tickets.resize(ranges.size(), 0);
+
+        worker = std::thread([this]() { run(); });
+    }
+
+    ~llama_layer_streamer() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    size_t size() const {
+        size_t res = 0;
+        for (const auto & group : ranges) {
+            for (const auto & r : group) {
+                res += r.second;
+            }
+        }
+        return res;
+    }
+
+    // requests reading the weights of a group in the background, unless they were read already
+    void prefetch(int g) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (tickets[g] == 0) {
+            tickets[g] = ++n_requested;
+            queue.push_back(g);
+            cv.notify_all();
+        }
+    }
+
+    // waits until the weights of a group are read
+    void wait(int g) {
+        prefetch(g);
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return n_read >= tickets[g]; });
+    }
+
+    // releases the pages of a group
+    void release(int g) {
+        for (const auto & r : ranges[g]) {
+            llama_mmap::advise_dontneed(r.first, r.second);
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        tickets[g] = 0;
+    }
+
+    void run() {
+        while (true) {
+            int g;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() { return stop || !queue.empty(); });
+                if (stop) {
+                    return;
+                }
+                g = queue.front();
+                queue.pop_front();
+            }
+
+            // touch every page so that it is resident when computed
+            for (const auto & r : ranges[g]) {
+                llama_mmap::touch(r.first, r.second);
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                n_read++;
+            }
+            cv.notify_all();
+        }
+    }
+};
+
 struct llama_context {
     llama_context(const llama_model & model) : model(model), t_load_us(model.t_load_us), t_start_us(model.t_start_us) {}
     ~llama_context() {
+        {
+            std::lock_guard<std::mutex> lock(model.contexts_mutex);
+            model.n_contexts--;
+            if (streamer) {
+                model.n_streaming--;
+            }
+        }
         if (model_owner) {
             delete &model;
         }
@@ -1103,6 +1423,20 @@ struct llama_context {
     int32_t n_eval   = 0; // number of eval calls
     int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
 
+    // time spent in the phases of the evals (see llama_timings)
+    int64_t t_build_us  = 0;
+    int64_t t_alloc_us  = 0;
+    int64_t t_output_us = 0;
+    llama_compute_timings t_compute;
+
+    // compute time of each layer, with layer_timings
+    bool layer_timings = false;
+    std::vector<int64_t> t_layer_us;
+    std::unique_ptr<struct ggml_cgraph> graph_segment;
+
+    // time and number of calls of each sampling function, by __func__
+    std::unordered_map<const char *, std::pair<int64_t, int32_t>> t_sampler_us;
+
     const llama_model & model;
 
     bool model_owner = false;
@@ -1113,22 +1447,78 @@ struct llama_context {
     // key + value cache for the self attention
     struct llama_kv_cache kv_self;
 
+    // if > 0, kv_self grows in chunks of this many tokens as it fills
+    int n_kv_chunk = 0;
+
+    // maximum number of tokens in a single eval the compute buffer was sized for
+    int n_batch = 0;
+
     // decode output (2-dimensional array: [n_tokens][n_vocab])
     std::vector<float> logits;
     bool logits_all = false;
 
+    // caller-owned buffer the logits are written to instead of `logits` (see llama_set_logits_buffer)
+    float * logits_ext      = nullptr;
+    size_t  logits_ext_size = 0;
+
+    // number of floats in the logits output of the last eval
+    size_t n_logits = 0;
+
     // input embedding (1-dimensional array: [n_embd])
     std::vector<float> embedding;
 
+    // while set, evals only compute the hidden states of all tokens (2-dimensional array: [n_tokens][n_embd]) into embedding_hidden
+    // the graph ends at the final norm
+    std::vector<float> embedding_hidden;
+    bool embedding_all = false;
+
+    // while set, evals at n_past = 0 keep K and V in the compute buffer instead of writing them to the KV cache
+    bool kv_scratch = false;
+
+    // while set, the last guidance_n_tokens tokens of the eval batch belong to the context guidance, of the same model,
+    // they attend to its KV cache from guidance_n_past and their logits are returned to it (see llama_eval_guided)
+    llama_context * guidance = nullptr;
+    int guidance_n_tokens = 0;
+    int guidance_n_past   = 0;
+
+    // number of tensors of the worst-case graph the compute buffer was measured with
+    int n_graph_tensors = 0;
+
+    // set once the compute buffer is measured with custom positions and an attention mask (see llama_reserve_mask)
+    bool reserved_mask = false;
+
     // reusable buffer for `struct ggml_graph_plan.work_data`
     std::vector<uint8_t> work_buffer;
 
+    // CPUs the compute threads are pinned to (empty - not pinned)
+    std::vector<int> cpus;
+
+    // layers skipped by the evals (empty - none, see llama_set_layer_skip)
+    std::vector<bool> layer_skip;
+
+    // tokens the logits of the evals are restricted to (empty - all, see llama_set_output_tokens)
+    std::vector<int32_t> output_ids;
+
+    // reads the layers of the model mapping as they are evaluated (see llama_context_params.stream_layers)
+    std::unique_ptr<llama_layer_streamer> streamer;
+
+    // LoRA adapter applied by the evals and its scale (see llama_set_lora_adapter)
+    const llama_lora_adapter * lora = nullptr;
+    float lora_scale = 1.0f;
+
+    // weights and largest rank of the last adapter the compute buffer was measured for
+    std::unordered_set<const ggml_tensor *> lora_reserved;
+    int64_t lora_reserved_rank = 0;
+
     // memory buffers used to evaluate the model
     llama_buffer buf_compute;
 
     llama_buffer buf_alloc;
     ggml_allocr * alloc = NULL;
 
+    // size of the tensors of the worst-case graph, from the last measure pass
+    size_t alloc_peak = 0;
+
 #ifdef GGML_USE_METAL
     ggml_metal_context * ctx_metal = NULL;
 #endif
@@ -1155,7 +1545,8 @@ static bool llama_kv_cache_init(
     const int64_t n_elements = n_embd*n_mem;
 
     cache.buf.resize(2u*n_elements*ggml_type_size(wtype) + 2u*MB);
-    cache.n = 0;
+    cache.n    = 0;
+    cache.size = n_ctx;
 
     struct ggml_init_params params;
     params.mem_size   = cache.buf.size;
@@ -1187,6 +1578,83 @@ static bool llama_kv_cache_init(
     return true;
 }
 
+// size of the KV cache buffer for n_ctx tokens, as reported in the session state
+static size_t llama_kv_cache_buf_size(const struct llama_hparams & hparams, ggml_type wtype, int n_ctx) {
+    const int64_t n_elements = (int64_t) hparams.n_embd_gqa()*hparams.n_layer*n_ctx;
+
+    return 2u*n_elements*ggml_type_size(wtype) + 2u*MB;
+}
+
+// reallocate the KV cache with storage for size tokens, keeping the tokens that still fit
+static bool llama_kv_cache_resize(
+        const struct llama_hparams & hparams,
+             struct llama_kv_cache & cache,
+                               int   size) {
+    GGML_ASSERT(cache.k->backend == GGML_BACKEND_CPU && cache.v->backend == GGML_BACKEND_CPU);
+
+    llama_kv_cache tmp;
+    if (!llama_kv_cache_init(hparams, tmp, cache.k->type, size, 0)) {
+        return false;
+    }
+
+    const int64_t n_embd  = hparams.n_embd_gqa();
+    const int64_t n_layer = hparams.n_layer;
+
+    const int n_tok = std::min(cache.n, size);
+
+    const size_t esize = ggml_element_size(cache.k);
+
+    for (int64_t il = 0; il < n_layer; ++il) {
+        // K: [n_embd, size, n_layer]
+        memcpy((uint8_t *) tmp.k->data   + esize*n_embd*tmp.size*il,
+               (uint8_t *) cache.k->data + esize*n_embd*cache.size*il, esize*n_embd*n_tok);
+
+        // V: [size, n_embd, n_layer] (transposed)
+        for (int64_t i = 0; i < n_embd; ++i) {
+            memcpy((uint8_t *) tmp.v->data   + esize*(tmp.size*(n_embd*il + i)),
+                   (uint8_t *) cache.v->data + esize*(cache.size*(n_embd*il + i)), esize*n_tok);
+        }
+    }
+
+    // llama_buffer is not movable - swap the contents and let tmp release the old storage
+    std::swap(cache.k,   tmp.k);
+    std::swap(cache.v,   tmp.v);
+    std::swap(cache.ctx, tmp.ctx);
+    std::swap(cache.buf.data,     tmp.buf.data);
+    std::swap(cache.buf.size,     tmp.buf.size);
+    std::swap(cache.buf.fallback, tmp.buf.fallback);
+
+    cache.n    = n_tok;
+    cache.size = size;
+
+    return true;
+}
+
+// copy the K and V entries of all layers from cache slot src to slot dst
+static void llama_kv_cache_copy_slot(
+        const struct llama_hparams & hparams,
+             struct llama_kv_cache & cache,
+                               int   dst,
+                               int   src) {
+    const int64_t n_embd  = hparams.n_embd_gqa();
+    const int64_t n_layer = hparams.n_layer;
+    const int64_t n_ctx   = cache.size;
+
+    const size_t esize = ggml_element_size(cache.k);
+
+    for (int64_t il = 0; il < n_layer; ++il) {
+        // K: [n_embd, n_ctx, n_layer]
+        uint8_t * k = (uint8_t *) cache.k->data + esize*n_embd*n_ctx*il;
+        memcpy(k + esize*n_embd*dst, k + esize*n_embd*src, esize*n_embd);
+
+        // V: [n_ctx, n_embd, n_layer] (transposed)
+        uint8_t * v = (uint8_t *) cache.v->data + esize*n_ctx*n_embd*il;
+        for (int64_t i = 0; i < n_embd; ++i) {
+            memcpy(v + esize*(n_ctx*i + dst), v + esize*(n_ctx*i + src), esize);
+        }
+    }
+}
+
 //
 // model loading and saving
 //
@@ -1231,17 +1699,22 @@ struct llama_model_loader {
     int64_t n_elements = 0;
 
     bool use_mmap = false;
+    bool prefetch = true; // with mmap, read the CPU weights when the file is mapped
 
+    std::string fname;
     llama_file  file;
     llama_ftype ftype;
     llama_fver  fver;
 
     std::unique_ptr<llama_mmap> mapping;
 
+    // tensors created by create_tensor_fused with mmap, and the first of their parts
+    std::vector<std::pair<struct ggml_tensor *, struct ggml_tensor *>> fused_mapped;
+
     struct gguf_context * ctx_gguf = NULL;
     struct ggml_context * ctx_meta = NULL;
 
-    llama_model_loader(const std::string & fname, bool use_mmap) : file(fname.c_str(), "rb") {
+    llama_model_loader(const std::string & fname, bool use_mmap) : fname(fname), file(fname.c_str(), "rb") {
         struct gguf_init_params params = {
             /*.no_alloc = */ true,
             /*.ctx      = */ &ctx_meta,
@@ -1292,6 +1765,7 @@ struct llama_model_loader {
                 case GGML_TYPE_F32:  ftype = LLAMA_FTYPE_ALL_F32;       break;
                 case GGML_TYPE_F16:  ftype = LLAMA_FTYPE_MOSTLY_F16;    break;
                 case GGML_TYPE_Q4_0: ftype = LLAMA_FTYPE_MOSTLY_Q4_0;   break;
+                case GGML_TYPE_Q4_0_4X: ftype = LLAMA_FTYPE_MOSTLY_Q4_0; break;
                 case GGML_TYPE_Q4_1: ftype = LLAMA_FTYPE_MOSTLY_Q4_1;   break;
                 case GGML_TYPE_Q5_0: ftype = LLAMA_FTYPE_MOSTLY_Q5_0;   break;
                 case GGML_TYPE_Q5_1: ftype = LLAMA_FTYPE_MOSTLY_Q5_1;   break;
@@ -1404,7 +1878,7 @@ struct llama_model_loader {
         return tensor;
     }
 
-    struct ggml_tensor * create_tensor(struct ggml_context * ctx, const std::string & name, const std::vector<int64_t> & ne, ggml_backend backend) {
+    struct ggml_tensor * get_tensor_meta_checked(const std::string & name, const std::vector<int64_t> & ne) const {
         struct ggml_tensor * cur = ggml_get_tensor(ctx_meta, name.c_str());
 
         if (cur == NULL) {
@@ -1428,7 +1902,68 @@ struct llama_model_loader {
             }
         }
 
-        return create_tensor_for(ctx, cur, backend);
+        return cur;
+    }
+
+    struct ggml_tensor * create_tensor(struct ggml_context * ctx, const std::string & name, const std::vector<int64_t> & ne, ggml_backend backend) {
+        return create_tensor_for(ctx, get_tensor_meta_checked(name, ne), backend);
+    }
+
+    // creates the 2-d CPU tensors `names` as consecutive row ranges of a single tensor `name`, so that they can be
+    // multiplied in a single matmul - the tensors must share their type and number of columns
+    // with mmap, they must also be adjacent in the file
+    // returns NULL and creates nothing if the tensors cannot share memory
+    struct ggml_tensor * create_tensor_fused(
+            struct ggml_context * ctx, const std::string & name,
+            const std::vector<std::string> & names, const std::vector<std::vector<int64_t>> & nes,
+            std::vector<struct ggml_tensor *> & tensors) {
+        std::vector<struct ggml_tensor *> metas;
+        int64_t n_rows = 0;
+
+        for (size_t i = 0; i < names.size(); ++i) {
+            struct ggml_tensor * meta = get_tensor_meta_checked(names[i], nes[i]);
+
+            if (meta->ne[2] != 1 || meta->ne[3] != 1) {
+                return NULL;
+            }
+            if (i > 0) {
+                if (meta->type != metas[0]->type || meta->ne[0] != metas[0]->ne[0]) {
+                    return NULL;
+                }
+                if (use_mmap && file_offset(names[i].c_str()) != file_offset(names[i - 1].c_str()) + ggml_nbytes(metas.back())) {
+                    return NULL;
+                }
+            }
+
+            metas.push_back(meta);
+            n_rows += meta->ne[1];
+        }
+
+        // without mmap, the fused tensor owns the memory and the tensors are loaded into its rows
+        struct ggml_tensor * fused = ggml_new_tensor_2d(ctx, metas[0]->type, metas[0]->ne[0], n_rows);
+        ggml_set_name(fused, name.c_str());
+
+        ggml_set_no_alloc(ctx, true);
+
+        size_t offs = 0;
+        tensors.clear();
+        for (auto * meta : metas) {
+            struct ggml_tensor * cur = create_tensor_for(ctx, meta, GGML_BACKEND_CPU);
+            if (!use_mmap) {
+                cur->data = (char *) fused->data + offs;
+            }
+            offs += ggml_nbytes(cur);
+            tensors.push_back(cur);
+        }
+
+        ggml_set_no_alloc(ctx, use_mmap);
+
+        // with mmap, the fused tensor points to the mapped rows once they are mapped
+        if (use_mmap) {
+            fused_mapped.emplace_back(fused, tensors[0]);
+        }
+
+        return fused;
     }
 
     void done_getting_tensors() const {
@@ -1458,65 +1993,278 @@ struct llama_model_loader {
         }
     }
 
-    void load_all_data(struct ggml_context * ctx, llama_progress_callback progress_callback, void * progress_callback_user_data, llama_mlock * lmlock) {
-        size_t size_data = 0;
-        size_t size_lock = 0;
-        size_t size_pref = 0; // prefetch
+    // reads the data of the CPU tensors without mmap, with several threads each reading chunks of the file with its own handle
+    // the progress callback is called from the calling thread
+    void load_data_parallel(
+            const std::vector<struct ggml_tensor *> & tensors,
+            size_t size_data,
+            size_t & done_size,
+            llama_progress_callback progress_callback,
+            void * progress_callback_user_data) {
+        static const size_t chunk_size = 16*1024*1024;
 
-        for (int i = 0; i < gguf_get_n_tensors(ctx_gguf); i++) {
-            struct ggml_tensor * cur = ggml_get_tensor(ctx, gguf_get_tensor_name(ctx_gguf, i));
-            size_data += ggml_nbytes(cur);
-            if (cur->backend == GGML_BACKEND_CPU) {
-                size_pref += ggml_nbytes(cur);
-            }
-        }
+        struct chunk {
+            uint8_t * dst;
+            size_t    offs;
+            size_t    size;
+        };
 
-        if (use_mmap) {
-            mapping.reset(new llama_mmap(&file, size_pref, ggml_is_numa()));
-            if (lmlock) {
-                lmlock->init(mapping->addr);
+        std::vector<chunk> chunks;
+        for (struct ggml_tensor * cur : tensors) {
+            const size_t offs  = file_offset(ggml_get_name(cur));
+            const size_t nbytes = ggml_nbytes(cur);
+            for (size_t i = 0; i < nbytes; i += chunk_size) {
+                chunks.push_back({ (uint8_t *) cur->data + i, offs + i, std::min(chunk_size, nbytes - i) });
             }
         }
 
-        size_t done_size = 0;
-        for (int i = 0; i < gguf_get_n_tensors(ctx_gguf); i++) {
-            struct ggml_tensor * cur = ggml_get_tensor(ctx, gguf_get_tensor_name(ctx_gguf, i));
-            GGML_ASSERT(cur); // unused tensors should have been caught by load_data already
+        // in file order, so that each reader reads mostly sequentially
+        std::sort(chunks.begin(), chunks.end(), [](const chunk & a, const chunk & b) { return a.offs < b.offs; });
 
-            if (progress_callback) {
-                progress_callback((float) done_size / size_data, progress_callback_user_data);
-            }
+        const int n_readers = std::max(1, std::min({ 8, (int) std::thread::hardware_concurrency(), (int) chunks.size() }));
 
-            // allocate temp buffer if not using mmap
-            if (!use_mmap && cur->data == NULL) {
-                GGML_ASSERT(cur->backend != GGML_BACKEND_CPU);
-                #ifdef GGML_USE_CPU_HBM
-                cur->data = (uint8_t*)hbw_malloc(ggml_nbytes(cur));
-                #else
-                cur->data = (uint8_t*)malloc(ggml_nbytes(cur));
-                #endif
-            }
+        const size_t done_start = done_size;
 
-            load_data_for(cur);
+        std::atomic<size_t> next(0);
+        std::atomic<size_t> done(0);
 
-            switch (cur->backend) {
-                case GGML_BACKEND_CPU:
-                    if (use_mmap && lmlock) {
-                        size_lock += ggml_nbytes(cur);
-                        lmlock->grow_to(size_lock);
-                    }
-                    break;
-#if defined(GGML_USE_CUBLAS)
-                case GGML_BACKEND_GPU:
-                case GGML_BACKEND_GPU_SPLIT:
-                    // old code:
-                    //ggml_cuda_transform_tensor(lt.data, lt.ggml_tensor);
+        std::mutex mutex;
+        std::string error;
 
-                    // TODO: test if this works !!
-                    ggml_cuda_transform_tensor(cur->data, cur);
-                    if (!use_mmap) {
-                        free(cur->data);
-                    }
+        auto read = [&](bool report) {
+            try {
+                // the first reader uses the file of the loader
+                std::unique_ptr<llama_file> own;
+                const llama_file * f = &file;
+                if (!report) {
+                    own.reset(new llama_file(fname.c_str(), "rb"));
+                    f = own.get();
+                }
+
+                while (true) {
+                    const size_t i = next++;
+                    if (i >= chunks.size()) {
+                        break;
+                    }
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        if (!error.empty()) {
+                            break;
+                        }
+                    }
+
+                    f->seek(chunks[i].offs, SEEK_SET);
+                    f->read_raw(chunks[i].dst, chunks[i].size);
+
+                    const size_t cur_done = done += chunks[i].size;
+                    if (report && progress_callback) {
+                        progress_callback((float) (done_start + cur_done) / size_data, progress_callback_user_data);
+                    }
+                }
+            } catch (const std::exception & err) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (error.empty()) {
+                    error = err.what();
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (int i = 1; i < n_readers; ++i) {
+            workers.push_back(std::thread(read, false));
+        }
+        read(true);
+        for (auto & worker : workers) {
+            worker.join();
+        }
+
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+
+        done_size += done;
+    }
+
+    // faults in the mapped data of the CPU tensors with several threads, instead of in the first evals
+    // with NUMA, each NUMA node touches its share of the rows of each tensor, as split between the compute threads by ggml
+    // the progress callback is called from the calling thread
+    void warm_up(
+            const std::vector<struct ggml_tensor *> & tensors,
+            size_t size_data,
+            size_t & done_size,
+            llama_progress_callback progress_callback,
+            void * progress_callback_user_data) {
+        static const size_t chunk_size = 4*1024*1024;
+
+        const int n_nodes = ggml_is_numa() ? ggml_numa_n_nodes() : 1;
+
+        // the chunks of each node
+        std::vector<std::vector<std::pair<uint8_t *, size_t>>> chunks(n_nodes);
+        for (const struct ggml_tensor * cur : tensors) {
+            uint8_t * data = (uint8_t *) cur->data;
+            const int64_t   nr   = ggml_nrows(cur);
+            for (int node = 0; node < n_nodes; ++node) {
+                const size_t first = (size_t) (nr*node/n_nodes)*cur->nb[1];
+                const size_t last  = (size_t) (nr*(node + 1)/n_nodes)*cur->nb[1];
+                for (size_t i = first; i < last; i += chunk_size) {
+                    chunks[node].push_back({ data + i, std::min(chunk_size, last - i) });
+                }
+            }
+        }
+
+        const int n_threads = std::max(n_nodes, std::min(32, (int) std::thread::hardware_concurrency()));
+
+        const size_t done_start = done_size;
+
+        std::vector<std::atomic<size_t>> next(n_nodes);
+        for (auto & n : next) {
+            n = 0;
+        }
+        std::atomic<size_t> done(0);
+        std::atomic<int>    n_finished(0);
+
+        auto touch = [&](int node, bool report) {
+            if (n_nodes > 1) {
+                ggml_numa_set_thread_node(node);
+            }
+            while (true) {
+                const size_t i = next[node]++;
+                if (i >= chunks[node].size()) {
+                    break;
+                }
+
+                llama_mmap::touch(chunks[node][i].first, chunks[node][i].second);
+
+                const size_t cur_done = done += chunks[node][i].second;
+                if (report && progress_callback) {
+                    progress_callback((float) (done_start + cur_done) / size_data, progress_callback_user_data);
+                }
+            }
+            n_finished++;
+        };
+
+        // with NUMA, all the workers are bound to a node and the calling thread only reports the progress
+        const int n_workers = n_nodes > 1 ? n_threads : n_threads - 1;
+
+        std::vector<std::thread> workers;
+        for (int i = 0; i < n_workers; ++i) {
+            workers.push_back(std::thread(touch, (i + 1) % n_nodes, false));
+        }
+        if (n_nodes > 1) {
+            while (n_finished < n_workers) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                if (progress_callback) {
+                    progress_callback((float) (done_start + done) / size_data, progress_callback_user_data);
+                }
+            }
+        } else {
+            touch(0, true);
+        }
+        for (auto & worker : workers) {
+            worker.join();
+        }
+
+        done_size += done;
+    }
+
+    void load_all_data(struct ggml_context * ctx, llama_progress_callback progress_callback, void * progress_callback_user_data, llama_mlock * lmlock) {
+        size_t size_data = 0;
+        size_t size_lock = 0;
+        size_t size_pref = 0; // prefetch
+
+        for (int i = 0; i < gguf_get_n_tensors(ctx_gguf); i++) {
+            struct ggml_tensor * cur = ggml_get_tensor(ctx, gguf_get_tensor_name(ctx_gguf, i));
+            size_data += ggml_nbytes(cur);
+            if (cur->backend == GGML_BACKEND_CPU) {
+                size_pref += ggml_nbytes(cur);
+            }
+        }
+
+        if (use_mmap) {
+            // the data is faulted in by warm_up below
+            mapping.reset(new llama_mmap(&file, /* prefetch */ 0, ggml_is_numa()));
+            if (lmlock) {
+                lmlock->init(mapping->addr);
+            }
+        }
+
+        size_t done_size = 0;
+
+        // with mmap, the tensors in host memory are made resident first, in parallel
+        const bool warm = use_mmap && prefetch && size_pref > 0;
+        if (warm) {
+            std::vector<struct ggml_tensor *> tensors;
+            for (int i = 0; i < gguf_get_n_tensors(ctx_gguf); i++) {
+                struct ggml_tensor * cur = ggml_get_tensor(ctx, gguf_get_tensor_name(ctx_gguf, i));
+                if (cur && cur->backend == GGML_BACKEND_CPU) {
+                    load_data_for(cur);
+                    tensors.push_back(cur);
+                }
+            }
+
+            const int64_t t_start_us = ggml_time_us();
+            warm_up(tensors, size_data, done_size, progress_callback, progress_callback_user_data);
+            LLAMA_LOG_INFO("%s: warmed up %.2f MB in %.2f ms\n", __func__, size_pref/1024.0/1024.0, (ggml_time_us() - t_start_us)/1000.0);
+        }
+
+        // without mmap, the tensors in host memory are read first, in parallel
+        if (!use_mmap) {
+            std::vector<struct ggml_tensor *> tensors;
+            for (int i = 0; i < gguf_get_n_tensors(ctx_gguf); i++) {
+                struct ggml_tensor * cur = ggml_get_tensor(ctx, gguf_get_tensor_name(ctx_gguf, i));
+                if (cur && cur->backend == GGML_BACKEND_CPU) {
+                    tensors.push_back(cur);
+                }
+            }
+            load_data_parallel(tensors, size_data, done_size, progress_callback, progress_callback_user_data);
+        }
+
+        for (int i = 0; i < gguf_get_n_tensors(ctx_gguf); i++) {
+            struct ggml_tensor * cur = ggml_get_tensor(ctx, gguf_get_tensor_name(ctx_gguf, i));
+            GGML_ASSERT(cur); // unused tensors should have been caught by load_data already
+
+            if (!use_mmap && cur->backend == GGML_BACKEND_CPU) {
+                continue;
+            }
+
+            if (progress_callback) {
+                progress_callback((float) done_size / size_data, progress_callback_user_data);
+            }
+
+            // allocate temp buffer if not using mmap
+            if (!use_mmap && cur->data == NULL) {
+                GGML_ASSERT(cur->backend != GGML_BACKEND_CPU);
+                #ifdef GGML_USE_CPU_HBM
+                cur->data = (uint8_t*)hbw_malloc(ggml_nbytes(cur));
+                #else
+                cur->data = (uint8_t*)malloc(ggml_nbytes(cur));
+                #endif
+            }
+
+            load_data_for(cur);
+
+            switch (cur->backend) {
+                case GGML_BACKEND_CPU:
+                    if (use_mmap && lmlock) {
+                        size_lock += ggml_nbytes(cur);
+                        lmlock->grow_to(size_lock);
+                    }
+                    if (warm) {
+                        // counted by warm_up
+                        continue;
+                    }
+                    break;
+#if defined(GGML_USE_CUBLAS)
+                case GGML_BACKEND_GPU:
+                case GGML_BACKEND_GPU_SPLIT:
+                    // old code:
+                    //ggml_cuda_transform_tensor(lt.data, lt.ggml_tensor);
+
+                    // TODO: test if this works !!
+                    ggml_cuda_transform_tensor(cur->data, cur);
+                    if (!use_mmap) {
+                        free(cur->data);
+                    }
                     break;
 #elif defined(GGML_USE_CLBLAST)
                 case GGML_BACKEND_GPU:
@@ -1532,6 +2280,10 @@ struct llama_model_loader {
 
             done_size += ggml_nbytes(cur);
         }
+
+        for (auto & it : fused_mapped) {
+            it.first->data = it.second->data;
+        }
     }
 };
 
@@ -1850,6 +2602,46 @@ static void llm_load_print_meta(llama_model_loader & ml, llama_model & model) {
     if (vocab.linefeed_id    != -1) { LLAMA_LOG_INFO( "%s: LF token  = %d '%s'\n", __func__, vocab.linefeed_id,    vocab.id_to_token[vocab.linefeed_id].text.c_str() );    }
 }
 
+// interleaves the blocks of each group of 4 rows of q4_0 data in place (see GGML_TYPE_Q4_0_4X)
+static void llama_repack_q4_0_4x(void * data, int64_t nrows, size_t row_size) {
+    const size_t block_size = ggml_type_size(GGML_TYPE_Q4_0);
+    const size_t nblocks    = row_size/block_size;
+
+    GGML_ASSERT(nrows % 4 == 0);
+
+    std::vector<uint8_t> tmp(4*row_size);
+    for (int64_t i = 0; i < nrows; i += 4) {
+        uint8_t * group = (uint8_t *) data + i*row_size;
+        memcpy(tmp.data(), group, tmp.size());
+        for (size_t ib = 0; ib < nblocks; ++ib) {
+            for (size_t r = 0; r < 4; ++r) {
+                memcpy(group + (4*ib + r)*block_size, tmp.data() + r*row_size + ib*block_size, block_size);
+            }
+        }
+    }
+}
+
+// repacks a q4_0 matrix of the model and sets the type of the views of its rows (the parts of fused weights)
+static bool llama_repack_weight(struct ggml_tensor * w, std::initializer_list<struct ggml_tensor *> parts = {}) {
+    if (!w || w->type != GGML_TYPE_Q4_0 || w->backend != GGML_BACKEND_CPU || w->n_dims != 2 || w->ne[1] % 4 != 0) {
+        return false;
+    }
+    for (struct ggml_tensor * part : parts) {
+        if (part->ne[1] % 4 != 0) {
+            return false;
+        }
+    }
+
+    llama_repack_q4_0_4x(w->data, w->ne[1], w->nb[1]);
+
+    w->type = GGML_TYPE_Q4_0_4X;
+    for (struct ggml_tensor * part : parts) {
+        part->type = GGML_TYPE_Q4_0_4X;
+    }
+
+    return true;
+}
+
 static void llm_load_tensors(
         llama_model_loader & ml,
         llama_model & model,
@@ -1861,6 +2653,8 @@ static void llm_load_tensors(
         bool low_vram,
         ggml_type memory_type,
         bool use_mlock,
+        bool fuse_weights,
+        bool repack_weights,
         llama_progress_callback progress_callback,
         void * progress_callback_user_data) {
     model.t_start_us = ggml_time_us();
@@ -1870,11 +2664,33 @@ static void llm_load_tensors(
 
     model.n_gpu_layers = n_gpu_layers;
 
+#ifdef LLAMA_SUPPORTS_GPU_OFFLOAD
+    // the GPU backends have no kernels for the interleaved rows of a model quantized with --repack
+    if (n_gpu_layers > 0) {
+        for (int i = 0; i < ml.n_tensors; i++) {
+            const char * name = gguf_get_tensor_name(ml.ctx_gguf, i);
+            if (ggml_get_tensor(ml.ctx_meta, name)->type == GGML_TYPE_Q4_0_4X) {
+                throw std::runtime_error(format("tensor '%s' is repacked (%s) and cannot be offloaded, use -ngl 0 or a model quantized without --repack",
+                        name, ggml_type_name(GGML_TYPE_Q4_0_4X)));
+            }
+        }
+    }
+#endif
+
     size_t ctx_size;
     size_t mmapped_size;
 
     ml.calc_sizes(ctx_size, mmapped_size);
 
+    // the fused weights of a layer use the memory of their parts, only their headers are extra
+    bool fuse = fuse_weights && model.arch == LLM_ARCH_LLAMA;
+#ifdef GGML_USE_METAL
+    fuse = fuse && n_gpu_layers <= 0;
+#endif
+    if (fuse) {
+        ctx_size += 2*hparams.n_layer*(sizeof(struct ggml_tensor) + GGML_OBJECT_SIZE + GGML_MEM_ALIGN);
+    }
+
     LLAMA_LOG_INFO("%s: ggml ctx size = %7.2f MB\n", __func__, ctx_size/1024.0/1024.0);
 
     // create the ggml context
@@ -1916,6 +2732,7 @@ static void llm_load_tensors(
 
     // prepare memory for the weights
     size_t vram_weights = 0;
+    int    n_fused      = 0;
     {
         const int64_t n_embd     = hparams.n_embd;
         const int64_t n_embd_gqa = hparams.n_embd_gqa();
@@ -1974,16 +2791,43 @@ static void llm_load_tensors(
 
                         layer.attn_norm = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_NORM, "weight", i), {n_embd}, backend);
 
-                        layer.wq = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_Q,   "weight", i), {n_embd, n_embd},     backend_split);
-                        layer.wk = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_K,   "weight", i), {n_embd, n_embd_gqa}, backend_split);
-                        layer.wv = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_V,   "weight", i), {n_embd, n_embd_gqa}, backend_split);
+                        std::vector<struct ggml_tensor *> parts;
+
+                        if (fuse && backend_split == GGML_BACKEND_CPU) {
+                            layer.wqkv = ml.create_tensor_fused(ctx, format("blk.%d.attn_qkv_fused.weight", i),
+                                    { tn(LLM_TENSOR_ATTN_Q, "weight", i), tn(LLM_TENSOR_ATTN_K, "weight", i), tn(LLM_TENSOR_ATTN_V, "weight", i) },
+                                    { { n_embd, n_embd },                 { n_embd, n_embd_gqa },             { n_embd, n_embd_gqa } }, parts);
+                        }
+
+                        if (layer.wqkv) {
+                            layer.wq = parts[0];
+                            layer.wk = parts[1];
+                            layer.wv = parts[2];
+                            n_fused++;
+                        } else {
+                            layer.wq = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_Q,   "weight", i), {n_embd, n_embd},     backend_split);
+                            layer.wk = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_K,   "weight", i), {n_embd, n_embd_gqa}, backend_split);
+                            layer.wv = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_V,   "weight", i), {n_embd, n_embd_gqa}, backend_split);
+                        }
                         layer.wo = ml.create_tensor(ctx, tn(LLM_TENSOR_ATTN_OUT, "weight", i), {n_embd, n_embd},     backend_split);
 
                         layer.ffn_norm = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_NORM, "weight", i), {n_embd}, backend);
 
-                        layer.w1 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_GATE, "weight", i), {n_embd,   n_ff}, backend_split);
+                        if (fuse && backend_split == GGML_BACKEND_CPU) {
+                            layer.w13 = ml.create_tensor_fused(ctx, format("blk.%d.ffn_gate_up_fused.weight", i),
+                                    { tn(LLM_TENSOR_FFN_GATE, "weight", i), tn(LLM_TENSOR_FFN_UP, "weight", i) },
+                                    { { n_embd, n_ff },                     { n_embd, n_ff } }, parts);
+                        }
+
+                        if (layer.w13) {
+                            layer.w1 = parts[0];
+                            layer.w3 = parts[1];
+                            n_fused++;
+                        } else {
+                            layer.w1 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_GATE, "weight", i), {n_embd,   n_ff}, backend_split);
+                            layer.w3 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_UP,   "weight", i), {n_embd,   n_ff}, backend_split);
+                        }
                         layer.w2 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_DOWN, "weight", i), {  n_ff, n_embd}, backend_split);
-                        layer.w3 = ml.create_tensor(ctx, tn(LLM_TENSOR_FFN_UP,   "weight", i), {n_embd,   n_ff}, backend_split);
 
                         if (backend == GGML_BACKEND_GPU) {
                             vram_weights +=
@@ -2078,6 +2922,10 @@ static void llm_load_tensors(
 
     ml.done_getting_tensors();
 
+    if (fuse) {
+        LLAMA_LOG_INFO("%s: fused %d/%d weight groups\n", __func__, n_fused, 2*hparams.n_layer);
+    }
+
     // print memory requirements
     {
         const size_t scale = memory_type == GGML_TYPE_F32 ? 2 : 1;
@@ -2152,6 +3000,38 @@ static void llm_load_tensors(
 
     ml.load_all_data(ctx, progress_callback, progress_callback_user_data, use_mlock ? &model.mlock_mmap : NULL);
 
+#ifdef GGML_USE_METAL
+    repack_weights = repack_weights && n_gpu_layers <= 0;
+#endif
+    if (repack_weights && !ggml_cpu_has_avx2()) {
+        // the scalar dot product of the repacked rows is slower than the q4_0 one
+        LLAMA_LOG_WARN("%s: the weights are only repacked with AVX2\n", __func__);
+    } else if (repack_weights && ml.use_mmap) {
+        LLAMA_LOG_WARN("%s: the mapped weights cannot be repacked, use --no-mmap or a model quantized with --repack\n", __func__);
+    } else if (repack_weights) {
+        int n_repacked = 0;
+        for (auto & layer : model.layers) {
+            if (layer.wqkv) {
+                n_repacked += llama_repack_weight(layer.wqkv, { layer.wq, layer.wk, layer.wv });
+            } else {
+                n_repacked += llama_repack_weight(layer.wq);
+                n_repacked += llama_repack_weight(layer.wk);
+                n_repacked += llama_repack_weight(layer.wv);
+            }
+            n_repacked += llama_repack_weight(layer.wo);
+            if (layer.w13) {
+                n_repacked += llama_repack_weight(layer.w13, { layer.w1, layer.w3 });
+            } else {
+                n_repacked += llama_repack_weight(layer.w1);
+                n_repacked += llama_repack_weight(layer.w3);
+            }
+            n_repacked += llama_repack_weight(layer.w2);
+        }
+        n_repacked += llama_repack_weight(model.output);
+
+        LLAMA_LOG_INFO("%s: repacked %d q4_0 matrices\n", __func__, n_repacked);
+    }
+
     if (progress_callback) {
         progress_callback(1.0f, progress_callback_user_data);
     }
@@ -2179,11 +3059,17 @@ static bool llama_model_load(
         bool use_mmap,
         bool use_mlock,
         bool vocab_only,
+        bool fuse_weights,
+        bool stream_layers,
+        bool repack_weights,
         llama_progress_callback progress_callback,
         void *progress_callback_user_data) {
     try {
         std::unique_ptr<llama_model_loader> ml(new llama_model_loader(fname, use_mmap));
 
+        // the layers are read as they are evaluated
+        ml->prefetch = !stream_layers;
+
         llm_load_arch   (*ml, model);
         llm_load_hparams(*ml, model, n_ctx, rope_freq_base, rope_freq_scale);
         llm_load_vocab  (*ml, model);
@@ -2202,7 +3088,7 @@ static bool llama_model_load(
         llm_load_tensors(
                 *ml, model, n_batch, n_gpu_layers,
                 main_gpu, tensor_split, mul_mat_q, low_vram, memory_type,
-                use_mlock, progress_callback, progress_callback_user_data);
+                use_mlock, fuse_weights, repack_weights, progress_callback, progress_callback_user_data);
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("error loading model: %s\n", err.what());
         return false;
@@ -2211,12 +3097,153 @@ static bool llama_model_load(
     return true;
 }
 
+// adds the low-rank update of the runtime LoRA adapter to cur = w*x, if the adapter has factors for w: cur + scale*B*(A*x)
+static struct ggml_tensor * llm_build_lora(
+         const llama_context & lctx,
+         struct ggml_context * ctx0,
+          struct ggml_tensor * lora_scale,
+    const struct ggml_tensor * w,
+          struct ggml_tensor * x,
+          struct ggml_tensor * cur) {
+    if (!lctx.lora) {
+        return cur;
+    }
+
+    const auto it = lctx.lora->weights.find(w);
+    if (it == lctx.lora->weights.end()) {
+        return cur;
+    }
+
+    struct ggml_tensor * ax = ggml_mul_mat(ctx0, it->second.a, x);
+    ggml_set_name(ax, "lora_ax");
+
+    struct ggml_tensor * bax = ggml_mul_mat(ctx0, it->second.b, ax);
+    bax = ggml_scale_inplace(ctx0, bax, lora_scale);
+    ggml_set_name(bax, "lora_bax");
+
+    // cur can be a view of a fused matmul
+    bax = ggml_reshape_4d(ctx0, bax, cur->ne[0], cur->ne[1], cur->ne[2], cur->ne[3]);
+
+    return ggml_add(ctx0, cur, bax);
+}
+
+// w*x, including the runtime LoRA adapter
+static struct ggml_tensor * llm_build_mm(
+         const llama_context & lctx,
+         struct ggml_context * ctx0,
+          struct ggml_tensor * lora_scale,
+          struct ggml_tensor * w,
+          struct ggml_tensor * x) {
+    return llm_build_lora(lctx, ctx0, lora_scale, w, x, ggml_mul_mat(ctx0, w, x));
+}
+
+static bool llama_can_get_rows(const struct ggml_tensor * t) {
+    switch (t->type) {
+        case GGML_TYPE_F32:
+        case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+#ifdef GGML_USE_K_QUANTS
+        case GGML_TYPE_Q2_K:
+        case GGML_TYPE_Q3_K:
+        case GGML_TYPE_Q4_K:
+        case GGML_TYPE_Q5_K:
+        case GGML_TYPE_Q6_K:
+#endif
+            return t->backend == GGML_BACKEND_CPU;
+        default:
+            return false;
+    }
+}
+
+// the lm_head is restricted to the rows of lctx.output_ids when they are few enough for the gathered rows
+// to be cheaper than the full matmul and to fit in the compute buffer, sized for the logits of n_batch tokens
+static bool llama_output_rows_enabled(const llama_context & lctx) {
+    const auto & model = lctx.model;
+
+    const int64_t n_ids   = lctx.output_ids.size();
+    const int64_t n_vocab = model.hparams.n_vocab;
+    const int64_t n_embd  = model.hparams.n_embd;
+
+    if (n_ids == 0 || 8*n_ids > n_vocab || n_ids*n_embd > lctx.n_batch*n_vocab/2) {
+        return false;
+    }
+
+#ifdef GGML_USE_METAL
+    if (lctx.ctx_metal) {
+        return false;
+    }
+#endif
+
+    if (!llama_can_get_rows(model.output)) {
+        return false;
+    }
+
+    if (lctx.lora) {
+        const auto it = lctx.lora->weights.find(model.output);
+        if (it != lctx.lora->weights.end() && !llama_can_get_rows(it->second.b)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// the lm_head, only for the tokens of lctx.output_ids if enabled (see llama_set_output_tokens)
+static struct ggml_tensor * llm_build_output(
+         const llama_context & lctx,
+         struct ggml_context * ctx0,
+          struct ggml_tensor * lora_scale,
+          struct ggml_tensor * x) {
+    struct ggml_tensor * w = lctx.model.output;
+
+    if (!llama_output_rows_enabled(lctx)) {
+        return llm_build_mm(lctx, ctx0, lora_scale, w, x);
+    }
+
+    const int n_ids = (int) lctx.output_ids.size();
+
+    struct ggml_tensor * inp_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_ids);
+    ggml_allocr_alloc(lctx.alloc, inp_ids);
+    if (!ggml_allocr_is_measure(lctx.alloc)) {
+        memcpy(inp_ids->data, lctx.output_ids.data(), n_ids*ggml_element_size(inp_ids));
+    }
+    ggml_set_name(inp_ids, "inp_output_ids");
+
+    // the gathered rows are dequantized to F32
+    struct ggml_tensor * w_rows = ggml_get_rows(ctx0, w, inp_ids);
+    ggml_set_name(w_rows, "output_rows");
+
+    struct ggml_tensor * cur = ggml_mul_mat(ctx0, w_rows, x);
+
+    if (lctx.lora) {
+        const auto it = lctx.lora->weights.find(w);
+        if (it != lctx.lora->weights.end()) {
+            struct ggml_tensor * ax = ggml_mul_mat(ctx0, it->second.a, x);
+            ggml_set_name(ax, "lora_ax");
+
+            struct ggml_tensor * bax = ggml_mul_mat(ctx0, ggml_get_rows(ctx0, it->second.b, inp_ids), ax);
+            bax = ggml_scale_inplace(ctx0, bax, lora_scale);
+            ggml_set_name(bax, "lora_bax");
+
+            cur = ggml_add(ctx0, cur, bax);
+        }
+    }
+
+    return cur;
+}
+
 static struct ggml_cgraph * llm_build_llama(
          llama_context & lctx,
      const llama_token * tokens,
            const float * embd,
                    int   n_tokens,
-                   int   n_past) {
+                   int   n_past,
+             const int * pos,
+           const float * mask) {
 
     GGML_ASSERT((!tokens && embd) || (tokens && !embd)); // NOLINT
 
@@ -2231,11 +3258,11 @@ static struct ggml_cgraph * llm_build_llama(
 
     const int64_t n_embd      = hparams.n_embd;
     const int64_t n_layer     = hparams.n_layer;
-    const int64_t n_ctx       = hparams.n_ctx;
     const int64_t n_head      = hparams.n_head;
     const int64_t n_head_kv   = hparams.n_head_kv;
     const int64_t n_embd_head = hparams.n_embd_head();
     const int64_t n_embd_gqa  = hparams.n_embd_gqa();
+    const int64_t n_ff        = hparams.n_ff;
 
     GGML_ASSERT(n_embd_head == hparams.n_rot);
 
@@ -2316,7 +3343,59 @@ static struct ggml_cgraph * llm_build_llama(
     }
     ggml_set_name(KQ_scale, "1/sqrt(n_embd_head)");
 
+    // scale of the runtime LoRA adapter (see llama_set_lora_adapter)
+    struct ggml_tensor * lora_scale = NULL;
+    if (lctx.lora) {
+        lora_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
+        ggml_allocr_alloc(lctx.alloc, lora_scale);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            ggml_set_f32(lora_scale, lctx.lora_scale*lctx.lora->scaling);
+        }
+        ggml_set_name(lora_scale, "lora_scale");
+    }
+
+    // custom positions and attention mask for the batch (see llama_eval_mask)
+    struct ggml_tensor * inp_pos = NULL;
+    if (pos) {
+        inp_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+        ggml_allocr_alloc(lctx.alloc, inp_pos);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            memcpy(inp_pos->data, pos, N*ggml_element_size(inp_pos));
+        }
+        ggml_set_name(inp_pos, "inp_pos");
+    }
+
+    struct ggml_tensor * KQ_mask = NULL;
+    if (mask) {
+        KQ_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_past + N, N);
+        ggml_allocr_alloc(lctx.alloc, KQ_mask);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            memcpy(KQ_mask->data, mask, ggml_nbytes(KQ_mask));
+        }
+        ggml_set_name(KQ_mask, "KQ_mask");
+    }
+
+    // a batch that is only encoded attends to its own K and V in the compute buffer, the KV cache is left untouched
+    const bool kv_scratch = lctx.kv_scratch;
+    GGML_ASSERT(!kv_scratch || n_past == 0);
+
+    // the sequences in the batch, each attending to its own KV cache: the tokens of lctx, then the tokens of
+    // the guidance context (see llama_eval_guided)
+    const int N_guidance = lctx.guidance ? lctx.guidance_n_tokens : 0;
+    const int n_seq      = N_guidance > 0 ? 2 : 1;
+
+    const llama_kv_cache * seq_kv[2]   = { &kv_self, lctx.guidance ? &lctx.guidance->kv_self : NULL };
+    const int              seq_past[2] = { n_past,   lctx.guidance_n_past };
+    const int              seq_i0[2]   = { 0,        N - N_guidance };
+    const int              seq_n[2]    = { N - N_guidance, N_guidance };
+
+    GGML_ASSERT(n_seq == 1 || (!kv_scratch && !mask && pos));
+
     for (int il = 0; il < n_layer; ++il) {
+        if (!lctx.layer_skip.empty() && lctx.layer_skip[il]) {
+            continue;
+        }
+
         ggml_format_name(inpL, "layer_inp_%d", il);
 
         offload_func_t offload_func = llama_nop;
@@ -2344,109 +3423,171 @@ static struct ggml_cgraph * llm_build_llama(
         // self-attention
         {
             // compute Q and K and RoPE them
-            struct ggml_tensor * tmpk = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
-            offload_func_kq(tmpk);
-            ggml_set_name(tmpk, "tmpk");
+            struct ggml_tensor * tmpk;
+            struct ggml_tensor * tmpq;
+            struct ggml_tensor * tmpv;
+
+            if (model.layers[il].wqkv) {
+                // fused weights - a single matmul, split by rows into Q, K and V
+                struct ggml_tensor * tmpqkv = ggml_mul_mat(ctx0, model.layers[il].wqkv, cur);
+                offload_func_kq(tmpqkv);
+                ggml_set_name(tmpqkv, "tmpqkv");
+
+                tmpk = ggml_view_3d(ctx0, tmpqkv, n_embd_head, n_head_kv, N, ggml_element_size(tmpqkv)*n_embd_head, tmpqkv->nb[1], ggml_element_size(tmpqkv)*n_embd);
+                tmpq = ggml_view_3d(ctx0, tmpqkv, n_embd_head, n_head,    N, ggml_element_size(tmpqkv)*n_embd_head, tmpqkv->nb[1], 0);
+                tmpv = ggml_view_2d(ctx0, tmpqkv, n_embd_gqa, N, tmpqkv->nb[1], ggml_element_size(tmpqkv)*(n_embd + n_embd_gqa));
+                ggml_set_name(tmpk, "tmpk");
+                ggml_set_name(tmpq, "tmpq");
+                ggml_set_name(tmpv, "tmpv");
 
-            struct ggml_tensor * tmpq = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
-            offload_func_kq(tmpq);
-            ggml_set_name(tmpq, "tmpq");
+                tmpk = llm_build_lora(lctx, ctx0, lora_scale, model.layers[il].wk, cur, tmpk);
+                tmpq = llm_build_lora(lctx, ctx0, lora_scale, model.layers[il].wq, cur, tmpq);
+                tmpv = llm_build_lora(lctx, ctx0, lora_scale, model.layers[il].wv, cur, tmpv);
+            } else {
+                tmpk = llm_build_mm(lctx, ctx0, lora_scale, model.layers[il].wk, cur);
+                offload_func_kq(tmpk);
+                ggml_set_name(tmpk, "tmpk");
 
-            struct ggml_tensor * Kcur = ggml_rope_custom_inplace(ctx0, ggml_reshape_3d(ctx0, tmpk, n_embd_head, n_head_kv, N), n_past, n_embd_head, 0, 0, freq_base, freq_scale);
-            offload_func_kq(Kcur);
-            ggml_set_name(Kcur, "Kcur");
-
-            struct ggml_tensor * Qcur = ggml_rope_custom_inplace(ctx0, ggml_reshape_3d(ctx0, tmpq, n_embd_head, n_head, N),    n_past, n_embd_head, 0, 0, freq_base, freq_scale);
-            offload_func_kq(Qcur);
-            ggml_set_name(Qcur, "Qcur");
-
-            // store key and value to memory
-            {
-                // compute the transposed [N, n_embd] V matrix
+                tmpq = llm_build_mm(lctx, ctx0, lora_scale, model.layers[il].wq, cur);
+                offload_func_kq(tmpq);
+                ggml_set_name(tmpq, "tmpq");
 
-                struct ggml_tensor * tmpv = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+                tmpv = llm_build_mm(lctx, ctx0, lora_scale, model.layers[il].wv, cur);
                 offload_func_v(tmpv);
                 ggml_set_name(tmpv, "tmpv");
 
-                struct ggml_tensor * Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, tmpv, n_embd_gqa, N));
-                offload_func_v(Vcur);
-                ggml_set_name(Vcur, "Vcur");
-
-                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_embd_gqa, (ggml_element_size(kv_self.k)*n_embd_gqa)*(il*n_ctx + n_past));
-                offload_func_kq(k);
-                ggml_set_name(k, "k");
-
-                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, N, n_embd_gqa,
-                        (   n_ctx)*ggml_element_size(kv_self.v),
-                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_embd_gqa + n_past*ggml_element_size(kv_self.v));
-                offload_func_v(v);
-                ggml_set_name(v, "v");
-
-                // important: storing RoPE-ed version of K in the KV cache!
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
+                tmpk = ggml_reshape_3d(ctx0, tmpk, n_embd_head, n_head_kv, N);
+                tmpq = ggml_reshape_3d(ctx0, tmpq, n_embd_head, n_head,    N);
             }
 
-            struct ggml_tensor * Q = ggml_permute(ctx0, Qcur, 0, 2, 1, 3);
-            offload_func_kq(Q);
-            ggml_set_name(Q, "Q");
+            struct ggml_tensor * Kcur;
+            struct ggml_tensor * Qcur;
 
-            struct ggml_tensor * K =
-                ggml_view_3d(ctx0, kv_self.k,
-                        n_embd_head, n_past + N, n_head_kv,
-                        ggml_element_size(kv_self.k)*n_embd_gqa,
-                        ggml_element_size(kv_self.k)*n_embd_head,
-                        ggml_element_size(kv_self.k)*n_embd_gqa*n_ctx*il);
-            offload_func_kq(K);
-            ggml_set_name(K, "K");
+            if (inp_pos) {
+                Kcur = ggml_rope_custom_pos_inplace(ctx0, tmpk, inp_pos, n_embd_head, 0, 0, freq_base, freq_scale);
+                Qcur = ggml_rope_custom_pos_inplace(ctx0, tmpq, inp_pos, n_embd_head, 0, 0, freq_base, freq_scale);
+            } else {
+                Kcur = ggml_rope_custom_inplace(ctx0, tmpk, n_past, n_embd_head, 0, 0, freq_base, freq_scale);
+                Qcur = ggml_rope_custom_inplace(ctx0, tmpq, n_past, n_embd_head, 0, 0, freq_base, freq_scale);
+            }
+            offload_func_kq(Kcur);
+            ggml_set_name(Kcur, "Kcur");
 
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-            offload_func_kq(KQ);
-            ggml_set_name(KQ, "KQ");
+            offload_func_kq(Qcur);
+            ggml_set_name(Qcur, "Qcur");
 
-            // KQ_scaled = KQ / sqrt(n_embd_head)
-            // KQ_scaled shape [n_past + N, N, n_head, 1]
-            struct ggml_tensor * KQ_scaled = ggml_scale_inplace(ctx0, KQ, KQ_scale);
-            offload_func_kq(KQ_scaled);
-            ggml_set_name(KQ_scaled, "KQ_scaled");
+            // the attention of each sequence, over its KV cache
+            struct ggml_tensor * KQV_merged = NULL;
+
+            for (int is = 0; is < n_seq; ++is) {
+                const llama_kv_cache & kv = *seq_kv[is];
+
+                const int64_t n_kv_ctx = kv.size; // allocated KV cache slots
+                const int     n_past_s = seq_past[is];
+                const int     N_s      = seq_n[is];
+
+                // the rows of the sequence in the batch
+                struct ggml_tensor * Kcur_s = Kcur;
+                struct ggml_tensor * Qcur_s = Qcur;
+                struct ggml_tensor * tmpv_s = tmpv;
+                if (n_seq > 1) {
+                    Kcur_s = ggml_view_3d(ctx0, Kcur, n_embd_head, n_head_kv, N_s, Kcur->nb[1], Kcur->nb[2], seq_i0[is]*Kcur->nb[2]);
+                    Qcur_s = ggml_view_3d(ctx0, Qcur, n_embd_head, n_head,    N_s, Qcur->nb[1], Qcur->nb[2], seq_i0[is]*Qcur->nb[2]);
+                    tmpv_s = ggml_view_2d(ctx0, tmpv, n_embd_gqa, N_s, tmpv->nb[1], seq_i0[is]*tmpv->nb[1]);
+                    offload_func_kq(Kcur_s);
+                    offload_func_kq(Qcur_s);
+                    offload_func_v(tmpv_s);
+                }
 
-            // KQ_masked = mask_past(KQ_scaled)
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
-            offload_func_kq(KQ_masked);
-            ggml_set_name(KQ_masked, "KQ_masked");
+                // the transposed [N, n_embd] V matrix
+                struct ggml_tensor * Vcur = ggml_transpose(ctx0, tmpv_s);
+                offload_func_v(Vcur);
+                ggml_set_name(Vcur, "Vcur");
 
-            // KQ = soft_max(KQ_masked)
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
-            offload_func_v(KQ_soft_max);
-            ggml_set_name(KQ_soft_max, "KQ_soft_max");
+                // store key and value to memory
+                if (!kv_scratch) {
+                    struct ggml_tensor * k = ggml_view_1d(ctx0, kv.k, N_s*n_embd_gqa, (ggml_element_size(kv.k)*n_embd_gqa)*(il*n_kv_ctx + n_past_s));
+                    offload_func_kq(k);
+                    ggml_set_name(k, "k");
+
+                    struct ggml_tensor * v = ggml_view_2d(ctx0, kv.v, N_s, n_embd_gqa,
+                            (   n_kv_ctx)*ggml_element_size(kv.v),
+                            (il*n_kv_ctx)*ggml_element_size(kv.v)*n_embd_gqa + n_past_s*ggml_element_size(kv.v));
+                    offload_func_v(v);
+                    ggml_set_name(v, "v");
+
+                    // important: storing RoPE-ed version of K in the KV cache!
+                    ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur_s, k));
+                    ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
+                }
 
-            // split cached V into n_head heads
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, kv_self.v,
-                        n_past + N, n_embd_head, n_head_kv,
-                        ggml_element_size(kv_self.v)*n_ctx,
-                        ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
-                        ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
-            offload_func_v(V);
-            ggml_set_name(V, "V");
+                struct ggml_tensor * Q = ggml_permute(ctx0, Qcur_s, 0, 2, 1, 3);
+                offload_func_kq(Q);
+                ggml_set_name(Q, "Q");
+
+                struct ggml_tensor * K = kv_scratch ? ggml_permute(ctx0, Kcur_s, 0, 2, 1, 3) :
+                    ggml_view_3d(ctx0, kv.k,
+                            n_embd_head, n_past_s + N_s, n_head_kv,
+                            ggml_element_size(kv.k)*n_embd_gqa,
+                            ggml_element_size(kv.k)*n_embd_head,
+                            ggml_element_size(kv.k)*n_embd_gqa*n_kv_ctx*il);
+                offload_func_kq(K);
+                ggml_set_name(K, "K");
+
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+                offload_func_kq(KQ);
+                ggml_set_name(KQ, "KQ");
+
+                // KQ_scaled = KQ / sqrt(n_embd_head)
+                // KQ_scaled shape [n_past + N, N, n_head, 1]
+                struct ggml_tensor * KQ_scaled = ggml_scale_inplace(ctx0, KQ, KQ_scale);
+                offload_func_kq(KQ_scaled);
+                ggml_set_name(KQ_scaled, "KQ_scaled");
+
+                // KQ_masked = mask_past(KQ_scaled)
+                struct ggml_tensor * KQ_masked = KQ_mask ? ggml_add_inplace(ctx0, KQ_scaled, KQ_mask) : ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past_s);
+                offload_func_kq(KQ_masked);
+                ggml_set_name(KQ_masked, "KQ_masked");
+
+                // KQ = soft_max(KQ_masked)
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
+                offload_func_v(KQ_soft_max);
+                ggml_set_name(KQ_soft_max, "KQ_soft_max");
+
+                // split cached V into n_head heads
+                struct ggml_tensor * V = kv_scratch ? ggml_reshape_3d(ctx0, ggml_cont(ctx0, Vcur), N_s, n_embd_head, n_head_kv) :
+                    ggml_view_3d(ctx0, kv.v,
+                            n_past_s + N_s, n_embd_head, n_head_kv,
+                            ggml_element_size(kv.v)*n_kv_ctx,
+                            ggml_element_size(kv.v)*n_kv_ctx*n_embd_head,
+                            ggml_element_size(kv.v)*n_kv_ctx*n_embd_gqa*il);
+                offload_func_v(V);
+                if (kv_scratch) {
+                    offload_func_v(V->src[0]);
+                }
+                ggml_set_name(V, "V");
 
 #if 1
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
-            offload_func_v(KQV);
-            ggml_set_name(KQV, "KQV");
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                offload_func_v(KQV);
+                ggml_set_name(KQV, "KQV");
 #else
-            // make V contiguous in memory to speed up the matmul, however we waste time on the copy
-            // on M1 this is faster for the perplexity computation, but ~5% slower for the single-token generation
-            // is there a better way?
-            struct ggml_tensor * V_cont = ggml_cpy(ctx0, V, ggml_new_tensor_3d(ctx0, kv_self.v->type, n_past + N, n_embd_head, n_head));
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_cont, KQ_soft_max);
+                // make V contiguous in memory to speed up the matmul, however we waste time on the copy
+                // on M1 this is faster for the perplexity computation, but ~5% slower for the single-token generation
+                // is there a better way?
+                struct ggml_tensor * V_cont = ggml_cpy(ctx0, V, ggml_new_tensor_3d(ctx0, kv.v->type, n_past_s + N_s, n_embd_head, n_head));
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_cont, KQ_soft_max);
 #endif
 
-            // KQV_merged = KQV.permute(0, 2, 1, 3)
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
-            offload_func_v(KQV_merged);
-            ggml_set_name(KQV_merged, "KQV_merged");
+                // KQV_merged = KQV.permute(0, 2, 1, 3)
+                struct ggml_tensor * KQV_merged_s = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                offload_func_v(KQV_merged_s);
+                ggml_set_name(KQV_merged_s, "KQV_merged");
+
+                // the rows of the sequences are joined back in the order of the batch
+                KQV_merged = KQV_merged ? ggml_concat(ctx0, KQV_merged, KQV_merged_s) : KQV_merged_s;
+            }
 
             // cur = KQV_merged.contiguous().view(n_embd, N)
             cur = ggml_cpy(ctx0,
@@ -2456,7 +3597,7 @@ static struct ggml_cgraph * llm_build_llama(
             ggml_set_name(cur, "KQV_merged_contiguous");
 
             // projection (no bias)
-            cur = ggml_mul_mat(ctx0,
+            cur = llm_build_mm(lctx, ctx0, lora_scale,
                     model.layers[il].wo,
                     cur);
             offload_func(cur);
@@ -2481,17 +3622,36 @@ static struct ggml_cgraph * llm_build_llama(
                 ggml_set_name(cur, "ffn_norm");
             }
 
-            struct ggml_tensor * tmp = ggml_mul_mat(ctx0,
-                    model.layers[il].w3,
-                    cur);
-            offload_func(tmp);
-            ggml_set_name(tmp, "result_w3");
+            struct ggml_tensor * tmp;
 
-            cur = ggml_mul_mat(ctx0,
-                    model.layers[il].w1,
-                    cur);
-            offload_func(cur);
-            ggml_set_name(cur, "result_w1");
+            if (model.layers[il].w13) {
+                // fused weights - a single matmul, split by rows into gate and up
+                struct ggml_tensor * tmp13 = ggml_mul_mat(ctx0,
+                        model.layers[il].w13,
+                        cur);
+                offload_func(tmp13);
+                ggml_set_name(tmp13, "result_w13");
+
+                tmp = ggml_view_2d(ctx0, tmp13, n_ff, N, tmp13->nb[1], ggml_element_size(tmp13)*n_ff);
+                cur = ggml_view_2d(ctx0, tmp13, n_ff, N, tmp13->nb[1], 0);
+                ggml_set_name(tmp, "result_w3");
+                ggml_set_name(cur, "result_w1");
+
+                tmp = llm_build_lora(lctx, ctx0, lora_scale, model.layers[il].w3, tmp13->src[1], tmp);
+                cur = llm_build_lora(lctx, ctx0, lora_scale, model.layers[il].w1, tmp13->src[1], cur);
+            } else {
+                tmp = llm_build_mm(lctx, ctx0, lora_scale,
+                        model.layers[il].w3,
+                        cur);
+                offload_func(tmp);
+                ggml_set_name(tmp, "result_w3");
+
+                cur = llm_build_mm(lctx, ctx0, lora_scale,
+                        model.layers[il].w1,
+                        cur);
+                offload_func(cur);
+                ggml_set_name(cur, "result_w1");
+            }
 
             // SILU activation
             cur = ggml_silu(ctx0, cur);
@@ -2502,7 +3662,7 @@ static struct ggml_cgraph * llm_build_llama(
             offload_func(cur);
             ggml_set_name(cur, "silu_x_result_w3");
 
-            cur = ggml_mul_mat(ctx0,
+            cur = llm_build_mm(lctx, ctx0, lora_scale,
                     model.layers[il].w2,
                     cur);
             offload_func(cur);
@@ -2519,6 +3679,33 @@ static struct ggml_cgraph * llm_build_llama(
 
     cur = inpL;
 
+    if (n_seq > 1 && cur->backend == GGML_BACKEND_CPU) {
+        // only the rows of the outputs of each sequence are needed
+        const int N_main   = N - N_guidance;
+        const int n_out    = lctx.logits_all ? N_main : 1;
+        const int n_out_g  = lctx.guidance->logits_all ? N_guidance : 1;
+
+        struct ggml_tensor * inp_rows = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_out + n_out_g);
+        ggml_allocr_alloc(lctx.alloc, inp_rows);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            int32_t * rows = (int32_t *) inp_rows->data;
+            for (int i = 0; i < n_out; ++i) {
+                rows[i] = N_main - n_out + i;
+            }
+            for (int i = 0; i < n_out_g; ++i) {
+                rows[n_out + i] = N - n_out_g + i;
+            }
+        }
+        ggml_set_name(inp_rows, "inp_rows");
+
+        cur = ggml_get_rows(ctx0, cur, inp_rows);
+        ggml_set_name(cur, "result_rows");
+    } else if (!lctx.logits_all && !pos && !mask && N > 1 && cur->backend == GGML_BACKEND_CPU) {
+        // only the last token is needed for the output - skip the other rows in the final norm and lm_head
+        cur = ggml_view_2d(ctx0, cur, n_embd, 1, cur->nb[1], (N - 1)*cur->nb[1]);
+        ggml_set_name(cur, "result_last");
+    }
+
     // norm
     {
         cur = ggml_rms_norm(ctx0, cur, norm_rms_eps);
@@ -2531,12 +3718,18 @@ static struct ggml_cgraph * llm_build_llama(
         ggml_set_name(cur, "result_norm");
     }
 
-    // lm_head
-    cur = ggml_mul_mat(ctx0, model.output, cur);
-    ggml_set_name(cur, "result_output");
+    // lm_head, skipped when only the hidden states are needed
+    if (!lctx.embedding_all) {
+        cur = llm_build_output(lctx, ctx0, lora_scale, cur);
+        ggml_set_name(cur, "result_output");
+    }
 
     ggml_build_forward_expand(gf, cur);
 
+    if (ggml_allocr_is_measure(lctx.alloc)) {
+        lctx.n_graph_tensors = (int) ((ggml_used_mem(ctx0) - ggml_graph_overhead())/ggml_tensor_overhead());
+    }
+
     ggml_free(ctx0);
 
     return gf;
@@ -2547,7 +3740,9 @@ static struct ggml_cgraph * llm_build_falcon(
      const llama_token * tokens,
            const float * embd,
                    int   n_tokens,
-                   int   n_past) {
+                   int   n_past,
+             const int * pos,
+           const float * mask) {
 
     GGML_ASSERT((!tokens && embd) || (tokens && !embd)); // NOLINT
 
@@ -2562,7 +3757,7 @@ static struct ggml_cgraph * llm_build_falcon(
 
     const int64_t n_embd      = hparams.n_embd;
     const int64_t n_layer     = hparams.n_layer;
-    const int64_t n_ctx       = hparams.n_ctx;
+    const int64_t n_ctx       = kv_self.size; // allocated KV cache slots
     const int64_t n_head      = hparams.n_head;
     const int64_t n_head_kv   = hparams.n_head_kv;
     const int64_t n_embd_head = hparams.n_embd_head();
@@ -2647,7 +3842,47 @@ static struct ggml_cgraph * llm_build_falcon(
     }
     ggml_set_name(KQ_scale, "1/sqrt(n_embd_head)");
 
+    // scale of the runtime LoRA adapter (see llama_set_lora_adapter)
+    struct ggml_tensor * lora_scale = NULL;
+    if (lctx.lora) {
+        lora_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
+        ggml_allocr_alloc(lctx.alloc, lora_scale);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            ggml_set_f32(lora_scale, lctx.lora_scale*lctx.lora->scaling);
+        }
+        ggml_set_name(lora_scale, "lora_scale");
+    }
+
+    // custom positions and attention mask for the batch (see llama_eval_mask)
+    struct ggml_tensor * inp_pos = NULL;
+    if (pos) {
+        inp_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+        ggml_allocr_alloc(lctx.alloc, inp_pos);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            memcpy(inp_pos->data, pos, N*ggml_element_size(inp_pos));
+        }
+        ggml_set_name(inp_pos, "inp_pos");
+    }
+
+    struct ggml_tensor * KQ_mask = NULL;
+    if (mask) {
+        KQ_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_past + N, N);
+        ggml_allocr_alloc(lctx.alloc, KQ_mask);
+        if (!ggml_allocr_is_measure(lctx.alloc)) {
+            memcpy(KQ_mask->data, mask, ggml_nbytes(KQ_mask));
+        }
+        ggml_set_name(KQ_mask, "KQ_mask");
+    }
+
+    // a batch that is only encoded attends to its own K and V in the compute buffer, the KV cache is left untouched
+    const bool kv_scratch = lctx.kv_scratch;
+    GGML_ASSERT(!kv_scratch || n_past == 0);
+
     for (int il = 0; il < n_layer; ++il) {
+        if (!lctx.layer_skip.empty() && lctx.layer_skip[il]) {
+            continue;
+        }
+
         struct ggml_tensor * attn_norm;
 
         offload_func_t offload_func = llama_nop;
@@ -2685,7 +3920,7 @@ static struct ggml_cgraph * llm_build_falcon(
 
             // compute QKV
 
-            cur = ggml_mul_mat(ctx0, model.layers[il].wqkv, cur);
+            cur = llm_build_mm(lctx, ctx0, lora_scale, model.layers[il].wqkv, cur);
             offload_func_kq(cur);
 
             // Note that the strides for Kcur, Vcur are set up so that the
@@ -2723,17 +3958,25 @@ static struct ggml_cgraph * llm_build_falcon(
             offload_func_v(tmpv);
 
             // using mode = 2 for neox mode
-            struct ggml_tensor * Qcur = ggml_rope_custom_inplace(ctx0, tmpq, n_past, n_embd_head, 2, 0, freq_base, freq_scale);
+            struct ggml_tensor * Qcur;
+            struct ggml_tensor * Kcur;
+
+            if (inp_pos) {
+                Qcur = ggml_rope_custom_pos_inplace(ctx0, tmpq, inp_pos, n_embd_head, 2, 0, freq_base, freq_scale);
+                Kcur = ggml_rope_custom_pos_inplace(ctx0, tmpk, inp_pos, n_embd_head, 2, 0, freq_base, freq_scale);
+            } else {
+                Qcur = ggml_rope_custom_inplace(ctx0, tmpq, n_past, n_embd_head, 2, 0, freq_base, freq_scale);
+                Kcur = ggml_rope_custom_inplace(ctx0, tmpk, n_past, n_embd_head, 2, 0, freq_base, freq_scale);
+            }
             offload_func_kq(Qcur);
-            struct ggml_tensor * Kcur = ggml_rope_custom_inplace(ctx0, tmpk, n_past, n_embd_head, 2, 0, freq_base, freq_scale);
             offload_func_kq(Kcur);
 
-            {
-                struct ggml_tensor * Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, ggml_cont(ctx0, tmpv), n_embd_gqa, N));
-                offload_func_v(Vcur);
-                offload_func_v(Vcur->src[0]->src[0]);
-                ggml_set_name(Vcur, "Vcur");
+            struct ggml_tensor * Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, ggml_cont(ctx0, tmpv), n_embd_gqa, N));
+            offload_func_v(Vcur);
+            offload_func_v(Vcur->src[0]->src[0]);
+            ggml_set_name(Vcur, "Vcur");
 
+            if (!kv_scratch) {
                 struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_embd_gqa, (ggml_element_size(kv_self.k)*n_embd_gqa)*(il*n_ctx + n_past));
                 offload_func_kq(k);
                 ggml_set_name(k, "k");
@@ -2751,7 +3994,7 @@ static struct ggml_cgraph * llm_build_falcon(
             offload_func_kq(Q);
             ggml_set_name(Q, "Q");
 
-            struct ggml_tensor * K =
+            struct ggml_tensor * K = kv_scratch ? ggml_permute(ctx0, Kcur, 0, 2, 1, 3) :
                 ggml_view_3d(ctx0, kv_self.k,
                         n_embd_head, n_past + N, n_head_kv,
                         ggml_element_size(kv_self.k)*n_embd_gqa,
@@ -2768,7 +4011,7 @@ static struct ggml_cgraph * llm_build_falcon(
             offload_func_kq(KQ_scaled);
             ggml_set_name(KQ_scaled, "KQ_scaled");
 
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
+            struct ggml_tensor * KQ_masked = KQ_mask ? ggml_add_inplace(ctx0, KQ_scaled, KQ_mask) : ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
             offload_func_kq(KQ_masked);
             ggml_set_name(KQ_masked, "KQ_masked");
 
@@ -2776,13 +4019,16 @@ static struct ggml_cgraph * llm_build_falcon(
             offload_func_v(KQ_soft_max);
             ggml_set_name(KQ_soft_max, "KQ_soft_max");
 
-            struct ggml_tensor * V =
+            struct ggml_tensor * V = kv_scratch ? ggml_reshape_3d(ctx0, ggml_cont(ctx0, Vcur), N, n_embd_head, n_head_kv) :
                 ggml_view_3d(ctx0, kv_self.v,
                         n_past + N, n_embd_head, n_head_kv,
                         ggml_element_size(kv_self.v)*n_ctx,
                         ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
                         ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
             offload_func_v(V);
+            if (kv_scratch) {
+                offload_func_v(V->src[0]);
+            }
             ggml_set_name(V, "V");
 
             struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
@@ -2797,7 +4043,7 @@ static struct ggml_cgraph * llm_build_falcon(
             offload_func_v(cur);
             ggml_set_name(cur, "KQV_merged_contiguous");
 
-            cur = ggml_mul_mat(ctx0, model.layers[il].wo, cur);
+            cur = llm_build_mm(lctx, ctx0, lora_scale, model.layers[il].wo, cur);
             offload_func(cur);
             ggml_set_name(cur, "result_wo");
         }
@@ -2808,12 +4054,12 @@ static struct ggml_cgraph * llm_build_falcon(
         {
             struct ggml_tensor * inpFF = attn_norm;
 
-            cur = ggml_mul_mat(ctx0, model.layers[il].w3, inpFF);
+            cur = llm_build_mm(lctx, ctx0, lora_scale, model.layers[il].w3, inpFF);
             offload_func(cur);
 
             cur = ggml_gelu(ctx0, cur);
             offload_func(cur);
-            cur = ggml_mul_mat(ctx0, model.layers[il].w2, cur);
+            cur = llm_build_mm(lctx, ctx0, lora_scale, model.layers[il].w2, cur);
             offload_func(cur);
         }
 
@@ -2828,6 +4074,12 @@ static struct ggml_cgraph * llm_build_falcon(
 
     cur = inpL;
 
+    // only the last token is needed for the output - skip the other rows in the final norm and lm_head
+    if (!lctx.logits_all && !pos && !mask && N > 1 && cur->backend == GGML_BACKEND_CPU) {
+        cur = ggml_view_2d(ctx0, cur, n_embd, 1, cur->nb[1], (N - 1)*cur->nb[1]);
+        ggml_set_name(cur, "result_last");
+    }
+
     // norm
     {
         cur = ggml_norm(ctx0, cur, norm_eps);
@@ -2839,8 +4091,10 @@ static struct ggml_cgraph * llm_build_falcon(
         ggml_set_name(cur, "result_norm");
     }
 
-    cur = ggml_mul_mat(ctx0, model.output, cur);
-    ggml_set_name(cur, "result_output");
+    if (!lctx.embedding_all) {
+        cur = llm_build_output(lctx, ctx0, lora_scale, cur);
+        ggml_set_name(cur, "result_output");
+    }
 
     ggml_build_forward_expand(gf, cur);
 
@@ -2854,7 +4108,9 @@ static struct ggml_cgraph * llama_build_graph(
      const llama_token * tokens,
            const float * embd,
                    int   n_tokens,
-                   int   n_past) {
+                   int   n_past,
+             const int * pos,
+           const float * mask) {
     const auto & model = lctx.model;
 
     struct ggml_cgraph * result = NULL;
@@ -2862,11 +4118,11 @@ static struct ggml_cgraph * llama_build_graph(
     switch (model.arch) {
         case LLM_ARCH_LLAMA:
             {
-                result = llm_build_llama(lctx, tokens, embd, n_tokens, n_past);
+                result = llm_build_llama(lctx, tokens, embd, n_tokens, n_past, pos, mask);
             } break;
         case LLM_ARCH_FALCON:
             {
-                result = llm_build_falcon(lctx, tokens, embd, n_tokens, n_past);
+                result = llm_build_falcon(lctx, tokens, embd, n_tokens, n_past, pos, mask);
             } break;
         default:
             GGML_ASSERT(false);
@@ -2875,6 +4131,197 @@ static struct ggml_cgraph * llama_build_graph(
     return result;
 }
 
+// make sure the KV cache has storage for n_tokens tokens, growing it in chunks if needed
+static bool llama_kv_cache_reserve(llama_context & lctx, int n_tokens) {
+    auto & kv_self = lctx.kv_self;
+
+    if (n_tokens <= kv_self.size) {
+        return true;
+    }
+
+    const int n_ctx = lctx.model.hparams.n_ctx;
+
+    if (lctx.n_kv_chunk <= 0 || n_tokens > n_ctx) {
+        return false;
+    }
+
+    const int size = std::min(n_ctx, (n_tokens + lctx.n_kv_chunk - 1)/lctx.n_kv_chunk*lctx.n_kv_chunk);
+
+    return llama_kv_cache_resize(lctx.model.hparams, kv_self, size);
+}
+
+// computes the nodes [i0, i1) of the graph gf, through the graph segment
+static void llama_graph_compute_nodes(llama_context & lctx, struct ggml_cgraph * gf, struct ggml_cgraph * segment, int i0, int i1, int n_threads) {
+    segment->n_nodes = i1 - i0;
+    segment->n_leafs = 0;
+    segment->perf_runs    = 0;
+    segment->perf_cycles  = 0;
+    segment->perf_time_us = 0;
+    for (int i = i0; i < i1; ++i) {
+        segment->nodes[i - i0] = gf->nodes[i];
+        segment->grads[i - i0] = NULL;
+    }
+
+    ggml_graph_compute_helper(lctx.work_buffer, segment, n_threads, lctx.cpus, &lctx.t_compute);
+}
+
+// computes the graph one layer at a time to measure the time of each layer
+static void llama_graph_compute_layers(llama_context & lctx, struct ggml_cgraph * gf, int n_threads) {
+    const auto & model = lctx.model;
+
+    const int n_layer = (int) model.layers.size();
+
+    // a layer starts at the first node that uses its attention norm, the output at the first node that uses the output norm
+    std::unordered_map<const struct ggml_tensor *, int> marks;
+    for (int il = 0; il < n_layer; ++il) {
+        marks[model.layers[il].attn_norm] = il;
+    }
+    marks[model.output_norm] = n_layer;
+
+    std::vector<int> first(n_layer + 1, -1);
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        for (int j = 0; j < GGML_MAX_SRC; ++j) {
+            const auto it = marks.find(gf->nodes[i]->src[j]);
+            if (gf->nodes[i]->src[j] && it != marks.end() && first[it->second] < 0) {
+                first[it->second] = i;
+            }
+        }
+    }
+    if (first[n_layer] < 0) {
+        first[n_layer] = gf->n_nodes;
+    }
+
+    for (int il = 0; il < n_layer; ++il) {
+        if (first[il] < 0 || first[il] > first[il + 1]) {
+            // skipped layers or an unknown layout - compute the graph at once
+            ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads, lctx.cpus, &lctx.t_compute);
+            return;
+        }
+    }
+
+    if (!lctx.graph_segment) {
+        lctx.graph_segment.reset(new ggml_cgraph);
+    }
+    struct ggml_cgraph * segment = lctx.graph_segment.get();
+
+    lctx.t_layer_us.resize(n_layer);
+
+    if (first[0] > 0) {
+        llama_graph_compute_nodes(lctx, gf, segment, 0, first[0], n_threads);
+    }
+    for (int il = 0; il < n_layer; ++il) {
+        const int64_t t_start_us = ggml_time_us();
+        llama_graph_compute_nodes(lctx, gf, segment, first[il], first[il + 1], n_threads);
+        lctx.t_layer_us[il] += ggml_time_us() - t_start_us;
+    }
+    if (first[n_layer] < gf->n_nodes) {
+        llama_graph_compute_nodes(lctx, gf, segment, first[n_layer], gf->n_nodes, n_threads);
+    }
+}
+
+// computes the graph one layer at a time, reading the weights of the next layer while a layer is computed
+// and releasing the weights of each layer after it is computed
+static void llama_graph_compute_streamed(llama_context & lctx, struct ggml_cgraph * gf, int n_threads) {
+    llama_layer_streamer & streamer = *lctx.streamer;
+
+    const int n_groups = (int) streamer.ranges.size();
+
+    // the graph is split before the first node that uses the weights of each group
+    std::vector<int> first(n_groups, -1);
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        for (int j = 0; j < GGML_MAX_SRC; ++j) {
+            const struct ggml_tensor * src = gf->nodes[i]->src[j];
+            if (!src) {
+                continue;
+            }
+            const auto it = streamer.group_of.find(src);
+            if (it != streamer.group_of.end() && first[it->second] < 0) {
+                first[it->second] = i;
+            }
+        }
+    }
+
+    std::vector<std::pair<int, int>> segments; // group, first node
+    for (int g = 0; g < n_groups; ++g) {
+        if (first[g] < 0) {
+            continue;
+        }
+        if (!segments.empty() && first[g] < segments.back().second) {
+            // the groups are not used in order - compute the graph at once
+            ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads, lctx.cpus, &lctx.t_compute);
+            return;
+        }
+        segments.push_back({ g, segments.empty() ? 0 : first[g] });
+    }
+
+    if (segments.empty()) {
+        ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads, lctx.cpus, &lctx.t_compute);
+        return;
+    }
+
+    struct ggml_cgraph * segment = streamer.segment.get();
+
+    streamer.prefetch(segments[0].first);
+
+    for (size_t k = 0; k < segments.size(); ++k) {
+        const int g  = segments[k].first;
+        const int i0 = segments[k].second;
+        const int i1 = k + 1 < segments.size() ? segments[k + 1].second : gf->n_nodes;
+
+        if (k + 1 < segments.size()) {
+            streamer.prefetch(segments[k + 1].first);
+        }
+        streamer.wait(g);
+
+        llama_graph_compute_nodes(lctx, gf, segment, i0, i1, n_threads);
+
+        streamer.release(g);
+    }
+
+    // the first layer is read while the next tokens are sampled
+    streamer.prefetch(segments[0].first);
+}
+
+// copies the rows [i0, i0 + n_rows) of the output res to logits
+// when the output is restricted to lctx.output_ids, the logits of the other tokens are set to -INFINITY - also when
+// the full output was computed, so that the samplers can rely on the restriction
+static void llama_copy_logits(const llama_context & lctx, float * logits, const struct ggml_tensor * res, int64_t i0, int64_t n_rows) {
+    const int64_t n_vocab = lctx.model.hparams.n_vocab;
+    const int64_t n_cols  = res->ne[0];
+
+    const float * data = (const float *) ggml_get_data(res) + n_cols*i0;
+
+    if (n_cols == n_vocab && lctx.output_ids.empty()) {
+        memcpy(logits, data, sizeof(float)*n_vocab*n_rows);
+        return;
+    }
+
+    if (n_cols == n_vocab) {
+        const int64_t n_ids = lctx.output_ids.size();
+
+        for (int64_t i = 0; i < n_rows; ++i) {
+            float * row = logits + n_vocab*i;
+
+            std::fill(row, row + n_vocab, -INFINITY);
+            for (int64_t j = 0; j < n_ids; ++j) {
+                row[lctx.output_ids[j]] = data[n_vocab*i + lctx.output_ids[j]];
+            }
+        }
+        return;
+    }
+
+    GGML_ASSERT(n_cols == (int64_t) lctx.output_ids.size());
+
+    for (int64_t i = 0; i < n_rows; ++i) {
+        float * row = logits + n_vocab*i;
+
+        std::fill(row, row + n_vocab, -INFINITY);
+        for (int64_t j = 0; j < n_cols; ++j) {
+            row[lctx.output_ids[j]] = data[n_cols*i + j];
+        }
+    }
+}
+
 // evaluate the transformer
 //
 //   - lctx:      llama context
@@ -2882,6 +4329,8 @@ static struct ggml_cgraph * llama_build_graph(
 //   - embd       embeddings input
 //   - n_tokens   number of tokens
 //   - n_past:    the context size so far
+//   - pos:       custom token positions (optional)
+//   - mask:      custom attention mask (optional)
 //   - n_threads: number of threads to use
 //
 static bool llama_eval_internal(
@@ -2890,6 +4339,8 @@ static bool llama_eval_internal(
            const float * embd,
                    int   n_tokens,
                    int   n_past,
+             const int * pos,
+           const float * mask,
                    int   n_threads,
             const char * cgraph_fname) {
 
@@ -2921,9 +4372,139 @@ static bool llama_eval_internal(
     const int64_t n_embd  = hparams.n_embd;
     const int64_t n_vocab = hparams.n_vocab;
 
+    // a custom attention structure needs the logits of every token in the batch
+    const bool logits_all = lctx.logits_all || pos || mask;
+
+    // the last tokens of the batch may belong to a guidance context (see llama_eval_guided)
+    llama_context * guidance = lctx.guidance;
+
+    const int N_guidance = guidance ? lctx.guidance_n_tokens : 0;
+    const int N_main     = N - N_guidance;
+
+    // the sequences are placed at their positions in their own KV caches
+    std::vector<int> pos_guided;
+    if (guidance) {
+        GGML_ASSERT(tokens && !pos && !mask && N_main > 0 && N_guidance > 0);
+
+        if (model.arch != LLM_ARCH_LLAMA || lctx.embedding_all || lctx.kv_scratch) {
+            LLAMA_LOG_ERROR("%s: a guidance batch is only supported for the logits of the LLaMA architecture\n", __func__);
+            return false;
+        }
+
+        pos_guided.resize(N);
+        for (int i = 0; i < N_main; ++i) {
+            pos_guided[i] = n_past + i;
+        }
+        for (int i = 0; i < N_guidance; ++i) {
+            pos_guided[N_main + i] = lctx.guidance_n_past + i;
+        }
+        pos = pos_guided.data();
+    }
+
+    if (pos || mask) {
+#ifdef GGML_USE_METAL
+        if (lctx.ctx_metal) {
+            LLAMA_LOG_ERROR("%s: custom positions and attention masks are not supported with Metal\n", __func__);
+            return false;
+        }
+#endif
+#ifdef GGML_USE_CUBLAS
+        if (pos && model.n_gpu_layers > (int) hparams.n_layer + 2) {
+            LLAMA_LOG_ERROR("%s: custom positions are not supported with an offloaded K cache\n", __func__);
+            return false;
+        }
+        if (mask && model.n_gpu_layers > (int) hparams.n_layer + 2) {
+            LLAMA_LOG_ERROR("%s: custom attention masks are not supported with an offloaded KQ\n", __func__);
+            return false;
+        }
+#endif
+    }
+
+    // when only the hidden states are needed, the graph ends at the final norm and no logits are computed
+    const bool embd_only  = lctx.embedding_all;
+    const bool kv_scratch = lctx.kv_scratch;
+
+    if (!kv_scratch && !llama_kv_cache_reserve(lctx, n_past + N_main)) {
+        LLAMA_LOG_ERROR("%s: the KV cache cannot hold %d tokens (n_ctx = %d)\n", __func__, n_past + N_main, (int) hparams.n_ctx);
+        return false;
+    }
+
+    if (guidance && !llama_kv_cache_reserve(*guidance, lctx.guidance_n_past + N_guidance)) {
+        LLAMA_LOG_ERROR("%s: the KV cache of the guidance context cannot hold %d tokens\n", __func__, lctx.guidance_n_past + N_guidance);
+        return false;
+    }
+
     ggml_allocr_reset(lctx.alloc);
 
-    ggml_cgraph * gf = llama_build_graph(lctx, tokens, embd, n_tokens, n_past);
+    int64_t t_phase_us = ggml_time_us();
+
+    ggml_cgraph * gf = llama_build_graph(lctx, tokens, embd, n_tokens, n_past, pos, mask);
+
+    lctx.t_build_us += ggml_time_us() - t_phase_us;
+
+    struct ggml_tensor * res        = embd_only ? NULL : gf->nodes[gf->n_nodes - 1];
+    struct ggml_tensor * embeddings = gf->nodes[gf->n_nodes - (embd_only ? 1 : 2)];
+    if ((lctx.lora || !lctx.output_ids.empty()) && !embd_only) {
+        // the LoRA adapter or the gathered rows of the output add nodes between the final norm and the logits
+        embeddings = ggml_graph_get_tensor(gf, "result_norm");
+    }
+
+    GGML_ASSERT(!res || strcmp(res->name, "result_output") == 0);
+    GGML_ASSERT(strcmp(embeddings->name, "result_norm") == 0);
+
+    // the logits are written to the caller's buffer if one is set, or to lctx.logits
+    const int64_t n_outputs = embd_only ? 0 : logits_all ? N_main : 1;
+    const size_t  n_logits  = n_vocab*n_outputs;
+
+    const int64_t n_outputs_guidance = !guidance ? 0 : guidance->logits_all ? N_guidance : 1;
+    const size_t  n_logits_guidance  = n_vocab*n_outputs_guidance;
+
+    float * logits_guidance = NULL;
+    if (guidance) {
+        logits_guidance = guidance->logits_ext;
+        if (logits_guidance) {
+            if (guidance->logits_ext_size < n_logits_guidance) {
+                LLAMA_LOG_ERROR("%s: the logits buffer of the guidance context holds %zu floats, but %zu are needed\n", __func__, guidance->logits_ext_size, n_logits_guidance);
+                return false;
+            }
+        } else {
+            guidance->logits.resize(n_logits_guidance);
+            logits_guidance = guidance->logits.data();
+        }
+    }
+
+    float * logits_out = lctx.logits_ext;
+    if (logits_out) {
+        if (lctx.logits_ext_size < n_logits) {
+            LLAMA_LOG_ERROR("%s: the logits buffer holds %zu floats, but %zu are needed\n", __func__, lctx.logits_ext_size, n_logits);
+            return false;
+        }
+    } else {
+        lctx.logits.resize(n_logits);
+        logits_out = lctx.logits.data();
+    }
+
+    // compute the output directly into its destination instead of copying it out of the compute buffer
+    // (a restricted output is masked when copied, see llama_copy_logits)
+    bool logits_in_place = res && !guidance && res->ne[0] == n_vocab && res->ne[1] == n_outputs && res->backend == GGML_BACKEND_CPU &&
+        lctx.output_ids.empty();
+#ifdef GGML_USE_METAL
+    logits_in_place = logits_in_place && !lctx.ctx_metal;
+#endif
+    if (logits_in_place) {
+        res->data = logits_out;
+    }
+
+    bool embd_in_place = embd_only && embeddings->backend == GGML_BACKEND_CPU;
+#ifdef GGML_USE_METAL
+    embd_in_place = embd_in_place && !lctx.ctx_metal;
+#endif
+    if (embd_in_place) {
+        lctx.embedding_hidden.resize(n_embd*N);
+        embeddings->data = lctx.embedding_hidden.data();
+    }
+
+    t_phase_us = ggml_time_us();
 
     ggml_allocr_alloc_graph(lctx.alloc, gf);
 
@@ -2943,6 +4524,8 @@ static bool llama_eval_internal(
     }
 #endif
 
+    lctx.t_alloc_us += ggml_time_us() - t_phase_us;
+
     // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
 
     // for big prompts, if BLAS is enabled, it is better to use only one thread
@@ -2954,12 +4537,6 @@ static bool llama_eval_internal(
         n_threads = std::min(4, n_threads);
     }
 
-    struct ggml_tensor * res        = gf->nodes[gf->n_nodes - 1];
-    struct ggml_tensor * embeddings = gf->nodes[gf->n_nodes - 2];
-
-    GGML_ASSERT(strcmp(res->name,        "result_output") == 0);
-    GGML_ASSERT(strcmp(embeddings->name, "result_norm")   == 0);
-
 #if GGML_USE_MPI
     const int64_t n_layer = hparams.n_layer;
     ggml_mpi_graph_compute_pre(lctx.ctx_mpi, gf, n_layer);
@@ -2967,17 +4544,31 @@ static bool llama_eval_internal(
 
 #ifdef GGML_USE_METAL
     if (lctx.ctx_metal) {
+        t_phase_us = ggml_time_us();
         ggml_metal_set_n_cb     (lctx.ctx_metal, n_threads);
         ggml_metal_graph_compute(lctx.ctx_metal, gf);
-        ggml_metal_get_tensor   (lctx.ctx_metal, res);
-        if (!lctx.embedding.empty()) {
+        if (res) {
+            ggml_metal_get_tensor(lctx.ctx_metal, res);
+        }
+        if (!lctx.embedding.empty() || embd_only) {
             ggml_metal_get_tensor(lctx.ctx_metal, embeddings);
         }
+        lctx.t_compute.t_compute_us += ggml_time_us() - t_phase_us;
+    } else if (lctx.streamer) {
+        llama_graph_compute_streamed(lctx, gf, n_threads);
+    } else if (lctx.layer_timings) {
+        llama_graph_compute_layers(lctx, gf, n_threads);
     } else {
-        ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads);
+        ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads, lctx.cpus, &lctx.t_compute);
     }
 #else
-    ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads);
+    if (lctx.streamer) {
+        llama_graph_compute_streamed(lctx, gf, n_threads);
+    } else if (lctx.layer_timings) {
+        llama_graph_compute_layers(lctx, gf, n_threads);
+    } else {
+        ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads, lctx.cpus, &lctx.t_compute);
+    }
 #endif
 
 #if GGML_USE_MPI
@@ -2985,7 +4576,10 @@ static bool llama_eval_internal(
 #endif
 
     // update kv token count
-    lctx.kv_self.n = n_past + N;
+    lctx.kv_self.n = kv_scratch ? n_past : n_past + N_main;
+    if (guidance) {
+        guidance->kv_self.n = lctx.guidance_n_past + N_guidance;
+    }
 
     if (cgraph_fname) {
         ggml_graph_export(gf, cgraph_fname);
@@ -3002,28 +4596,45 @@ static bool llama_eval_internal(
     //    ggml_graph_dump_dot(gf, NULL, "llama.dot");
     //}
 
+    t_phase_us = ggml_time_us();
+
+    // the output rows are either only the rows of the outputs, or all the rows of the batch
+    const bool rows_selected = !embd_only && embeddings->ne[1] == n_outputs + n_outputs_guidance;
+    const int64_t i_out      = rows_selected ? 0 : embeddings->ne[1] - N_guidance - std::max<int64_t>(n_outputs, 1);
+
     // extract logits
-    {
-        auto & logits_out = lctx.logits;
+    if (res && !logits_in_place) {
+        llama_copy_logits(lctx, logits_out, res, i_out, n_outputs);
+    }
 
-        if (lctx.logits_all) {
-            logits_out.resize(n_vocab * N);
-            memcpy(logits_out.data(), (float *) ggml_get_data(res), sizeof(float)*n_vocab*N);
-        } else {
-            // return result for just the last token
-            logits_out.resize(n_vocab);
-            memcpy(logits_out.data(), (float *) ggml_get_data(res) + (n_vocab*(N-1)), sizeof(float)*n_vocab);
-        }
+    lctx.n_logits = n_logits;
+
+    if (guidance) {
+        const int64_t i_out_guidance = rows_selected ? n_outputs : N - n_outputs_guidance;
+        llama_copy_logits(lctx, logits_guidance, res, i_out_guidance, n_outputs_guidance);
+
+        guidance->n_logits = n_logits_guidance;
     }
 
     // extract embeddings
     if (!lctx.embedding.empty()) {
         auto & embedding_out = lctx.embedding;
 
+        const int64_t i_last = rows_selected ? n_outputs - 1 : embeddings->ne[1] - N_guidance - 1;
+
         embedding_out.resize(n_embd);
-        memcpy(embedding_out.data(), (float *) ggml_get_data(embeddings) + (n_embd*(N - 1)), sizeof(float)*n_embd);
+        memcpy(embedding_out.data(), (float *) ggml_get_data(embeddings) + n_embd*i_last, sizeof(float)*n_embd);
     }
 
+    if (embd_only && !embd_in_place) {
+        GGML_ASSERT(embeddings->ne[1] == N);
+
+        lctx.embedding_hidden.resize(n_embd*N);
+        memcpy(lctx.embedding_hidden.data(), ggml_get_data(embeddings), sizeof(float)*n_embd*N);
+    }
+
+    lctx.t_output_us += ggml_time_us() - t_phase_us;
+
     // measure the performance only for the single-token evals
     if (N == 1) {
         lctx.t_eval_us += ggml_time_us() - t_start_us;
@@ -3860,6 +5471,17 @@ struct llama_grammar * llama_grammar_copy(const struct llama_grammar * grammar)
 // sampling
 //
 
+// accounts the time of a sampling function
+static void llama_add_sample_time(struct llama_context * ctx, const char * func, int64_t t_start_sample_us) {
+    const int64_t t_us = ggml_time_us() - t_start_sample_us;
+
+    ctx->t_sample_us += t_us;
+
+    auto & t = ctx->t_sampler_us[func];
+    t.first  += t_us;
+    t.second += 1;
+}
+
 void llama_sample_softmax(struct llama_context * ctx, llama_token_data_array * candidates) {
     GGML_ASSERT(candidates->size > 0);
 
@@ -3885,7 +5507,7 @@ void llama_sample_softmax(struct llama_context * ctx, llama_token_data_array * c
     }
 
     if (ctx) {
-        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        llama_add_sample_time(ctx, __func__, t_start_sample_us);
     }
 }
 
@@ -3910,7 +5532,7 @@ void llama_sample_top_k(struct llama_context * ctx, llama_token_data_array * can
     candidates->size = k;
 
     if (ctx) {
-        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        llama_add_sample_time(ctx, __func__, t_start_sample_us);
     }
 }
 
@@ -3942,7 +5564,7 @@ void llama_sample_top_p(struct llama_context * ctx, llama_token_data_array * can
     candidates->size = last_idx;
 
     if (ctx) {
-        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        llama_add_sample_time(ctx, __func__, t_start_sample_us);
     }
 }
 
@@ -4001,7 +5623,7 @@ void llama_sample_tail_free(struct llama_context * ctx, llama_token_data_array *
     candidates->size = last_idx;
 
     if (ctx) {
-        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        llama_add_sample_time(ctx, __func__, t_start_sample_us);
     }
 }
 
@@ -4064,7 +5686,7 @@ void llama_sample_typical(struct llama_context * ctx, llama_token_data_array * c
     candidates->size = new_candidates.size();
 
     if (ctx) {
-        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        llama_add_sample_time(ctx, __func__, t_start_sample_us);
     }
 }
 
@@ -4076,7 +5698,7 @@ void llama_sample_temperature(struct llama_context * ctx, llama_token_data_array
     }
 
     if (ctx) {
-        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        llama_add_sample_time(ctx, __func__, t_start_sample_us);
     }
 }
 
@@ -4105,7 +5727,7 @@ void llama_sample_repetition_penalty(struct llama_context * ctx, llama_token_dat
     candidates->sorted = false;
 
     if (ctx) {
-        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        llama_add_sample_time(ctx, __func__, t_start_sample_us);
     }
 }
 
@@ -4136,7 +5758,7 @@ void llama_sample_frequency_and_presence_penalties(struct llama_context * ctx, l
     candidates->sorted = false;
 
     if (ctx) {
-        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        llama_add_sample_time(ctx, __func__, t_start_sample_us);
     }
 }
 
@@ -4158,6 +5780,10 @@ void llama_sample_grammar(struct llama_context * ctx, llama_token_data_array * c
     std::vector<llama_grammar_candidate>                              candidates_grammar;
 
     for (size_t i = 0; i < candidates->size; ++i) {
+        if (candidates->data[i].logit == -INFINITY) {
+            // already excluded, e.g. by llama_set_output_tokens
+            continue;
+        }
         const llama_token id    = candidates->data[i].id;
         const std::string piece = llama_token_to_str(ctx, id);
         if (id == eos) {
@@ -4177,7 +5803,7 @@ void llama_sample_grammar(struct llama_context * ctx, llama_token_data_array * c
         candidates->data[reject.index].logit = -INFINITY;
     }
 
-    ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+    llama_add_sample_time(ctx, __func__, t_start_sample_us);
 }
 
 static void llama_log_softmax(float * array, size_t size) {
@@ -4221,12 +5847,31 @@ void llama_sample_classifier_free_guidance(
     for (int i = 0; i < n_vocab; ++i) {
         float logit_guidance = logits_guidance[i];
         float logit_base = logits_base[i];
-        candidates->data[i].logit = scale * (logit_base - logit_guidance) + logit_guidance;
+        // the tokens excluded from the base logits stay excluded (e.g. by llama_set_output_tokens)
+        candidates->data[i].logit = logit_base == -INFINITY ? -INFINITY : scale * (logit_base - logit_guidance) + logit_guidance;
     }
 
     if (ctx) {
-        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        llama_add_sample_time(ctx, __func__, t_start_sample_us);
+    }
+}
+
+// draws a token without accounting the time, for the samplers built on it
+static llama_token llama_sample_token_impl(struct llama_context * ctx, llama_token_data_array * candidates) {
+    llama_sample_softmax(nullptr, candidates);
+
+    std::vector<float> probs;
+    probs.reserve(candidates->size);
+    for (size_t i = 0; i < candidates->size; ++i) {
+        probs.push_back(candidates->data[i].p);
     }
+
+    std::discrete_distribution<> dist(probs.begin(), probs.end());
+    auto & rng = ctx->rng;
+    int idx = dist(rng);
+
+    ctx->n_sample++;
+    return candidates->data[idx].id;
 }
 
 llama_token llama_sample_token_mirostat(struct llama_context * ctx, llama_token_data_array * candidates, float tau, float eta, int m, float * mu) {
@@ -4256,11 +5901,7 @@ llama_token llama_sample_token_mirostat(struct llama_context * ctx, llama_token_
 
     // Sample the next word X using top-k sampling
     llama_sample_top_k(nullptr, candidates, int(k), 1);
-    if (ctx) {
-        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
-    }
-    llama_token X = llama_sample_token(ctx, candidates);
-    t_start_sample_us = ggml_time_us();
+    llama_token X = llama_sample_token_impl(ctx, candidates);
 
     // Compute error as the difference between observed surprise and target surprise value
     size_t X_idx = std::distance(candidates->data, std::find_if(candidates->data, candidates->data + candidates->size, [&](const llama_token_data & candidate) {
@@ -4273,16 +5914,18 @@ llama_token llama_sample_token_mirostat(struct llama_context * ctx, llama_token_
     *mu = *mu - eta * e;
 
     if (ctx) {
-        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        llama_add_sample_time(ctx, __func__, t_start_sample_us);
     }
     return X;
 }
 
 llama_token llama_sample_token_mirostat_v2(struct llama_context * ctx, llama_token_data_array * candidates, float tau, float eta, float * mu) {
+    GGML_ASSERT(ctx);
+
     int64_t t_start_sample_us;
     t_start_sample_us = ggml_time_us();
 
-    llama_sample_softmax(ctx, candidates);
+    llama_sample_softmax(nullptr, candidates);
 
     // Truncate the words with surprise values greater than mu
     candidates->size = std::distance(candidates->data, std::find_if(candidates->data, candidates->data + candidates->size, [&](const llama_token_data & candidate) {
@@ -4293,16 +5936,11 @@ llama_token llama_sample_token_mirostat_v2(struct llama_context * ctx, llama_tok
         candidates->size = 1;
     }
 
-    if (ctx) {
-        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
-    }
-
     // Normalize the probabilities of the remaining words
-    llama_sample_softmax(ctx, candidates);
+    llama_sample_softmax(nullptr, candidates);
 
     // Sample the next word X from the remaining words
-    llama_token X = llama_sample_token(ctx, candidates);
-    t_start_sample_us = ggml_time_us();
+    llama_token X = llama_sample_token_impl(ctx, candidates);
 
     // Compute error as the difference between observed surprise and target surprise value
     size_t X_idx = std::distance(candidates->data, std::find_if(candidates->data, candidates->data + candidates->size, [&](const llama_token_data & candidate) {
@@ -4315,7 +5953,7 @@ llama_token llama_sample_token_mirostat_v2(struct llama_context * ctx, llama_tok
     *mu = *mu - eta * e;
 
     if (ctx) {
-        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        llama_add_sample_time(ctx, __func__, t_start_sample_us);
     }
     return X;
 }
@@ -4330,7 +5968,7 @@ llama_token llama_sample_token_greedy(struct llama_context * ctx, llama_token_da
 
     llama_token result = max_iter->id;
     if (ctx) {
-        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        llama_add_sample_time(ctx, __func__, t_start_sample_us);
         ctx->n_sample++;
     }
     return result;
@@ -4340,22 +5978,10 @@ llama_token llama_sample_token(struct llama_context * ctx, llama_token_data_arra
     GGML_ASSERT(ctx);
 
     const int64_t t_start_sample_us = ggml_time_us();
-    llama_sample_softmax(nullptr, candidates);
-
-    std::vector<float> probs;
-    probs.reserve(candidates->size);
-    for (size_t i = 0; i < candidates->size; ++i) {
-        probs.push_back(candidates->data[i].p);
-    }
-
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
-    auto & rng = ctx->rng;
-    int idx = dist(rng);
 
-    llama_token result = candidates->data[idx].id;
+    llama_token result = llama_sample_token_impl(ctx, candidates);
 
-    ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
-    ctx->n_sample++;
+    llama_add_sample_time(ctx, __func__, t_start_sample_us);
     return result;
 }
 
@@ -4382,7 +6008,7 @@ void llama_grammar_accept_token(struct llama_context * ctx, struct llama_grammar
     grammar->partial_utf8 = decoded.second;
     GGML_ASSERT(!grammar->stacks.empty());
 
-    ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+    llama_add_sample_time(ctx, __func__, t_start_sample_us);
 }
 
 //
@@ -4393,6 +6019,8 @@ struct llama_beam {
     std::vector<llama_token> tokens;
     float p;  // Cumulative beam probability (renormalized relative to all beams)
     bool eob; // Initialize end-of-beam to false. Callback sets this to true.
+    int node; // With batched evals, node of the last token in the tree of the beams (-1 for none).
+    std::vector<llama_token_data> next; // With batched evals, top tokens after the beam with their probabilities.
     // Sort beams by probability. In case of ties, prefer beams at eob.
     bool operator<(const llama_beam & rhs) const {
         return std::make_pair(p, eob) < std::make_pair(rhs.p, rhs.eob);
@@ -4417,9 +6045,10 @@ struct llama_logit_info {
         float max_l;
         float operator()(float sum, float l) const { return sum + std::exp(l - max_l); }
     };
-    llama_logit_info(llama_context * ctx)
-      : logits(llama_get_logits(ctx))
-      , n_vocab(llama_n_vocab(ctx))
+    llama_logit_info(llama_context * ctx) : llama_logit_info(llama_get_logits(ctx), llama_n_vocab(ctx)) { }
+    llama_logit_info(const float * logits, int n_vocab)
+      : logits(logits)
+      , n_vocab(n_vocab)
       , max_l(*std::max_element(logits, logits + n_vocab))
       , normalizer(1.0f / std::accumulate(logits, logits + n_vocab, 0.0f, sum_exp{max_l}))
       { }
@@ -4450,6 +6079,14 @@ struct llama_logit_info {
     float probability_from_logit(float logit) const {
         return normalizer * std::exp(logit - max_l);
     }
+    // Return top k token_data by logit, with their probabilities.
+    std::vector<llama_token_data> top_k_p(size_t k) {
+        std::vector<llama_token_data> next_tokens = top_k(k);
+        for (llama_token_data & token_data : next_tokens) {
+            token_data.p = probability_from_logit(token_data.logit);
+        }
+        return next_tokens;
+    }
 };
 
 struct llama_beam_search_data {
@@ -4467,6 +6104,13 @@ struct llama_beam_search_data {
     // Used to communicate to/from callback on beams state.
     std::vector<llama_beam_view> beam_views;
 
+    // With batched evals, the tokens of the beams after n_past form a tree in the KV cache,
+    // node i is in the cache slot n_past + i and node_parent[i] is -1 for the children of n_past.
+    // The new token of every beam is evaluated in one batch, attending to its ancestors only.
+    // Otherwise, each beam evaluates its whole suffix on each step.
+    bool batched;
+    std::vector<int> node_parent;
+
     llama_beam_search_data(llama_context * ctx, size_t n_beams, int n_past, int n_predict, int n_threads)
       : ctx(ctx)
       , n_beams(n_beams)
@@ -4476,6 +6120,122 @@ struct llama_beam_search_data {
       , beam_views(n_beams) {
         beams.reserve(n_beams);
         next_beams.reserve(n_beams);
+
+        // the tree is compacted in place and evaluated with a custom mask
+        batched = ctx->kv_self.k->backend == GGML_BACKEND_CPU && ctx->kv_self.v->backend == GGML_BACKEND_CPU;
+#ifdef GGML_USE_METAL
+        batched = batched && !ctx->ctx_metal;
+#endif
+    }
+
+    // Keep the nodes of the tree that are the tokens of the beams, then move the first n_commit of them,
+    // the common prefix of the beams, before n_past.
+    void compact_tree(const size_t n_commit) {
+        const int n_nodes = (int) node_parent.size();
+
+        std::vector<bool> live(n_nodes, false);
+        for (const llama_beam & beam : beams) {
+            for (int node = beam.node; node >= 0 && !live[node]; node = node_parent[node]) {
+                live[node] = true;
+            }
+        }
+
+        std::vector<int> ids;
+        std::vector<int> remap(n_nodes, -1);
+        for (int node = 0; node < n_nodes; ++node) {
+            if (live[node]) {
+                remap[node] = (int) ids.size();
+                ids.push_back(node);
+            }
+        }
+        llama_kv_cache_keep(ctx, n_past, ids.data(), (int) ids.size());
+
+        // the nodes are created one depth at a time, so the common prefix is the first n_commit nodes
+        const int n_shift = (int) n_commit;
+        std::vector<int> parents;
+        for (int i = 0; i < (int) ids.size(); ++i) {
+            const int parent = node_parent[ids[i]] < 0 ? -1 : remap[node_parent[ids[i]]];
+            if (i < n_shift) {
+                GGML_ASSERT(parent == i - 1);
+            } else {
+                parents.push_back(parent < n_shift ? -1 : parent - n_shift);
+            }
+        }
+        node_parent.swap(parents);
+
+        for (llama_beam & beam : beams) {
+            beam.node = beam.node < 0 ? -1 : remap[beam.node] - n_shift;
+        }
+    }
+
+    // Evaluate the new token of each beam in one batch, then find the top tokens after it.
+    // When the tree no longer fits the KV cache or cannot be evaluated, the search goes on with the evals of each beam.
+    void eval_new_tokens() {
+        std::vector<llama_beam *> pending;
+        for (llama_beam & beam : beams) {
+            if (!beam.eob && beam.next.empty()) {
+                pending.push_back(&beam);
+            }
+        }
+        if (pending.empty()) {
+            return;
+        }
+
+        const int n_nodes  = (int) node_parent.size();
+        const int n_tokens = (int) pending.size();
+        const int n_cur    = n_past + n_nodes;
+        const int n_kv     = n_cur + n_tokens;
+
+        // each beam evaluates its whole suffix after n_past from the next step on
+        const auto unbatch = [&]() {
+            batched = false;
+            node_parent.clear();
+            for (llama_beam & beam : beams) {
+                beam.node = -1;
+                beam.next.clear();
+            }
+        };
+
+        if (n_kv > llama_n_ctx(ctx)) {
+            LLAMA_LOG_WARN("%s: the beams need %d tokens of KV cache, more than n_ctx = %d - evaluating them separately\n", __func__, n_kv, llama_n_ctx(ctx));
+            unbatch();
+            return;
+        }
+
+        std::vector<llama_token> tokens(n_tokens);
+        std::vector<int>         pos(n_tokens);
+        std::vector<float>       mask((size_t) n_tokens*n_kv, -INFINITY);
+
+        for (int j = 0; j < n_tokens; ++j) {
+            const llama_beam & beam = *pending[j];
+
+            tokens[j] = beam.tokens.back();
+            pos[j]    = n_past + (int) beam.tokens.size() - 1;
+
+            float * row = mask.data() + (size_t) j*n_kv;
+            std::fill(row, row + n_past, 0.0f);
+            for (int node = beam.node; node >= 0; node = node_parent[node]) {
+                row[n_past + node] = 0.0f;
+            }
+            row[n_cur + j] = 0.0f;
+        }
+
+        if (llama_eval_mask(ctx, tokens.data(), n_tokens, n_cur, pos.data(), mask.data(), n_threads) != 0) {
+            LLAMA_LOG_WARN("%s: failed to eval the beams in one batch - evaluating them separately\n", __func__);
+            unbatch();
+            return;
+        }
+
+        const int n_vocab = llama_n_vocab(ctx);
+        for (int j = 0; j < n_tokens; ++j) {
+            llama_beam & beam = *pending[j];
+
+            node_parent.push_back(beam.node);
+            beam.node = n_nodes + j;
+
+            llama_logit_info logit_info(llama_get_logits(ctx) + (size_t) j*n_vocab, n_vocab);
+            beam.next = logit_info.top_k_p(n_beams);
+        }
     }
 
     // Collapse beams to a single beam given by index.
@@ -4508,17 +6268,23 @@ struct llama_beam_search_data {
             }
         } else {
             // beam is not at end-of-sentence, so branch with next top_k tokens.
-            if (!beam.tokens.empty()) {
-                llama_eval(ctx, beam.tokens.data(), beam.tokens.size(), n_past, n_threads);
+            std::vector<llama_token_data> next_tokens;
+            if (batched) {
+                // evaluated with the other beams at the end of the previous step
+                next_tokens.swap(beam.next);
+            } else {
+                if (!beam.tokens.empty()) {
+                    llama_eval(ctx, beam.tokens.data(), beam.tokens.size(), n_past, n_threads);
+                }
+                llama_logit_info logit_info(ctx);
+                next_tokens = logit_info.top_k_p(n_beams);
             }
-            llama_logit_info logit_info(ctx);
-            std::vector<llama_token_data> next_tokens = logit_info.top_k(n_beams);
             size_t i=0;
             if (next_beams.size() < n_beams) {
                 for (; next_beams.size() < n_beams ; ++i) {
                     llama_beam next_beam = beam;
                     next_beam.tokens.push_back(next_tokens[i].id);
-                    next_beam.p *= logit_info.probability_from_logit(next_tokens[i].logit);
+                    next_beam.p *= next_tokens[i].p;
                     next_beams.push_back(std::move(next_beam));
                 }
                 std::make_heap(next_beams.begin(), next_beams.end(), comp);
@@ -4527,12 +6293,12 @@ struct llama_beam_search_data {
                     std::pop_heap(next_beams.begin(), next_beams.end(), comp);
                     next_beams.back() = beam;
                     next_beams.back().tokens.push_back(next_tokens[i].id);
-                    next_beams.back().p *= logit_info.probability_from_logit(next_tokens[i].logit);
+                    next_beams.back().p *= next_tokens[i].p;
                     std::push_heap(next_beams.begin(), next_beams.end(), comp);
                 }
             }
             for (; i < n_beams ; ++i) {
-                const float next_p = beam.p * logit_info.probability_from_logit(next_tokens[i].logit);
+                const float next_p = beam.p * next_tokens[i].p;
                 if (next_beams.front().p < next_p) {
                     std::pop_heap(next_beams.begin(), next_beams.end(), comp);
                     next_beams.back() = beam;
@@ -4576,13 +6342,21 @@ struct llama_beam_search_data {
     //  * the highest probability beam(s) (plural in case of ties) are not at end-of-sentence
     //    (since all other beam probabilities can only decrease)
     void loop(const llama_beam_search_callback_fn_t callback, void * const callback_data) {
-        beams.push_back({{}, 1.0f, false});  // Start with one empty beam w/ probability = 1.0 and !eob.
+        beams.push_back({{}, 1.0f, false, -1, {}});  // Start with one empty beam w/ probability = 1.0 and !eob.
+        if (batched) {
+            llama_logit_info logit_info(ctx);
+            beams[0].next = logit_info.top_k_p(n_beams);
+        }
         const auto not_eob = [](const llama_beam & beam) { return !beam.eob; };
         for (int i = 0 ; i < n_predict && std::any_of(beams.begin(),beams.end(),not_eob) &&
                        !beams[top_beam_index()].eob ; ++i) {
             callback(callback_data, get_beams_state(false));  // Sets common_prefix_length
             update_beams_from_beam_views();   // Update values (p,eob) that callback may have changed.
-            if (common_prefix_length) {
+            if (batched) {
+                // the common prefix is already in the KV cache
+                compact_tree(common_prefix_length);
+                n_past += common_prefix_length;
+            } else if (common_prefix_length) {
                 llama_eval(ctx, beams[0].tokens.data(), common_prefix_length, n_past, n_threads);
                 n_past += common_prefix_length;
             }
@@ -4595,8 +6369,16 @@ struct llama_beam_search_data {
             // next_beams become the beams of next/final iteration. Swap them to re-use memory.
             beams.swap(next_beams);
             renormalize_beam_probabilities(beams);
+            // the new tokens of the last step are not evaluated, as with the evals of each beam
+            if (batched && i + 1 < n_predict) {
+                eval_new_tokens();
+            }
         }
         collapse_beams(top_beam_index());
+        if (batched) {
+            // leave the evaluated tokens of the top beam in the KV cache after n_past
+            compact_tree(0);
+        }
         callback(callback_data, get_beams_state(true));
     }
 
@@ -4632,1526 +6414,3409 @@ void llama_beam_search(llama_context * ctx,
 
     beam_search_data.loop(callback, callback_data);
 
-    ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+    llama_add_sample_time(ctx, __func__, t_start_sample_us);
     ctx->n_sample++;
 }
 
 //
-// quantization
+// speculative decoding
 //
 
-static void llama_convert_tensor_internal(struct ggml_tensor * tensor, std::vector<float> & output, const size_t nelements, const int nthread) {
-    if (output.size() < nelements) {
-        output.resize(nelements);
-    }
-    float * f32_output = (float *) output.data();
+struct llama_spec_node {
+    llama_token id;
+    int   parent; // index of the parent node, -1 for the root
+    int   depth;  // 0 for the root
+    float p;      // cumulative draft probability
+    int   i_dft;  // slot of the node in the draft KV cache after the accepted tokens, -1 if not evaluated by the draft
 
-    ggml_type_traits_t qtype;
-    if (ggml_is_quantized(tensor->type)) {
-        qtype = ggml_internal_get_type_traits(tensor->type);
-        if (qtype.to_float == NULL) {
-            throw std::runtime_error(format("type %s unsupported for integer quantization: no dequantization available", ggml_type_name(tensor->type)));
-        }
-    } else if (tensor->type != GGML_TYPE_F16) {
-        throw std::runtime_error(format("cannot dequantize/convert tensor type %s", ggml_type_name(tensor->type)));
-    }
+    std::vector<llama_token> cands;    // the drafted children in verification order - with temp > 0, draft samples that may repeat
+    std::vector<int>         children;
+    std::vector<float>       q;        // the draft distribution of the next token, if the node was evaluated
+};
 
-    if (nthread < 2) {
-        if (tensor->type == GGML_TYPE_F16) {
-            ggml_fp16_to_fp32_row((ggml_fp16_t *)tensor->data, f32_output, nelements);
-        } else if (ggml_is_quantized(tensor->type)) {
-            qtype.to_float(tensor->data, f32_output, nelements);
-        } else {
-            GGML_ASSERT(false); // unreachable
-        }
-        return;
-    }
+struct llama_speculative {
+    llama_context * ctx_tgt;
+    llama_context * ctx_dft;
 
-    auto block_size = tensor->type == GGML_TYPE_F16 ? 1 : (size_t)ggml_blck_size(tensor->type);
-    auto block_size_bytes = ggml_type_size(tensor->type);
+    llama_speculative_params params;
 
-    GGML_ASSERT(nelements % block_size == 0);
-    auto nblocks = nelements / block_size;
-    auto blocks_per_thread = nblocks / nthread;
-    auto spare_blocks = nblocks - (blocks_per_thread * nthread); // if blocks aren't divisible by thread count
+    int n_past_tgt = 0;
+    int n_past_dft = 0;
 
-    std::vector<std::thread> workers;
-    for (auto tnum = 0, in_buff_offs = 0, out_buff_offs = 0; tnum < nthread; tnum++) {
-        auto thr_blocks = blocks_per_thread + (tnum == nthread - 1 ? spare_blocks : 0); // num blocks for this thread
-        auto thr_elems = thr_blocks * block_size; // number of elements for this thread
-        auto thr_block_bytes = thr_blocks * block_size_bytes; // number of input bytes for this thread
+    // accepted tokens the draft has not evaluated yet - the last one is the root of the next tree,
+    // which the target has not evaluated yet either
+    std::vector<llama_token> pending;
 
-        auto compute = [qtype] (ggml_type typ, uint8_t * inbuf, float * outbuf, int nels) {
-            if (typ == GGML_TYPE_F16) {
-                ggml_fp16_to_fp32_row((ggml_fp16_t *)inbuf, outbuf, nels);
-            } else {
-                qtype.to_float(inbuf, outbuf, nels);
-            }
-        };
-        workers.push_back(std::thread(compute, tensor->type, (uint8_t *) tensor->data + in_buff_offs, f32_output + out_buff_offs, thr_elems));
-        in_buff_offs += thr_block_bytes;
-        out_buff_offs += thr_elems;
+    int n_draft   = 0; // number of tokens to draft in the next step
+    int n_drafted = 0;
+    int n_accept  = 0;
+};
+
+// with temp <= 0, the draft tokens are still ranked by their probability at temperature 1
+static void llama_spec_softmax(const float * logits, int n_vocab, float temp, std::vector<float> & probs) {
+    const float scale = temp > 0.0f ? 1.0f/temp : 1.0f;
+    const float max_l = *std::max_element(logits, logits + n_vocab);
+
+    probs.resize(n_vocab);
+
+    double sum = 0.0;
+    for (int i = 0; i < n_vocab; ++i) {
+        probs[i] = expf((logits[i] - max_l)*scale);
+        sum += probs[i];
     }
-    for (auto & worker : workers) {
-        worker.join();
+    for (int i = 0; i < n_vocab; ++i) {
+        probs[i] /= sum;
     }
 }
 
-static void llama_model_quantize_internal(const std::string & fname_inp, const std::string & fname_out, const llama_model_quantize_params * params) {
-    ggml_type quantized_type;
-    llama_ftype ftype = params->ftype;
+// evaluates a level of the tree with the draft model - each node sees the accepted tokens and its ancestors
+static bool llama_spec_eval_dft(llama_speculative & spec, std::vector<llama_spec_node> & tree, const std::vector<int> & level, int n_evaluated, int n_threads) {
+    const int n_tokens = level.size();
+    const int n_past   = spec.n_past_dft + n_evaluated;
+    const int n_kv     = n_past + n_tokens;
 
-    switch (params->ftype) {
-        case LLAMA_FTYPE_MOSTLY_Q4_0: quantized_type = GGML_TYPE_Q4_0; break;
-        case LLAMA_FTYPE_MOSTLY_Q4_1: quantized_type = GGML_TYPE_Q4_1; break;
-        case LLAMA_FTYPE_MOSTLY_Q5_0: quantized_type = GGML_TYPE_Q5_0; break;
-        case LLAMA_FTYPE_MOSTLY_Q5_1: quantized_type = GGML_TYPE_Q5_1; break;
-        case LLAMA_FTYPE_MOSTLY_Q8_0: quantized_type = GGML_TYPE_Q8_0; break;
-        case LLAMA_FTYPE_MOSTLY_F16:  quantized_type = GGML_TYPE_F16;  break;
-        case LLAMA_FTYPE_ALL_F32:     quantized_type = GGML_TYPE_F32;  break;
+    std::vector<llama_token> tokens(n_tokens);
+    std::vector<int>         pos   (n_tokens);
+    std::vector<float>       mask  ((size_t) n_tokens*n_kv, -INFINITY);
 
-#ifdef GGML_USE_K_QUANTS
-        // K-quants
-        case LLAMA_FTYPE_MOSTLY_Q2_K:   quantized_type = GGML_TYPE_Q2_K; break;
-        case LLAMA_FTYPE_MOSTLY_Q3_K_S:
-        case LLAMA_FTYPE_MOSTLY_Q3_K_M:
-        case LLAMA_FTYPE_MOSTLY_Q3_K_L: quantized_type = GGML_TYPE_Q3_K; break;
-        case LLAMA_FTYPE_MOSTLY_Q4_K_S:
-        case LLAMA_FTYPE_MOSTLY_Q4_K_M: quantized_type = GGML_TYPE_Q4_K; break;
-        case LLAMA_FTYPE_MOSTLY_Q5_K_S:
-        case LLAMA_FTYPE_MOSTLY_Q5_K_M: quantized_type = GGML_TYPE_Q5_K; break;
-        case LLAMA_FTYPE_MOSTLY_Q6_K:   quantized_type = GGML_TYPE_Q6_K; break;
-#endif
-        default: throw std::runtime_error(format("invalid output file type %d\n", ftype));
-    }
+    for (int i = 0; i < n_tokens; ++i) {
+        llama_spec_node & node = tree[level[i]];
 
-    int nthread = params->nthread;
+        node.i_dft = n_evaluated + i;
 
-    if (nthread <= 0) {
-        nthread = std::thread::hardware_concurrency();
+        tokens[i] = node.id;
+        pos[i]    = spec.n_past_dft + node.depth - 1;
+
+        float * row = mask.data() + (size_t) i*n_kv;
+
+        std::fill(row, row + spec.n_past_dft, 0.0f);
+
+        // the root is already among the accepted tokens
+        for (int j = level[i]; tree[j].parent >= 0; j = tree[j].parent) {
+            row[spec.n_past_dft + tree[j].i_dft] = 0.0f;
+        }
     }
 
-    std::unique_ptr<llama_model_loader> ml(new llama_model_loader(fname_inp, /*use_mmap*/ false));
+    if (llama_eval_mask(spec.ctx_dft, tokens.data(), n_tokens, n_past, pos.data(), mask.data(), n_threads) != 0) {
+        return false;
+    }
 
-    llama_model model;
-    llm_load_arch(*ml, model);
-    llm_load_hparams(*ml, model, 0, 0, 0);
+    const int n_vocab = llama_n_vocab(spec.ctx_dft);
 
-    if (params->only_copy) {
-        ftype = model.ftype;
+    const float * logits = llama_get_logits(spec.ctx_dft);
+    for (int i = 0; i < n_tokens; ++i) {
+        llama_spec_softmax(logits + (size_t) i*n_vocab, n_vocab, spec.params.temp, tree[level[i]].q);
     }
 
-    const size_t align = GGUF_DEFAULT_ALIGNMENT;
-    struct gguf_context * ctx_out = gguf_init_empty();
+    return true;
+}
 
-    // copy the KV pairs from the input file
-    gguf_set_kv     (ctx_out, ml->ctx_gguf);
-    gguf_set_val_u32(ctx_out, "general.quantization_version", GGML_QNT_VERSION);
-    gguf_set_val_u32(ctx_out, "general.file_type", ftype);
+struct llama_speculative_params llama_speculative_default_params() {
+    struct llama_speculative_params result = {
+        /*.n_draft  =*/ 16,
+        /*.n_branch =*/ 2,
+        /*.p_min    =*/ 0.05f,
+        /*.temp     =*/ 0.80f,
+        /*.adaptive =*/ true,
+    };
 
-#ifdef GGML_USE_K_QUANTS
-    int n_attention_wv    = 0;
-    int n_feed_forward_w2 = 0;
+    return result;
+}
 
-    for (int i = 0; i < ml->n_tensors; ++i) {
-        struct ggml_tensor * meta = ml->get_tensor_meta(i);
+struct llama_speculative * llama_speculative_init(
+        struct llama_context * ctx_tgt,
+        struct llama_context * ctx_dft,
+        struct llama_speculative_params params) {
+    if (ctx_tgt == ctx_dft) {
+        LLAMA_LOG_ERROR("%s: the target and the draft need separate contexts\n", __func__);
+        return nullptr;
+    }
 
-        const std::string name = ggml_get_name(meta);
+    if (llama_n_vocab(ctx_tgt) != llama_n_vocab(ctx_dft)) {
+        LLAMA_LOG_ERROR("%s: the target and the draft have different vocabularies (%d vs %d)\n", __func__,
+                llama_n_vocab(ctx_tgt), llama_n_vocab(ctx_dft));
+        return nullptr;
+    }
 
-        // TODO: avoid hardcoded tensor names - use the TN_* constants
-        if (name.find("attn_v.weight") != std::string::npos) {
-            ++n_attention_wv;
-        }
-        else if (name.find("ffn_down.weight") != std::string::npos) {
-            ++n_feed_forward_w2;
+    // the rejected branches are dropped with llama_kv_cache_keep
+    for (const llama_context * ctx : { ctx_tgt, ctx_dft }) {
+        if (ctx->kv_self.k->backend != GGML_BACKEND_CPU || ctx->kv_self.v->backend != GGML_BACKEND_CPU) {
+            LLAMA_LOG_ERROR("%s: the KV caches must be in host memory\n", __func__);
+            return nullptr;
         }
     }
-    if (n_attention_wv != n_feed_forward_w2 || (uint32_t)n_attention_wv != model.hparams.n_layer) {
-        LLAMA_LOG_WARN("%s ============ Strange model: n_attention_wv = %d, n_feed_forward_w2 = %d, hparams.n_layer = %d\n",
-                __func__, n_attention_wv, n_feed_forward_w2, model.hparams.n_layer);
-    }
 
-    int i_attention_wv = 0;
-    int i_feed_forward_w2 = 0;
-#endif
+    llama_speculative * spec = new llama_speculative;
 
-    size_t total_size_org = 0;
-    size_t total_size_new = 0;
-    std::vector<int64_t> hist_all(1 << 4, 0);
+    spec->ctx_tgt = ctx_tgt;
+    spec->ctx_dft = ctx_dft;
+    spec->params  = params;
+    spec->n_draft = std::max(0, params.n_draft);
 
-    std::vector<std::thread> workers;
-    std::mutex mutex;
+    return spec;
+}
 
-#ifdef GGML_USE_K_QUANTS
-    auto use_more_bits = [] (int i_layer, int num_layers) -> bool {
-        return i_layer < num_layers/8 || i_layer >= 7*num_layers/8 || (i_layer - num_layers/8)%3 == 2;
-    };
-#endif
+void llama_speculative_free(struct llama_speculative * spec) {
+    delete spec;
+}
 
-    int idx = 0;
+int llama_speculative_prompt(struct llama_speculative * spec, const llama_token * tokens, int n_tokens, int n_threads) {
+    if (n_tokens < 1) {
+        LLAMA_LOG_ERROR("%s: the prompt is empty\n", __func__);
+        return 1;
+    }
 
-    std::vector<uint8_t> read_data;
-    std::vector<uint8_t> work;
+    // the last token is the root of the first tree
+    for (llama_context * ctx : { spec->ctx_tgt, spec->ctx_dft }) {
+        for (int i = 0; i < n_tokens - 1; i += ctx->n_batch) {
+            const int n_eval = std::min(n_tokens - 1 - i, ctx->n_batch);
+            if (llama_eval(ctx, tokens + i, n_eval, i, n_threads) != 0) {
+                return 1;
+            }
+        }
+    }
 
-    // populate the original tensors so we get an initial meta data
-    for (int i = 0; i < ml->n_tensors; ++i) {
-        struct ggml_tensor * meta = ml->get_tensor_meta(i);
-        gguf_add_tensor(ctx_out, meta);
+    spec->n_past_tgt = n_tokens - 1;
+    spec->n_past_dft = n_tokens - 1;
+    spec->pending.assign(1, tokens[n_tokens - 1]);
+
+    return 0;
+}
+
+int llama_speculative_step(struct llama_speculative * spec, llama_token * out, int n_out_max, int n_threads) {
+    llama_context * ctx_tgt = spec->ctx_tgt;
+    llama_context * ctx_dft = spec->ctx_dft;
+
+    const auto & params = spec->params;
+
+    const int n_vocab = llama_n_vocab(ctx_tgt);
+
+    if (spec->pending.empty() || n_out_max < 1) {
+        LLAMA_LOG_ERROR("%s: no prompt was evaluated or the output is empty\n", __func__);
+        return -1;
     }
 
-    std::ofstream fout(fname_out, std::ios::binary);
+    // the tree must fit in both contexts, and its evals in the compute buffers measured for n_batch tokens
+    const int n_pending = (int) spec->pending.size();
+    const int n_draft = std::min({
+        spec->n_draft,
+        llama_n_ctx(ctx_tgt) - spec->n_past_tgt - 1,
+        llama_n_ctx(ctx_dft) - spec->n_past_dft - n_pending,
+        ctx_tgt->n_batch - n_pending - 1,
+        ctx_dft->n_batch - n_pending - 1 });
 
-    const size_t meta_size = gguf_get_meta_size(ctx_out);
+    if (n_draft < 0) {
+        LLAMA_LOG_ERROR("%s: the context is full or the accepted tokens exceed n_batch\n", __func__);
+        return -1;
+    }
 
-    LLAMA_LOG_INFO("%s: meta size = %zu bytes\n", __func__, meta_size);
+    // evaluate the accepted tokens with the draft - the last one is the root of the tree
+    if (llama_eval(ctx_dft, spec->pending.data(), spec->pending.size(), spec->n_past_dft, n_threads) != 0) {
+        return -1;
+    }
 
-    // placeholder for the meta data
-    ::zeros(fout, meta_size);
+    std::vector<llama_spec_node> tree;
+    tree.push_back({ spec->pending.back(), -1, 0, 1.0f, -1, {}, {}, {} });
 
-    for (int i = 0; i < ml->n_tensors; ++i) {
-        struct ggml_tensor * tensor = ml->get_tensor_meta(i);
+    {
+        const int n_rows = ctx_dft->logits_all ? spec->pending.size() : 1;
+        llama_spec_softmax(llama_get_logits(ctx_dft) + (size_t) (n_rows - 1)*n_vocab, n_vocab, params.temp, tree[0].q);
+    }
 
-        const std::string name = ggml_get_name(tensor);
+    spec->n_past_dft += spec->pending.size();
+    spec->pending.clear();
 
-        read_data.resize(ggml_nbytes(tensor));
-        tensor->data = read_data.data();
-        ml->load_data_for(tensor);
+    // draft the tree level by level, expanding the most likely nodes first
+    std::vector<int> level = { 0 };
+    std::vector<int> top(n_vocab);
 
-        LLAMA_LOG_INFO("[%4d/%4d] %36s - [%s], type = %6s, ",
-               ++idx, ml->n_tensors,
-               ggml_get_name(tensor),
-               llama_format_tensor_shape(tensor).c_str(),
-               ggml_type_name(tensor->type));
+    int n_evaluated = 0;
 
-        // This used to be a regex, but <regex> has an extreme cost to compile times.
-        bool quantize = name.rfind("weight") == name.size() - 6; // ends with 'weight'?
+    while (!level.empty()) {
+        std::sort(level.begin(), level.end(), [&](int a, int b) { return tree[a].p > tree[b].p; });
 
-        // quantize only 2D tensors
-        quantize &= (tensor->n_dims == 2);
-        quantize &= params->quantize_output_tensor || name != "output.weight";
-        quantize &= !params->only_copy;
+        std::vector<int> next;
 
-        enum ggml_type new_type;
-        void * new_data;
-        size_t new_size;
+        for (int i_node : level) {
+            // fixing the number of candidates before drafting them keeps the speculative sampling exact
+            const int n_cand = std::min<int>(params.n_branch, n_draft - (tree.size() - 1));
+            if (n_cand <= 0) {
+                break;
+            }
 
-        if (quantize) {
-            new_type = quantized_type;
-#ifdef GGML_USE_K_QUANTS
-            // TODO: avoid hardcoded tensor names - use the TN_* constants
-            const auto tn = LLM_TN(ml->get_arch());
+            const std::vector<float> & q = tree[i_node].q;
 
-            if (name == tn(LLM_TENSOR_OUTPUT, "weight")) {
-                int nx = tensor->ne[0];
-                if (model.arch == LLM_ARCH_FALCON || nx % QK_K != 0) {
-                    new_type = GGML_TYPE_Q8_0;
-                }
-                else if (new_type != GGML_TYPE_Q8_0) {
-                    new_type = GGML_TYPE_Q6_K;
-                }
-            } else if (name.find("attn_v.weight") != std::string::npos) {
-                if      (ftype == LLAMA_FTYPE_MOSTLY_Q2_K) new_type = GGML_TYPE_Q3_K;
-                else if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_M) {
-                    new_type = i_attention_wv < 2 ? GGML_TYPE_Q5_K : GGML_TYPE_Q4_K;
-                }
-                else if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_L) new_type = GGML_TYPE_Q5_K;
-                else if ((ftype == LLAMA_FTYPE_MOSTLY_Q4_K_M || ftype == LLAMA_FTYPE_MOSTLY_Q5_K_M) &&
-                        use_more_bits(i_attention_wv, n_attention_wv)) new_type = GGML_TYPE_Q6_K;
-                else if (ftype == LLAMA_FTYPE_MOSTLY_Q4_K_S && i_attention_wv < 4) new_type = GGML_TYPE_Q5_K;
-                else if (QK_K == 64 && (ftype == LLAMA_FTYPE_MOSTLY_Q4_K_S || ftype == LLAMA_FTYPE_MOSTLY_Q3_K_S) &&
-                        (i_attention_wv < n_attention_wv/8 || i_attention_wv >= 7*n_attention_wv/8)) new_type = GGML_TYPE_Q6_K;
-                if (model.type == MODEL_70B) {
-                    // In the 70B model we have 8 heads sharing the same attn_v weights. As a result, the attn_v.weight tensor is
-                    // 8x smaller compared to attn_q.weight. Hence, we can get a nice boost in quantization accuracy with
-                    // nearly negligible increase in model size by quantizing this tensor with more bits:
-                    if (new_type == GGML_TYPE_Q3_K || new_type == GGML_TYPE_Q4_K) new_type = GGML_TYPE_Q5_K;
-                }
-                ++i_attention_wv;
-            } else if (name.find("ffn_down.weight") != std::string::npos) {
-                if      (ftype == LLAMA_FTYPE_MOSTLY_Q2_K) new_type = GGML_TYPE_Q3_K;
-                else if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_M) {
-                    new_type = i_feed_forward_w2 < 2 ? GGML_TYPE_Q5_K
-                             : model.arch != LLM_ARCH_FALCON || use_more_bits(i_feed_forward_w2, n_feed_forward_w2) ? GGML_TYPE_Q4_K
-                             : GGML_TYPE_Q3_K;
-                }
-                else if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_L) {
-                    new_type = model.arch == LLM_ARCH_FALCON ? GGML_TYPE_Q4_K : GGML_TYPE_Q5_K;
-                }
-                else if (ftype == LLAMA_FTYPE_MOSTLY_Q4_K_M) {
-                    if (model.arch == LLM_ARCH_FALCON) {
-                        new_type = i_feed_forward_w2 < 2 ? GGML_TYPE_Q6_K :
-                                   use_more_bits(i_feed_forward_w2, n_feed_forward_w2) ? GGML_TYPE_Q5_K : GGML_TYPE_Q4_K;
-                    } else {
-                        if (use_more_bits(i_feed_forward_w2, n_feed_forward_w2)) new_type = GGML_TYPE_Q6_K;
-                    }
-                }
-                else if (ftype == LLAMA_FTYPE_MOSTLY_Q5_K_M && use_more_bits(i_feed_forward_w2, n_feed_forward_w2)) new_type = GGML_TYPE_Q6_K;
-                else if (ftype == LLAMA_FTYPE_MOSTLY_Q4_K_S && model.arch != LLM_ARCH_FALCON && i_feed_forward_w2 < 4) {
-                    new_type = GGML_TYPE_Q5_K;
+            std::vector<llama_token> cands;
+            if (params.temp <= 0.0f) {
+                std::iota(top.begin(), top.end(), 0);
+                std::partial_sort(top.begin(), top.begin() + n_cand, top.end(), [&](int a, int b) { return q[a] > q[b]; });
+                for (int i = 0; i < n_cand && tree[i_node].p*q[top[i]] >= params.p_min; ++i) {
+                    cands.push_back(top[i]);
                 }
-                ++i_feed_forward_w2;
-            } else if (name.find("attn_output.weight") != std::string::npos) {
-                if (model.arch != LLM_ARCH_FALCON) {
-                    if      (ftype == LLAMA_FTYPE_MOSTLY_Q2_K  ) new_type = GGML_TYPE_Q3_K;
-                    else if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_M) new_type = GGML_TYPE_Q4_K;
-                    else if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_L) new_type = GGML_TYPE_Q5_K;
-                } else {
-                    if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_L) new_type = GGML_TYPE_Q4_K;
+            } else {
+                std::discrete_distribution<> dist(q.begin(), q.end());
+                for (int i = 0; i < n_cand; ++i) {
+                    cands.push_back(dist(ctx_tgt->rng));
                 }
             }
-            else if (name.find("attn_qkv.weight") != std::string::npos) {
-                if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_M || ftype == LLAMA_FTYPE_MOSTLY_Q3_K_L) new_type = GGML_TYPE_Q4_K;
-                else if (ftype == LLAMA_FTYPE_MOSTLY_Q4_K_M) new_type = GGML_TYPE_Q5_K;
-                else if (ftype == LLAMA_FTYPE_MOSTLY_Q5_K_M) new_type = GGML_TYPE_Q6_K;
-            }
-            else if (name.find("ffn_gate.weight") != std::string::npos || name.find("ffn_up.weight") != std::string::npos) {
-                if (ftype == LLAMA_FTYPE_MOSTLY_Q2_K) new_type = GGML_TYPE_Q3_K;
-            }
-            // This can be used to reduce the size of the Q5_K_S model.
-            // The associated PPL increase is fully in line with the size reduction
-            //else {
-            //    if (ftype == LLAMA_FTYPE_MOSTLY_Q5_K_S) new_type = GGML_TYPE_Q4_K;
-            //}
-            bool convert_incompatible_tensor = false;
-            if (new_type == GGML_TYPE_Q2_K || new_type == GGML_TYPE_Q3_K || new_type == GGML_TYPE_Q4_K ||
-                new_type == GGML_TYPE_Q5_K || new_type == GGML_TYPE_Q6_K) {
-                int nx = tensor->ne[0];
-                int ny = tensor->ne[1];
-                if (nx % QK_K != 0) {
-                    LLAMA_LOG_WARN("\n\n%s : tensor cols %d x %d are not divisible by %d, required for k-quants\n", __func__, nx, ny, QK_K);
-                    convert_incompatible_tensor = true;
+
+            for (llama_token id : cands) {
+                bool dup = false;
+                for (int c : tree[i_node].children) {
+                    dup = dup || tree[c].id == id;
                 }
-            }
-            if (convert_incompatible_tensor) {
-                if (name == tn(LLM_TENSOR_OUTPUT, "weight")) {
-                    new_type = GGML_TYPE_F16; //fall back to F16 instead of just failing.
-                    LLAMA_LOG_WARN("F16 will be used for this tensor instead.\n");
-                } else if (name == tn(LLM_TENSOR_TOKEN_EMBD, "weight")) {
-                    new_type = GGML_TYPE_Q4_0; //fall back to Q4_0 instead of just failing.
-                    LLAMA_LOG_WARN("Q4_0 will be used for this tensor instead.\n");
-                } else {
-                    throw std::runtime_error("Unsupported tensor size encountered\n");
+                if (dup) {
+                    continue;
+                }
+
+                const float p = tree[i_node].p*q[id];
+
+                tree[i_node].children.push_back(tree.size());
+                tree.push_back({ id, i_node, tree[i_node].depth + 1, p, -1, {}, {}, {} });
+
+                if (p >= params.p_min) {
+                    next.push_back(tree.size() - 1);
                 }
             }
-#endif
-            // If we've decided to quantize to the same type the tensor is already
-            // in then there's nothing to do.
-            quantize = tensor->type != new_type;
+
+            tree[i_node].cands = std::move(cands);
         }
-        if (!quantize) {
-            new_type = tensor->type;
-            new_data = tensor->data;
-            new_size = ggml_nbytes(tensor);
-            LLAMA_LOG_INFO("size = %8.3f MB\n", ggml_nbytes(tensor)/1024.0/1024.0);
-        } else {
-            const size_t nelements = ggml_nelements(tensor);
 
-            float * f32_data;
-            std::vector<float> f32_conv_buf;
+        // there is no need to evaluate nodes that will not be expanded
+        if ((int) tree.size() - 1 >= n_draft || next.empty()) {
+            break;
+        }
 
-            if (tensor->type == GGML_TYPE_F32) {
-                f32_data = (float *) tensor->data;
-            } else if (ggml_is_quantized(tensor->type) && !params->allow_requantize) {
-                throw std::runtime_error(format("requantizing from type %s is disabled", ggml_type_name(tensor->type)));
-            } else {
-                llama_convert_tensor_internal(tensor, f32_conv_buf, nelements, nthread);
-                f32_data = (float *) f32_conv_buf.data();
-            }
+        if (!llama_spec_eval_dft(*spec, tree, next, n_evaluated, n_threads)) {
+            return -1;
+        }
 
-            LLAMA_LOG_INFO("quantizing to %s .. ", ggml_type_name(new_type));
-            fflush(stdout);
+        n_evaluated += next.size();
 
-            work.resize(nelements * 4); // upper bound on size
-            new_data = work.data();
-            std::vector<int64_t> hist_cur(1 << 4, 0);
+        level = std::move(next);
+    }
 
-            static const int chunk_size = 32 * 512;
-            const int nchunk = (nelements + chunk_size - 1)/chunk_size;
-            const int nthread_use = nthread > 1 ? std::max(1, std::min(nthread, nchunk)) : 1;
-            if (nthread_use < 2) {
-                new_size = ggml_quantize_chunk(new_type, f32_data, new_data, 0, nelements, hist_cur.data());
-            } else {
-                size_t counter = 0;
-                new_size = 0;
-                auto compute = [&mutex, &counter, &hist_cur, &new_size, new_type, f32_data, new_data, nelements]() {
-                    std::vector<int64_t> local_hist;
-                    size_t local_size = 0;
-                    while (true) {
-                        std::unique_lock<std::mutex> lock(mutex);
-                        size_t first = counter; counter += chunk_size;
-                        if (first >= nelements) {
-                            if (!local_hist.empty()) {
-                                for (int j=0; j<int(local_hist.size()); ++j) {
-                                    hist_cur[j] += local_hist[j];
-                                }
-                                new_size += local_size;
-                            }
-                            break;
-                        }
-                        lock.unlock();
-                        size_t last = std::min(nelements, first + chunk_size);
-                        if (local_hist.empty()) {
-                            local_hist.resize(hist_cur.size(), 0);
+    // verify the whole tree with one target evaluation
+    {
+        std::vector<llama_token> tokens (tree.size());
+        std::vector<int>         parents(tree.size());
+        for (size_t i = 0; i < tree.size(); ++i) {
+            tokens[i]  = tree[i].id;
+            parents[i] = tree[i].parent;
+        }
+
+        if (llama_eval_tree(ctx_tgt, tokens.data(), parents.data(), tree.size(), spec->n_past_tgt, n_threads) != 0) {
+            return -1;
+        }
+    }
+
+    const int64_t t_start_sample_us = ggml_time_us();
+
+    const float * logits = llama_get_logits(ctx_tgt);
+
+    std::vector<int>   path; // accepted nodes
+    std::vector<float> p;
+
+    int cur = 0;
+    llama_token id = -1;
+
+    while (true) {
+        const llama_spec_node & node = tree[cur];
+        const float * row = logits + (size_t) cur*n_vocab;
+
+        int next = -1;
+
+        if (params.temp <= 0.0f) {
+            id = std::max_element(row, row + n_vocab) - row;
+            for (int c : node.children) {
+                if (tree[c].id == id) {
+                    next = c;
+                }
+            }
+        } else {
+            llama_spec_softmax(row, n_vocab, params.temp, p);
+
+            // accept each candidate with probability min(1, p/q), otherwise continue with the residual max(0, p - q)
+            for (llama_token cand : node.cands) {
+                const float r = std::uniform_real_distribution<float>(0.0f, 1.0f)(ctx_tgt->rng);
+                if (r*node.q[cand] < p[cand]) {
+                    for (int c : node.children) {
+                        if (tree[c].id == cand) {
+                            next = c;
                         }
-                        local_size += ggml_quantize_chunk(new_type, f32_data, new_data, first, last - first, local_hist.data());
                     }
-                };
-                if ((int) workers.size() < nthread_use - 1) {
-                    workers.resize(nthread_use - 1);
+                    id = cand;
+                    break;
                 }
-                for (int it = 0; it < nthread_use - 1; ++it) {
-                    workers[it] = std::thread(compute);
+
+                double sum = 0.0;
+                for (int i = 0; i < n_vocab; ++i) {
+                    p[i] = std::max(0.0f, p[i] - node.q[i]);
+                    sum += p[i];
                 }
-                compute();
-                for (int it = 0; it < nthread_use - 1; ++it) {
-                    workers[it].join();
+                for (int i = 0; i < n_vocab; ++i) {
+                    p[i] = sum > 0.0 ? p[i]/sum : node.q[i];
                 }
             }
 
-            LLAMA_LOG_INFO("size = %8.2f MB -> %8.2f MB | hist: ", ggml_nbytes(tensor)/1024.0/1024.0, new_size/1024.0/1024.0);
-            int64_t tot_count = 0;
-            for (size_t i = 0; i < hist_cur.size(); i++) {
-                hist_all[i] += hist_cur[i];
-                tot_count += hist_cur[i];
+            if (next < 0) {
+                std::discrete_distribution<> dist(p.begin(), p.end());
+                id = dist(ctx_tgt->rng);
             }
+        }
 
-            if (tot_count > 0) {
-                for (size_t i = 0; i < hist_cur.size(); i++) {
-                    LLAMA_LOG_INFO("%5.3f ", hist_cur[i] / float(nelements));
-                }
-            }
-            LLAMA_LOG_INFO("\n");
+        // an accepted candidate that does not fit in the output becomes the sampled token
+        if (next < 0 || (int) path.size() + 2 > n_out_max) {
+            break;
         }
+
+        path.push_back(next);
+        cur = next;
+    }
+
+    llama_add_sample_time(ctx_tgt, __func__, t_start_sample_us);
+    ctx_tgt->n_sample    += path.size() + 1;
+
+    // keep the accepted path in both KV caches - the draft did not evaluate the leaves
+    {
+        std::vector<int> keep_tgt = { 0 };
+        std::vector<int> keep_dft;
+
+        for (int i_node : path) {
+            keep_tgt.push_back(i_node);
+            if (tree[i_node].i_dft >= 0) {
+                keep_dft.push_back(tree[i_node].i_dft);
+            } else {
+                spec->pending.push_back(tree[i_node].id);
+            }
+        }
+
+        llama_kv_cache_keep(ctx_tgt, spec->n_past_tgt, keep_tgt.data(), keep_tgt.size());
+        llama_kv_cache_keep(ctx_dft, spec->n_past_dft, keep_dft.data(), keep_dft.size());
+
+        spec->n_past_tgt += keep_tgt.size();
+        spec->n_past_dft += keep_dft.size();
+    }
+
+    spec->pending.push_back(id);
+
+    spec->n_drafted += tree.size() - 1;
+    spec->n_accept  += path.size();
+
+    // draft more after accepting a whole branch, less after a rejection
+    if (params.adaptive) {
+        if (tree[cur].children.empty()) {
+            spec->n_draft = std::min(spec->n_draft + 2, params.n_draft);
+        } else {
+            spec->n_draft = std::max(spec->n_draft - 1, std::min(params.n_draft, 1));
+        }
+    }
+
+    for (size_t i = 0; i < path.size(); ++i) {
+        out[i] = tree[path[i]].id;
+    }
+    out[path.size()] = id;
+
+    return path.size() + 1;
+}
+
+void llama_speculative_get_stats(const struct llama_speculative * spec, int * n_drafted, int * n_accept) {
+    *n_drafted = spec->n_drafted;
+    *n_accept  = spec->n_accept;
+}
+
+//
+// quantization
+//
+
+static void llama_convert_tensor_internal(struct ggml_tensor * tensor, std::vector<float> & output, const size_t nelements, const int nthread) {
+    if (output.size() < nelements) {
+        output.resize(nelements);
+    }
+    float * f32_output = (float *) output.data();
+
+    ggml_type_traits_t qtype;
+    if (ggml_is_quantized(tensor->type)) {
+        qtype = ggml_internal_get_type_traits(tensor->type);
+        if (qtype.to_float == NULL) {
+            throw std::runtime_error(format("type %s unsupported for integer quantization: no dequantization available", ggml_type_name(tensor->type)));
+        }
+    } else if (tensor->type != GGML_TYPE_F16) {
+        throw std::runtime_error(format("cannot dequantize/convert tensor type %s", ggml_type_name(tensor->type)));
+    }
+
+    if (nthread < 2) {
+        if (tensor->type == GGML_TYPE_F16) {
+            ggml_fp16_to_fp32_row((ggml_fp16_t *)tensor->data, f32_output, nelements);
+        } else if (ggml_is_quantized(tensor->type)) {
+            qtype.to_float(tensor->data, f32_output, nelements);
+        } else {
+            GGML_ASSERT(false); // unreachable
+        }
+        return;
+    }
+
+    auto block_size = tensor->type == GGML_TYPE_F16 ? 1 : (size_t)ggml_blck_size(tensor->type);
+    auto block_size_bytes = ggml_type_size(tensor->type);
+
+    GGML_ASSERT(nelements % block_size == 0);
+    auto nblocks = nelements / block_size;
+    auto blocks_per_thread = nblocks / nthread;
+    auto spare_blocks = nblocks - (blocks_per_thread * nthread); // if blocks aren't divisible by thread count
+
+    std::vector<std::thread> workers;
+    for (auto tnum = 0, in_buff_offs = 0, out_buff_offs = 0; tnum < nthread; tnum++) {
+        auto thr_blocks = blocks_per_thread + (tnum == nthread - 1 ? spare_blocks : 0); // num blocks for this thread
+        auto thr_elems = thr_blocks * block_size; // number of elements for this thread
+        auto thr_block_bytes = thr_blocks * block_size_bytes; // number of input bytes for this thread
+
+        auto compute = [qtype] (ggml_type typ, uint8_t * inbuf, float * outbuf, int nels) {
+            if (typ == GGML_TYPE_F16) {
+                ggml_fp16_to_fp32_row((ggml_fp16_t *)inbuf, outbuf, nels);
+            } else {
+                qtype.to_float(inbuf, outbuf, nels);
+            }
+        };
+        workers.push_back(std::thread(compute, tensor->type, (uint8_t *) tensor->data + in_buff_offs, f32_output + out_buff_offs, thr_elems));
+        in_buff_offs += thr_block_bytes;
+        out_buff_offs += thr_elems;
+    }
+    for (auto & worker : workers) {
+        worker.join();
+    }
+}
+
+static void llama_model_quantize_internal(const std::string & fname_inp, const std::string & fname_out, const llama_model_quantize_params * params) {
+    ggml_type quantized_type;
+    llama_ftype ftype = params->ftype;
+
+    switch (params->ftype) {
+        case LLAMA_FTYPE_MOSTLY_Q4_0: quantized_type = GGML_TYPE_Q4_0; break;
+        case LLAMA_FTYPE_MOSTLY_Q4_1: quantized_type = GGML_TYPE_Q4_1; break;
+        case LLAMA_FTYPE_MOSTLY_Q5_0: quantized_type = GGML_TYPE_Q5_0; break;
+        case LLAMA_FTYPE_MOSTLY_Q5_1: quantized_type = GGML_TYPE_Q5_1; break;
+        case LLAMA_FTYPE_MOSTLY_Q8_0: quantized_type = GGML_TYPE_Q8_0; break;
+        case LLAMA_FTYPE_MOSTLY_F16:  quantized_type = GGML_TYPE_F16;  break;
+        case LLAMA_FTYPE_ALL_F32:     quantized_type = GGML_TYPE_F32;  break;
+
+#ifdef GGML_USE_K_QUANTS
+        // K-quants
+        case LLAMA_FTYPE_MOSTLY_Q2_K:   quantized_type = GGML_TYPE_Q2_K; break;
+        case LLAMA_FTYPE_MOSTLY_Q3_K_S:
+        case LLAMA_FTYPE_MOSTLY_Q3_K_M:
+        case LLAMA_FTYPE_MOSTLY_Q3_K_L: quantized_type = GGML_TYPE_Q3_K; break;
+        case LLAMA_FTYPE_MOSTLY_Q4_K_S:
+        case LLAMA_FTYPE_MOSTLY_Q4_K_M: quantized_type = GGML_TYPE_Q4_K; break;
+        case LLAMA_FTYPE_MOSTLY_Q5_K_S:
+        case LLAMA_FTYPE_MOSTLY_Q5_K_M: quantized_type = GGML_TYPE_Q5_K; break;
+        case LLAMA_FTYPE_MOSTLY_Q6_K:   quantized_type = GGML_TYPE_Q6_K; break;
+#endif
+        default: throw std::runtime_error(format("invalid output file type %d\n", ftype));
+    }
+
+    int nthread = params->nthread;
+
+    if (nthread <= 0) {
+        nthread = std::thread::hardware_concurrency();
+    }
+
+    if (params->repack && !ggml_cpu_has_avx2()) {
+        LLAMA_LOG_WARN("%s: the repacked q4_0 matrices are only multiplied faster with AVX2, the model will be slower on CPUs without it\n", __func__);
+    }
+
+    std::unique_ptr<llama_model_loader> ml(new llama_model_loader(fname_inp, /*use_mmap*/ false));
+
+    llama_model model;
+    llm_load_arch(*ml, model);
+    llm_load_hparams(*ml, model, 0, 0, 0);
+
+    if (params->only_copy) {
+        ftype = model.ftype;
+    }
+
+    const size_t align = GGUF_DEFAULT_ALIGNMENT;
+    struct gguf_context * ctx_out = gguf_init_empty();
+
+    // copy the KV pairs from the input file
+    gguf_set_kv     (ctx_out, ml->ctx_gguf);
+    gguf_set_val_u32(ctx_out, "general.quantization_version", GGML_QNT_VERSION);
+    gguf_set_val_u32(ctx_out, "general.file_type", ftype);
+
+#ifdef GGML_USE_K_QUANTS
+    int n_attention_wv    = 0;
+    int n_feed_forward_w2 = 0;
+
+    for (int i = 0; i < ml->n_tensors; ++i) {
+        struct ggml_tensor * meta = ml->get_tensor_meta(i);
+
+        const std::string name = ggml_get_name(meta);
+
+        // TODO: avoid hardcoded tensor names - use the TN_* constants
+        if (name.find("attn_v.weight") != std::string::npos) {
+            ++n_attention_wv;
+        }
+        else if (name.find("ffn_down.weight") != std::string::npos) {
+            ++n_feed_forward_w2;
+        }
+    }
+    if (n_attention_wv != n_feed_forward_w2 || (uint32_t)n_attention_wv != model.hparams.n_layer) {
+        LLAMA_LOG_WARN("%s ============ Strange model: n_attention_wv = %d, n_feed_forward_w2 = %d, hparams.n_layer = %d\n",
+                __func__, n_attention_wv, n_feed_forward_w2, model.hparams.n_layer);
+    }
+
+    int i_attention_wv = 0;
+    int i_feed_forward_w2 = 0;
+#endif
+
+    size_t total_size_org = 0;
+    size_t total_size_new = 0;
+    std::vector<int64_t> hist_all(1 << 4, 0);
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+
+#ifdef GGML_USE_K_QUANTS
+    auto use_more_bits = [] (int i_layer, int num_layers) -> bool {
+        return i_layer < num_layers/8 || i_layer >= 7*num_layers/8 || (i_layer - num_layers/8)%3 == 2;
+    };
+#endif
+
+    int idx = 0;
+
+    std::vector<uint8_t> read_data;
+    std::vector<uint8_t> work;
+
+    // populate the original tensors so we get an initial meta data
+    for (int i = 0; i < ml->n_tensors; ++i) {
+        struct ggml_tensor * meta = ml->get_tensor_meta(i);
+        gguf_add_tensor(ctx_out, meta);
+    }
+
+    std::ofstream fout(fname_out, std::ios::binary);
+
+    const size_t meta_size = gguf_get_meta_size(ctx_out);
+
+    LLAMA_LOG_INFO("%s: meta size = %zu bytes\n", __func__, meta_size);
+
+    // placeholder for the meta data
+    ::zeros(fout, meta_size);
+
+    for (int i = 0; i < ml->n_tensors; ++i) {
+        struct ggml_tensor * tensor = ml->get_tensor_meta(i);
+
+        const std::string name = ggml_get_name(tensor);
+
+        read_data.resize(ggml_nbytes(tensor));
+        tensor->data = read_data.data();
+        ml->load_data_for(tensor);
+
+        LLAMA_LOG_INFO("[%4d/%4d] %36s - [%s], type = %6s, ",
+               ++idx, ml->n_tensors,
+               ggml_get_name(tensor),
+               llama_format_tensor_shape(tensor).c_str(),
+               ggml_type_name(tensor->type));
+
+        // This used to be a regex, but <regex> has an extreme cost to compile times.
+        bool quantize = name.rfind("weight") == name.size() - 6; // ends with 'weight'?
+
+        // quantize only 2D tensors
+        quantize &= (tensor->n_dims == 2);
+        quantize &= params->quantize_output_tensor || name != "output.weight";
+        quantize &= !params->only_copy;
+
+        enum ggml_type new_type;
+        void * new_data;
+        size_t new_size;
+
+        if (quantize) {
+            new_type = quantized_type;
+#ifdef GGML_USE_K_QUANTS
+            // TODO: avoid hardcoded tensor names - use the TN_* constants
+            const auto tn = LLM_TN(ml->get_arch());
+
+            if (name == tn(LLM_TENSOR_OUTPUT, "weight")) {
+                int nx = tensor->ne[0];
+                if (model.arch == LLM_ARCH_FALCON || nx % QK_K != 0) {
+                    new_type = GGML_TYPE_Q8_0;
+                }
+                else if (new_type != GGML_TYPE_Q8_0) {
+                    new_type = GGML_TYPE_Q6_K;
+                }
+            } else if (name.find("attn_v.weight") != std::string::npos) {
+                if      (ftype == LLAMA_FTYPE_MOSTLY_Q2_K) new_type = GGML_TYPE_Q3_K;
+                else if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_M) {
+                    new_type = i_attention_wv < 2 ? GGML_TYPE_Q5_K : GGML_TYPE_Q4_K;
+                }
+                else if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_L) new_type = GGML_TYPE_Q5_K;
+                else if ((ftype == LLAMA_FTYPE_MOSTLY_Q4_K_M || ftype == LLAMA_FTYPE_MOSTLY_Q5_K_M) &&
+                        use_more_bits(i_attention_wv, n_attention_wv)) new_type = GGML_TYPE_Q6_K;
+                else if (ftype == LLAMA_FTYPE_MOSTLY_Q4_K_S && i_attention_wv < 4) new_type = GGML_TYPE_Q5_K;
+                else if (QK_K == 64 && (ftype == LLAMA_FTYPE_MOSTLY_Q4_K_S || ftype == LLAMA_FTYPE_MOSTLY_Q3_K_S) &&
+                        (i_attention_wv < n_attention_wv/8 || i_attention_wv >= 7*n_attention_wv/8)) new_type = GGML_TYPE_Q6_K;
+                if (model.type == MODEL_70B) {
+                    // In the 70B model we have 8 heads sharing the same attn_v weights. As a result, the attn_v.weight tensor is
+                    // 8x smaller compared to attn_q.weight. Hence, we can get a nice boost in quantization accuracy with
+                    // nearly negligible increase in model size by quantizing this tensor with more bits:
+                    if (new_type == GGML_TYPE_Q3_K || new_type == GGML_TYPE_Q4_K) new_type = GGML_TYPE_Q5_K;
+                }
+                ++i_attention_wv;
+            } else if (name.find("ffn_down.weight") != std::string::npos) {
+                if      (ftype == LLAMA_FTYPE_MOSTLY_Q2_K) new_type = GGML_TYPE_Q3_K;
+                else if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_M) {
+                    new_type = i_feed_forward_w2 < 2 ? GGML_TYPE_Q5_K
+                             : model.arch != LLM_ARCH_FALCON || use_more_bits(i_feed_forward_w2, n_feed_forward_w2) ? GGML_TYPE_Q4_K
+                             : GGML_TYPE_Q3_K;
+                }
+                else if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_L) {
+                    new_type = model.arch == LLM_ARCH_FALCON ? GGML_TYPE_Q4_K : GGML_TYPE_Q5_K;
+                }
+                else if (ftype == LLAMA_FTYPE_MOSTLY_Q4_K_M) {
+                    if (model.arch == LLM_ARCH_FALCON) {
+                        new_type = i_feed_forward_w2 < 2 ? GGML_TYPE_Q6_K :
+                                   use_more_bits(i_feed_forward_w2, n_feed_forward_w2) ? GGML_TYPE_Q5_K : GGML_TYPE_Q4_K;
+                    } else {
+                        if (use_more_bits(i_feed_forward_w2, n_feed_forward_w2)) new_type = GGML_TYPE_Q6_K;
+                    }
+                }
+                else if (ftype == LLAMA_FTYPE_MOSTLY_Q5_K_M && use_more_bits(i_feed_forward_w2, n_feed_forward_w2)) new_type = GGML_TYPE_Q6_K;
+                else if (ftype == LLAMA_FTYPE_MOSTLY_Q4_K_S && model.arch != LLM_ARCH_FALCON && i_feed_forward_w2 < 4) {
+                    new_type = GGML_TYPE_Q5_K;
+                }
+                ++i_feed_forward_w2;
+            } else if (name.find("attn_output.weight") != std::string::npos) {
+                if (model.arch != LLM_ARCH_FALCON) {
+                    if      (ftype == LLAMA_FTYPE_MOSTLY_Q2_K  ) new_type = GGML_TYPE_Q3_K;
+                    else if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_M) new_type = GGML_TYPE_Q4_K;
+                    else if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_L) new_type = GGML_TYPE_Q5_K;
+                } else {
+                    if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_L) new_type = GGML_TYPE_Q4_K;
+                }
+            }
+            else if (name.find("attn_qkv.weight") != std::string::npos) {
+                if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_M || ftype == LLAMA_FTYPE_MOSTLY_Q3_K_L) new_type = GGML_TYPE_Q4_K;
+                else if (ftype == LLAMA_FTYPE_MOSTLY_Q4_K_M) new_type = GGML_TYPE_Q5_K;
+                else if (ftype == LLAMA_FTYPE_MOSTLY_Q5_K_M) new_type = GGML_TYPE_Q6_K;
+            }
+            else if (name.find("ffn_gate.weight") != std::string::npos || name.find("ffn_up.weight") != std::string::npos) {
+                if (ftype == LLAMA_FTYPE_MOSTLY_Q2_K) new_type = GGML_TYPE_Q3_K;
+            }
+            // This can be used to reduce the size of the Q5_K_S model.
+            // The associated PPL increase is fully in line with the size reduction
+            //else {
+            //    if (ftype == LLAMA_FTYPE_MOSTLY_Q5_K_S) new_type = GGML_TYPE_Q4_K;
+            //}
+            bool convert_incompatible_tensor = false;
+            if (new_type == GGML_TYPE_Q2_K || new_type == GGML_TYPE_Q3_K || new_type == GGML_TYPE_Q4_K ||
+                new_type == GGML_TYPE_Q5_K || new_type == GGML_TYPE_Q6_K) {
+                int nx = tensor->ne[0];
+                int ny = tensor->ne[1];
+                if (nx % QK_K != 0) {
+                    LLAMA_LOG_WARN("\n\n%s : tensor cols %d x %d are not divisible by %d, required for k-quants\n", __func__, nx, ny, QK_K);
+                    convert_incompatible_tensor = true;
+                }
+            }
+            if (convert_incompatible_tensor) {
+                if (name == tn(LLM_TENSOR_OUTPUT, "weight")) {
+                    new_type = GGML_TYPE_F16; //fall back to F16 instead of just failing.
+                    LLAMA_LOG_WARN("F16 will be used for this tensor instead.\n");
+                } else if (name == tn(LLM_TENSOR_TOKEN_EMBD, "weight")) {
+                    new_type = GGML_TYPE_Q4_0; //fall back to Q4_0 instead of just failing.
+                    LLAMA_LOG_WARN("Q4_0 will be used for this tensor instead.\n");
+                } else {
+                    throw std::runtime_error("Unsupported tensor size encountered\n");
+                }
+            }
+#endif
+            // If we've decided to quantize to the same type the tensor is already
+            // in then there's nothing to do.
+            quantize = tensor->type != new_type;
+        }
+        if (!quantize) {
+            new_type = tensor->type;
+            new_data = tensor->data;
+            new_size = ggml_nbytes(tensor);
+            LLAMA_LOG_INFO("size = %8.3f MB\n", ggml_nbytes(tensor)/1024.0/1024.0);
+        } else {
+            const size_t nelements = ggml_nelements(tensor);
+
+            float * f32_data;
+            std::vector<float> f32_conv_buf;
+
+            if (tensor->type == GGML_TYPE_F32) {
+                f32_data = (float *) tensor->data;
+            } else if (tensor->type == GGML_TYPE_Q4_0_4X) {
+                throw std::runtime_error(format("requantizing from type %s is not supported", ggml_type_name(tensor->type)));
+            } else if (ggml_is_quantized(tensor->type) && !params->allow_requantize) {
+                throw std::runtime_error(format("requantizing from type %s is disabled", ggml_type_name(tensor->type)));
+            } else {
+                llama_convert_tensor_internal(tensor, f32_conv_buf, nelements, nthread);
+                f32_data = (float *) f32_conv_buf.data();
+            }
+
+            LLAMA_LOG_INFO("quantizing to %s .. ", ggml_type_name(new_type));
+            fflush(stdout);
+
+            work.resize(nelements * 4); // upper bound on size
+            new_data = work.data();
+            std::vector<int64_t> hist_cur(1 << 4, 0);
+
+            static const int chunk_size = 32 * 512;
+            const int nchunk = (nelements + chunk_size - 1)/chunk_size;
+            const int nthread_use = nthread > 1 ? std::max(1, std::min(nthread, nchunk)) : 1;
+            if (nthread_use < 2) {
+                new_size = ggml_quantize_chunk(new_type, f32_data, new_data, 0, nelements, hist_cur.data());
+            } else {
+                size_t counter = 0;
+                new_size = 0;
+                auto compute = [&mutex, &counter, &hist_cur, &new_size, new_type, f32_data, new_data, nelements]() {
+                    std::vector<int64_t> local_hist;
+                    size_t local_size = 0;
+                    while (true) {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        size_t first = counter; counter += chunk_size;
+                        if (first >= nelements) {
+                            if (!local_hist.empty()) {
+                                for (int j=0; j<int(local_hist.size()); ++j) {
+                                    hist_cur[j] += local_hist[j];
+                                }
+                                new_size += local_size;
+                            }
+                            break;
+                        }
+                        lock.unlock();
+                        size_t last = std::min(nelements, first + chunk_size);
+                        if (local_hist.empty()) {
+                            local_hist.resize(hist_cur.size(), 0);
+                        }
+                        local_size += ggml_quantize_chunk(new_type, f32_data, new_data, first, last - first, local_hist.data());
+                    }
+                };
+                if ((int) workers.size() < nthread_use - 1) {
+                    workers.resize(nthread_use - 1);
+                }
+                for (int it = 0; it < nthread_use - 1; ++it) {
+                    workers[it] = std::thread(compute);
+                }
+                compute();
+                for (int it = 0; it < nthread_use - 1; ++it) {
+                    workers[it].join();
+                }
+            }
+
+            LLAMA_LOG_INFO("size = %8.2f MB -> %8.2f MB | hist: ", ggml_nbytes(tensor)/1024.0/1024.0, new_size/1024.0/1024.0);
+            int64_t tot_count = 0;
+            for (size_t i = 0; i < hist_cur.size(); i++) {
+                hist_all[i] += hist_cur[i];
+                tot_count += hist_cur[i];
+            }
+
+            if (tot_count > 0) {
+                for (size_t i = 0; i < hist_cur.size(); i++) {
+                    LLAMA_LOG_INFO("%5.3f ", hist_cur[i] / float(nelements));
+                }
+            }
+            LLAMA_LOG_INFO("\n");
+        }
+
+        // the token embeddings are read by rows and cannot be repacked
+        if (params->repack && new_type == GGML_TYPE_Q4_0 && tensor->n_dims == 2 && tensor->ne[1] % 4 == 0 &&
+            name != LLM_TN(ml->get_arch())(LLM_TENSOR_TOKEN_EMBD, "weight")) {
+            if (new_data != work.data()) {
+                work.resize(new_size);
+                memcpy(work.data(), new_data, new_size);
+                new_data = work.data();
+            }
+            llama_repack_q4_0_4x(new_data, tensor->ne[1], new_size/tensor->ne[1]);
+            new_type = GGML_TYPE_Q4_0_4X;
+        }
+
         total_size_org += ggml_nbytes(tensor);
         total_size_new += new_size;
 
-        // update the gguf meta data as we go
-        gguf_set_tensor_type(ctx_out, name.c_str(), new_type);
-        gguf_set_tensor_data(ctx_out, name.c_str(), new_data, new_size);
+        // update the gguf meta data as we go
+        gguf_set_tensor_type(ctx_out, name.c_str(), new_type);
+        gguf_set_tensor_data(ctx_out, name.c_str(), new_data, new_size);
+
+        // write tensor data + padding
+        fout.write((const char *) new_data, new_size);
+        zeros(fout, GGML_PAD(new_size, align) - new_size);
+    }
+
+    // go back to beginning of file and write the updated meta data
+    {
+        fout.seekp(0);
+        std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
+        gguf_get_meta_data(ctx_out, data.data());
+        fout.write((const char *) data.data(), data.size());
+    }
+
+    fout.close();
+
+    gguf_free(ctx_out);
+
+    LLAMA_LOG_INFO("%s: model size  = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
+    LLAMA_LOG_INFO("%s: quant size  = %8.2f MB\n", __func__, total_size_new/1024.0/1024.0);
+
+    // print histogram for all tensors
+    {
+        int64_t sum_all = 0;
+        for (size_t i = 0; i < hist_all.size(); i++) {
+            sum_all += hist_all[i];
+        }
+
+        if (sum_all > 0) {
+            LLAMA_LOG_INFO("%s: hist: ", __func__);
+            for (size_t i = 0; i < hist_all.size(); i++) {
+                LLAMA_LOG_INFO("%5.3f ", hist_all[i] / float(sum_all));
+            }
+            LLAMA_LOG_INFO("\n");
+        }
+    }
+}
+
+// the factors of a LoRA adapter, read as f32
+struct llama_lora_tensor {
+    int64_t ne[2];
+    std::vector<float> data;
+};
+
+struct llama_lora_pair {
+    struct ggml_tensor * w;
+    const llama_lora_tensor * a; // [r, n_in]
+    const llama_lora_tensor * b; // [r, n_out]
+};
+
+// reads all the tensors of a LoRA adapter file (ggla, version 1)
+static void llama_lora_read(const char * path_lora, int32_t & lora_r, int32_t & lora_alpha, std::map<std::string, llama_lora_tensor> & tensors) {
+    auto fin = std::ifstream(path_lora, std::ios::binary);
+    if (!fin) {
+        throw std::runtime_error(format("failed to open '%s'", path_lora));
+    }
+
+    // verify magic and version
+    {
+        uint32_t magic;
+        fin.read((char *) &magic, sizeof(magic));
+        uint32_t format_version;
+        fin.read((char *) &format_version, sizeof(format_version));
+
+        if (format_version != 1) {
+            throw std::runtime_error("unsupported file version");
+        }
+    }
+
+    fin.read((char *) &lora_r, sizeof(lora_r));
+    fin.read((char *) &lora_alpha, sizeof(lora_alpha));
+    if (!fin || lora_r <= 0) {
+        throw std::runtime_error("invalid lora header");
+    }
+
+    std::vector<uint8_t> read_buf;
+
+    while (true) {
+        int32_t n_dims;
+        int32_t length;
+        int32_t ftype;
+
+        fin.read(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
+        fin.read(reinterpret_cast<char *>(&length), sizeof(length));
+        fin.read(reinterpret_cast<char *>(&ftype),  sizeof(ftype));
+        if (fin.eof()) {
+            break;
+        }
+
+        if (n_dims != 2) {
+            throw std::runtime_error(format("unsupported tensor dimension %d", n_dims));
+        }
+        if (ftype != 0 && ftype != 1) {
+            throw std::runtime_error(format("invalid tensor data type '%d'", ftype));
+        }
+
+        int32_t ne[2] = { 1, 1 };
+        for (int i = 0; i < n_dims; ++i) {
+            fin.read(reinterpret_cast<char *>(&ne[i]), sizeof(ne[i]));
+        }
+
+        std::string name(length, '\0');
+        fin.read(&name[0], length);
+
+        if (name.rfind(".lora") == std::string::npos) {
+            throw std::runtime_error(format("'%s' is not a lora tensor", name.c_str()));
+        }
+
+        llama_lora_tensor & t = tensors[name];
+        t.ne[0] = ne[0];
+        t.ne[1] = ne[1];
+        t.data.resize((size_t) ne[0]*ne[1]);
+
+        size_t offset = fin.tellg();
+        offset = (offset + 31) & -32;
+        fin.seekg(offset);
+
+        if (ftype == 0) {
+            fin.read((char *) t.data.data(), t.data.size()*sizeof(float));
+        } else {
+            read_buf.resize(t.data.size()*sizeof(ggml_fp16_t));
+            fin.read((char *) read_buf.data(), read_buf.size());
+            ggml_fp16_to_fp32_row((const ggml_fp16_t *) read_buf.data(), t.data.data(), (int) t.data.size());
+        }
+        if (!fin) {
+            throw std::runtime_error(format("failed to read tensor '%s'", name.c_str()));
+        }
+    }
+}
+
+// pairs the A and B factors with the model tensor they adapt
+static std::vector<llama_lora_pair> llama_lora_match(const struct llama_model & model, const std::map<std::string, llama_lora_tensor> & tensors) {
+    std::unordered_map<std::string, struct ggml_tensor *> model_tensors;
+    for (const auto & kv : model.tensors_by_name) {
+        model_tensors.insert(kv);
+    }
+
+    std::vector<llama_lora_pair> pairs;
+    for (const auto & it : tensors) {
+        const std::string & name = it.first;
+        if (name.size() < 6 || name.compare(name.size() - 6, 6, ".loraA") != 0) {
+            continue;
+        }
+        const std::string base_name = name.substr(0, name.size() - 6);
+
+        const auto it_b = tensors.find(base_name + ".loraB");
+        if (it_b == tensors.end()) {
+            throw std::runtime_error(format("missing tensor '%s.loraB'", base_name.c_str()));
+        }
+
+        const auto it_w = model_tensors.find(base_name);
+        if (it_w == model_tensors.end()) {
+            throw std::runtime_error(format("unknown tensor '%s' in lora adapter", base_name.c_str()));
+        }
+
+        const struct ggml_tensor * w = it_w->second;
+        const llama_lora_tensor & a = it.second;
+        const llama_lora_tensor & b = it_b->second;
+
+        if (a.ne[0] != b.ne[0] || w->ne[0] != a.ne[1] || w->ne[1] != b.ne[1]) {
+            throw std::runtime_error(format("incompatible tensor dimensions for '%s';"
+                        " are you sure that this adapter is for this model?", base_name.c_str()));
+        }
+
+        pairs.push_back({ it_w->second, &a, &b });
+    }
+
+    return pairs;
+}
+
+// merges w = w + s*BA into the weights in host memory, in place
+// the rows of all the tensors are split between the threads; quantized rows are dequantized, updated and quantized again
+static void llama_lora_merge_host(const std::vector<llama_lora_pair> & pairs, float scaling, int n_threads) {
+    // A transposed to [n_in, r], to update a row with contiguous accesses
+    std::vector<std::vector<float>> a_t(pairs.size());
+    for (size_t p = 0; p < pairs.size(); ++p) {
+        const llama_lora_tensor & a = *pairs[p].a;
+        const int64_t r    = a.ne[0];
+        const int64_t n_in = a.ne[1];
+
+        a_t[p].resize(a.data.size());
+        for (int64_t k = 0; k < r; ++k) {
+            for (int64_t i = 0; i < n_in; ++i) {
+                a_t[p][k*n_in + i] = a.data[i*r + k];
+            }
+        }
+    }
+
+    // work items of up to chunk_size rows of one tensor
+    static const int64_t chunk_size = 16;
+    std::vector<std::pair<size_t, int64_t>> chunks;
+    for (size_t p = 0; p < pairs.size(); ++p) {
+        for (int64_t j = 0; j < pairs[p].w->ne[1]; j += chunk_size) {
+            chunks.push_back({ p, j });
+        }
+    }
+
+    std::atomic<size_t> next(0);
+
+    auto compute = [&]() {
+        std::vector<float> row;
+        while (true) {
+            const size_t c = next++;
+            if (c >= chunks.size()) {
+                break;
+            }
+
+            const llama_lora_pair & pair = pairs[chunks[c].first];
+            const float * at = a_t[chunks[c].first].data();
+
+            struct ggml_tensor * w = pair.w;
+            const ggml_type_traits_t traits = ggml_internal_get_type_traits(w->type);
+
+            const int64_t r    = pair.a->ne[0];
+            const int64_t n_in = w->ne[0];
+            const int64_t j1   = std::min(w->ne[1], chunks[c].second + chunk_size);
+
+            row.resize(n_in);
+
+            for (int64_t j = chunks[c].second; j < j1; ++j) {
+                char * dst = (char *) w->data + j*w->nb[1];
+
+                float * x = w->type == GGML_TYPE_F32 ? (float *) dst : row.data();
+                if (w->type != GGML_TYPE_F32) {
+                    traits.to_float(dst, x, (int) n_in);
+                }
+
+                const float * b = pair.b->data.data() + j*r;
+                for (int64_t k = 0; k < r; ++k) {
+                    const float bk = scaling*b[k];
+                    const float * ak = at + k*n_in;
+                    for (int64_t i = 0; i < n_in; ++i) {
+                        x[i] += bk*ak[i];
+                    }
+                }
+
+                if (w->type != GGML_TYPE_F32) {
+                    traits.from_float(x, dst, (int) n_in);
+                }
+            }
+        }
+    };
+
+    n_threads = std::max(1, std::min(n_threads, (int) chunks.size()));
+
+    std::vector<std::thread> workers(n_threads - 1);
+    for (auto & worker : workers) {
+        worker = std::thread(compute);
+    }
+    compute();
+    for (auto & worker : workers) {
+        worker.join();
+    }
+}
+
+// merges the adapter with llama_lora_merge_host if all the adapted weights are in host memory
+// returns false if the weights must be merged on their backend
+static bool llama_apply_lora_host(const struct llama_model & model, const char * path_lora, int n_threads) {
+    const int64_t t_start_lora_us = ggml_time_us();
+
+    int32_t lora_r;
+    int32_t lora_alpha;
+    std::map<std::string, llama_lora_tensor> tensors;
+    llama_lora_read(path_lora, lora_r, lora_alpha, tensors);
+
+    const std::vector<llama_lora_pair> pairs = llama_lora_match(model, tensors);
+
+    for (const auto & pair : pairs) {
+        if (pair.w->backend != GGML_BACKEND_CPU) {
+            return false;
+        }
+        if (pair.w->type == GGML_TYPE_Q4_0_4X) {
+            throw std::runtime_error("LoRA adapters cannot be merged into repacked weights, use --lora-runtime");
+        }
+        const ggml_type_traits_t traits = ggml_internal_get_type_traits(pair.w->type);
+        if (pair.w->type != GGML_TYPE_F32 && (!traits.to_float || !traits.from_float)) {
+            return false;
+        }
+    }
+
+    const float scaling = (float)lora_alpha / (float)lora_r;
+
+    LLAMA_LOG_INFO("%s: r = %d, alpha = %d, scaling = %.2f\n", __func__, lora_r, lora_alpha, scaling);
+
+    const int64_t t_read_us = ggml_time_us() - t_start_lora_us;
+
+    bool quantized = false;
+    for (const auto & pair : pairs) {
+        quantized = quantized || ggml_is_quantized(pair.w->type);
+    }
+    if (quantized) {
+        LLAMA_LOG_WARN("%s: warning: merging into quantized weights, the updated rows are quantized again\n", __func__);
+    }
+
+    llama_lora_merge_host(pairs, scaling, n_threads);
+
+    const int64_t t_lora_us = ggml_time_us() - t_start_lora_us;
+    LLAMA_LOG_INFO("%s: merged %zu tensors with %d threads in %.2f ms (read %.2f ms, merge %.2f ms)\n", __func__,
+            pairs.size(), n_threads, t_lora_us / 1000.0, t_read_us / 1000.0, (t_lora_us - t_read_us) / 1000.0);
+
+    return true;
+}
+
+// loads the factors of a LoRA adapter without merging them
+static llama_lora_adapter * llama_lora_adapter_init_internal(const struct llama_model & model, const char * path_lora) {
+    LLAMA_LOG_INFO("%s: loading lora adapter from '%s' - please wait ...\n", __func__, path_lora);
+
+    const int64_t t_start_lora_us = ggml_time_us();
+
+    int32_t lora_r;
+    int32_t lora_alpha;
+    std::map<std::string, llama_lora_tensor> tensors;
+    llama_lora_read(path_lora, lora_r, lora_alpha, tensors);
+
+    const std::vector<llama_lora_pair> pairs = llama_lora_match(model, tensors);
+
+    std::unique_ptr<llama_lora_adapter> adapter(new llama_lora_adapter());
+    adapter->model   = &model;
+    adapter->scaling = (float)lora_alpha / (float)lora_r;
+
+    LLAMA_LOG_INFO("%s: r = %d, alpha = %d, scaling = %.2f\n", __func__, lora_r, lora_alpha, adapter->scaling);
+
+    size_t data_size = 0;
+    for (const auto & pair : pairs) {
+        data_size += (pair.a->data.size() + pair.b->data.size())*sizeof(float);
+    }
+
+    struct ggml_init_params params;
+    params.mem_size   = data_size + 2*pairs.size()*(ggml_tensor_overhead() + GGML_MEM_ALIGN);
+    params.mem_buffer = NULL;
+    params.no_alloc   = false;
+
+    adapter->ctx = ggml_init(params);
+    if (!adapter->ctx) {
+        throw std::runtime_error("failed to allocate the lora context");
+    }
+
+    for (const auto & pair : pairs) {
+        const llama_lora_tensor & a = *pair.a;
+        const llama_lora_tensor & b = *pair.b;
+
+        const int64_t r    = a.ne[0];
+        const int64_t n_in = a.ne[1];
+
+        // A is stored as [r, n_in] - transpose it to multiply the input
+        llama_lora_weight lw;
+        lw.a = ggml_new_tensor_2d(adapter->ctx, GGML_TYPE_F32, n_in, r);
+        lw.b = ggml_new_tensor_2d(adapter->ctx, GGML_TYPE_F32, r, b.ne[1]);
+        ggml_set_name(lw.a, "loraA");
+        ggml_set_name(lw.b, "loraB");
+
+        float * data_a = (float *) lw.a->data;
+        for (int64_t k = 0; k < r; ++k) {
+            for (int64_t i = 0; i < n_in; ++i) {
+                data_a[k*n_in + i] = a.data[i*r + k];
+            }
+        }
+        memcpy(lw.b->data, b.data.data(), b.data.size()*sizeof(float));
+
+        adapter->weights[pair.w] = lw;
+    }
+
+    const int64_t t_lora_us = ggml_time_us() - t_start_lora_us;
+    LLAMA_LOG_INFO("%s: loaded %zu tensors, %.2f MB (%.2f ms)\n", __func__,
+            pairs.size(), data_size/1024.0/1024.0, t_lora_us / 1000.0);
+
+    return adapter.release();
+}
+
+// TODO: after the GGUF PR, this likely won't work and needs to be updated
+int llama_apply_lora_from_file_internal(const struct llama_model & model, const char * path_lora, const char * path_base_model, int n_threads) {
+    LLAMA_LOG_INFO("%s: applying lora adapter from '%s' - please wait ...\n", __func__, path_lora);
+
+    // without a base model, the weights in host memory are merged in place by all the threads
+    if (!path_base_model && llama_apply_lora_host(model, path_lora, n_threads)) {
+        return 0;
+    }
+
+    const int64_t t_start_lora_us = ggml_time_us();
+
+    auto fin = std::ifstream(path_lora, std::ios::binary);
+    if (!fin) {
+        LLAMA_LOG_ERROR("%s: failed to open '%s'\n", __func__, path_lora);
+        return 1;
+    }
+
+    // verify magic and version
+    {
+        uint32_t magic;
+        fin.read((char *) &magic, sizeof(magic));
+        uint32_t format_version;
+        fin.read((char *) &format_version, sizeof(format_version));
+
+        if (format_version != 1) {
+            LLAMA_LOG_ERROR("%s: unsupported file version\n", __func__ );
+            return 1;
+        }
+    }
+
+    int32_t lora_r;
+    int32_t lora_alpha;
+    fin.read((char *) &lora_r, sizeof(lora_r));
+    fin.read((char *) &lora_alpha, sizeof(lora_alpha));
+    float scaling = (float)lora_alpha / (float)lora_r;
+
+    LLAMA_LOG_INFO("%s: r = %d, alpha = %d, scaling = %.2f\n", __func__, lora_r, lora_alpha, scaling);
+
+    // create a temporary ggml context to store the lora tensors
+    // todo: calculate size from biggest possible tensor
+    std::vector<uint8_t> lora_buf(1024ull * 1024ull * 1024ull);
+    struct ggml_init_params params;
+    params.mem_size   = lora_buf.size();
+    params.mem_buffer = lora_buf.data();
+    params.no_alloc   = false;
+
+    ggml_context * lora_ctx = ggml_init(params);
+    std::unordered_map<std::string, struct ggml_tensor *> lora_tensors;
+
+    // create a name -> tensor map of the model to accelerate lookups
+    std::unordered_map<std::string, struct ggml_tensor*> model_tensors;
+    for (const auto & kv : model.tensors_by_name) {
+        model_tensors.insert(kv);
+    }
+
+    // load base model
+    std::unique_ptr<llama_model_loader> ml;
+    ggml_context * base_ctx = NULL;
+    std::vector<uint8_t> base_buf;
+    if (path_base_model) {
+        LLAMA_LOG_INFO("%s: loading base model from '%s'\n", __func__, path_base_model);
+        ml.reset(new llama_model_loader(path_base_model, /*use_mmap*/ true));
+
+        size_t ctx_size;
+        size_t mmapped_size;
+        ml->calc_sizes(ctx_size, mmapped_size);
+        base_buf.resize(ctx_size);
+
+        ggml_init_params base_params;
+        base_params.mem_size   = base_buf.size();
+        base_params.mem_buffer = base_buf.data();
+        base_params.no_alloc   = ml->use_mmap;
+
+        base_ctx = ggml_init(base_params);
+
+        // maybe this should in llama_model_loader
+        if (ml->use_mmap) {
+            ml->mapping.reset(new llama_mmap(&ml->file, /* prefetch */ 0, ggml_is_numa()));
+        }
+    }
+
+    // read tensors and apply
+    bool warned = false;
+    int n_tensors = 0;
+
+    std::vector<uint8_t> work_buffer;
+
+    while (true) {
+        int32_t n_dims;
+        int32_t length;
+        int32_t ftype;
+
+        fin.read(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
+        fin.read(reinterpret_cast<char *>(&length), sizeof(length));
+        fin.read(reinterpret_cast<char *>(&ftype),  sizeof(ftype));
+        if (fin.eof()) {
+            break;
+        }
+
+        int32_t ne[2] = { 1, 1 };
+        for (int i = 0; i < n_dims; ++i) {
+            fin.read(reinterpret_cast<char *>(&ne[i]), sizeof(ne[i]));
+        }
+
+        std::string name;
+        {
+            char buf[1024];
+            fin.read(buf, length);
+            name = std::string(buf, length);
+        }
+
+        // check for lora suffix and get the type of tensor
+        const std::string lora_suffix = ".lora";
+        size_t pos = name.rfind(lora_suffix);
+        if (pos == std::string::npos) {
+            LLAMA_LOG_ERROR("%s: error: '%s' is not a lora tensor\n", __func__, name.c_str());
+            return 1;
+        }
+
+        std::string lora_type = name.substr(pos + lora_suffix.length());
+        std::string base_name = name;
+        base_name.erase(pos);
+        // LLAMA_LOG_INFO("%s: %s => %s (lora type %s) \n", __func__, name.c_str(),base_name.c_str(), lora_type.c_str());
+
+        if (model_tensors.find(base_name) == model_tensors.end()) {
+            LLAMA_LOG_ERROR("%s: unknown tensor '%s' in lora adapter\n", __func__, name.data());
+            return 1;
+        }
+
+        // create ggml tensor
+        ggml_type wtype;
+        switch (ftype) {
+            case 0: wtype = GGML_TYPE_F32;  break;
+            case 1: wtype = GGML_TYPE_F16;  break;
+            default:
+                    {
+                        LLAMA_LOG_ERROR("%s: invalid tensor data type '%d'\n",
+                                __func__, ftype);
+                        return false;
+                    }
+        }
+        ggml_tensor * lora_tensor;
+        if (n_dims == 2) {
+            lora_tensor = ggml_new_tensor_2d(lora_ctx, wtype, ne[0], ne[1]);
+        }
+        else {
+            LLAMA_LOG_ERROR("%s: unsupported tensor dimension %d\n", __func__, n_dims);
+            return 1;
+        }
+        ggml_set_name(lora_tensor, "lora_tensor");
+
+        // load tensor data
+        size_t offset = fin.tellg();
+        size_t tensor_data_size = ggml_nbytes(lora_tensor);
+        offset = (offset + 31) & -32;
+        fin.seekg(offset);
+        fin.read((char*)lora_tensor->data, tensor_data_size);
+
+        lora_tensors[name] = lora_tensor;
+
+        // check if we have both A and B tensors and apply
+        if (lora_tensors.find(base_name + ".loraA") != lora_tensors.end() &&
+            lora_tensors.find(base_name + ".loraB") != lora_tensors.end()) {
+
+            ggml_tensor * dest_t = model_tensors[base_name];
+
+            offload_func_t offload_func = llama_nop;
+            offload_func_t offload_func_force_inplace = llama_nop;
+
+#ifdef GGML_USE_CUBLAS
+            if (dest_t->backend == GGML_BACKEND_GPU || dest_t->backend == GGML_BACKEND_GPU_SPLIT) {
+                if (dest_t->type != GGML_TYPE_F16) {
+                    throw std::runtime_error(format(
+                        "%s: error: the simultaneous use of LoRAs and GPU acceleration is only supported for f16 models", __func__));
+                }
+                offload_func = ggml_cuda_assign_buffers;
+                offload_func_force_inplace = ggml_cuda_assign_buffers_force_inplace;
+            }
+#endif // GGML_USE_CUBLAS
+
+            ggml_tensor * base_t;
+            if (ml) {
+                struct gguf_context * ctx_gguf = ml->ctx_gguf;
+
+                // load from base model
+                if (gguf_find_tensor(ctx_gguf, base_name.c_str()) < 0) {
+                    // TODO: throw
+                    LLAMA_LOG_ERROR("%s: error: tensor '%s' not found in base model\n", __func__, base_name.c_str());
+                    return 1;
+                }
+
+                // TODO: not tested!! maybe not working!
+                base_t = ml->create_tensor(base_ctx, base_name, { (uint32_t)dest_t->ne[0], (uint32_t)dest_t->ne[1] }, GGML_BACKEND_CPU);
+                ml->load_data_for(base_t);
+            } else {
+                base_t = dest_t;
+            }
+
+            if (ggml_is_quantized(base_t->type)) {
+                if (!warned) {
+                    LLAMA_LOG_WARN("%s: warning: using a lora adapter with a quantized model may result in poor quality, "
+                                   "use a f16 or f32 base model with --lora-base\n", __func__);
+                    warned = true;
+                }
+            }
+
+            ggml_tensor * loraA = lora_tensors[base_name + ".loraA"];
+            GGML_ASSERT(loraA->type == GGML_TYPE_F32);
+            ggml_set_name(loraA, "loraA");
+
+            ggml_tensor * loraB = lora_tensors[base_name + ".loraB"];
+            GGML_ASSERT(loraB->type == GGML_TYPE_F32);
+            ggml_set_name(loraB, "loraB");
+
+            if (base_t->ne[0] != loraA->ne[1] || base_t->ne[1] != loraB->ne[1]) {
+                LLAMA_LOG_ERROR("%s: incompatible tensor dimensions (%" PRId64 " and %" PRId64 ");"
+                                " are you sure that this adapter is for this model?\n", __func__, base_t->ne[0], loraA->ne[1]);
+                return 1;
+            }
+
+            // w = w + BA*s
+            ggml_tensor * BA = ggml_mul_mat(lora_ctx, loraA, loraB);
+            offload_func(BA);
+            ggml_set_name(BA, "BA");
+
+            if (scaling != 1.0f) {
+                ggml_tensor * scale_tensor = ggml_new_f32(lora_ctx, scaling);
+                ggml_set_name(scale_tensor, "scale_tensor");
+
+                BA = ggml_scale_inplace(lora_ctx, BA, scale_tensor);
+                offload_func(BA);
+                ggml_set_name(BA, "BA_scaled");
+            }
+
+            ggml_tensor * r;
+            if (base_t == dest_t) {
+                r = ggml_add_inplace(lora_ctx, dest_t, BA);
+                offload_func_force_inplace(r);
+                ggml_set_name(r, "r_add_inplace");
+            }
+            else {
+                r = ggml_add(lora_ctx, base_t, BA);
+                offload_func(r);
+                ggml_set_name(r, "r_add");
+
+                r = ggml_cpy(lora_ctx, r, dest_t);
+                offload_func(r);
+                ggml_set_name(r, "r_cpy");
+            }
+
+            struct ggml_cgraph gf = ggml_build_forward(r);
+
+            ggml_graph_compute_helper(work_buffer, &gf, n_threads);
+
+            // we won't need these tensors again, reset the context to save memory
+            ggml_free(lora_ctx);
+            lora_ctx = ggml_init(params);
+            lora_tensors.clear();
+
+            n_tensors++;
+            if (n_tensors % 4 == 0) {
+                LLAMA_LOG_INFO(".");
+            }
+        }
+    }
+
+    // TODO: this should be in a destructor, it will leak on failure
+    ggml_free(lora_ctx);
+    if (base_ctx) {
+        ggml_free(base_ctx);
+    }
+
+    const int64_t t_lora_us = ggml_time_us() - t_start_lora_us;
+    LLAMA_LOG_INFO(" done (%.2f ms)\n", t_lora_us / 1000.0);
+
+    return 0;
+}
+
+
+//
+// interface implementation
+//
+
+struct llama_context_params llama_context_default_params() {
+    struct llama_context_params result = {
+        /*.seed                        =*/ LLAMA_DEFAULT_SEED,
+        /*.n_ctx                       =*/ 512,
+        /*.n_batch                     =*/ 512,
+        /*.n_gpu_layers                =*/ 0,
+        /*.main_gpu                    =*/ 0,
+        /*.n_kv_chunk                  =*/ 0,
+        /*.tensor_split                =*/ nullptr,
+        /*.rope_freq_base              =*/ 10000.0f,
+        /*.rope_freq_scale             =*/ 1.0f,
+        /*.progress_callback           =*/ nullptr,
+        /*.progress_callback_user_data =*/ nullptr,
+        /*.low_vram                    =*/ false,
+        /*.mul_mat_q                   =*/ true,
+        /*.f16_kv                      =*/ true,
+        /*.logits_all                  =*/ false,
+        /*.vocab_only                  =*/ false,
+        /*.use_mmap                    =*/ true,
+        /*.use_mlock                   =*/ false,
+        /*.embedding                   =*/ false,
+        /*.fuse_weights                =*/ false,
+        /*.stream_layers               =*/ false,
+        /*.repack_weights              =*/ false,
+        /*.layer_timings               =*/ false,
+    };
+
+#ifdef GGML_USE_METAL
+    result.n_gpu_layers = 1;
+#endif
+
+    return result;
+}
+
+struct llama_model_quantize_params llama_model_quantize_default_params() {
+    struct llama_model_quantize_params result = {
+        /*.nthread                     =*/ 0,
+        /*.ftype                       =*/ LLAMA_FTYPE_MOSTLY_Q5_1,
+        /*.allow_requantize            =*/ false,
+        /*.quantize_output_tensor      =*/ true,
+        /*.only_copy                   =*/ false,
+        /*.repack                      =*/ false,
+    };
+
+    return result;
+}
+
+int llama_max_devices(void) {
+    return LLAMA_MAX_DEVICES;
+}
+
+bool llama_mmap_supported(void) {
+    return llama_mmap::SUPPORTED;
+}
+
+bool llama_mlock_supported(void) {
+    return llama_mlock::SUPPORTED;
+}
+
+void llama_backend_init(bool numa) {
+    ggml_time_init();
+
+    // needed to initialize f16 tables
+    {
+        struct ggml_init_params params = { 0, NULL, false };
+        struct ggml_context * ctx = ggml_init(params);
+        ggml_free(ctx);
+    }
+
+    if (numa) {
+        ggml_numa_init();
+    }
+
+#ifdef GGML_USE_MPI
+    ggml_mpi_backend_init();
+#endif
+}
+
+void llama_backend_free(void) {
+#ifdef GGML_USE_MPI
+    ggml_mpi_backend_free();
+#endif
+}
+
+int64_t llama_time_us(void) {
+    return ggml_time_us();
+}
+
+struct llama_model * llama_load_model_from_file(
+                             const char * path_model,
+            struct llama_context_params   params) {
+    ggml_time_init();
+
+    llama_model * model = new llama_model;
+
+    ggml_type memory_type = params.f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
+
+    unsigned cur_percentage = 0;
+    if (params.progress_callback == NULL) {
+        params.progress_callback_user_data = &cur_percentage;
+        params.progress_callback = [](float progress, void * ctx) {
+            unsigned * cur_percentage_p = (unsigned *) ctx;
+            unsigned percentage = (unsigned) (100 * progress);
+            while (percentage > *cur_percentage_p) {
+                *cur_percentage_p = percentage;
+                LLAMA_LOG_INFO(".");
+                if (percentage >= 100) {
+                    LLAMA_LOG_INFO("\n");
+                }
+            }
+        };
+    }
+
+    if (!llama_model_load(path_model, *model, params.n_ctx, params.n_batch, params.n_gpu_layers,
+                params.main_gpu, params.tensor_split, params.mul_mat_q, params.rope_freq_base, params.rope_freq_scale,
+                params.low_vram, memory_type, params.use_mmap, params.use_mlock, params.vocab_only, params.fuse_weights, params.stream_layers, params.repack_weights,
+                params.progress_callback, params.progress_callback_user_data)) {
+        LLAMA_LOG_ERROR("%s: failed to load model\n", __func__);
+        delete model;
+        return nullptr;
+    }
+
+    return model;
+}
+
+void llama_free_model(struct llama_model * model) {
+    delete model;
+}
+
+// sizes the allocator buffer for the worst-case graph of the context: a full batch at the end of the context,
+// including the custom positions and mask inputs so that llama_eval_mask fits as well
+// the buffer only grows, e.g. when a runtime LoRA adapter adds nodes to the graph
+static size_t llama_reserve_alloc(llama_context & ctx) {
+    static const size_t tensor_alignment = 32;
+
+    const auto & hparams = ctx.model.hparams;
+
+    ggml_allocr * alloc = ctx.alloc;
+
+    // create measure allocator
+    ctx.alloc = ggml_allocr_new_measure(tensor_alignment);
+
+    // build worst-case graph
+    int n_tokens = ctx.n_batch;
+    int n_past = hparams.n_ctx - n_tokens;
+    llama_token token = llama_token_bos(&ctx); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
+
+    // the custom positions and the n_tokens*n_ctx attention mask are only measured once they are used
+    std::vector<int>   pos;
+    std::vector<float> mask;
+    if (ctx.reserved_mask) {
+        pos.resize(n_tokens);
+        mask.resize((size_t) n_tokens*hparams.n_ctx);
+    }
+
+    // a KV cache that grows on demand is smaller than the worst case - measure with views over
+    // full size placeholders that share its data pointer, they are never computed
+    auto & kv_self = ctx.kv_self;
+
+    ggml_tensor * kv_k    = kv_self.k;
+    ggml_tensor * kv_v    = kv_self.v;
+    const int     kv_size = kv_self.size;
+
+    ggml_context * ctx_kv_measure = ggml_init({ 2*ggml_tensor_overhead(), NULL, /* no_alloc */ true });
+
+    if (kv_size < (int) hparams.n_ctx) {
+        const int64_t n_elements = (int64_t) hparams.n_embd_gqa()*hparams.n_layer*hparams.n_ctx;
+
+        kv_self.k = ggml_new_tensor_1d(ctx_kv_measure, kv_k->type, n_elements);
+        kv_self.v = ggml_new_tensor_1d(ctx_kv_measure, kv_v->type, n_elements);
+        kv_self.k->data = kv_k->data;
+        kv_self.v->data = kv_v->data;
+        kv_self.size    = hparams.n_ctx;
+    }
+
+    // the worst case has the logits of all tokens (see llama_set_output_tokens)
+    std::vector<int32_t> output_ids;
+    output_ids.swap(ctx.output_ids);
+
+    const bool logits_all = ctx.logits_all;
+    ctx.logits_all = true;
+
+    ggml_cgraph * gf = llama_build_graph(ctx, &token, NULL, n_tokens, n_past,
+            ctx.reserved_mask ? pos.data() : NULL, ctx.reserved_mask ? mask.data() : NULL);
+
+    ctx.logits_all = logits_all;
+    output_ids.swap(ctx.output_ids);
+#ifdef GGML_USE_METAL
+    if (ctx.ctx_metal) {
+        ggml_metal_graph_find_concurrency(ctx.ctx_metal, gf, false);
+        ggml_allocr_set_parse_seq(ctx.alloc, ggml_metal_get_concur_list(ctx.ctx_metal), ggml_metal_if_optimized(ctx.ctx_metal));
+    }
+#endif
+    // measure memory requirements for the graph
+    const size_t alloc_size = ggml_allocr_alloc_graph(ctx.alloc, gf) + tensor_alignment;
+
+    ctx.alloc_peak = alloc_size;
+
+    kv_self.k    = kv_k;
+    kv_self.v    = kv_v;
+    kv_self.size = kv_size;
+
+    ggml_free(ctx_kv_measure);
+
+    ggml_allocr_free(ctx.alloc);
+    ctx.alloc = alloc;
+
+    // (re)create the allocator with the measured memory requirements
+    if (!ctx.alloc || alloc_size > ctx.buf_alloc.size) {
+        if (ctx.alloc) {
+            ggml_allocr_free(ctx.alloc);
+        }
+
+        ctx.buf_alloc.resize(alloc_size);
+        ctx.alloc = ggml_allocr_new(ctx.buf_alloc.data, ctx.buf_alloc.size, tensor_alignment);
+#ifdef GGML_USE_METAL
+        if (ctx.ctx_metal) {
+            ggml_allocr_set_parse_seq(ctx.alloc, ggml_metal_get_concur_list(ctx.ctx_metal), ggml_metal_if_optimized(ctx.ctx_metal));
+        }
+#endif
+    }
+
+    return alloc_size;
+}
+
+// grows the compute buffer for the custom positions and attention masks of the evals on their first use
+static void llama_reserve_mask(llama_context & ctx) {
+    if (!ctx.reserved_mask) {
+        ctx.reserved_mask = true;
+        llama_reserve_alloc(ctx);
+    }
+}
+
+struct llama_context * llama_new_context_with_model(
+                 struct llama_model * model,
+        struct llama_context_params   params) {
+
+    if (!model) {
+        return nullptr;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(model->contexts_mutex);
+        if (model->n_streaming > 0) {
+            LLAMA_LOG_ERROR("%s: the layers of the model are streamed by another context\n", __func__);
+            return nullptr;
+        }
+        model->n_contexts++;
+    }
+
+    llama_context * ctx = new llama_context(*model);
+
+    if (params.seed == LLAMA_DEFAULT_SEED) {
+        params.seed = time(NULL);
+    }
+
+    ctx->rng = std::mt19937(params.seed);
+    ctx->logits_all = params.logits_all;
+    ctx->n_batch    = std::min((int) ctx->model.hparams.n_ctx, params.n_batch);
+
+    ggml_type memory_type = params.f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
+
+    // reserve memory for context buffers
+    if (!params.vocab_only) {
+        int n_kv_init = ctx->model.hparams.n_ctx;
+
+        if (params.n_kv_chunk > 0) {
+            bool kv_host = true;
+#ifdef GGML_USE_CUBLAS
+            kv_host = params.n_gpu_layers <= (int) ctx->model.hparams.n_layer + 1;
+#elif defined(GGML_USE_METAL)
+            kv_host = params.n_gpu_layers <= 0;
+#endif
+            if (kv_host) {
+                ctx->n_kv_chunk = params.n_kv_chunk;
+                n_kv_init = std::min(n_kv_init, params.n_kv_chunk);
+            } else {
+                LLAMA_LOG_WARN("%s: the KV cache is offloaded, allocating it for the full context\n", __func__);
+            }
+        }
+
+        if (!llama_kv_cache_init(ctx->model.hparams, ctx->kv_self, memory_type, n_kv_init, params.n_gpu_layers)) {
+            LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for self-attention cache\n", __func__);
+            llama_free(ctx);
+            return nullptr;
+        }
+
+        {
+            const size_t memory_size = ggml_nbytes(ctx->kv_self.k) + ggml_nbytes(ctx->kv_self.v);
+            LLAMA_LOG_INFO("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
+            if (ctx->n_kv_chunk > 0) {
+                const size_t memory_size_max = memory_size/n_kv_init*ctx->model.hparams.n_ctx;
+                LLAMA_LOG_INFO("%s: kv self grows in chunks of %d tokens, up to %7.2f MB\n", __func__, ctx->n_kv_chunk, memory_size_max / 1024.0 / 1024.0);
+            }
+        }
+
+        const auto & hparams = ctx->model.hparams;
+
+        // resized during inference
+        if (params.logits_all) {
+            ctx->logits.reserve(hparams.n_ctx*hparams.n_vocab);
+        } else {
+            ctx->logits.reserve(hparams.n_vocab);
+        }
+
+        if (params.embedding){
+            ctx->embedding.resize(hparams.n_embd);
+        }
+
+        ctx->layer_timings = params.layer_timings;
+
+        if (params.stream_layers) {
+            std::lock_guard<std::mutex> lock(model->contexts_mutex);
+            if (!ctx->model.mapping || params.use_mlock) {
+                LLAMA_LOG_WARN("%s: layer streaming needs mmap without mlock, disabling it\n", __func__);
+            } else if (model->n_contexts > 1) {
+                LLAMA_LOG_WARN("%s: layer streaming needs a single context of the model, disabling it\n", __func__);
+            } else {
+                model->n_streaming++;
+                ctx->streamer.reset(new llama_layer_streamer(ctx->model));
+                LLAMA_LOG_INFO("%s: streaming %7.2f MB of weights in %d groups\n", __func__,
+                        ctx->streamer->size() / 1024.0 / 1024.0, (int) ctx->streamer->ranges.size());
+            }
+        }
+
+        {
+            // the compute buffer is used to store the tensor and graph structs, while the allocator buffer is used for the tensor data
+            ctx->buf_compute.resize(ggml_tensor_overhead()*GGML_MAX_NODES + ggml_graph_overhead());
+
+#ifdef GGML_USE_METAL
+            if (params.n_gpu_layers > 0) {
+                ctx->ctx_metal = ggml_metal_init(1);
+                if (!ctx->ctx_metal) {
+                    LLAMA_LOG_ERROR("%s: ggml_metal_init() failed\n", __func__);
+                    llama_free(ctx);
+                    return NULL;
+                }
+            }
+#endif
+            // create the allocator with exact memory requirements
+            const size_t alloc_size = llama_reserve_alloc(*ctx);
+
+            LLAMA_LOG_INFO("%s: compute buffer total size = %7.2f MB\n", __func__, (ctx->buf_compute.size + alloc_size) / 1024.0 / 1024.0);
+
+#ifdef GGML_USE_CUBLAS
+            if (params.low_vram) {
+                LLAMA_LOG_INFO("%s: not allocating a VRAM scratch buffer due to low VRAM option\n", __func__);
+                ggml_cuda_set_scratch_size(0); // disable scratch
+            } else {
+                ggml_cuda_set_scratch_size(alloc_size);
+                LLAMA_LOG_INFO("%s: VRAM scratch buffer: %.2f MB\n", __func__, alloc_size / 1024.0 / 1024.0);
+            }
+#endif
+        }
+
+#ifdef GGML_USE_METAL
+        if (params.n_gpu_layers > 0) {
+            // this allocates all Metal resources and memory buffers
+
+            void * data_ptr  = NULL;
+            size_t data_size = 0;
 
-        // write tensor data + padding
-        fout.write((const char *) new_data, new_size);
-        zeros(fout, GGML_PAD(new_size, align) - new_size);
+            if (params.use_mmap) {
+                data_ptr  = ctx->model.mapping->addr;
+                data_size = ctx->model.mapping->size;
+            } else {
+                data_ptr  = ggml_get_mem_buffer(ctx->model.ctx);
+                data_size = ggml_get_mem_size  (ctx->model.ctx);
+            }
+
+            const size_t max_size = ggml_get_max_tensor_size(ctx->model.ctx);
+
+            LLAMA_LOG_INFO("%s: max tensor size = %8.2f MB\n", __func__, max_size/1024.0/1024.0);
+
+#define LLAMA_METAL_CHECK_BUF(result)                            \
+            if (!(result)) {                                             \
+                LLAMA_LOG_ERROR("%s: failed to add buffer\n", __func__); \
+                llama_free(ctx);                                         \
+                return NULL;                                             \
+            }
+
+            LLAMA_METAL_CHECK_BUF(ggml_metal_add_buffer(ctx->ctx_metal, "data", data_ptr, data_size, max_size));
+
+            LLAMA_METAL_CHECK_BUF(ggml_metal_add_buffer(ctx->ctx_metal, "eval", ctx->buf_compute.data, ctx->buf_compute.size, 0));
+            LLAMA_METAL_CHECK_BUF(ggml_metal_add_buffer(ctx->ctx_metal, "kv",   ctx->kv_self.buf.data, ctx->kv_self.buf.size, 0));
+
+            LLAMA_METAL_CHECK_BUF(ggml_metal_add_buffer(ctx->ctx_metal, "alloc", ctx->buf_alloc.data, ctx->buf_alloc.size, 0));
+#undef LLAMA_METAL_CHECK_BUF
+        }
+#endif
     }
 
-    // go back to beginning of file and write the updated meta data
+#ifdef GGML_USE_MPI
+    ctx->ctx_mpi = ggml_mpi_init();
+
+    if (ggml_mpi_rank(ctx->ctx_mpi) > 0) {
+        // Enter a blocking eval loop with dummy input, letting rank=0 drive the process
+        const std::vector<llama_token> tmp(ctx->model.hparams.n_ctx, llama_token_bos(ctx));
+        while (!llama_eval(ctx, tmp.data(), tmp.size(), 0, 0)) {};
+        llama_backend_free();
+        exit(1);
+    }
+#endif
+
+    return ctx;
+}
+
+struct llama_context * llama_init_from_file(
+                             const char * path_model,
+            struct llama_context_params   params) {
+    struct llama_model * model = llama_load_model_from_file(path_model, params);
+    if (!model) {
+        return nullptr;
+    }
+
+    struct llama_context * ctx = llama_new_context_with_model(model, params);
+    ctx->model_owner = true;
+
+    return ctx;
+}
+
+void llama_free(struct llama_context * ctx) {
+    if (ctx->lora) {
+        std::lock_guard<std::mutex> lock(ctx->model.lora_mutex);
+        ctx->lora->n_used--;
+    }
+
+    delete ctx;
+}
+
+void llama_set_cpu_affinity(struct llama_context * ctx, const int * cpus, int n_cpus) {
+    ctx->cpus.assign(cpus, cpus + std::max(0, n_cpus));
+}
+
+//
+// context pool
+//
+
+struct llama_context_pool {
+    std::vector<llama_context *> ctxs;
+    std::vector<llama_context *> free;
+
+    int n_threads = 0;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    ~llama_context_pool() {
+        for (auto * ctx : ctxs) {
+            llama_free(ctx);
+        }
+    }
+};
+
+// the CPUs the process is allowed to run on
+static std::vector<int> llama_get_available_cpus() {
+    std::vector<int> cpus;
+
+#if defined(__linux__) && !defined(__BIONIC__)
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int i = 0; i < CPU_SETSIZE; ++i) {
+            if (CPU_ISSET(i, &set)) {
+                cpus.push_back(i);
+            }
+        }
+    }
+#endif
+
+    if (cpus.empty()) {
+        for (int i = 0; i < (int) std::max(1u, std::thread::hardware_concurrency()); ++i) {
+            cpus.push_back(i);
+        }
+    }
+
+    return cpus;
+}
+
+struct llama_context_pool * llama_context_pool_init(
+                 struct llama_model * model,
+        struct llama_context_params   params,
+                                int   n_contexts,
+                                int   n_threads) {
+    GGML_ASSERT(n_contexts > 0);
+
+#ifdef GGML_USE_CUBLAS
+    if (params.n_gpu_layers > 0) {
+        LLAMA_LOG_ERROR("%s: contexts offloaded with CUDA share scratch buffers and cannot be evaluated concurrently\n", __func__);
+        return nullptr;
+    }
+#endif
+
+    const std::vector<int> cpus = llama_get_available_cpus();
+
+    if (n_threads <= 0) {
+        n_threads = std::max(1, (int) cpus.size()/n_contexts);
+    }
+
+    const bool pin = n_threads*n_contexts <= (int) cpus.size();
+    if (!pin) {
+        LLAMA_LOG_WARN("%s: %d contexts x %d threads exceed the %d available CPUs, threads will not be pinned\n",
+                __func__, n_contexts, n_threads, (int) cpus.size());
+    }
+
+    llama_context_pool * pool = new llama_context_pool;
+    pool->n_threads = n_threads;
+
+    for (int i = 0; i < n_contexts; ++i) {
+        llama_context * ctx = llama_new_context_with_model(model, params);
+        if (!ctx) {
+            LLAMA_LOG_ERROR("%s: failed to create context %d\n", __func__, i);
+            delete pool;
+            return nullptr;
+        }
+
+        // each context gets its own block of consecutive CPUs
+        if (pin) {
+            llama_set_cpu_affinity(ctx, cpus.data() + i*n_threads, n_threads);
+        }
+
+        pool->ctxs.push_back(ctx);
+    }
+
+    // hand out the first context first
+    pool->free.assign(pool->ctxs.rbegin(), pool->ctxs.rend());
+
+    LLAMA_LOG_INFO("%s: %d contexts with %d threads each\n", __func__, n_contexts, n_threads);
+
+    return pool;
+}
+
+int llama_context_pool_n_threads(const struct llama_context_pool * pool) {
+    return pool->n_threads;
+}
+
+struct llama_context * llama_context_pool_acquire(struct llama_context_pool * pool) {
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->cv.wait(lock, [pool] { return !pool->free.empty(); });
+
+    llama_context * ctx = pool->free.back();
+    pool->free.pop_back();
+
+    return ctx;
+}
+
+void llama_context_pool_release(struct llama_context_pool * pool, struct llama_context * ctx) {
     {
-        fout.seekp(0);
-        std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
-        gguf_get_meta_data(ctx_out, data.data());
-        fout.write((const char *) data.data(), data.size());
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        GGML_ASSERT(std::find(pool->ctxs.begin(), pool->ctxs.end(), ctx) != pool->ctxs.end());
+        GGML_ASSERT(std::find(pool->free.begin(), pool->free.end(), ctx) == pool->free.end() && "context released twice");
+        pool->free.push_back(ctx);
     }
+    pool->cv.notify_one();
+}
 
-    fout.close();
+void llama_context_pool_free(struct llama_context_pool * pool) {
+    if (!pool) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        GGML_ASSERT(pool->free.size() == pool->ctxs.size() && "contexts of the pool still acquired");
+    }
+    delete pool;
+}
 
-    gguf_free(ctx_out);
+int llama_n_vocab(const struct llama_context * ctx) {
+    return llama_model_n_vocab(&ctx->model);
+}
+
+int llama_n_ctx(const struct llama_context * ctx) {
+    return llama_model_n_ctx(&ctx->model);
+}
+
+int llama_n_ctx_train(const struct llama_context * ctx) {
+    return llama_model_n_ctx_train(&ctx->model);
+}
+
+int llama_n_embd(const struct llama_context * ctx) {
+    return llama_model_n_embd(&ctx->model);
+}
+
+int llama_n_layer(const struct llama_context * ctx) {
+    return llama_model_n_layer(&ctx->model);
+}
+
+enum llama_vocab_type llama_vocab_type(const struct llama_context * ctx) {
+    return ctx->model.vocab.type;
+}
+
+int llama_model_n_vocab(const struct llama_model * model) {
+    return model->vocab.id_to_token.size();
+}
+
+int llama_model_n_ctx(const struct llama_model * model) {
+    return model->hparams.n_ctx;
+}
+
+int llama_model_n_ctx_train(const struct llama_model * model) {
+    return model->hparams.n_ctx_train;
+}
+
+int llama_model_n_embd(const struct llama_model * model) {
+    return model->hparams.n_embd;
+}
+
+int llama_model_n_layer(const struct llama_model * model) {
+    return model->hparams.n_layer;
+}
+
+int llama_model_desc(const struct llama_model * model, char * buf, size_t buf_size) {
+    return snprintf(buf, buf_size, "%s %s %s",
+            model->name.c_str(),
+            llama_model_type_name(model->type),
+            llama_model_ftype_name(model->ftype).c_str());
+}
+
+uint64_t llama_model_size(const struct llama_model * model) {
+    uint64_t size = 0;
+    for (const auto & it : model->tensors_by_name) {
+        size += ggml_nbytes(it.second);
+    }
+    return size;
+}
+
+uint64_t llama_model_n_params(const struct llama_model * model) {
+    uint64_t nparams = 0;
+    for (const auto & it : model->tensors_by_name) {
+        nparams += ggml_nelements(it.second);
+    }
+    return nparams;
+}
+
+int llama_model_quantize(
+        const char * fname_inp,
+        const char * fname_out,
+        const llama_model_quantize_params * params) {
+    try {
+        llama_model_quantize_internal(fname_inp, fname_out, params);
+        return 0;
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to quantize: %s\n", __func__, err.what());
+        return 1;
+    }
+}
+
+int llama_apply_lora_from_file(struct llama_context * ctx, const char * path_lora, const char * path_base_model, int n_threads) {
+    try {
+        return llama_apply_lora_from_file_internal(ctx->model, path_lora, path_base_model, n_threads);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to apply lora adapter: %s\n", __func__, err.what());
+        return 1;
+    }
+}
+
+int llama_model_apply_lora_from_file(const struct llama_model * model, const char * path_lora, const char * path_base_model, int n_threads) {
+    try {
+        return llama_apply_lora_from_file_internal(*model, path_lora, path_base_model, n_threads);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to apply lora adapter: %s\n", __func__, err.what());
+        return 1;
+    }
+}
+
+struct llama_lora_adapter * llama_lora_adapter_init(const struct llama_model * model, const char * path_lora) {
+    try {
+        llama_lora_adapter * adapter = llama_lora_adapter_init_internal(*model, path_lora);
+        std::lock_guard<std::mutex> lock(model->lora_mutex);
+        model->lora_adapters.insert(adapter);
+        return adapter;
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to load lora adapter: %s\n", __func__, err.what());
+        return nullptr;
+    }
+}
+
+void llama_lora_adapter_free(struct llama_lora_adapter * adapter) {
+    if (!adapter) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(adapter->model->lora_mutex);
+        if (adapter->n_used > 0) {
+            LLAMA_LOG_ERROR("%s: the lora adapter is set for %d contexts and is not freed\n", __func__, adapter->n_used);
+            return;
+        }
+        adapter->model->lora_adapters.erase(adapter);
+    }
+    delete adapter;
+}
+
+int llama_set_lora_adapter(struct llama_context * ctx, const struct llama_lora_adapter * adapter, float scale) {
+    if (adapter) {
+        if (adapter->model != &ctx->model) {
+            LLAMA_LOG_ERROR("%s: the lora adapter was loaded for a different model\n", __func__);
+            return 1;
+        }
+#ifdef GGML_USE_METAL
+        if (ctx->ctx_metal) {
+            LLAMA_LOG_ERROR("%s: runtime lora adapters are not supported with Metal\n", __func__);
+            return 1;
+        }
+#endif
+        for (const auto & it : adapter->weights) {
+            if (it.first->backend != GGML_BACKEND_CPU) {
+                LLAMA_LOG_ERROR("%s: runtime lora adapters are only supported for weights in host memory\n", __func__);
+                return 1;
+            }
+        }
+    }
 
-    LLAMA_LOG_INFO("%s: model size  = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
-    LLAMA_LOG_INFO("%s: quant size  = %8.2f MB\n", __func__, total_size_new/1024.0/1024.0);
+    // the graph of an adapter that only adapts weights of the last measured one, with no larger rank, fits the compute buffer
+    bool reserve = false;
+    int64_t rank = 0;
+    if (adapter) {
+        for (const auto & it : adapter->weights) {
+            rank = std::max(rank, it.second.a->ne[1]);
+            reserve = reserve || ctx->lora_reserved.count(it.first) == 0;
+        }
+        reserve = reserve || rank > ctx->lora_reserved_rank;
+    }
 
-    // print histogram for all tensors
     {
-        int64_t sum_all = 0;
-        for (size_t i = 0; i < hist_all.size(); i++) {
-            sum_all += hist_all[i];
+        std::lock_guard<std::mutex> lock(ctx->model.lora_mutex);
+        if (ctx->lora) {
+            ctx->lora->n_used--;
         }
+        if (adapter) {
+            adapter->n_used++;
+        }
+    }
 
-        if (sum_all > 0) {
-            LLAMA_LOG_INFO("%s: hist: ", __func__);
-            for (size_t i = 0; i < hist_all.size(); i++) {
-                LLAMA_LOG_INFO("%5.3f ", hist_all[i] / float(sum_all));
-            }
-            LLAMA_LOG_INFO("\n");
+    ctx->lora       = adapter;
+    ctx->lora_scale = scale;
+
+    if (reserve) {
+        // the graph has more nodes - grow the compute buffer if needed
+        llama_reserve_alloc(*ctx);
+
+        ctx->lora_reserved.clear();
+        for (const auto & it : adapter->weights) {
+            ctx->lora_reserved.insert(it.first);
         }
+        ctx->lora_reserved_rank = rank;
     }
+
+    return 0;
 }
 
-// TODO: after the GGUF PR, this likely won't work and needs to be updated
-int llama_apply_lora_from_file_internal(const struct llama_model & model, const char * path_lora, const char * path_base_model, int n_threads) {
-    LLAMA_LOG_INFO("%s: applying lora adapter from '%s' - please wait ...\n", __func__, path_lora);
+int llama_get_kv_cache_token_count(const struct llama_context * ctx) {
+    return ctx->kv_self.n;
+}
 
-    const int64_t t_start_lora_us = ggml_time_us();
+int llama_get_kv_cache_capacity(const struct llama_context * ctx) {
+    return ctx->kv_self.size;
+}
 
-    auto fin = std::ifstream(path_lora, std::ios::binary);
-    if (!fin) {
-        LLAMA_LOG_ERROR("%s: failed to open '%s'\n", __func__, path_lora);
-        return 1;
+void llama_kv_cache_trim(struct llama_context * ctx, int n_past) {
+    auto & kv_self = ctx->kv_self;
+
+    kv_self.n = std::min(kv_self.n, n_past);
+
+    if (ctx->n_kv_chunk <= 0) {
+        return;
     }
 
-    // verify magic and version
-    {
-        uint32_t magic;
-        fin.read((char *) &magic, sizeof(magic));
-        uint32_t format_version;
-        fin.read((char *) &format_version, sizeof(format_version));
+    const int size = std::max(1, (n_past + ctx->n_kv_chunk - 1)/ctx->n_kv_chunk)*ctx->n_kv_chunk;
 
-        if (format_version != 1) {
-            LLAMA_LOG_ERROR("%s: unsupported file version\n", __func__ );
-            return 1;
+    if (size < kv_self.size && !llama_kv_cache_resize(ctx->model.hparams, kv_self, size)) {
+        LLAMA_LOG_ERROR("%s: failed to shrink the KV cache to %d tokens\n", __func__, size);
+    }
+}
+
+void llama_kv_cache_keep(struct llama_context * ctx, int n_past, const int * ids, int n_ids) {
+    auto & kv_self = ctx->kv_self;
+
+    GGML_ASSERT(kv_self.k->backend == GGML_BACKEND_CPU && kv_self.v->backend == GGML_BACKEND_CPU);
+
+    for (int i = 0; i < n_ids; ++i) {
+        GGML_ASSERT(ids[i] >= i && (i == 0 || ids[i] > ids[i - 1]));
+        GGML_ASSERT(n_past + ids[i] < kv_self.n);
+
+        if (ids[i] != i) {
+            llama_kv_cache_copy_slot(ctx->model.hparams, kv_self, n_past + i, n_past + ids[i]);
         }
     }
 
-    int32_t lora_r;
-    int32_t lora_alpha;
-    fin.read((char *) &lora_r, sizeof(lora_r));
-    fin.read((char *) &lora_alpha, sizeof(lora_alpha));
-    float scaling = (float)lora_alpha / (float)lora_r;
+    kv_self.n = n_past + n_ids;
+}
 
-    LLAMA_LOG_INFO("%s: r = %d, alpha = %d, scaling = %.2f\n", __func__, lora_r, lora_alpha, scaling);
+int llama_kv_cache_shift(struct llama_context * ctx, int n_keep, int n_discard, int n_threads) {
+    auto & kv_self = ctx->kv_self;
 
-    // create a temporary ggml context to store the lora tensors
-    // todo: calculate size from biggest possible tensor
-    std::vector<uint8_t> lora_buf(1024ull * 1024ull * 1024ull);
-    struct ggml_init_params params;
-    params.mem_size   = lora_buf.size();
-    params.mem_buffer = lora_buf.data();
-    params.no_alloc   = false;
+    const auto & model   = ctx->model;
+    const auto & hparams = model.hparams;
 
-    ggml_context * lora_ctx = ggml_init(params);
-    std::unordered_map<std::string, struct ggml_tensor *> lora_tensors;
+    if (kv_self.k->backend != GGML_BACKEND_CPU || kv_self.v->backend != GGML_BACKEND_CPU) {
+        LLAMA_LOG_ERROR("%s: the KV cache must be in host memory\n", __func__);
+        return 1;
+    }
+#ifdef GGML_USE_METAL
+    if (ctx->ctx_metal) {
+        LLAMA_LOG_ERROR("%s: not supported with Metal\n", __func__);
+        return 1;
+    }
+#endif
 
-    // create a name -> tensor map of the model to accelerate lookups
-    std::unordered_map<std::string, struct ggml_tensor*> model_tensors;
-    for (const auto & kv : model.tensors_by_name) {
-        model_tensors.insert(kv);
+    const int n_kv = kv_self.n;
+
+    GGML_ASSERT(n_keep >= 0 && n_discard >= 0 && n_keep + n_discard <= n_kv);
+
+    if (n_discard == 0) {
+        return 0;
     }
 
-    // load base model
-    std::unique_ptr<llama_model_loader> ml;
-    ggml_context * base_ctx = NULL;
-    std::vector<uint8_t> base_buf;
-    if (path_base_model) {
-        LLAMA_LOG_INFO("%s: loading base model from '%s'\n", __func__, path_base_model);
-        ml.reset(new llama_model_loader(path_base_model, /*use_mmap*/ true));
+    const int64_t n_layer     = hparams.n_layer;
+    const int64_t n_ctx       = kv_self.size;
+    const int64_t n_embd_gqa  = hparams.n_embd_gqa();
+    const int64_t n_embd_head = hparams.n_embd_head();
+    const int64_t n_head_kv   = hparams.n_head_kv;
 
-        size_t ctx_size;
-        size_t mmapped_size;
-        ml->calc_sizes(ctx_size, mmapped_size);
-        base_buf.resize(ctx_size);
+    const int n_move = n_kv - n_keep - n_discard;
 
-        ggml_init_params base_params;
-        base_params.mem_size   = base_buf.size();
-        base_params.mem_buffer = base_buf.data();
-        base_params.no_alloc   = ml->use_mmap;
+    const size_t esize = ggml_element_size(kv_self.k);
 
-        base_ctx = ggml_init(base_params);
+    // move the tokens after the discarded ones to their new slots
+    for (int64_t il = 0; il < n_layer; ++il) {
+        // K: [n_embd, n_ctx, n_layer]
+        uint8_t * k = (uint8_t *) kv_self.k->data + esize*n_embd_gqa*n_ctx*il;
+        memmove(k + esize*n_embd_gqa*n_keep, k + esize*n_embd_gqa*(n_keep + n_discard), esize*n_embd_gqa*n_move);
 
-        // maybe this should in llama_model_loader
-        if (ml->use_mmap) {
-            ml->mapping.reset(new llama_mmap(&ml->file, /* prefetch */ 0, ggml_is_numa()));
+        // V: [n_ctx, n_embd, n_layer] (transposed)
+        uint8_t * v = (uint8_t *) kv_self.v->data + esize*n_ctx*n_embd_gqa*il;
+        for (int64_t i = 0; i < n_embd_gqa; ++i) {
+            memmove(v + esize*(n_ctx*i + n_keep), v + esize*(n_ctx*i + n_keep + n_discard), esize*n_move);
         }
     }
 
-    // read tensors and apply
-    bool warned = false;
-    int n_tensors = 0;
-
-    std::vector<uint8_t> work_buffer;
+    kv_self.n = n_keep + n_move;
 
-    while (true) {
-        int32_t n_dims;
-        int32_t length;
-        int32_t ftype;
+    if (n_move == 0) {
+        return 0;
+    }
 
-        fin.read(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
-        fin.read(reinterpret_cast<char *>(&length), sizeof(length));
-        fin.read(reinterpret_cast<char *>(&ftype),  sizeof(ftype));
-        if (fin.eof()) {
-            break;
-        }
+    // the keys were rotated at their old position - rotate them back by n_discard
+    {
+        std::vector<int32_t> pos(n_move, -n_discard);
 
-        int32_t ne[2] = { 1, 1 };
-        for (int i = 0; i < n_dims; ++i) {
-            fin.read(reinterpret_cast<char *>(&ne[i]), sizeof(ne[i]));
-        }
+        const int mode = model.arch == LLM_ARCH_FALCON ? 2 : 0;
 
-        std::string name;
-        {
-            char buf[1024];
-            fin.read(buf, length);
-            name = std::string(buf, length);
-        }
+        ggml_context * shift_ctx = ggml_init({ ggml_tensor_overhead()*(3*n_layer + 1) + ggml_graph_overhead(), NULL, /* no_alloc */ true });
+        ggml_cgraph * gf = ggml_new_graph(shift_ctx);
 
-        // check for lora suffix and get the type of tensor
-        const std::string lora_suffix = ".lora";
-        size_t pos = name.rfind(lora_suffix);
-        if (pos == std::string::npos) {
-            LLAMA_LOG_ERROR("%s: error: '%s' is not a lora tensor\n", __func__, name.c_str());
-            return 1;
-        }
+        ggml_tensor * inp_pos = ggml_new_tensor_1d(shift_ctx, GGML_TYPE_I32, n_move);
+        inp_pos->data = pos.data();
 
-        std::string lora_type = name.substr(pos + lora_suffix.length());
-        std::string base_name = name;
-        base_name.erase(pos);
-        // LLAMA_LOG_INFO("%s: %s => %s (lora type %s) \n", __func__, name.c_str(),base_name.c_str(), lora_type.c_str());
+        for (int64_t il = 0; il < n_layer; ++il) {
+            ggml_tensor * k = ggml_view_3d(shift_ctx, kv_self.k,
+                n_embd_head, n_head_kv, n_move,
+                esize*n_embd_head, esize*n_embd_gqa,
+                esize*n_embd_gqa*(n_ctx*il + n_keep));
 
-        if (model_tensors.find(base_name) == model_tensors.end()) {
-            LLAMA_LOG_ERROR("%s: unknown tensor '%s' in lora adapter\n", __func__, name.data());
-            return 1;
+            ggml_build_forward_expand(gf, ggml_rope_custom_pos_inplace(shift_ctx, k, inp_pos,
+                n_embd_head, mode, 0, hparams.rope_freq_base, hparams.rope_freq_scale));
         }
 
-        // create ggml tensor
-        ggml_type wtype;
-        switch (ftype) {
-            case 0: wtype = GGML_TYPE_F32;  break;
-            case 1: wtype = GGML_TYPE_F16;  break;
-            default:
-                    {
-                        LLAMA_LOG_ERROR("%s: invalid tensor data type '%d'\n",
-                                __func__, ftype);
-                        return false;
-                    }
-        }
-        ggml_tensor * lora_tensor;
-        if (n_dims == 2) {
-            lora_tensor = ggml_new_tensor_2d(lora_ctx, wtype, ne[0], ne[1]);
-        }
-        else {
-            LLAMA_LOG_ERROR("%s: unsupported tensor dimension %d\n", __func__, n_dims);
-            return 1;
-        }
-        ggml_set_name(lora_tensor, "lora_tensor");
+        ggml_graph_compute_helper(ctx->work_buffer, gf, n_threads);
 
-        // load tensor data
-        size_t offset = fin.tellg();
-        size_t tensor_data_size = ggml_nbytes(lora_tensor);
-        offset = (offset + 31) & -32;
-        fin.seekg(offset);
-        fin.read((char*)lora_tensor->data, tensor_data_size);
+        ggml_free(shift_ctx);
+    }
 
-        lora_tensors[name] = lora_tensor;
+    return 0;
+}
 
-        // check if we have both A and B tensors and apply
-        if (lora_tensors.find(base_name + ".loraA") != lora_tensors.end() &&
-            lora_tensors.find(base_name + ".loraB") != lora_tensors.end()) {
+#define LLAMA_MAX_RNG_STATE (64*1024)
 
-            ggml_tensor * dest_t = model_tensors[base_name];
+void llama_set_rng_seed(struct llama_context * ctx, uint32_t seed) {
+    if (seed == LLAMA_DEFAULT_SEED) {
+        seed = time(NULL);
+    }
+    ctx->rng.seed(seed);
+}
 
-            offload_func_t offload_func = llama_nop;
-            offload_func_t offload_func_force_inplace = llama_nop;
+// number of logits stored in the session state
+static size_t llama_get_state_logits_capacity(const struct llama_context * ctx) {
+    const auto & hparams = ctx->model.hparams;
 
-#ifdef GGML_USE_CUBLAS
-            if (dest_t->backend == GGML_BACKEND_GPU || dest_t->backend == GGML_BACKEND_GPU_SPLIT) {
-                if (dest_t->type != GGML_TYPE_F16) {
-                    throw std::runtime_error(format(
-                        "%s: error: the simultaneous use of LoRAs and GPU acceleration is only supported for f16 models", __func__));
-                }
-                offload_func = ggml_cuda_assign_buffers;
-                offload_func_force_inplace = ggml_cuda_assign_buffers_force_inplace;
-            }
-#endif // GGML_USE_CUBLAS
+    return ctx->logits_all ? (size_t) hparams.n_ctx*hparams.n_vocab : (size_t) hparams.n_vocab;
+}
 
-            ggml_tensor * base_t;
-            if (ml) {
-                struct gguf_context * ctx_gguf = ml->ctx_gguf;
+// Returns the *maximum* size of the state
+size_t llama_get_state_size(const struct llama_context * ctx) {
+    // we don't know size of rng until we actually serialize it. so reserve more than enough memory for its serialized state.
+    // for reference, std::mt19937(1337) serializes to 6701 bytes.
+    const size_t s_rng_size        = sizeof(size_t);
+    const size_t s_rng             = LLAMA_MAX_RNG_STATE;
+    const size_t s_logits_capacity = sizeof(size_t);
+    const size_t s_logits_size     = sizeof(size_t);
+    const size_t s_logits          = llama_get_state_logits_capacity(ctx) * sizeof(float);
+    const size_t s_embedding_size  = sizeof(size_t);
+    const size_t s_embedding       = ctx->embedding.size() * sizeof(float);
+    const size_t s_kv_size         = sizeof(size_t);
+    const size_t s_kv_ntok         = sizeof(int);
+    const size_t s_kv              = llama_kv_cache_buf_size(ctx->model.hparams, ctx->kv_self.k->type, ctx->model.hparams.n_ctx);
 
-                // load from base model
-                if (gguf_find_tensor(ctx_gguf, base_name.c_str()) < 0) {
-                    // TODO: throw
-                    LLAMA_LOG_ERROR("%s: error: tensor '%s' not found in base model\n", __func__, base_name.c_str());
-                    return 1;
-                }
+    const size_t s_total = (
+        + s_rng_size
+        + s_rng
+        + s_logits_capacity
+        + s_logits_size
+        + s_logits
+        + s_embedding_size
+        + s_embedding
+        + s_kv_size
+        + s_kv_ntok
+        + s_kv
+    );
 
-                // TODO: not tested!! maybe not working!
-                base_t = ml->create_tensor(base_ctx, base_name, { (uint32_t)dest_t->ne[0], (uint32_t)dest_t->ne[1] }, GGML_BACKEND_CPU);
-                ml->load_data_for(base_t);
-            } else {
-                base_t = dest_t;
-            }
+    return s_total;
+}
 
-            if (ggml_is_quantized(base_t->type)) {
-                if (!warned) {
-                    LLAMA_LOG_WARN("%s: warning: using a lora adapter with a quantized model may result in poor quality, "
-                                   "use a f16 or f32 base model with --lora-base\n", __func__);
-                    warned = true;
-                }
-            }
+// llama_context_data
+struct llama_data_context {
+    virtual void write(const void * src, size_t size) = 0;
+    virtual size_t get_size_written() = 0;
+    virtual ~llama_data_context() = default;
+};
 
-            ggml_tensor * loraA = lora_tensors[base_name + ".loraA"];
-            GGML_ASSERT(loraA->type == GGML_TYPE_F32);
-            ggml_set_name(loraA, "loraA");
+struct llama_data_buffer_context : llama_data_context {
+    uint8_t * ptr;
+    size_t size_written = 0;
 
-            ggml_tensor * loraB = lora_tensors[base_name + ".loraB"];
-            GGML_ASSERT(loraB->type == GGML_TYPE_F32);
-            ggml_set_name(loraB, "loraB");
+    llama_data_buffer_context(uint8_t * p) : ptr(p) {}
 
-            if (base_t->ne[0] != loraA->ne[1] || base_t->ne[1] != loraB->ne[1]) {
-                LLAMA_LOG_ERROR("%s: incompatible tensor dimensions (%" PRId64 " and %" PRId64 ");"
-                                " are you sure that this adapter is for this model?\n", __func__, base_t->ne[0], loraA->ne[1]);
-                return 1;
-            }
+    void write(const void * src, size_t size) override {
+        memcpy(ptr, src, size);
+        ptr += size;
+        size_written += size;
+    }
 
-            // w = w + BA*s
-            ggml_tensor * BA = ggml_mul_mat(lora_ctx, loraA, loraB);
-            offload_func(BA);
-            ggml_set_name(BA, "BA");
+    size_t get_size_written() override {
+        return size_written;
+    }
+};
 
-            if (scaling != 1.0f) {
-                ggml_tensor * scale_tensor = ggml_new_f32(lora_ctx, scaling);
-                ggml_set_name(scale_tensor, "scale_tensor");
+struct llama_data_file_context : llama_data_context {
+    llama_file * file;
+    size_t size_written = 0;
 
-                BA = ggml_scale_inplace(lora_ctx, BA, scale_tensor);
-                offload_func(BA);
-                ggml_set_name(BA, "BA_scaled");
-            }
+    llama_data_file_context(llama_file * f) : file(f) {}
 
-            ggml_tensor * r;
-            if (base_t == dest_t) {
-                r = ggml_add_inplace(lora_ctx, dest_t, BA);
-                offload_func_force_inplace(r);
-                ggml_set_name(r, "r_add_inplace");
-            }
-            else {
-                r = ggml_add(lora_ctx, base_t, BA);
-                offload_func(r);
-                ggml_set_name(r, "r_add");
+    void write(const void * src, size_t size) override {
+        file->write_raw(src, size);
+        size_written += size;
+    }
 
-                r = ggml_cpy(lora_ctx, r, dest_t);
-                offload_func(r);
-                ggml_set_name(r, "r_cpy");
-            }
+    size_t get_size_written() override {
+        return size_written;
+    }
+};
 
-            struct ggml_cgraph gf = ggml_build_forward(r);
+// llama_context_data for reading
+struct llama_data_read_context {
+    virtual void read(void * dst, size_t size) = 0;
+    virtual void skip(size_t size) = 0;
+    virtual size_t get_size_read() = 0;
+    virtual ~llama_data_read_context() = default;
+};
 
-            ggml_graph_compute_helper(work_buffer, &gf, n_threads);
+struct llama_data_read_buffer_context : llama_data_read_context {
+    const uint8_t * ptr;
+    size_t size_read = 0;
 
-            // we won't need these tensors again, reset the context to save memory
-            ggml_free(lora_ctx);
-            lora_ctx = ggml_init(params);
-            lora_tensors.clear();
+    llama_data_read_buffer_context(const uint8_t * p) : ptr(p) {}
 
-            n_tensors++;
-            if (n_tensors % 4 == 0) {
-                LLAMA_LOG_INFO(".");
-            }
-        }
+    void read(void * dst, size_t size) override {
+        memcpy(dst, ptr, size);
+        ptr += size;
+        size_read += size;
     }
 
-    // TODO: this should be in a destructor, it will leak on failure
-    ggml_free(lora_ctx);
-    if (base_ctx) {
-        ggml_free(base_ctx);
+    void skip(size_t size) override {
+        ptr += size;
+        size_read += size;
     }
 
-    const int64_t t_lora_us = ggml_time_us() - t_start_lora_us;
-    LLAMA_LOG_INFO(" done (%.2f ms)\n", t_lora_us / 1000.0);
+    size_t get_size_read() override {
+        return size_read;
+    }
+};
 
-    return 0;
-}
+struct llama_data_read_file_context : llama_data_read_context {
+    llama_file * file;
+    size_t size_read = 0;
 
-//
-// interface implementation
-//
+    llama_data_read_file_context(llama_file * f) : file(f) {}
 
-struct llama_context_params llama_context_default_params() {
-    struct llama_context_params result = {
-        /*.seed                        =*/ LLAMA_DEFAULT_SEED,
-        /*.n_ctx                       =*/ 512,
-        /*.n_batch                     =*/ 512,
-        /*.n_gpu_layers                =*/ 0,
-        /*.main_gpu                    =*/ 0,
-        /*.tensor_split                =*/ nullptr,
-        /*.rope_freq_base              =*/ 10000.0f,
-        /*.rope_freq_scale             =*/ 1.0f,
-        /*.progress_callback           =*/ nullptr,
-        /*.progress_callback_user_data =*/ nullptr,
-        /*.low_vram                    =*/ false,
-        /*.mul_mat_q                   =*/ true,
-        /*.f16_kv                      =*/ true,
-        /*.logits_all                  =*/ false,
-        /*.vocab_only                  =*/ false,
-        /*.use_mmap                    =*/ true,
-        /*.use_mlock                   =*/ false,
-        /*.embedding                   =*/ false,
-    };
+    void read(void * dst, size_t size) override {
+        file->read_raw(dst, size);
+        size_read += size;
+    }
 
-#ifdef GGML_USE_METAL
-    result.n_gpu_layers = 1;
-#endif
+    void skip(size_t size) override {
+        file->seek(size, SEEK_CUR);
+        size_read += size;
+    }
 
-    return result;
-}
+    size_t get_size_read() override {
+        return size_read;
+    }
+};
 
-struct llama_model_quantize_params llama_model_quantize_default_params() {
-    struct llama_model_quantize_params result = {
-        /*.nthread                     =*/ 0,
-        /*.ftype                       =*/ LLAMA_FTYPE_MOSTLY_Q5_1,
-        /*.allow_requantize            =*/ false,
-        /*.quantize_output_tensor      =*/ true,
-        /*.only_copy                   =*/ false,
-    };
+/** copy state data into either a buffer or file depending on the passed in context
+ *
+ * file context:
+ * llama_file file("/path", "wb");
+ * llama_data_file_context data_ctx(&file);
+ * llama_copy_state_data(ctx, &data_ctx);
+ *
+ * buffer context:
+ * std::vector<uint8_t> buf(max_size, 0);
+ * llama_data_buffer_context data_ctx(&buf.data());
+ * llama_copy_state_data(ctx, &data_ctx);
+ *
+*/
+void llama_copy_state_data_internal(struct llama_context * ctx, llama_data_context * data_ctx) {
+    // copy rng
+    {
+        std::stringstream rng_ss;
+        rng_ss << ctx->rng;
 
-    return result;
-}
+        const size_t rng_size = rng_ss.str().size();
+        char rng_buf[LLAMA_MAX_RNG_STATE];
 
-int llama_max_devices(void) {
-    return LLAMA_MAX_DEVICES;
-}
+        memset(&rng_buf[0], 0, LLAMA_MAX_RNG_STATE);
+        memcpy(&rng_buf[0], rng_ss.str().data(), rng_ss.str().size());
 
-bool llama_mmap_supported(void) {
-    return llama_mmap::SUPPORTED;
-}
+        data_ctx->write(&rng_size,   sizeof(rng_size));
+        data_ctx->write(&rng_buf[0], LLAMA_MAX_RNG_STATE);
+    }
 
-bool llama_mlock_supported(void) {
-    return llama_mlock::SUPPORTED;
-}
+    // copy logits
+    {
+        // the last rows are kept if the last eval returned more logits than the state holds
+        const size_t logits_cap  = llama_get_state_logits_capacity(ctx);
+        const size_t logits_size = std::min(ctx->n_logits, logits_cap);
 
-void llama_backend_init(bool numa) {
-    ggml_time_init();
+        data_ctx->write(&logits_cap,  sizeof(logits_cap));
+        data_ctx->write(&logits_size, sizeof(logits_size));
 
-    // needed to initialize f16 tables
-    {
-        struct ggml_init_params params = { 0, NULL, false };
-        struct ggml_context * ctx = ggml_init(params);
-        ggml_free(ctx);
-    }
+        if (logits_size) {
+            data_ctx->write(llama_get_logits(ctx) + (ctx->n_logits - logits_size), logits_size * sizeof(float));
+        }
 
-    if (numa) {
-        ggml_numa_init();
+        // If there is a gap between the size and the capacity, write padding
+        size_t padding_size = (logits_cap - logits_size) * sizeof(float);
+        if (padding_size > 0) {
+            static const uint8_t padding[4096] = { 0 };
+            for (size_t i = 0; i < padding_size; i += sizeof(padding)) {
+                data_ctx->write(padding, std::min(sizeof(padding), padding_size - i));
+            }
+        }
     }
 
-#ifdef GGML_USE_MPI
-    ggml_mpi_backend_init();
-#endif
-}
+    // copy embeddings
+    {
+        const size_t embedding_size = ctx->embedding.size();
 
-void llama_backend_free(void) {
-#ifdef GGML_USE_MPI
-    ggml_mpi_backend_free();
-#endif
-}
+        data_ctx->write(&embedding_size, sizeof(embedding_size));
 
-int64_t llama_time_us(void) {
-    return ggml_time_us();
-}
+        if (embedding_size) {
+            data_ctx->write(ctx->embedding.data(), embedding_size * sizeof(float));
+        }
+    }
 
-struct llama_model * llama_load_model_from_file(
-                             const char * path_model,
-            struct llama_context_params   params) {
-    ggml_time_init();
+    // copy kv cache
+    {
+        const auto & kv_self = ctx->kv_self;
+        const auto & hparams = ctx->model.hparams;
+        const int    n_layer = hparams.n_layer;
+        const int    n_embd  = hparams.n_embd_gqa();
+        const int    n_ctx   = kv_self.size;
 
-    llama_model * model = new llama_model;
+        // the reported size is that of a cache for the full context, independent of the current capacity
+        const size_t kv_size = llama_kv_cache_buf_size(hparams, kv_self.k->type, hparams.n_ctx);
+        const int    kv_ntok = llama_get_kv_cache_token_count(ctx);
 
-    ggml_type memory_type = params.f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
+        data_ctx->write(&kv_size, sizeof(kv_size));
+        data_ctx->write(&kv_ntok, sizeof(kv_ntok));
 
-    unsigned cur_percentage = 0;
-    if (params.progress_callback == NULL) {
-        params.progress_callback_user_data = &cur_percentage;
-        params.progress_callback = [](float progress, void * ctx) {
-            unsigned * cur_percentage_p = (unsigned *) ctx;
-            unsigned percentage = (unsigned) (100 * progress);
-            while (percentage > *cur_percentage_p) {
-                *cur_percentage_p = percentage;
-                LLAMA_LOG_INFO(".");
-                if (percentage >= 100) {
-                    LLAMA_LOG_INFO("\n");
-                }
+        if (kv_size) {
+            const size_t elt_size = ggml_element_size(kv_self.k);
+
+            // the cache is written straight to the destination, K as [n_embd, kv_ntok, n_layer] and V as [kv_ntok, n_embd, n_layer]
+            for (int il = 0; il < n_layer; ++il) {
+                const uint8_t * k = (const uint8_t *) kv_self.k->data + elt_size*n_embd*n_ctx*il;
+                data_ctx->write(k, elt_size*n_embd*kv_ntok);
             }
-        };
-    }
 
-    if (!llama_model_load(path_model, *model, params.n_ctx, params.n_batch, params.n_gpu_layers,
-                params.main_gpu, params.tensor_split, params.mul_mat_q, params.rope_freq_base, params.rope_freq_scale,
-                params.low_vram, memory_type, params.use_mmap, params.use_mlock, params.vocab_only,
-                params.progress_callback, params.progress_callback_user_data)) {
-        LLAMA_LOG_ERROR("%s: failed to load model\n", __func__);
-        delete model;
-        return nullptr;
+            for (int il = 0; il < n_layer; ++il) {
+                for (int ir = 0; ir < n_embd; ++ir) {
+                    const uint8_t * v = (const uint8_t *) kv_self.v->data + elt_size*n_ctx*(n_embd*il + ir);
+                    data_ctx->write(v, elt_size*kv_ntok);
+                }
+            }
+        }
     }
-
-    return model;
 }
 
-void llama_free_model(struct llama_model * model) {
-    delete model;
-}
+size_t llama_copy_state_data(struct llama_context * ctx, uint8_t * dst) {
+    llama_data_buffer_context data_ctx(dst);
+    llama_copy_state_data_internal(ctx, &data_ctx);
 
-struct llama_context * llama_new_context_with_model(
-                 struct llama_model * model,
-        struct llama_context_params   params) {
+    return data_ctx.get_size_written();
+}
 
-    if (!model) {
-        return nullptr;
-    }
+// Sets the state reading from either a buffer or a file depending on the passed in context
+static void llama_set_state_data_internal(struct llama_context * ctx, llama_data_read_context * data_ctx) {
+    // set rng
+    {
+        size_t rng_size;
+        char   rng_buf[LLAMA_MAX_RNG_STATE];
 
-    llama_context * ctx = new llama_context(*model);
+        data_ctx->read(&rng_size,   sizeof(rng_size));
+        data_ctx->read(&rng_buf[0], LLAMA_MAX_RNG_STATE);
 
-    if (params.seed == LLAMA_DEFAULT_SEED) {
-        params.seed = time(NULL);
-    }
+        GGML_ASSERT(rng_size <= LLAMA_MAX_RNG_STATE);
 
-    ctx->rng = std::mt19937(params.seed);
-    ctx->logits_all = params.logits_all;
+        std::stringstream rng_ss;
+        rng_ss.str(std::string(&rng_buf[0], rng_size));
+        rng_ss >> ctx->rng;
 
-    ggml_type memory_type = params.f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
+        GGML_ASSERT(!rng_ss.fail());
+    }
 
-    // reserve memory for context buffers
-    if (!params.vocab_only) {
-        if (!llama_kv_cache_init(ctx->model.hparams, ctx->kv_self, memory_type, ctx->model.hparams.n_ctx, params.n_gpu_layers)) {
-            LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for self-attention cache\n", __func__);
-            llama_free(ctx);
-            return nullptr;
-        }
+    // set logits
+    {
+        size_t logits_cap;
+        size_t logits_size;
 
-        {
-            const size_t memory_size = ggml_nbytes(ctx->kv_self.k) + ggml_nbytes(ctx->kv_self.v);
-            LLAMA_LOG_INFO("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
-        }
+        data_ctx->read(&logits_cap,  sizeof(logits_cap));
+        data_ctx->read(&logits_size, sizeof(logits_size));
 
-        const auto & hparams = ctx->model.hparams;
+        GGML_ASSERT(llama_get_state_logits_capacity(ctx) == logits_cap);
+        GGML_ASSERT(logits_size <= logits_cap);
 
-        // resized during inference
-        if (params.logits_all) {
-            ctx->logits.reserve(hparams.n_ctx*hparams.n_vocab);
+        if (ctx->logits_ext) {
+            GGML_ASSERT(ctx->logits_ext_size >= logits_size);
         } else {
-            ctx->logits.reserve(hparams.n_vocab);
+            ctx->logits.resize(logits_size);
         }
 
-        if (params.embedding){
-            ctx->embedding.resize(hparams.n_embd);
+        if (logits_size) {
+            data_ctx->read(llama_get_logits(ctx), logits_size * sizeof(float));
         }
 
-        {
-            static const size_t tensor_alignment = 32;
-            // the compute buffer is used to store the tensor and graph structs, while the allocator buffer is used for the tensor data
-            ctx->buf_compute.resize(ggml_tensor_overhead()*GGML_MAX_NODES + ggml_graph_overhead());
+        ctx->n_logits = logits_size;
 
-            // create measure allocator
-            ctx->alloc = ggml_allocr_new_measure(tensor_alignment);
+        data_ctx->skip((logits_cap - logits_size) * sizeof(float));
+    }
 
-            // build worst-case graph
-            int n_tokens = std::min((int)hparams.n_ctx, params.n_batch);
-            int n_past = hparams.n_ctx - n_tokens;
-            llama_token token = llama_token_bos(ctx); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
-            ggml_cgraph * gf = llama_build_graph(*ctx, &token, NULL, n_tokens, n_past);
-#ifdef GGML_USE_METAL
-            if (params.n_gpu_layers > 0) {
-                ctx->ctx_metal = ggml_metal_init(1);
-                if (!ctx->ctx_metal) {
-                    LLAMA_LOG_ERROR("%s: ggml_metal_init() failed\n", __func__);
-                    llama_free(ctx);
-                    return NULL;
-                }
-                ggml_metal_graph_find_concurrency(ctx->ctx_metal, gf, false);
-                ggml_allocr_set_parse_seq(ctx->alloc, ggml_metal_get_concur_list(ctx->ctx_metal), ggml_metal_if_optimized(ctx->ctx_metal));
-            }
-#endif
-            // measure memory requirements for the graph
-            size_t alloc_size = ggml_allocr_alloc_graph(ctx->alloc, gf) + tensor_alignment;
+    // set embeddings
+    {
+        size_t embedding_size;
 
-            LLAMA_LOG_INFO("%s: compute buffer total size = %7.2f MB\n", __func__, (ctx->buf_compute.size + alloc_size) / 1024.0 / 1024.0);
+        data_ctx->read(&embedding_size, sizeof(embedding_size));
 
-            // recreate allocator with exact memory requirements
-            ggml_allocr_free(ctx->alloc);
+        GGML_ASSERT(ctx->embedding.capacity() == embedding_size);
 
-            ctx->buf_alloc.resize(alloc_size);
-            ctx->alloc = ggml_allocr_new(ctx->buf_alloc.data, ctx->buf_alloc.size, tensor_alignment);
-#ifdef GGML_USE_METAL
-            if (ctx->ctx_metal) {
-                ggml_allocr_set_parse_seq(ctx->alloc, ggml_metal_get_concur_list(ctx->ctx_metal), ggml_metal_if_optimized(ctx->ctx_metal));
-            }
-#endif
-#ifdef GGML_USE_CUBLAS
-            if (params.low_vram) {
-                LLAMA_LOG_INFO("%s: not allocating a VRAM scratch buffer due to low VRAM option\n", __func__);
-                ggml_cuda_set_scratch_size(0); // disable scratch
-            } else {
-                ggml_cuda_set_scratch_size(alloc_size);
-                LLAMA_LOG_INFO("%s: VRAM scratch buffer: %.2f MB\n", __func__, alloc_size / 1024.0 / 1024.0);
-            }
-#endif
+        if (embedding_size) {
+            data_ctx->read(ctx->embedding.data(), embedding_size * sizeof(float));
         }
+    }
 
-#ifdef GGML_USE_METAL
-        if (params.n_gpu_layers > 0) {
-            // this allocates all Metal resources and memory buffers
+    // set kv cache
+    {
+        const auto & kv_self = ctx->kv_self;
+        const auto & hparams = ctx->model.hparams;
+        const int    n_layer = hparams.n_layer;
+        const int    n_embd  = hparams.n_embd_gqa();
 
-            void * data_ptr  = NULL;
-            size_t data_size = 0;
+        size_t kv_size;
+        int kv_ntok;
 
-            if (params.use_mmap) {
-                data_ptr  = ctx->model.mapping->addr;
-                data_size = ctx->model.mapping->size;
-            } else {
-                data_ptr  = ggml_get_mem_buffer(ctx->model.ctx);
-                data_size = ggml_get_mem_size  (ctx->model.ctx);
+        data_ctx->read(&kv_size, sizeof(kv_size));
+        data_ctx->read(&kv_ntok, sizeof(kv_ntok));
+
+        if (kv_size) {
+            GGML_ASSERT(llama_kv_cache_buf_size(hparams, kv_self.k->type, hparams.n_ctx) == kv_size);
+            if (!llama_kv_cache_reserve(*ctx, kv_ntok)) {
+                LLAMA_LOG_ERROR("%s: failed to grow the KV cache to %d tokens\n", __func__, kv_ntok);
+                GGML_ASSERT(false);
             }
 
-            const size_t max_size = ggml_get_max_tensor_size(ctx->model.ctx);
+            const int n_ctx = kv_self.size;
 
-            LLAMA_LOG_INFO("%s: max tensor size = %8.2f MB\n", __func__, max_size/1024.0/1024.0);
+            const size_t elt_size = ggml_element_size(kv_self.k);
 
-#define LLAMA_METAL_CHECK_BUF(result)                            \
-            if (!(result)) {                                             \
-                LLAMA_LOG_ERROR("%s: failed to add buffer\n", __func__); \
-                llama_free(ctx);                                         \
-                return NULL;                                             \
+            // the cache is read straight into kv_self, see llama_copy_state_data_internal for the layout
+            for (int il = 0; il < n_layer; ++il) {
+                uint8_t * k = (uint8_t *) kv_self.k->data + elt_size*n_embd*n_ctx*il;
+                data_ctx->read(k, elt_size*n_embd*kv_ntok);
             }
 
-            LLAMA_METAL_CHECK_BUF(ggml_metal_add_buffer(ctx->ctx_metal, "data", data_ptr, data_size, max_size));
-
-            LLAMA_METAL_CHECK_BUF(ggml_metal_add_buffer(ctx->ctx_metal, "eval", ctx->buf_compute.data, ctx->buf_compute.size, 0));
-            LLAMA_METAL_CHECK_BUF(ggml_metal_add_buffer(ctx->ctx_metal, "kv",   ctx->kv_self.buf.data, ctx->kv_self.buf.size, 0));
-
-            LLAMA_METAL_CHECK_BUF(ggml_metal_add_buffer(ctx->ctx_metal, "alloc", ctx->buf_alloc.data, ctx->buf_alloc.size, 0));
-#undef LLAMA_METAL_CHECK_BUF
+            for (int il = 0; il < n_layer; ++il) {
+                for (int ir = 0; ir < n_embd; ++ir) {
+                    uint8_t * v = (uint8_t *) kv_self.v->data + elt_size*n_ctx*(n_embd*il + ir);
+                    data_ctx->read(v, elt_size*kv_ntok);
+                }
+            }
         }
-#endif
-    }
-
-#ifdef GGML_USE_MPI
-    ctx->ctx_mpi = ggml_mpi_init();
 
-    if (ggml_mpi_rank(ctx->ctx_mpi) > 0) {
-        // Enter a blocking eval loop with dummy input, letting rank=0 drive the process
-        const std::vector<llama_token> tmp(ctx->model.hparams.n_ctx, llama_token_bos(ctx));
-        while (!llama_eval(ctx, tmp.data(), tmp.size(), 0, 0)) {};
-        llama_backend_free();
-        exit(1);
+        ctx->kv_self.n = kv_ntok;
     }
-#endif
-
-    return ctx;
 }
 
-struct llama_context * llama_init_from_file(
-                             const char * path_model,
-            struct llama_context_params   params) {
-    struct llama_model * model = llama_load_model_from_file(path_model, params);
-    if (!model) {
-        return nullptr;
-    }
+// Sets the state reading from the specified source address
+size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
+    llama_data_read_buffer_context data_ctx(src);
+    llama_set_state_data_internal(ctx, &data_ctx);
 
-    struct llama_context * ctx = llama_new_context_with_model(model, params);
-    ctx->model_owner = true;
+    const size_t nread    = data_ctx.get_size_read();
+    const size_t max_size = llama_get_state_size(ctx);
 
-    return ctx;
-}
+    GGML_ASSERT(nread <= max_size);
 
-void llama_free(struct llama_context * ctx) {
-    delete ctx;
+    return nread;
 }
 
-int llama_n_vocab(const struct llama_context * ctx) {
-    return llama_model_n_vocab(&ctx->model);
-}
+static bool llama_load_session_compact(struct llama_context * ctx, llama_file & file, const char * path_session, const llama_token * tokens, size_t n_token_count, int depth);
 
-int llama_n_ctx(const struct llama_context * ctx) {
-    return llama_model_n_ctx(&ctx->model);
-}
+static bool llama_load_session_file_internal(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out, int depth) {
+    llama_file file(path_session, "rb");
 
-int llama_n_ctx_train(const struct llama_context * ctx) {
-    return llama_model_n_ctx_train(&ctx->model);
-}
+    uint32_t version;
 
-int llama_n_embd(const struct llama_context * ctx) {
-    return llama_model_n_embd(&ctx->model);
-}
+    // sanity checks
+    {
+        const uint32_t magic = file.read_u32();
+        version = file.read_u32();
 
-enum llama_vocab_type llama_vocab_type(const struct llama_context * ctx) {
-    return ctx->model.vocab.type;
-}
+        if (magic != LLAMA_SESSION_MAGIC || (version != LLAMA_SESSION_VERSION && version != LLAMA_SESSION_VERSION_COMPACT)) {
+            LLAMA_LOG_ERROR("%s : unknown (magic, version) for session file: %08x, %08x\n", __func__, magic, version);
+            return false;
+        }
 
-int llama_model_n_vocab(const struct llama_model * model) {
-    return model->vocab.id_to_token.size();
-}
+        llama_hparams session_hparams;
+        file.read_raw(&session_hparams, sizeof(llama_hparams));
 
-int llama_model_n_ctx(const struct llama_model * model) {
-    return model->hparams.n_ctx;
-}
+        if (session_hparams != ctx->model.hparams) {
+            LLAMA_LOG_INFO("%s : model hparams didn't match from session file!\n", __func__);
+            return false;
+        }
+    }
 
-int llama_model_n_ctx_train(const struct llama_model * model) {
-    return model->hparams.n_ctx_train;
-}
+    // load the prompt
+    {
+        const uint32_t n_token_count = file.read_u32();
 
-int llama_model_n_embd(const struct llama_model * model) {
-    return model->hparams.n_embd;
-}
+        if (n_token_count > n_token_capacity) {
+            LLAMA_LOG_ERROR("%s : token count in session file exceeded capacity! %u > %zu\n", __func__, n_token_count, n_token_capacity);
+            return false;
+        }
 
-int llama_model_desc(const struct llama_model * model, char * buf, size_t buf_size) {
-    return snprintf(buf, buf_size, "%s %s %s",
-            model->name.c_str(),
-            llama_model_type_name(model->type),
-            llama_model_ftype_name(model->ftype).c_str());
-}
+        file.read_raw(tokens_out, sizeof(llama_token) * n_token_count);
+        *n_token_count_out = n_token_count;
+    }
 
-uint64_t llama_model_size(const struct llama_model * model) {
-    uint64_t size = 0;
-    for (const auto & it : model->tensors_by_name) {
-        size += ggml_nbytes(it.second);
+    if (version == LLAMA_SESSION_VERSION_COMPACT) {
+        return llama_load_session_compact(ctx, file, path_session, tokens_out, *n_token_count_out, depth);
     }
-    return size;
-}
 
-uint64_t llama_model_n_params(const struct llama_model * model) {
-    uint64_t nparams = 0;
-    for (const auto & it : model->tensors_by_name) {
-        nparams += ggml_nelements(it.second);
+    // restore the context state
+    {
+        const size_t n_state_size_cur = file.size - file.tell();
+        const size_t n_state_size_max = llama_get_state_size(ctx);
+
+        if (n_state_size_cur > n_state_size_max) {
+            LLAMA_LOG_ERROR("%s : the state size in session file is too big! max %zu, got %zu\n", __func__, n_state_size_max, n_state_size_cur);
+            return false;
+        }
+
+        // the state is read straight from the file into the context
+        llama_data_read_file_context data_ctx(&file);
+        llama_set_state_data_internal(ctx, &data_ctx);
     }
-    return nparams;
+
+    return true;
 }
 
-int llama_model_quantize(
-        const char * fname_inp,
-        const char * fname_out,
-        const llama_model_quantize_params * params) {
+bool llama_load_session_file(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
     try {
-        llama_model_quantize_internal(fname_inp, fname_out, params);
-        return 0;
+        return llama_load_session_file_internal(ctx, path_session, tokens_out, n_token_capacity, n_token_count_out, 0);
     } catch (const std::exception & err) {
-        LLAMA_LOG_ERROR("%s: failed to quantize: %s\n", __func__, err.what());
-        return 1;
+        LLAMA_LOG_ERROR("error loading session file: %s\n", err.what());
+        return false;
     }
 }
 
-int llama_apply_lora_from_file(struct llama_context * ctx, const char * path_lora, const char * path_base_model, int n_threads) {
-    try {
-        return llama_apply_lora_from_file_internal(ctx->model, path_lora, path_base_model, n_threads);
-    } catch (const std::exception & err) {
-        LLAMA_LOG_ERROR("%s: failed to apply lora adapter: %s\n", __func__, err.what());
-        return 1;
+bool llama_save_session_file(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count) {
+    llama_file file(path_session, "wb");
+
+    file.write_u32(LLAMA_SESSION_MAGIC);
+    file.write_u32(LLAMA_SESSION_VERSION);
+
+    file.write_raw(&ctx->model.hparams, sizeof(llama_hparams));
+
+    // save the prompt
+    file.write_u32((uint32_t) n_token_count);
+    file.write_raw(tokens, sizeof(llama_token) * n_token_count);
+
+    // save the context state using stream saving
+    llama_data_file_context data_ctx(&file);
+    llama_copy_state_data_internal(ctx, &data_ctx);
+
+    return true;
+}
+
+// compact session files
+//
+// after the prompt, a compact session file holds:
+//  - the path of the parent session file and the number of tokens of the cache taken from it (n_base)
+//  - the rng, the last logits without padding and the embeddings
+//  - the cache of the tokens [n_base, kv_ntok), by token: the K rows of all the layers, then the V rows, in kv_type
+
+// converts between the rows of the cache and their stored type through f32
+static void llama_session_row_to_float(ggml_type type, const void * src, float * dst, int n) {
+    if (type == GGML_TYPE_F32) {
+        memcpy(dst, src, n*sizeof(float));
+    } else {
+        ggml_internal_get_type_traits(type).to_float(src, dst, n);
     }
 }
 
-int llama_model_apply_lora_from_file(const struct llama_model * model, const char * path_lora, const char * path_base_model, int n_threads) {
-    try {
-        return llama_apply_lora_from_file_internal(*model, path_lora, path_base_model, n_threads);
-    } catch (const std::exception & err) {
-        LLAMA_LOG_ERROR("%s: failed to apply lora adapter: %s\n", __func__, err.what());
-        return 1;
+static void llama_session_row_from_float(ggml_type type, const float * src, void * dst, int n) {
+    if (type == GGML_TYPE_F32) {
+        memcpy(dst, src, n*sizeof(float));
+    } else {
+        ggml_internal_get_type_traits(type).from_float(src, dst, n);
     }
 }
 
-int llama_get_kv_cache_token_count(const struct llama_context * ctx) {
-    return ctx->kv_self.n;
+static bool llama_path_is_absolute(const std::string & path) {
+    return (!path.empty() && (path[0] == '/' || path[0] == '\\')) || (path.size() > 1 && path[1] == ':');
 }
 
-#define LLAMA_MAX_RNG_STATE (64*1024)
-
-void llama_set_rng_seed(struct llama_context * ctx, uint32_t seed) {
-    if (seed == LLAMA_DEFAULT_SEED) {
-        seed = time(NULL);
+// the components of the absolute form of a path, with "." and ".." resolved - the first one is the root
+static std::vector<std::string> llama_path_components(const std::string & path) {
+    std::string path_abs = path;
+    if (!llama_path_is_absolute(path)) {
+        char cwd[4096];
+#if defined(_WIN32)
+        const bool ok = _getcwd(cwd, sizeof(cwd)) != NULL;
+#else
+        const bool ok = getcwd(cwd, sizeof(cwd)) != NULL;
+#endif
+        if (!ok) {
+            throw std::runtime_error(format("failed to get the current directory: %s", strerror(errno)));
+        }
+        path_abs = std::string(cwd) + "/" + path;
     }
-    ctx->rng.seed(seed);
-}
-
-// Returns the *maximum* size of the state
-size_t llama_get_state_size(const struct llama_context * ctx) {
-    // we don't know size of rng until we actually serialize it. so reserve more than enough memory for its serialized state.
-    // for reference, std::mt19937(1337) serializes to 6701 bytes.
-    const size_t s_rng_size        = sizeof(size_t);
-    const size_t s_rng             = LLAMA_MAX_RNG_STATE;
-    const size_t s_logits_capacity = sizeof(size_t);
-    const size_t s_logits_size     = sizeof(size_t);
-    const size_t s_logits          = ctx->logits.capacity() * sizeof(float);
-    const size_t s_embedding_size  = sizeof(size_t);
-    const size_t s_embedding       = ctx->embedding.size() * sizeof(float);
-    const size_t s_kv_size         = sizeof(size_t);
-    const size_t s_kv_ntok         = sizeof(int);
-    const size_t s_kv              = ctx->kv_self.buf.size;
 
-    const size_t s_total = (
-        + s_rng_size
-        + s_rng
-        + s_logits_capacity
-        + s_logits_size
-        + s_logits
-        + s_embedding_size
-        + s_embedding
-        + s_kv_size
-        + s_kv_ntok
-        + s_kv
-    );
+    std::vector<std::string> parts;
+    size_t i0 = 0;
+    for (size_t i = 0; i <= path_abs.size(); ++i) {
+        if (i < path_abs.size() && path_abs[i] != '/' && path_abs[i] != '\\') {
+            continue;
+        }
+        const std::string part = path_abs.substr(i0, i - i0);
+        if (parts.empty()) {
+            parts.push_back(part);
+        } else if (part == "..") {
+            if (parts.size() > 1) {
+                parts.pop_back();
+            }
+        } else if (!part.empty() && part != ".") {
+            parts.push_back(part);
+        }
+        i0 = i + 1;
+    }
 
-    return s_total;
+    return parts;
 }
 
-// llama_context_data
-struct llama_data_context {
-    virtual void write(const void * src, size_t size) = 0;
-    virtual size_t get_size_written() = 0;
-    virtual ~llama_data_context() = default;
-};
-
-struct llama_data_buffer_context : llama_data_context {
-    uint8_t * ptr;
-    size_t size_written = 0;
+// the path of a parent session file as stored in a compact session file: relative to the directory of the
+// session file, so that the files can be moved together and used from any working directory
+static std::string llama_session_parent_to_stored(const std::string & path_parent, const std::string & path_session) {
+    const std::vector<std::string> parent = llama_path_components(path_parent);
+    std::vector<std::string> dir = llama_path_components(path_session);
+    dir.pop_back();
 
-    llama_data_buffer_context(uint8_t * p) : ptr(p) {}
+    std::string res;
+    if (parent[0] != dir[0]) {
+        // on another drive
+        for (size_t i = 0; i < parent.size(); ++i) {
+            res += parent[i] + (i + 1 < parent.size() ? "/" : "");
+        }
+        return res;
+    }
 
-    void write(const void * src, size_t size) override {
-        memcpy(ptr, src, size);
-        ptr += size;
-        size_written += size;
+    size_t n_common = 0;
+    while (n_common < dir.size() && n_common + 1 < parent.size() && dir[n_common] == parent[n_common]) {
+        n_common++;
+    }
+    for (size_t i = n_common; i < dir.size(); ++i) {
+        res += "../";
     }
+    for (size_t i = n_common; i < parent.size(); ++i) {
+        res += parent[i] + (i + 1 < parent.size() ? "/" : "");
+    }
+    return res;
+}
 
-    size_t get_size_written() override {
-        return size_written;
+// the path of a parent session file read from a compact session file
+static std::string llama_session_parent_from_stored(const std::string & path_stored, const std::string & path_session) {
+    if (llama_path_is_absolute(path_stored)) {
+        return path_stored;
     }
-};
+    const size_t pos = path_session.find_last_of("/\\");
+    return pos == std::string::npos ? path_stored : path_session.substr(0, pos + 1) + path_stored;
+}
 
-struct llama_data_file_context : llama_data_context {
-    llama_file * file;
-    size_t size_written = 0;
+// reads the prompt of a session file of either version
+static bool llama_session_read_tokens(const struct llama_context * ctx, const char * path_session, std::vector<llama_token> & tokens) {
+    llama_file file(path_session, "rb");
 
-    llama_data_file_context(llama_file * f) : file(f) {}
+    const uint32_t magic   = file.read_u32();
+    const uint32_t version = file.read_u32();
 
-    void write(const void * src, size_t size) override {
-        file->write_raw(src, size);
-        size_written += size;
+    if (magic != LLAMA_SESSION_MAGIC || (version != LLAMA_SESSION_VERSION && version != LLAMA_SESSION_VERSION_COMPACT)) {
+        LLAMA_LOG_ERROR("%s : unknown (magic, version) for session file: %08x, %08x\n", __func__, magic, version);
+        return false;
     }
 
-    size_t get_size_written() override {
-        return size_written;
+    llama_hparams session_hparams;
+    file.read_raw(&session_hparams, sizeof(llama_hparams));
+
+    if (session_hparams != ctx->model.hparams) {
+        LLAMA_LOG_ERROR("%s : model hparams didn't match from session file!\n", __func__);
+        return false;
     }
-};
 
-/** copy state data into either a buffer or file depending on the passed in context
- *
- * file context:
- * llama_file file("/path", "wb");
- * llama_data_file_context data_ctx(&file);
- * llama_copy_state_data(ctx, &data_ctx);
- *
- * buffer context:
- * std::vector<uint8_t> buf(max_size, 0);
- * llama_data_buffer_context data_ctx(&buf.data());
- * llama_copy_state_data(ctx, &data_ctx);
- *
-*/
-void llama_copy_state_data_internal(struct llama_context * ctx, llama_data_context * data_ctx) {
-    // copy rng
-    {
-        std::stringstream rng_ss;
-        rng_ss << ctx->rng;
+    tokens.resize(file.read_u32());
+    file.read_raw(tokens.data(), sizeof(llama_token) * tokens.size());
 
-        const size_t rng_size = rng_ss.str().size();
-        char rng_buf[LLAMA_MAX_RNG_STATE];
+    return true;
+}
 
-        memset(&rng_buf[0], 0, LLAMA_MAX_RNG_STATE);
-        memcpy(&rng_buf[0], rng_ss.str().data(), rng_ss.str().size());
+// the rows of V are stored by embedding dimension in the cache, they are transposed by chunks of tokens
+static const int LLAMA_SESSION_V_CHUNK = 32;
 
-        data_ctx->write(&rng_size,   sizeof(rng_size));
-        data_ctx->write(&rng_buf[0], LLAMA_MAX_RNG_STATE);
-    }
+static bool llama_save_session_file_compact_internal(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count, enum ggml_type kv_type, const char * path_parent) {
+    const auto & kv_self = ctx->kv_self;
+    const auto & hparams = ctx->model.hparams;
+    const int    n_layer = hparams.n_layer;
+    const int    n_embd  = hparams.n_embd_gqa();
+    const int    n_ctx   = kv_self.size;
 
-    // copy logits
-    {
-        const size_t logits_cap  = ctx->logits.capacity();
-        const size_t logits_size = ctx->logits.size();
+    // only the cache of the tokens of the prompt is stored, the logits are stored if they follow its last token
+    const int    kv_ntok = std::min(llama_get_kv_cache_token_count(ctx), (int) n_token_count);
+    const bool   logits  = kv_ntok == llama_get_kv_cache_token_count(ctx);
 
-        data_ctx->write(&logits_cap,  sizeof(logits_cap));
-        data_ctx->write(&logits_size, sizeof(logits_size));
+    const ggml_type_traits_t traits = ggml_internal_get_type_traits(kv_type);
+    if (kv_type != GGML_TYPE_F32 && (!traits.to_float || !traits.from_float)) {
+        LLAMA_LOG_ERROR("%s: the cache cannot be stored as %s\n", __func__, ggml_type_name(kv_type));
+        return false;
+    }
+    if (n_embd % ggml_blck_size(kv_type) != 0) {
+        LLAMA_LOG_ERROR("%s: the rows of %d values of the cache cannot be stored as %s\n", __func__, n_embd, ggml_type_name(kv_type));
+        return false;
+    }
 
-        if (logits_size) {
-            data_ctx->write(ctx->logits.data(), logits_size * sizeof(float));
+    // the cache of the tokens of the parent session is not stored again
+    uint32_t n_base = 0;
+    std::string parent_stored;
+    if (path_parent && *path_parent) {
+        if (llama_path_components(path_parent) == llama_path_components(path_session)) {
+            LLAMA_LOG_ERROR("%s: a session file cannot be its own parent\n", __func__);
+            return false;
         }
 
-        // If there is a gap between the size and the capacity, write padding
-        size_t padding_size = (logits_cap - logits_size) * sizeof(float);
-        if (padding_size > 0) {
-            std::vector<uint8_t> padding(padding_size, 0); // Create a buffer filled with zeros
-            data_ctx->write(padding.data(), padding_size);
+        std::vector<llama_token> parent_tokens;
+        if (!llama_session_read_tokens(ctx, path_parent, parent_tokens)) {
+            return false;
         }
-    }
-
-    // copy embeddings
-    {
-        const size_t embedding_size = ctx->embedding.size();
-
-        data_ctx->write(&embedding_size, sizeof(embedding_size));
-
-        if (embedding_size) {
-            data_ctx->write(ctx->embedding.data(), embedding_size * sizeof(float));
+        if (parent_tokens.size() > n_token_count || parent_tokens.size() > (size_t) kv_ntok ||
+            !std::equal(parent_tokens.begin(), parent_tokens.end(), tokens)) {
+            LLAMA_LOG_ERROR("%s: the prompt of the parent session '%s' is not a prefix of the prompt\n", __func__, path_parent);
+            return false;
         }
+        n_base = parent_tokens.size();
+        parent_stored = llama_session_parent_to_stored(path_parent, path_session);
     }
 
-    // copy kv cache
-    {
-        const auto & kv_self = ctx->kv_self;
-        const auto & hparams = ctx->model.hparams;
-        const int    n_layer = hparams.n_layer;
-        const int    n_embd  = hparams.n_embd_gqa();
-        const int    n_ctx   = hparams.n_ctx;
-
-        const size_t kv_size = kv_self.buf.size;
-        const int    kv_ntok = llama_get_kv_cache_token_count(ctx);
+    llama_file file(path_session, "wb");
 
-        data_ctx->write(&kv_size, sizeof(kv_size));
-        data_ctx->write(&kv_ntok, sizeof(kv_ntok));
+    file.write_u32(LLAMA_SESSION_MAGIC);
+    file.write_u32(LLAMA_SESSION_VERSION_COMPACT);
 
-        if (kv_size) {
-            const size_t elt_size = ggml_element_size(kv_self.k);
+    file.write_raw(&hparams, sizeof(llama_hparams));
 
-            ggml_context * cpy_ctx = ggml_init({ 4096, NULL, /* no_alloc */ true });
-            ggml_cgraph gf{};
+    // save the prompt
+    file.write_u32((uint32_t) n_token_count);
+    file.write_raw(tokens, sizeof(llama_token) * n_token_count);
 
-            ggml_tensor * kout3d = ggml_new_tensor_3d(cpy_ctx, kv_self.k->type, n_embd, kv_ntok, n_layer);
-            std::vector<uint8_t> kout3d_data(ggml_nbytes(kout3d), 0);
-            kout3d->data = kout3d_data.data();
+    // save the parent, relative to the directory of this file
+    file.write_u32((uint32_t) parent_stored.size());
+    file.write_raw(parent_stored.data(), parent_stored.size());
+    file.write_u32(n_base);
 
-            ggml_tensor * vout3d = ggml_new_tensor_3d(cpy_ctx, kv_self.v->type, kv_ntok, n_embd, n_layer);
-            std::vector<uint8_t> vout3d_data(ggml_nbytes(vout3d), 0);
-            vout3d->data = vout3d_data.data();
+    // save the rng, logits and embeddings
+    {
+        std::stringstream rng_ss;
+        rng_ss << ctx->rng;
 
-            ggml_tensor * k3d = ggml_view_3d(cpy_ctx, kv_self.k,
-                n_embd, kv_ntok, n_layer,
-                elt_size*n_embd, elt_size*n_embd*n_ctx, 0);
+        file.write_u32((uint32_t) rng_ss.str().size());
+        file.write_raw(rng_ss.str().data(), rng_ss.str().size());
 
-            ggml_tensor * v3d = ggml_view_3d(cpy_ctx, kv_self.v,
-                kv_ntok, n_embd, n_layer,
-                elt_size*n_ctx, elt_size*n_ctx*n_embd, 0);
+        const size_t logits_size = logits ? std::min(ctx->n_logits, llama_get_state_logits_capacity(ctx)) : 0;
+        file.write_u32((uint32_t) logits_size);
+        file.write_raw(llama_get_logits(ctx) + (ctx->n_logits - logits_size), logits_size * sizeof(float));
 
-            ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, k3d, kout3d));
-            ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, v3d, vout3d));
-            ggml_graph_compute_helper(ctx->work_buffer, &gf, /*n_threads*/ 1);
+        file.write_u32((uint32_t) ctx->embedding.size());
+        file.write_raw(ctx->embedding.data(), ctx->embedding.size() * sizeof(float));
+    }
 
-            ggml_free(cpy_ctx);
+    // save the cache of the new tokens
+    {
+        file.write_u32((uint32_t) kv_type);
+        file.write_u32((uint32_t) kv_ntok);
+
+        const ggml_type type_kv  = kv_self.k->type;
+        const size_t    elt_size = ggml_element_size(kv_self.k);
+        const size_t    row_size = ggml_type_size(kv_type)*n_embd/ggml_blck_size(kv_type);
+
+        std::vector<float>   row_f32(n_embd);
+        std::vector<float>   chunk_f32(n_embd*LLAMA_SESSION_V_CHUNK);
+        std::vector<uint8_t> row_out(row_size);
+
+        for (int il = 0; il < n_layer; ++il) {
+            for (int it = n_base; it < kv_ntok; ++it) {
+                const uint8_t * k = (const uint8_t *) kv_self.k->data + elt_size*(n_embd*n_ctx*il + n_embd*it);
+                llama_session_row_to_float(type_kv, k, row_f32.data(), n_embd);
+                llama_session_row_from_float(kv_type, row_f32.data(), row_out.data(), n_embd);
+                file.write_raw(row_out.data(), row_size);
+            }
+        }
 
-            // our data is now in the kout3d_data and vout3d_data buffers
-            // write them to file
-            data_ctx->write(kout3d_data.data(), kout3d_data.size());
-            data_ctx->write(vout3d_data.data(), vout3d_data.size());
+        for (int il = 0; il < n_layer; ++il) {
+            for (int i0 = n_base; i0 < kv_ntok; i0 += LLAMA_SESSION_V_CHUNK) {
+                const int nt = std::min(LLAMA_SESSION_V_CHUNK, kv_ntok - i0);
+                for (int ir = 0; ir < n_embd; ++ir) {
+                    const uint8_t * v = (const uint8_t *) kv_self.v->data + elt_size*(n_ctx*(n_embd*il + ir) + i0);
+                    llama_session_row_to_float(type_kv, v, chunk_f32.data() + ir*LLAMA_SESSION_V_CHUNK, nt);
+                }
+                for (int it = 0; it < nt; ++it) {
+                    for (int ir = 0; ir < n_embd; ++ir) {
+                        row_f32[ir] = chunk_f32[ir*LLAMA_SESSION_V_CHUNK + it];
+                    }
+                    llama_session_row_from_float(kv_type, row_f32.data(), row_out.data(), n_embd);
+                    file.write_raw(row_out.data(), row_size);
+                }
+            }
         }
     }
-}
 
-size_t llama_copy_state_data(struct llama_context * ctx, uint8_t * dst) {
-    llama_data_buffer_context data_ctx(dst);
-    llama_copy_state_data_internal(ctx, &data_ctx);
+    return true;
+}
 
-    return data_ctx.get_size_written();
+bool llama_save_session_file_compact(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count, enum ggml_type kv_type, const char * path_parent) {
+    try {
+        return llama_save_session_file_compact_internal(ctx, path_session, tokens, n_token_count, kv_type, path_parent);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("error saving session file: %s\n", err.what());
+        return false;
+    }
 }
 
-// Sets the state reading from the specified source address
-size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
-    uint8_t * inp = src;
+static bool llama_load_session_compact(struct llama_context * ctx, llama_file & file, const char * path_session, const llama_token * tokens, size_t n_token_count, int depth) {
+    const auto & kv_self = ctx->kv_self;
+    const auto & hparams = ctx->model.hparams;
+    const int    n_layer = hparams.n_layer;
+    const int    n_embd  = hparams.n_embd_gqa();
 
-    // set rng
+    // load the parent first, it sets the cache of the first n_base tokens
+    uint32_t n_base;
     {
-        size_t rng_size;
-        char   rng_buf[LLAMA_MAX_RNG_STATE];
+        std::string path_parent(file.read_u32(), 0);
+        file.read_raw(&path_parent[0], path_parent.size());
+        n_base = file.read_u32();
 
-        memcpy(&rng_size,   inp, sizeof(rng_size));    inp += sizeof(rng_size);
-        memcpy(&rng_buf[0], inp, LLAMA_MAX_RNG_STATE); inp += LLAMA_MAX_RNG_STATE;
+        if (!path_parent.empty()) {
+            path_parent = llama_session_parent_from_stored(path_parent, path_session);
+        }
 
-        std::stringstream rng_ss;
-        rng_ss.str(std::string(&rng_buf[0], rng_size));
-        rng_ss >> ctx->rng;
+        if (!path_parent.empty()) {
+            if (depth >= LLAMA_SESSION_MAX_DEPTH) {
+                LLAMA_LOG_ERROR("%s : too many parent session files\n", __func__);
+                return false;
+            }
 
-        GGML_ASSERT(!rng_ss.fail());
+            std::vector<llama_token> parent_tokens(n_token_count);
+            size_t n_parent = 0;
+            if (!llama_load_session_file_internal(ctx, path_parent.c_str(), parent_tokens.data(), parent_tokens.size(), &n_parent, depth + 1)) {
+                LLAMA_LOG_ERROR("%s : failed to load the parent session file '%s'\n", __func__, path_parent.c_str());
+                return false;
+            }
+            if (n_parent != n_base || (uint32_t) kv_self.n != n_base || !std::equal(parent_tokens.begin(), parent_tokens.begin() + n_parent, tokens)) {
+                LLAMA_LOG_ERROR("%s : the parent session file '%s' has changed\n", __func__, path_parent.c_str());
+                return false;
+            }
+        } else if (n_base != 0) {
+            LLAMA_LOG_ERROR("%s : missing parent session file\n", __func__);
+            return false;
+        }
     }
 
-    // set logits
+    // restore the rng, logits and embeddings
     {
-        size_t logits_cap;
-        size_t logits_size;
-
-        memcpy(&logits_cap,  inp, sizeof(logits_cap));  inp += sizeof(logits_cap);
-        memcpy(&logits_size, inp, sizeof(logits_size)); inp += sizeof(logits_size);
+        const uint32_t rng_size = file.read_u32();
+        if (rng_size > LLAMA_MAX_RNG_STATE) {
+            LLAMA_LOG_ERROR("%s : invalid rng state\n", __func__);
+            return false;
+        }
+        std::string rng_str(rng_size, 0);
+        file.read_raw(&rng_str[0], rng_size);
 
-        GGML_ASSERT(ctx->logits.capacity() == logits_cap);
+        std::stringstream rng_ss(rng_str);
+        rng_ss >> ctx->rng;
+        if (rng_ss.fail()) {
+            LLAMA_LOG_ERROR("%s : invalid rng state\n", __func__);
+            return false;
+        }
 
-        if (logits_size) {
+        const uint32_t logits_size = file.read_u32();
+        if (logits_size > llama_get_state_logits_capacity(ctx) || (ctx->logits_ext && logits_size > ctx->logits_ext_size)) {
+            LLAMA_LOG_ERROR("%s : the logits in session file are too big: %u\n", __func__, logits_size);
+            return false;
+        }
+        if (!ctx->logits_ext) {
             ctx->logits.resize(logits_size);
-            memcpy(ctx->logits.data(), inp, logits_size * sizeof(float));
         }
+        file.read_raw(llama_get_logits(ctx), logits_size * sizeof(float));
+        ctx->n_logits = logits_size;
 
-        inp += logits_cap * sizeof(float);
+        const uint32_t embedding_size = file.read_u32();
+        if (embedding_size != ctx->embedding.size()) {
+            LLAMA_LOG_ERROR("%s : the embeddings size in session file does not match: %u\n", __func__, embedding_size);
+            return false;
+        }
+        file.read_raw(ctx->embedding.data(), embedding_size * sizeof(float));
     }
 
-    // set embeddings
+    // restore the cache of the new tokens
     {
-        size_t embedding_size;
-
-        memcpy(&embedding_size, inp, sizeof(embedding_size)); inp += sizeof(embedding_size);
+        const ggml_type kv_type = (ggml_type) file.read_u32();
+        const int       kv_ntok = (int) file.read_u32();
 
-        GGML_ASSERT(ctx->embedding.capacity() == embedding_size);
-
-        if (embedding_size) {
-            memcpy(ctx->embedding.data(), inp, embedding_size * sizeof(float));
-            inp += embedding_size * sizeof(float);
+        if (kv_type >= GGML_TYPE_COUNT || (kv_type != GGML_TYPE_F32 && !ggml_internal_get_type_traits(kv_type).to_float) ||
+            n_embd % ggml_blck_size(kv_type) != 0) {
+            LLAMA_LOG_ERROR("%s : unsupported cache type in session file: %u\n", __func__, (uint32_t) kv_type);
+            return false;
+        }
+        if (kv_ntok < (int) n_base || kv_ntok > (int) hparams.n_ctx) {
+            LLAMA_LOG_ERROR("%s : invalid cache token count in session file: %d\n", __func__, kv_ntok);
+            return false;
+        }
+        if (!llama_kv_cache_reserve(*ctx, kv_ntok)) {
+            LLAMA_LOG_ERROR("%s: failed to grow the KV cache to %d tokens\n", __func__, kv_ntok);
+            return false;
         }
-    }
 
-    // set kv cache
-    {
-        const auto & kv_self = ctx->kv_self;
-        const auto & hparams = ctx->model.hparams;
-        const int    n_layer = hparams.n_layer;
-        const int    n_embd  = hparams.n_embd_gqa();
-        const int    n_ctx   = hparams.n_ctx;
+        const int       n_ctx    = kv_self.size;
+        const ggml_type type_kv  = kv_self.k->type;
+        const size_t    elt_size = ggml_element_size(kv_self.k);
+        const size_t    row_size = ggml_type_size(kv_type)*n_embd/ggml_blck_size(kv_type);
 
-        size_t kv_size;
-        int kv_ntok;
+        std::vector<float>   row_f32(n_embd);
+        std::vector<float>   chunk_f32(n_embd*LLAMA_SESSION_V_CHUNK);
+        std::vector<uint8_t> row_in(row_size);
 
-        memcpy(&kv_size, inp, sizeof(kv_size)); inp += sizeof(kv_size);
-        memcpy(&kv_ntok, inp, sizeof(kv_ntok)); inp += sizeof(kv_ntok);
+        for (int il = 0; il < n_layer; ++il) {
+            for (int it = n_base; it < kv_ntok; ++it) {
+                uint8_t * k = (uint8_t *) kv_self.k->data + elt_size*(n_embd*n_ctx*il + n_embd*it);
+                file.read_raw(row_in.data(), row_size);
+                llama_session_row_to_float(kv_type, row_in.data(), row_f32.data(), n_embd);
+                llama_session_row_from_float(type_kv, row_f32.data(), k, n_embd);
+            }
+        }
 
-        if (kv_size) {
-            GGML_ASSERT(kv_self.buf.size == kv_size);
+        for (int il = 0; il < n_layer; ++il) {
+            for (int i0 = n_base; i0 < kv_ntok; i0 += LLAMA_SESSION_V_CHUNK) {
+                const int nt = std::min(LLAMA_SESSION_V_CHUNK, kv_ntok - i0);
+                for (int it = 0; it < nt; ++it) {
+                    file.read_raw(row_in.data(), row_size);
+                    llama_session_row_to_float(kv_type, row_in.data(), row_f32.data(), n_embd);
+                    for (int ir = 0; ir < n_embd; ++ir) {
+                        chunk_f32[ir*LLAMA_SESSION_V_CHUNK + it] = row_f32[ir];
+                    }
+                }
+                for (int ir = 0; ir < n_embd; ++ir) {
+                    uint8_t * v = (uint8_t *) kv_self.v->data + elt_size*(n_ctx*(n_embd*il + ir) + i0);
+                    llama_session_row_from_float(type_kv, chunk_f32.data() + ir*LLAMA_SESSION_V_CHUNK, v, nt);
+                }
+            }
+        }
 
-            const size_t elt_size = ggml_element_size(kv_self.k);
+        ctx->kv_self.n = kv_ntok;
+    }
 
-            ggml_context * cpy_ctx = ggml_init({ 4096, NULL, /* no_alloc */ true });
-            ggml_cgraph gf{};
+    return true;
+}
+
+// get a more accurate load time, upon first eval
+// TODO: fix this
+static void llama_update_load_time(struct llama_context * ctx) {
+    if (!ctx->has_evaluated_once) {
+        ctx->t_load_us = ggml_time_us() - ctx->t_start_us;
+        ctx->has_evaluated_once = true;
+    }
+}
 
-            ggml_tensor * kin3d = ggml_new_tensor_3d(cpy_ctx, kv_self.k->type, n_embd, kv_ntok, n_layer);
-            kin3d->data = (void *) inp;
-            inp += ggml_nbytes(kin3d);
+int llama_eval(
+        struct llama_context * ctx,
+           const llama_token * tokens,
+                         int   n_tokens,
+                         int   n_past,
+                         int   n_threads) {
+    if (!llama_eval_internal(*ctx, tokens, nullptr, n_tokens, n_past, nullptr, nullptr, n_threads, nullptr)) {
+        LLAMA_LOG_ERROR("%s: failed to eval\n", __func__);
+        return 1;
+    }
 
-            ggml_tensor * vin3d = ggml_new_tensor_3d(cpy_ctx, kv_self.v->type, kv_ntok, n_embd, n_layer);
-            vin3d->data = (void *) inp;
-            inp += ggml_nbytes(vin3d);
+    llama_update_load_time(ctx);
 
-            ggml_tensor * k3d = ggml_view_3d(cpy_ctx, kv_self.k,
-                n_embd, kv_ntok, n_layer,
-                elt_size*n_embd, elt_size*n_embd*n_ctx, 0);
+    return 0;
+}
 
-            ggml_tensor * v3d = ggml_view_3d(cpy_ctx, kv_self.v,
-                kv_ntok, n_embd, n_layer,
-                elt_size*n_ctx, elt_size*n_ctx*n_embd, 0);
+int llama_eval_embd(
+            struct llama_context * ctx,
+                     const float * embd,
+                             int   n_tokens,
+                             int   n_past,
+                             int   n_threads) {
+    if (!llama_eval_internal(*ctx, nullptr, embd, n_tokens, n_past, nullptr, nullptr, n_threads, nullptr)) {
+        LLAMA_LOG_ERROR("%s: failed to eval\n", __func__);
+        return 1;
+    }
 
-            ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, kin3d, k3d));
-            ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, vin3d, v3d));
-            ggml_graph_compute_helper(ctx->work_buffer, &gf, /*n_threads*/ 1);
+    llama_update_load_time(ctx);
 
-            ggml_free(cpy_ctx);
-        }
+    return 0;
+}
 
-        ctx->kv_self.n = kv_ntok;
+int llama_eval_mask(
+        struct llama_context * ctx,
+           const llama_token * tokens,
+                         int   n_tokens,
+                         int   n_past,
+                   const int * pos,
+                 const float * mask,
+                         int   n_threads) {
+    if (pos || mask) {
+        llama_reserve_mask(*ctx);
     }
 
-    const size_t nread    = inp - src;
-    const size_t max_size = llama_get_state_size(ctx);
+    if (!llama_eval_internal(*ctx, tokens, nullptr, n_tokens, n_past, pos, mask, n_threads, nullptr)) {
+        LLAMA_LOG_ERROR("%s: failed to eval\n", __func__);
+        return 1;
+    }
 
-    GGML_ASSERT(nread <= max_size);
+    llama_update_load_time(ctx);
 
-    return nread;
+    return 0;
 }
 
-static bool llama_load_session_file_internal(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
-    llama_file file(path_session, "rb");
+int llama_eval_tree(
+        struct llama_context * ctx,
+           const llama_token * tokens,
+                   const int * parents,
+                         int   n_tokens,
+                         int   n_past,
+                         int   n_threads) {
+    if (!parents) {
+        return llama_eval_mask(ctx, tokens, n_tokens, n_past, nullptr, nullptr, n_threads);
+    }
 
-    // sanity checks
-    {
-        const uint32_t magic   = file.read_u32();
-        const uint32_t version = file.read_u32();
+    const int n_kv = n_past + n_tokens;
 
-        if (magic != LLAMA_SESSION_MAGIC || version != LLAMA_SESSION_VERSION) {
-            LLAMA_LOG_ERROR("%s : unknown (magic, version) for session file: %08x, %08x\n", __func__, magic, version);
-            return false;
+    std::vector<int>   pos (n_tokens);
+    std::vector<float> mask((size_t) n_tokens*n_kv, -INFINITY);
+
+    for (int i = 0; i < n_tokens; ++i) {
+        if (parents[i] >= i) {
+            LLAMA_LOG_ERROR("%s: the parent of token %d must precede it in the batch, got %d\n", __func__, i, parents[i]);
+            return 1;
         }
 
-        llama_hparams session_hparams;
-        file.read_raw(&session_hparams, sizeof(llama_hparams));
+        pos[i] = parents[i] < 0 ? n_past : pos[parents[i]] + 1;
 
-        if (session_hparams != ctx->model.hparams) {
-            LLAMA_LOG_INFO("%s : model hparams didn't match from session file!\n", __func__);
-            return false;
-        }
-    }
+        float * row = mask.data() + (size_t) i*n_kv;
 
-    // load the prompt
-    {
-        const uint32_t n_token_count = file.read_u32();
+        // every token sees the tokens already in the cache ...
+        std::fill(row, row + n_past, 0.0f);
 
-        if (n_token_count > n_token_capacity) {
-            LLAMA_LOG_ERROR("%s : token count in session file exceeded capacity! %u > %zu\n", __func__, n_token_count, n_token_capacity);
-            return false;
+        // ... and its ancestors in the batch, including itself
+        for (int j = i; j >= 0; j = parents[j]) {
+            row[n_past + j] = 0.0f;
         }
-
-        file.read_raw(tokens_out, sizeof(llama_token) * n_token_count);
-        *n_token_count_out = n_token_count;
     }
 
-    // restore the context state
-    {
-        const size_t n_state_size_cur = file.size - file.tell();
-        const size_t n_state_size_max = llama_get_state_size(ctx);
+    return llama_eval_mask(ctx, tokens, n_tokens, n_past, pos.data(), mask.data(), n_threads);
+}
 
-        if (n_state_size_cur > n_state_size_max) {
-            LLAMA_LOG_ERROR("%s : the state size in session file is too big! max %zu, got %zu\n", __func__, n_state_size_max, n_state_size_cur);
+static bool llama_same_layer_skip(const llama_context & a, const llama_context & b) {
+    const int n_layer = a.model.hparams.n_layer;
+    for (int il = 0; il < n_layer; ++il) {
+        const bool skip_a = !a.layer_skip.empty() && a.layer_skip[il];
+        const bool skip_b = !b.layer_skip.empty() && b.layer_skip[il];
+        if (skip_a != skip_b) {
             return false;
         }
-
-        std::vector<uint8_t> state_data(n_state_size_max);
-        file.read_raw(state_data.data(), n_state_size_cur);
-
-        llama_set_state_data(ctx, state_data.data());
     }
-
     return true;
 }
 
-bool llama_load_session_file(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
-    try {
-        return llama_load_session_file_internal(ctx, path_session, tokens_out, n_token_capacity, n_token_count_out);
-    } catch (const std::exception & err) {
-        LLAMA_LOG_ERROR("error loading session file: %s\n", err.what());
-        return false;
+int llama_eval_guided(
+        struct llama_context * ctx,
+           const llama_token * tokens,
+                         int   n_tokens,
+                         int   n_past,
+        struct llama_context * ctx_guidance,
+           const llama_token * guidance_tokens,
+                         int   n_guidance_tokens,
+                         int   n_guidance_past,
+                         int   n_threads) {
+    if (!ctx_guidance || n_guidance_tokens == 0) {
+        return n_tokens > 0 ? llama_eval(ctx, tokens, n_tokens, n_past, n_threads) : 0;
+    }
+    if (n_tokens == 0) {
+        return llama_eval(ctx_guidance, guidance_tokens, n_guidance_tokens, n_guidance_past, n_threads);
     }
-}
 
-bool llama_save_session_file(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count) {
-    llama_file file(path_session, "wb");
+    if (&ctx_guidance->model != &ctx->model) {
+        LLAMA_LOG_ERROR("%s: the guidance context must use the same model\n", __func__);
+        return 1;
+    }
 
-    file.write_u32(LLAMA_SESSION_MAGIC);
-    file.write_u32(LLAMA_SESSION_VERSION);
+    // the compute buffer is sized for the outputs of n_batch tokens, one token is left for the selection of the output
+    // rows of the two sequences - larger batches, such as the prompts, are evaluated separately
+    bool batched = n_tokens + n_guidance_tokens < ctx->n_batch && ctx->model.arch == LLM_ARCH_LLAMA;
 
-    file.write_raw(&ctx->model.hparams, sizeof(llama_hparams));
+    // the attention of each layer is repeated for the second sequence, adding 21 tensors per layer, and the graph
+    // must fit in the GGML_MAX_NODES tensors of the compute context - sized for the guided graphs of 80-layer models
+    const int n_graph_tensors = ctx->n_graph_tensors + 21*(int) ctx->model.hparams.n_layer + 8;
+    batched = batched && n_graph_tensors <= GGML_MAX_NODES;
 
-    // save the prompt
-    file.write_u32((uint32_t) n_token_count);
-    file.write_raw(tokens, sizeof(llama_token) * n_token_count);
+    // both sequences are evaluated with the LoRA adapter and the skipped layers of ctx
+    batched = batched && ctx->lora == ctx_guidance->lora && (!ctx->lora || ctx->lora_scale == ctx_guidance->lora_scale);
+    batched = batched && llama_same_layer_skip(*ctx, *ctx_guidance);
+#ifdef GGML_USE_METAL
+    batched = batched && !ctx->ctx_metal;
+#endif
+#ifdef GGML_USE_CUBLAS
+    // the offloaded K and V caches are evaluated separately
+    batched = batched && ctx->model.n_gpu_layers <= (int) ctx->model.hparams.n_layer;
+#endif
+    if (!batched) {
+        if (llama_eval(ctx_guidance, guidance_tokens, n_guidance_tokens, n_guidance_past, n_threads)) {
+            return 1;
+        }
+        return llama_eval(ctx, tokens, n_tokens, n_past, n_threads);
+    }
 
-    // save the context state using stream saving
-    llama_data_file_context data_ctx(&file);
-    llama_copy_state_data_internal(ctx, &data_ctx);
+    // the two sequences are evaluated with custom positions
+    llama_reserve_mask(*ctx);
 
-    return true;
-}
+    std::vector<llama_token> batch(tokens, tokens + n_tokens);
+    batch.insert(batch.end(), guidance_tokens, guidance_tokens + n_guidance_tokens);
 
-int llama_eval(
-        struct llama_context * ctx,
-           const llama_token * tokens,
-                         int   n_tokens,
-                         int   n_past,
-                         int   n_threads) {
-    if (!llama_eval_internal(*ctx, tokens, nullptr, n_tokens, n_past, n_threads, nullptr)) {
+    ctx->guidance          = ctx_guidance;
+    ctx->guidance_n_tokens = n_guidance_tokens;
+    ctx->guidance_n_past   = n_guidance_past;
+
+    const bool ok = llama_eval_internal(*ctx, batch.data(), nullptr, batch.size(), n_past, nullptr, nullptr, n_threads, nullptr);
+
+    ctx->guidance = nullptr;
+
+    if (!ok) {
         LLAMA_LOG_ERROR("%s: failed to eval\n", __func__);
         return 1;
     }
 
-    // get a more accurate load time, upon first eval
-    // TODO: fix this
-    if (!ctx->has_evaluated_once) {
-        ctx->t_load_us = ggml_time_us() - ctx->t_start_us;
-        ctx->has_evaluated_once = true;
-    }
+    llama_update_load_time(ctx);
 
     return 0;
 }
 
-int llama_eval_embd(
-            struct llama_context * ctx,
-                     const float * embd,
-                             int   n_tokens,
-                             int   n_past,
-                             int   n_threads) {
-    if (!llama_eval_internal(*ctx, nullptr, embd, n_tokens, n_past, n_threads, nullptr)) {
-        LLAMA_LOG_ERROR("%s: failed to eval\n", __func__);
-        return 1;
+void llama_set_layer_skip(struct llama_context * ctx, const bool * skip) {
+#ifdef GGML_USE_MPI
+    // the MPI nodes split the graph by layer
+    if (skip) {
+        LLAMA_LOG_WARN("%s: skipping layers is not supported with MPI\n", __func__);
+        return;
+    }
+#endif
+    if (skip) {
+        ctx->layer_skip.assign(skip, skip + ctx->model.hparams.n_layer);
+    } else {
+        ctx->layer_skip.clear();
     }
+}
 
-    // get a more accurate load time, upon first eval
-    // TODO: fix this
-    if (!ctx->has_evaluated_once) {
-        ctx->t_load_us = ggml_time_us() - ctx->t_start_us;
-        ctx->has_evaluated_once = true;
+void llama_set_output_tokens(struct llama_context * ctx, const llama_token * tokens, int n_tokens) {
+    ctx->output_ids.clear();
+
+    if (!tokens) {
+        return;
     }
 
-    return 0;
+    const int n_vocab = ctx->model.hparams.n_vocab;
+    for (int i = 0; i < n_tokens; ++i) {
+        if (tokens[i] < 0 || tokens[i] >= n_vocab) {
+            LLAMA_LOG_ERROR("%s: invalid token %d, computing the logits of all tokens\n", __func__, tokens[i]);
+            ctx->output_ids.clear();
+            return;
+        }
+        ctx->output_ids.push_back(tokens[i]);
+    }
 }
 
 int llama_eval_export(struct llama_context * ctx, const char * fname) {
@@ -6160,7 +9825,7 @@ int llama_eval_export(struct llama_context * ctx, const char * fname) {
 
     const std::vector<llama_token> tmp(n_batch, llama_token_bos(ctx));
 
-    if (!llama_eval_internal(*ctx, tmp.data(), nullptr, tmp.size(), n_ctx, 1, fname)) {
+    if (!llama_eval_internal(*ctx, tmp.data(), nullptr, tmp.size(), n_ctx, nullptr, nullptr, 1, fname)) {
         LLAMA_LOG_ERROR("%s: failed to eval\n", __func__);
         return 1;
     }
@@ -6169,13 +9834,168 @@ int llama_eval_export(struct llama_context * ctx, const char * fname) {
 }
 
 float * llama_get_logits(struct llama_context * ctx) {
-    return ctx->logits.data();
+    return ctx->logits_ext ? ctx->logits_ext : ctx->logits.data();
+}
+
+void llama_set_logits_buffer(struct llama_context * ctx, float * logits, size_t n_floats) {
+    ctx->logits_ext      = logits;
+    ctx->logits_ext_size = logits ? n_floats : 0;
+    ctx->n_logits        = 0;
 }
 
 float * llama_get_embeddings(struct llama_context * ctx) {
     return ctx->embedding.data();
 }
 
+static void llama_embed_pool(const float * hidden, int n_tokens, int n_embd, enum llama_pooling_type pooling, bool normalize, float * out) {
+    switch (pooling) {
+        case LLAMA_POOLING_MEAN:
+            {
+                std::fill(out, out + n_embd, 0.0f);
+                for (int i = 0; i < n_tokens; ++i) {
+                    for (int j = 0; j < n_embd; ++j) {
+                        out[j] += hidden[(size_t) i*n_embd + j];
+                    }
+                }
+                for (int j = 0; j < n_embd; ++j) {
+                    out[j] /= n_tokens;
+                }
+            } break;
+        case LLAMA_POOLING_LAST:
+            {
+                memcpy(out, hidden + (size_t) (n_tokens - 1)*n_embd, sizeof(float)*n_embd);
+            } break;
+        case LLAMA_POOLING_FIRST:
+            {
+                memcpy(out, hidden, sizeof(float)*n_embd);
+            } break;
+    }
+
+    if (normalize) {
+        double sum = 0.0;
+        for (int j = 0; j < n_embd; ++j) {
+            sum += (double) out[j]*out[j];
+        }
+        const float scale = sum > 0.0 ? 1.0f/(float) sqrt(sum) : 0.0f;
+        for (int j = 0; j < n_embd; ++j) {
+            out[j] *= scale;
+        }
+    }
+}
+
+int llama_embed_batch(
+        struct llama_context * ctx,
+           const llama_token * tokens,
+                   const int * n_tokens,
+                         int   n_inputs,
+     enum llama_pooling_type   pooling,
+                        bool   normalize,
+                       float * embd,
+                         int   n_threads) {
+    const int n_ctx   = ctx->model.hparams.n_ctx;
+    const int n_embd  = ctx->model.hparams.n_embd;
+    const int n_batch = ctx->n_batch;
+
+    std::vector<size_t> offs(n_inputs + 1, 0);
+    for (int i = 0; i < n_inputs; ++i) {
+        if (n_tokens[i] <= 0 || n_tokens[i] > n_ctx) {
+            LLAMA_LOG_ERROR("%s: input %d has %d tokens, expected 1 to %d\n", __func__, i, n_tokens[i], n_ctx);
+            return 1;
+        }
+        offs[i + 1] = offs[i] + n_tokens[i];
+    }
+
+    std::vector<int>   pos;
+    std::vector<float> mask;
+    std::vector<float> hidden;
+
+    llama_reserve_mask(*ctx);
+
+    ctx->embedding_all = true;
+
+    int ret = 0;
+
+    for (int i0 = 0; i0 < n_inputs && ret == 0; ) {
+        if (n_tokens[i0] > n_batch) {
+            // an input longer than a batch is evaluated alone, in causal chunks
+            const int n = n_tokens[i0];
+
+            hidden.resize((size_t) n*n_embd);
+
+            for (int n_past = 0; n_past < n; ) {
+                const int n_cur = std::min(n_batch, n - n_past);
+                const int n_kv  = n_past + n_cur;
+
+                pos.resize(n_cur);
+                mask.assign((size_t) n_cur*n_kv, -INFINITY);
+
+                for (int i = 0; i < n_cur; ++i) {
+                    pos[i] = n_past + i;
+                    std::fill(mask.begin() + (size_t) i*n_kv, mask.begin() + (size_t) i*n_kv + n_past + i + 1, 0.0f);
+                }
+
+                if (!llama_eval_internal(*ctx, tokens + offs[i0] + n_past, nullptr, n_cur, n_past, pos.data(), mask.data(), n_threads, nullptr)) {
+                    LLAMA_LOG_ERROR("%s: failed to eval\n", __func__);
+                    ret = 1;
+                    break;
+                }
+
+                memcpy(hidden.data() + (size_t) n_past*n_embd, ctx->embedding_hidden.data(), sizeof(float)*n_cur*n_embd);
+
+                n_past += n_cur;
+            }
+
+            if (ret == 0) {
+                llama_embed_pool(hidden.data(), n, n_embd, pooling, normalize, embd + (size_t) i0*n_embd);
+            }
+
+            i0++;
+            continue;
+        }
+
+        // pack as many whole inputs as fit in a batch, each attending only to its own tokens
+        int i1 = i0;
+        while (i1 < n_inputs && offs[i1 + 1] - offs[i0] <= (size_t) n_batch) {
+            i1++;
+        }
+
+        const int n_cur = offs[i1] - offs[i0];
+
+        pos.resize(n_cur);
+        mask.assign((size_t) n_cur*n_cur, -INFINITY);
+
+        for (int k = i0; k < i1; ++k) {
+            const int p0 = offs[k] - offs[i0];
+            for (int i = 0; i < n_tokens[k]; ++i) {
+                pos[p0 + i] = i;
+                std::fill(mask.begin() + (size_t) (p0 + i)*n_cur + p0, mask.begin() + (size_t) (p0 + i)*n_cur + p0 + i + 1, 0.0f);
+            }
+        }
+
+        // the inputs are complete, their K and V are not needed after the batch
+        ctx->kv_scratch = true;
+        const bool ok = llama_eval_internal(*ctx, tokens + offs[i0], nullptr, n_cur, 0, pos.data(), mask.data(), n_threads, nullptr);
+        ctx->kv_scratch = false;
+
+        if (!ok) {
+            LLAMA_LOG_ERROR("%s: failed to eval\n", __func__);
+            ret = 1;
+            break;
+        }
+
+        for (int k = i0; k < i1; ++k) {
+            llama_embed_pool(ctx->embedding_hidden.data() + (offs[k] - offs[i0])*n_embd, n_tokens[k], n_embd, pooling, normalize, embd + (size_t) k*n_embd);
+        }
+
+        i0 = i1;
+    }
+
+    ctx->embedding_all = false;
+    ctx->embedding_hidden.clear();
+
+    return ret;
+}
+
 const char * llama_token_get_text(const struct llama_context * ctx, llama_token token) {
     return ctx->model.vocab.id_to_token[token].text.c_str();
 }
@@ -6267,6 +10087,68 @@ int llama_token_to_piece_with_model(const struct llama_model * model, llama_toke
     return 0;
 }
 
+struct llama_memory_info llama_get_memory_info(const struct llama_context * ctx) {
+    const auto & model   = ctx->model;
+    const auto & hparams = model.hparams;
+    const auto & kv_self = ctx->kv_self;
+
+    struct llama_memory_info info = {};
+
+    const uint8_t * map_addr = model.mapping ? (const uint8_t *) model.mapping->addr : NULL;
+    const size_t    map_size = model.mapping ? model.mapping->size : 0;
+
+    // the fused weights are not in tensors_by_name and their parts use their memory
+    // (the wqkv of a file is in tensors_by_name and has no parts)
+    std::vector<const struct ggml_tensor *> weights;
+    std::set<const struct ggml_tensor *> parts;
+    for (const auto & layer : model.layers) {
+        if (layer.wqkv && layer.wq) {
+            weights.push_back(layer.wqkv);
+            parts.insert({ layer.wq, layer.wk, layer.wv });
+        }
+        if (layer.w13 && layer.w1) {
+            weights.push_back(layer.w13);
+            parts.insert({ layer.w1, layer.w3 });
+        }
+    }
+    for (const auto & it : model.tensors_by_name) {
+        if (!parts.count(it.second)) {
+            weights.push_back(it.second);
+        }
+    }
+
+    for (const struct ggml_tensor * t : weights) {
+        const size_t size = ggml_nbytes(t);
+        const uint8_t * data = (const uint8_t *) t->data;
+
+        info.model_size += size;
+        if (t->backend != GGML_BACKEND_CPU) {
+            info.model_device += size;
+        } else if (!map_addr || data < map_addr || data >= map_addr + map_size) {
+            info.model_host += size;
+        }
+    }
+
+    if (model.mapping) {
+        info.model_mapped   = map_size;
+        info.model_resident = llama_mmap::resident(model.mapping->addr, map_size);
+    }
+
+    if (kv_self.k) {
+        info.kv_size = kv_self.buf.size;
+        info.kv_max  = std::max(kv_self.buf.size, llama_kv_cache_buf_size(hparams, kv_self.k->type, hparams.n_ctx));
+        info.kv_used = 2*ggml_element_size(kv_self.k)*hparams.n_embd_gqa()*hparams.n_layer*kv_self.n;
+    }
+
+    info.compute_size = ctx->buf_compute.size;
+    info.alloc_size   = ctx->buf_alloc.size;
+    info.alloc_peak   = ctx->alloc_peak;
+    info.work_size    = ctx->work_buffer.capacity();
+    info.output_size  = sizeof(float)*(ctx->logits.capacity() + ctx->embedding.capacity() + ctx->embedding_hidden.capacity());
+
+    return info;
+}
+
 struct llama_timings llama_get_timings(struct llama_context * ctx) {
     struct llama_timings result = {
         /*.t_start_ms  =*/ 1e-3 * ctx->t_start_us,
@@ -6279,11 +10161,42 @@ struct llama_timings llama_get_timings(struct llama_context * ctx) {
         /*.n_sample =*/ std::max(1, ctx->n_sample),
         /*.n_p_eval =*/ std::max(1, ctx->n_p_eval),
         /*.n_eval   =*/ std::max(1, ctx->n_eval),
+
+        /*.t_build_ms   =*/ 1e-3 * ctx->t_build_us,
+        /*.t_alloc_ms   =*/ 1e-3 * ctx->t_alloc_us,
+        /*.t_plan_ms    =*/ 1e-3 * ctx->t_compute.t_plan_us,
+        /*.t_threads_ms =*/ 1e-3 * ctx->t_compute.t_threads_us,
+        /*.t_compute_ms =*/ 1e-3 * ctx->t_compute.t_compute_us,
+        /*.t_output_ms  =*/ 1e-3 * ctx->t_output_us,
     };
 
     return result;
 }
 
+int llama_get_layer_timings(struct llama_context * ctx, double * t_ms, int n_max) {
+    const int n_layer = (int) ctx->t_layer_us.size();
+
+    for (int il = 0; il < std::min(n_layer, n_max); ++il) {
+        t_ms[il] = 1e-3 * ctx->t_layer_us[il];
+    }
+
+    return n_layer;
+}
+
+int llama_get_sampler_timings(struct llama_context * ctx, struct llama_sampler_timings * timings, int n_max) {
+    std::vector<llama_sampler_timings> result;
+    for (const auto & it : ctx->t_sampler_us) {
+        result.push_back({ it.first, 1e-3 * it.second.first, it.second.second });
+    }
+    std::sort(result.begin(), result.end(), [](const llama_sampler_timings & a, const llama_sampler_timings & b) {
+        return strcmp(a.name, b.name) < 0;
+    });
+
+    std::copy(result.begin(), result.begin() + std::min((int) result.size(), n_max), timings);
+
+    return (int) result.size();
+}
+
 void llama_print_timings(struct llama_context * ctx) {
     const llama_timings timings = llama_get_timings(ctx);
 
@@ -6296,6 +10209,12 @@ void llama_print_timings(struct llama_context * ctx) {
     LLAMA_LOG_INFO("%s:        eval time = %8.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, timings.t_eval_ms, timings.n_eval, timings.t_eval_ms / timings.n_eval, 1e3 / timings.t_eval_ms * timings.n_eval);
     LLAMA_LOG_INFO("%s:       total time = %8.2f ms\n", __func__, (timings.t_end_ms - timings.t_start_ms));
+    LLAMA_LOG_INFO("%s:      eval phases = %8.2f ms build, %.2f ms alloc, %.2f ms plan, %.2f ms threads, %.2f ms compute, %.2f ms output\n",
+            __func__, timings.t_build_ms, timings.t_alloc_ms, timings.t_plan_ms, timings.t_threads_ms, timings.t_compute_ms, timings.t_output_ms);
+
+    for (size_t il = 0; il < ctx->t_layer_us.size(); ++il) {
+        LLAMA_LOG_INFO("%s:     layer %3zu time = %8.2f ms\n", __func__, il, 1e-3 * ctx->t_layer_us[il]);
+    }
 }
 
 void llama_reset_timings(struct llama_context * ctx) {
@@ -6303,6 +10222,13 @@ void llama_reset_timings(struct llama_context * ctx) {
     ctx->t_sample_us = ctx->n_sample = 0;
     ctx->t_eval_us   = ctx->n_eval   = 0;
     ctx->t_p_eval_us = ctx->n_p_eval = 0;
+
+    ctx->t_build_us  = 0;
+    ctx->t_alloc_us  = 0;
+    ctx->t_output_us = 0;
+    ctx->t_compute   = {};
+    std::fill(ctx->t_layer_us.begin(), ctx->t_layer_us.end(), 0);
+    ctx->t_sampler_us.clear();
 }
 
 const char * llama_print_system_info(void) {
@@ -6354,6 +10280,26 @@ void llama_dump_timing_info_yaml(FILE * stream, const llama_context * ctx) {
             1.0e6 * ctx->n_p_eval / ctx->t_p_eval_us);
     fprintf(stream, "ts_sample: %.2f  # tokens / second during sampling\n",
             1.0e6 * ctx->n_sample / ctx->t_sample_us);
+    fprintf(stream, "t_build_us: %" PRId64 "  # total microseconds spent building the graphs\n", ctx->t_build_us);
+    fprintf(stream, "t_alloc_us: %" PRId64 "  # total microseconds spent allocating the graphs\n", ctx->t_alloc_us);
+    fprintf(stream, "t_plan_us: %" PRId64 "  # total microseconds spent planning the computations\n", ctx->t_compute.t_plan_us);
+    fprintf(stream, "t_threads_us: %" PRId64 "  # total microseconds spent creating and joining the compute threads\n", ctx->t_compute.t_threads_us);
+    fprintf(stream, "t_compute_us: %" PRId64 "  # total microseconds spent computing the graphs\n", ctx->t_compute.t_compute_us);
+    fprintf(stream, "t_output_us: %" PRId64 "  # total microseconds spent copying the logits and embeddings out\n", ctx->t_output_us);
+
+    fprintf(stream, "t_layer_us: [");
+    for (size_t il = 0; il < ctx->t_layer_us.size(); ++il) {
+        fprintf(stream, "%s%" PRId64, il == 0 ? "" : ", ", ctx->t_layer_us[il]);
+    }
+    fprintf(stream, "]  # total microseconds spent computing each layer, with layer_timings\n");
+
+    std::vector<llama_sampler_timings> samplers(ctx->t_sampler_us.size());
+    llama_get_sampler_timings(const_cast<llama_context *>(ctx), samplers.data(), (int) samplers.size());
+
+    fprintf(stream, "t_sampler_us:  # total microseconds spent in each sampling function and number of calls\n");
+    for (const auto & sampler : samplers) {
+        fprintf(stream, "  %s: {t_us: %" PRId64 ", n: %d}\n", sampler.name, (int64_t) (1e3 * sampler.t_ms), sampler.n_calls);
+    }
 }
 
 // For internal test use
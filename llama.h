@@ -41,6 +41,8 @@
 
 #define LLAMA_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSN
 #define LLAMA_SESSION_VERSION 1
+#define LLAMA_SESSION_VERSION_COMPACT 2
+#define LLAMA_SESSION_MAX_DEPTH 64 // maximum number of parents of a compact session file
 
 #if defined(GGML_USE_CUBLAS) || defined(GGML_USE_CLBLAST) || defined(GGML_USE_METAL)
 // Defined when llama.cpp is compiled with support for offloading model layers to GPU.
@@ -59,6 +61,9 @@ extern "C" {
 
     struct llama_model;
     struct llama_context;
+    struct llama_context_pool;
+    struct llama_speculative;
+    struct llama_lora_adapter;
 
     typedef int llama_token;
 
@@ -83,6 +88,13 @@ extern "C" {
         LLAMA_TOKEN_TYPE_BYTE         = 6,
     };
 
+    // how llama_embed_batch reduces the hidden states of an input to a single vector
+    enum llama_pooling_type {
+        LLAMA_POOLING_MEAN  = 0, // average of all tokens
+        LLAMA_POOLING_LAST  = 1, // last token
+        LLAMA_POOLING_FIRST = 2, // first token (CLS-style)
+    };
+
     // model file types
     enum llama_ftype {
         LLAMA_FTYPE_ALL_F32              = 0,
@@ -128,6 +140,7 @@ extern "C" {
         int32_t  n_batch;      // prompt processing batch size
         int32_t  n_gpu_layers; // number of layers to store in VRAM
         int32_t  main_gpu;     // the GPU that is used for scratch and small tensors
+        int32_t  n_kv_chunk;   // if > 0, the KV cache grows on demand in chunks of this many tokens instead of being allocated for n_ctx
 
         const float * tensor_split; // how to split layers across multiple GPUs (size: LLAMA_MAX_DEVICES)
 
@@ -149,6 +162,11 @@ extern "C" {
         bool use_mmap;   // use mmap if possible
         bool use_mlock;  // force system to keep model in RAM
         bool embedding;  // embedding mode only
+        bool fuse_weights; // concatenate the Q/K/V and gate/up weights of each CPU layer to multiply them in one matmul each
+        bool stream_layers; // with mmap, read the weights of the next layer while a layer is evaluated and release the weights of the evaluated layers
+                            // Only for the single context of a model: no other context can be created while it exists
+        bool repack_weights; // without mmap, interleave the blocks of 4 rows of the q4_0 weights of the CPU layers (see llama_model_quantize_params.repack)
+        bool layer_timings;  // compute the graph one layer at a time to measure the time of each layer (see llama_get_layer_timings)
     };
 
     // Signature for logging events
@@ -165,6 +183,7 @@ extern "C" {
         bool allow_requantize;       // allow quantizing non-f32/f16 tensors
         bool quantize_output_tensor; // quantize output.weight
         bool only_copy;              // only copy tensors - ftype, allow_requantize and quantize_output_tensor are ignored
+        bool repack;                 // interleave the blocks of 4 rows of the q4_0 matrices, to load them without repacking
     } llama_model_quantize_params;
 
     // grammar types
@@ -213,6 +232,38 @@ extern "C" {
         int32_t n_sample;
         int32_t n_p_eval;
         int32_t n_eval;
+
+        // time spent in each phase of the evals
+        double t_build_ms;   // building the graph
+        double t_alloc_ms;   // allocating the tensors of the graph
+        double t_plan_ms;    // planning the computation
+        double t_threads_ms; // creating and joining the compute threads
+        double t_compute_ms; // computing the graph
+        double t_output_ms;  // copying the logits and embeddings out
+    };
+
+    // memory used by a context and its model, in bytes
+    struct llama_memory_info {
+        size_t model_size;     // weights of the model
+        size_t model_mapped;   // model file mapped in memory (0 without mmap)
+        size_t model_resident; // pages of the mapping resident in memory
+        size_t model_host;     // weights in host buffers, outside of the mapping
+        size_t model_device;   // weights offloaded to the GPU
+        size_t kv_size;        // KV cache allocated
+        size_t kv_max;         // KV cache for the full context, the cache grows up to this size
+        size_t kv_used;        // KV cache holding the tokens of the context
+        size_t compute_size;   // buffer of the tensor and graph structs
+        size_t alloc_size;     // buffer of the tensors of the graphs
+        size_t alloc_peak;     // tensors of the worst-case graph, from the last measure pass
+        size_t work_size;      // work buffer of the graph computations
+        size_t output_size;    // logits and embeddings
+    };
+
+    // time spent in a sampling function, including the functions it calls
+    struct llama_sampler_timings {
+        const char * name;
+        double  t_ms;
+        int32_t n_calls;
     };
 
     LLAMA_API struct llama_context_params llama_context_default_params(void);
@@ -239,6 +290,37 @@ extern "C" {
     // Frees all allocated memory
     LLAMA_API void llama_free(struct llama_context * ctx);
 
+    // Pins the compute threads of the context to the given CPUs: thread i runs on cpus[i % n_cpus]
+    // Pass n_cpus = 0 to remove the pinning. Only has an effect on Linux
+    LLAMA_API void llama_set_cpu_affinity(struct llama_context * ctx, const int * cpus, int n_cpus);
+
+    // Context pool
+    // Contexts created from the same model only read its weights and vocabulary during evaluation, so
+    // different contexts can be evaluated concurrently from different threads (but not with CUDA offloading)
+    // The contexts of a pool are pinned to disjoint sets of CPUs, so that concurrent evaluations do not compete for cores
+    // Note: llama_apply_lora_from_file modifies the shared weights and must not be used with a pool
+
+    // Creates n_contexts contexts for the model, each pinned to n_threads CPUs
+    // If n_threads <= 0, the available CPUs are split evenly between the contexts
+    LLAMA_API struct llama_context_pool * llama_context_pool_init(
+                     struct llama_model * model,
+            struct llama_context_params   params,
+                                    int   n_contexts,
+                                    int   n_threads);
+
+    // The number of threads to pass to llama_eval for contexts of the pool
+    LLAMA_API int llama_context_pool_n_threads(const struct llama_context_pool * pool);
+
+    // Returns a free context of the pool, waiting until one is released if all of them are in use
+    // The context keeps the KV cache of its previous user, start with n_past = 0 to discard it
+    LLAMA_API struct llama_context * llama_context_pool_acquire(struct llama_context_pool * pool);
+
+    // Returns a context to the pool, each acquired context must be released once
+    LLAMA_API void llama_context_pool_release(struct llama_context_pool * pool, struct llama_context * ctx);
+
+    // Frees the pool and all of its contexts, which must all have been released
+    LLAMA_API void llama_context_pool_free(struct llama_context_pool * pool);
+
     LLAMA_API int64_t llama_time_us(void);
 
     LLAMA_API int  llama_max_devices    (void);
@@ -249,6 +331,7 @@ extern "C" {
     LLAMA_API int llama_n_ctx      (const struct llama_context * ctx);
     LLAMA_API int llama_n_ctx_train(const struct llama_context * ctx);
     LLAMA_API int llama_n_embd     (const struct llama_context * ctx);
+    LLAMA_API int llama_n_layer    (const struct llama_context * ctx);
 
     LLAMA_API enum llama_vocab_type llama_vocab_type(const struct llama_context * ctx);
 
@@ -256,6 +339,7 @@ extern "C" {
     LLAMA_API int llama_model_n_ctx      (const struct llama_model * model);
     LLAMA_API int llama_model_n_ctx_train(const struct llama_model * model);
     LLAMA_API int llama_model_n_embd     (const struct llama_model * model);
+    LLAMA_API int llama_model_n_layer    (const struct llama_model * model);
 
     // Get a string describing the model type
     LLAMA_API int llama_model_desc(const struct llama_model * model, char * buf, size_t buf_size);
@@ -272,7 +356,8 @@ extern "C" {
 
     // Apply a LoRA adapter to a loaded model
     // path_base_model is the path to a higher quality model to use as a base for
-    // the layers modified by the adapter. Can be NULL to use the current loaded model.
+    // the layers modified by the adapter. Can be NULL to use the current loaded model,
+    // in which case the weights in host memory are updated in place by n_threads threads.
     // The model needs to be reloaded before applying a new adapter, otherwise the adapter
     // will be applied on top of the previous one
     // Returns 0 on success
@@ -289,9 +374,47 @@ extern "C" {
                           const char * path_base_model,
                                  int   n_threads);
 
+    // Load a LoRA adapter to apply at runtime, without modifying the model weights
+    // The adapter can be shared by the contexts of the model and is freed with the model if not freed before
+    // Returns NULL on failure
+    LLAMA_API struct llama_lora_adapter * llama_lora_adapter_init(
+            const struct llama_model * model,
+                          const char * path_lora);
+
+    // An adapter still set for a context is not freed
+    LLAMA_API void llama_lora_adapter_free(struct llama_lora_adapter * adapter);
+
+    // Set the LoRA adapter applied by the evals of the context, scaled by scale (NULL - none)
+    // Can be changed between evals; the KV cache of the tokens evaluated before is not updated
+    // Only supported for weights in host memory
+    // Returns 0 on success
+    LLAMA_API int llama_set_lora_adapter(
+            struct llama_context * ctx,
+            const struct llama_lora_adapter * adapter,
+                                 float   scale);
+
     // Returns the number of tokens in the KV cache
     LLAMA_API int llama_get_kv_cache_token_count(const struct llama_context * ctx);
 
+    // Keeps only the given tokens of the batch evaluated at n_past, moving them to the front of it
+    // ids are the sorted indices of the tokens to keep, relative to n_past
+    // The KV cache token count becomes n_past + n_ids (e.g. to keep the accepted path of a token tree)
+    LLAMA_API void llama_kv_cache_keep(struct llama_context * ctx, int n_past, const int * ids, int n_ids);
+
+    // Releases the KV cache storage beyond the first n_past tokens, which are kept
+    // Only has an effect if the context was created with n_kv_chunk > 0
+    LLAMA_API void llama_kv_cache_trim(struct llama_context * ctx, int n_past);
+
+    // Returns the number of tokens the KV cache currently has storage for
+    LLAMA_API int llama_get_kv_cache_capacity(const struct llama_context * ctx);
+
+    // Removes n_discard tokens from the KV cache after the first n_keep ("attention sink") tokens
+    // The following tokens are moved back and their keys are rotated to their new positions,
+    // so generation can continue past n_ctx without re-evaluating the context
+    // The KV cache token count decreases by n_discard
+    // Returns 0 on success, or 1 if the KV cache is not in host memory
+    LLAMA_API int llama_kv_cache_shift(struct llama_context * ctx, int n_keep, int n_discard, int n_threads);
+
     // Sets the current rng seed.
     LLAMA_API void llama_set_rng_seed(struct llama_context * ctx, uint32_t seed);
 
@@ -312,6 +435,20 @@ extern "C" {
     LLAMA_API bool llama_load_session_file(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out);
     LLAMA_API bool llama_save_session_file(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count);
 
+    // Save a compact session file, loaded with llama_load_session_file
+    // The cache is stored as kv_type (e.g. GGML_TYPE_Q8_0) without the padding of the state
+    // If path_parent is not NULL, only the cache of the tokens after those of the parent session file is stored,
+    // the prompt of the parent must be a prefix of tokens and the parent is loaded first when this file is loaded
+    // The parent is referenced relative to the directory of path_session, the files can be moved together
+    // If the cache holds more tokens than n_token_count, only the cache of the first n_token_count is stored, without the logits
+    LLAMA_API bool llama_save_session_file_compact(
+            struct llama_context * ctx,
+                      const char * path_session,
+               const llama_token * tokens,
+                          size_t   n_token_count,
+                  enum ggml_type   kv_type,
+                      const char * path_parent);
+
     // Run the llama inference to obtain the logits and probabilities for the next token.
     // tokens + n_tokens is the provided batch of new tokens to process
     // n_past is the number of tokens to use from previous eval calls
@@ -331,6 +468,61 @@ extern "C" {
                              int   n_past,
                              int   n_threads);
 
+    // Same as llama_eval, but with a custom attention structure for the batch
+    // pos:  the position of each token, used for RoPE (NULL to use n_past + i)
+    // mask: a [n_tokens][n_past + n_tokens] matrix added to the attention scores,
+    //       0.0f where token i attends to cache slot j and -INFINITY where it does not (NULL for causal)
+    // The logits of all tokens are returned
+    LLAMA_API int llama_eval_mask(
+            struct llama_context * ctx,
+               const llama_token * tokens,
+                             int   n_tokens,
+                             int   n_past,
+                       const int * pos,
+                     const float * mask,
+                             int   n_threads);
+
+    // Evaluates a tree of tokens in a single batch
+    // parents[i] is the index in the batch of the parent of token i, or -1 for a root
+    // Each token attends to the first n_past tokens of the cache and to its ancestors
+    // The logits of all tokens are returned
+    LLAMA_API int llama_eval_tree(
+            struct llama_context * ctx,
+               const llama_token * tokens,
+                       const int * parents,
+                             int   n_tokens,
+                             int   n_past,
+                             int   n_threads);
+
+    // Evaluates the tokens of ctx and the tokens of ctx_guidance, a context of the same model, in a single batch
+    // so that the weights are read once for both sequences (see llama_sample_classifier_free_guidance)
+    // Each sequence attends to its own KV cache and the logits of each context are set as by llama_eval
+    // ctx_guidance may be NULL and either batch may be empty. Batches that do not fit in n_batch together, or of contexts
+    // with different LoRA adapters or skipped layers, are evaluated separately
+    LLAMA_API int llama_eval_guided(
+            struct llama_context * ctx,
+               const llama_token * tokens,
+                             int   n_tokens,
+                             int   n_past,
+            struct llama_context * ctx_guidance,
+               const llama_token * guidance_tokens,
+                             int   n_guidance_tokens,
+                             int   n_guidance_past,
+                             int   n_threads);
+
+    // Skips layers in the following evals, to draft tokens with a subset of the model (self-speculative decoding)
+    // skip: llama_n_layer flags, true for each layer to skip, or NULL to run all layers again
+    // Skipped layers do not store K and V for the evaluated tokens, so these tokens must be evaluated
+    // again with all layers before the full model uses them as context
+    LLAMA_API void llama_set_layer_skip(struct llama_context * ctx, const bool * skip);
+
+    // Restricts the logits of the following evals to these tokens, e.g. the tokens a grammar accepts next
+    // Only their rows of the output matrix are multiplied and the logits of the other tokens are -INFINITY
+    // The full output is still computed when the tokens are more than 1/8 of the vocabulary, the logits of the
+    // other tokens are then -INFINITY as well
+    // NULL to compute the logits of all tokens again
+    LLAMA_API void llama_set_output_tokens(struct llama_context * ctx, const llama_token * tokens, int n_tokens);
+
     // Export a static computation graph for context of 511 and batch size of 1
     // NOTE: since this functionality is mostly for debugging and demonstration purposes, we hardcode these
     //       parameters here to keep things simple
@@ -344,10 +536,34 @@ extern "C" {
     // Cols: n_vocab
     LLAMA_API float * llama_get_logits(struct llama_context * ctx);
 
+    // Sets a caller-owned buffer that llama_eval computes the logits into, instead of an internal buffer
+    // The buffer must hold n_vocab floats, or n_tokens*n_vocab floats when the logits of all tokens are returned
+    // It must stay valid until another buffer is set, NULL is set to go back to the internal buffer, or the context is freed
+    // While it is set, llama_get_logits returns this buffer
+    LLAMA_API void llama_set_logits_buffer(struct llama_context * ctx, float * logits, size_t n_floats);
+
     // Get the embeddings for the input
     // shape: [n_embd] (1-dimensional)
     LLAMA_API float * llama_get_embeddings(struct llama_context * ctx);
 
+    // Computes a pooled embedding for each of n_inputs independent inputs
+    // tokens:   the tokens of all inputs, concatenated
+    // n_tokens: the number of tokens of each input, at most n_ctx
+    // embd:     the output, n_inputs*n_embd floats
+    // Inputs are packed into batches of up to n_batch tokens, masked so that they do not attend to each other
+    // If normalize is true, each embedding is scaled to unit L2 norm
+    // The KV cache is overwritten
+    // Returns 0 on success
+    LLAMA_API int llama_embed_batch(
+            struct llama_context * ctx,
+               const llama_token * tokens,
+                       const int * n_tokens,
+                             int   n_inputs,
+         enum llama_pooling_type   pooling,
+                            bool   normalize,
+                           float * embd,
+                             int   n_threads);
+
     //
     // Vocab
     //
@@ -512,13 +728,64 @@ extern "C" {
     /// @param n_past Number of tokens already evaluated.
     /// @param n_predict Maximum number of tokens to predict. EOS may occur earlier.
     /// @param n_threads Number of threads as passed to llama_eval().
+    /// With the KV cache on the CPU, the beams share their prefixes in the KV cache and their next tokens are evaluated in one batch.
+    /// On return, the KV cache holds the tokens of the top beam after n_past.
+    /// The search ends early with an error if the tree of the beams no longer fits in the context or cannot be evaluated.
     LLAMA_API void llama_beam_search(struct llama_context * ctx, llama_beam_search_callback_fn_t callback, void * callback_data, size_t n_beams, int n_past, int n_predict, int n_threads);
 
+    //
+    // Speculative decoding
+    //
+
+    struct llama_speculative_params {
+        int32_t n_draft;  // maximum number of tokens in the draft tree, also limited by the n_batch of both contexts
+        int32_t n_branch; // number of children drafted for each tree node
+        float   p_min;    // tree nodes with a lower cumulative draft probability are not expanded
+        float   temp;     // sampling temperature, <= 0.0f for greedy decoding
+        bool    adaptive; // adapt the number of drafted tokens to the acceptance rate
+    };
+
+    LLAMA_API struct llama_speculative_params llama_speculative_default_params(void);
+
+    /// @details Decodes with ctx_tgt, drafting token trees with the smaller ctx_dft. Both must share the vocabulary.
+    /// Each step drafts a tree whose nodes branch into the n_branch most likely draft tokens (or, with temp > 0, n_branch draft samples),
+    /// verifies it with one llama_eval_tree() of ctx_tgt and keeps the accepted path in the KV cache of both contexts.
+    /// With temp > 0, the accepted tokens follow the target distribution exactly (multi-candidate speculative sampling).
+    /// The caller owns the contexts, which must stay alive and must not be evaluated directly while the decoder is in use.
+    LLAMA_API struct llama_speculative * llama_speculative_init(
+            struct llama_context * ctx_tgt,
+            struct llama_context * ctx_dft,
+            struct llama_speculative_params params);
+
+    LLAMA_API void llama_speculative_free(struct llama_speculative * spec);
+
+    /// @details Evaluates the prompt with both models, replacing what they evaluated before. Returns 0 on success.
+    LLAMA_API int llama_speculative_prompt(struct llama_speculative * spec, const llama_token * tokens, int n_tokens, int n_threads);
+
+    /// @details Drafts and verifies one tree, and writes the accepted tokens, followed by one token sampled from the target, to out.
+    /// Returns the number of tokens written (at least 1, at most n_out_max), or a negative value if the context is full or on error.
+    LLAMA_API int llama_speculative_step(struct llama_speculative * spec, llama_token * out, int n_out_max, int n_threads);
+
+    /// @details Number of drafted and accepted draft tokens so far.
+    LLAMA_API void llama_speculative_get_stats(const struct llama_speculative * spec, int * n_drafted, int * n_accept);
+
+    // Memory information
+    // model_resident is queried from the OS with mincore and is model_mapped where it is not supported
+    LLAMA_API struct llama_memory_info llama_get_memory_info(const struct llama_context * ctx);
+
     // Performance information
     LLAMA_API struct llama_timings llama_get_timings(struct llama_context * ctx);
     LLAMA_API void llama_print_timings(struct llama_context * ctx);
     LLAMA_API void llama_reset_timings(struct llama_context * ctx);
 
+    // Get the compute time of each layer in ms, if llama_context_params.layer_timings is set
+    // Returns the number of layers, t_ms holds at most n_max of them
+    LLAMA_API int llama_get_layer_timings(struct llama_context * ctx, double * t_ms, int n_max);
+
+    // Get the time spent in each llama_sample_* function called with ctx, sorted by name
+    // Returns the number of functions, timings holds at most n_max of them
+    LLAMA_API int llama_get_sampler_timings(struct llama_context * ctx, struct llama_sampler_timings * timings, int n_max);
+
     // Print system information
     LLAMA_API const char * llama_print_system_info(void);
 
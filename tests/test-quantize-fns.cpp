@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include <string>
 #include <vector>
 
@@ -90,6 +91,44 @@ float dot_product_error(ggml_type_traits_t & qfns, size_t test_size, const float
     return fabsf(result - dot_ref) / test_size;
 }
 
+// Difference between the dot products of 4 interleaved q4_0 rows and those of the rows of the q4_0 reference
+float dot_product_q4_0_4x_error(size_t test_size, const float * test_data1, const float * test_data2) {
+    auto qfns   = ggml_internal_get_type_traits(GGML_TYPE_Q4_0);
+    auto qfns4x = ggml_internal_get_type_traits(GGML_TYPE_Q4_0_4X);
+    auto vdot   = ggml_internal_get_type_traits(qfns4x.vec_dot_type);
+
+    const size_t n          = test_size / 4;
+    const size_t block_size = ggml_type_size(GGML_TYPE_Q4_0);
+    const size_t nb         = n / ggml_blck_size(GGML_TYPE_Q4_0);
+    const size_t row_size   = nb * block_size;
+
+    std::vector<uint8_t> tmp_q(4*row_size);
+    std::vector<uint8_t> tmp_q4x(4*row_size);
+    std::vector<uint8_t> tmp_q2(2*n);
+
+    qfns.from_float(test_data1, tmp_q.data(), 4*n);
+    vdot.from_float(test_data2, tmp_q2.data(), n);
+
+    // block i of row r is at 4*i + r
+    for (size_t r = 0; r < 4; r++) {
+        for (size_t i = 0; i < nb; i++) {
+            memcpy(tmp_q4x.data() + (4*i + r)*block_size, tmp_q.data() + r*row_size + i*block_size, block_size);
+        }
+    }
+
+    float result[4] = { INFINITY, INFINITY, INFINITY, INFINITY };
+    qfns4x.vec_dot(n, result, tmp_q4x.data(), tmp_q2.data());
+
+    float max_error = 0.0f;
+    for (size_t r = 0; r < 4; r++) {
+        float result_ref = INFINITY;
+        qfns.vec_dot(n, &result_ref, tmp_q.data() + r*row_size, tmp_q2.data());
+        max_error = fmaxf(max_error, fabsf(result[r] - result_ref) / n);
+    }
+
+    return max_error;
+}
+
 int main(int argc, char * argv[]) {
     bool verbose = false;
     const size_t test_size = 32 * 128;
@@ -154,6 +193,15 @@ int main(int argc, char * argv[]) {
         }
     }
 
+    {
+        const float vec_dot_error = dot_product_q4_0_4x_error(test_size, test_data.data(), test_data2.data());
+        failed = !(vec_dot_error < MAX_QUANTIZATION_REFERENCE_ERROR);
+        num_failed += failed;
+        if (failed || verbose) {
+            printf("%5s dot product reference error:    %s (%f)\n", ggml_type_name(GGML_TYPE_Q4_0_4X), RESULT_STR[failed], vec_dot_error);
+        }
+    }
+
     if (num_failed || verbose) {
         printf("%d tests failed\n", num_failed);
     }
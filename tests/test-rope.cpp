@@ -0,0 +1,96 @@
+// Unit tests for RoPE with explicit positions
+
+#include "ggml.h"
+
+#undef NDEBUG
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+static const float MAX_ROPE_ERROR = 0.0001f;
+
+static float max_abs_diff(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    assert(ggml_nelements(a) == ggml_nelements(b));
+
+    float res = 0.0f;
+    for (int64_t i = 0; i < ggml_nelements(a); ++i) {
+        res = fmaxf(res, fabsf(((const float *) a->data)[i] - ((const float *) b->data)[i]));
+    }
+    return res;
+}
+
+static struct ggml_tensor * new_data(struct ggml_context * ctx, int64_t n_dims, int64_t n_head, int64_t n_tokens) {
+    struct ggml_tensor * t = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_dims, n_head, n_tokens);
+    for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+        ((float *) t->data)[i] = 2.0f*rand()/RAND_MAX - 1.0f;
+    }
+    return t;
+}
+
+static struct ggml_tensor * new_pos(struct ggml_context * ctx, int64_t n_tokens, int p0, int step) {
+    struct ggml_tensor * t = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n_tokens);
+    for (int64_t i = 0; i < n_tokens; ++i) {
+        ((int32_t *) t->data)[i] = p0 + step*i;
+    }
+    return t;
+}
+
+static void compute(struct ggml_context * ctx, struct ggml_tensor * t) {
+    struct ggml_cgraph gf = ggml_build_forward(t);
+    ggml_graph_compute_with_ctx(ctx, &gf, 2);
+}
+
+int main(int /*argc*/, const char ** /*argv*/) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 16*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    const int n_dims   = 64;
+    const int n_head   = 4;
+    const int n_tokens = 7;
+    const int n_past   = 13;
+
+    int num_failed = 0;
+
+    for (int mode : { 0, 2 }) {
+        struct ggml_context * ctx = ggml_init(params);
+
+        struct ggml_tensor * x = new_data(ctx, n_dims, n_head, n_tokens);
+
+        // positions n_past + i must match the implicit positions
+        struct ggml_tensor * r0 = ggml_rope_custom(ctx, x, n_past, n_dims, mode, 0, 10000.0f, 1.0f);
+        struct ggml_tensor * r1 = ggml_rope_custom_pos_inplace(ctx, ggml_dup(ctx, x), new_pos(ctx, n_tokens, n_past, 1), n_dims, mode, 0, 10000.0f, 1.0f);
+        compute(ctx, r0);
+        compute(ctx, r1);
+
+        const float err0 = max_abs_diff(r0, r1);
+        if (err0 > MAX_ROPE_ERROR) {
+            printf("mode %d: rope with positions differs from rope with n_past: %f\n", mode, err0);
+            num_failed++;
+        }
+
+        // shifting all positions by -n_past must match the rope at position i
+        struct ggml_tensor * r2 = ggml_rope_custom_pos_inplace(ctx, ggml_dup(ctx, r0), new_pos(ctx, n_tokens, -n_past, 0), n_dims, mode, 0, 10000.0f, 1.0f);
+        struct ggml_tensor * r3 = ggml_rope_custom(ctx, x, 0, n_dims, mode, 0, 10000.0f, 1.0f);
+        compute(ctx, r2);
+        compute(ctx, r3);
+
+        const float err1 = max_abs_diff(r2, r3);
+        if (err1 > MAX_ROPE_ERROR) {
+            printf("mode %d: rope rotations do not compose: %f\n", mode, err1);
+            num_failed++;
+        }
+
+        ggml_free(ctx);
+    }
+
+    return num_failed > 0;
+}